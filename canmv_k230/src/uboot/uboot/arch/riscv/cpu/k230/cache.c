@@ -29,6 +29,7 @@
 #include <dm/uclass-internal.h>
 #include <cache.h>
 #include <asm/csr.h>
+#include <kendryte/k230_cache.h>
 
 #ifndef __ASM
 #define __ASM                   __asm     /*!< asm keyword for GNU Compiler */
@@ -279,7 +280,35 @@ void flush_dcache_all(void)
 	csi_dcache_clean_invalid();
 }
 
-void flush_dcache_range(unsigned long start, unsigned long end)
+/*
+ * One dcache.cpa per 64 byte line makes a flush of a multi megabyte image
+ * cost more than cleaning the whole D-cache and L2, see cachebench.
+ */
+static ulong k230_dcache_full_threshold = CONFIG_K230_DCACHE_FULL_THRESHOLD;
+
+ulong k230_dcache_get_full_threshold(void)
+{
+	return k230_dcache_full_threshold;
+}
+
+void k230_dcache_set_full_threshold(ulong size)
+{
+	k230_dcache_full_threshold = size;
+}
+
+static bool k230_dcache_use_full(unsigned long start, unsigned long end)
+{
+	return k230_dcache_full_threshold &&
+	       (end - start >= k230_dcache_full_threshold);
+}
+
+void k230_dcache_flush_full(void)
+{
+	csi_dcache_clean_invalid();
+	csi_l2cache_flush_invalid();
+}
+
+void k230_dcache_flush_lines(unsigned long start, unsigned long end)
 {
 	register unsigned long i asm("a0") = start & ~(CONFIG_SYS_CACHELINE_SIZE - 1);
 
@@ -289,7 +318,7 @@ void flush_dcache_range(unsigned long start, unsigned long end)
 	sync_is();
 }
 
-void invalidate_dcache_range(unsigned long start, unsigned long end)
+static void k230_dcache_inval_lines(unsigned long start, unsigned long end)
 {
 	register unsigned long i asm("a0") = start & ~(CONFIG_SYS_CACHELINE_SIZE - 1);
 
@@ -299,6 +328,32 @@ void invalidate_dcache_range(unsigned long start, unsigned long end)
 	sync_is();
 }
 
+void flush_dcache_range(unsigned long start, unsigned long end)
+{
+	if (k230_dcache_use_full(start, end)) {
+		k230_dcache_flush_full();
+		return;
+	}
+
+	k230_dcache_flush_lines(start, end);
+}
+
+void invalidate_dcache_range(unsigned long start, unsigned long end)
+{
+	/*
+	 * There is no invalidate all that keeps other dirty data, so large
+	 * ranges are cleaned too. That is safe as long as the range was
+	 * flushed or invalidated before the device wrote it, which DMA users
+	 * do, and it keeps the partial lines at both edges intact.
+	 */
+	if (k230_dcache_use_full(start, end)) {
+		k230_dcache_flush_full();
+		return;
+	}
+
+	k230_dcache_inval_lines(start, end);
+}
+
 void icache_enable(void)
 {
 #if !CONFIG_IS_ENABLED(SYS_ICACHE_OFF)
@@ -88,4 +88,9 @@ void harts_early_init(void)
 	csr_write(pmpcfg0, 0x9999);
 
 	improving_cpu_performance();
+
+#if CONFIG_IS_ENABLED(RISCV_VECTOR_MEM)
+	/* mem* use the vector unit from here on */
+	csr_set(CSR_MSTATUS, SR_VS_INITIAL);
+#endif
 }
@@ -40,4 +40,11 @@ extern void *memmove(void *, const void *, __kernel_size_t);
 #endif
 extern void *memset(void *, int, __kernel_size_t);
 
+#if CONFIG_IS_ENABLED(RISCV_VECTOR_MEM)
+/* scalar versions, which the vector ones fall back to */
+extern void *__memcpy(void *, const void *, __kernel_size_t);
+extern void *__memmove(void *, const void *, __kernel_size_t);
+extern void *__memset(void *, int, __kernel_size_t);
+#endif
+
 #endif /* __ASM_RISCV_STRING_H */
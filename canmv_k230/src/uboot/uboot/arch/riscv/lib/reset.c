@@ -9,19 +9,20 @@
 
 #if defined (CONFIG_KENDRYTE_K230)
 #include <asm/io.h>
+#include <cpu_func.h>
 #include <kendryte/k230_platform.h>
 
-int do_reset(struct cmd_tbl *cmdtp, int flag, int argc, char *const argv[])
+/* soft reset of the SoC, SPL too needs it to retrain a DDR which failed */
+void reset_cpu(void)
 {
-	printf("resetting ...\n");
-
-#ifndef CONFIG_SPL_BUILD
 	writel(0x10001, (void*)SYSCTL_BOOT_BASE_ADDR+0x60);
 	while(1);
-#else
-	printf("reset not supported yet\n");
-	hang();
-#endif
+}
+
+int do_reset(struct cmd_tbl *cmdtp, int flag, int argc, char *const argv[])
+{
+	printf("resetting ...\n");
+	reset_cpu();
 
 	return 0;
 }
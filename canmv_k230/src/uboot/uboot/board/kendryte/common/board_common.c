@@ -27,6 +27,7 @@
 #include <asm/io.h>
 #include <asm/spl.h>
 #include <asm/types.h>
+#include <bootstage.h>
 #include <command.h>
 #include <common.h>
 #include <cpu_func.h>
@@ -34,12 +35,16 @@
 #include <gzip.h>
 #include <image.h>
 #include <linux/kernel.h>
+#include <linux/sizes.h>
 #include <lmb.h>
 #include <malloc.h>
 #include <memalign.h>
 #include <stdio.h>
+#include <time.h>
 #include <u-boot/crc.h>
 
+#include <kendryte/k230_cache.h>
+#include <kendryte/k230_gunzip.h>
 #include <kendryte/k230_platform.h>
 
 #include "board_common.h"
@@ -68,13 +73,13 @@ enum env_location arch_env_get_location(enum env_operation op, int prio) {
   return ENVL_MMC;
 }
 
-#ifndef CONFIG_SPL_BUILD
 int __weak kd_board_init(void)
 {
   return 0;
 }
 
-int board_init(void) {
+/* SD host setup of board_init(), the SPL fast boot does it as well */
+void k230_board_sd_init(void) {
   if ((BOOT_MEDIUM_SDIO0 == g_boot_medium) ||
       (BOOT_MEDIUM_SDIO1 == g_boot_medium)) {
 #define SD_HOST_REG_VOL_STABLE (1 << 4)
@@ -84,104 +89,157 @@ int board_init(void) {
     sd0_ctrl |= SD_HOST_REG_VOL_STABLE | SD_CARD_WRITE_PROT;
     writel(sd0_ctrl, (void *)SD0_CTRL);
   }
+}
+
+#ifndef CONFIG_SPL_BUILD
+int board_init(void) {
+  k230_board_sd_init();
+
+  bootstage_mark_name(K230_BOOTSTAGE_BOARD_INIT, "board_init");
 
   return kd_board_init();
 }
 
-static int k230_boot_prepare_args(int argc, char *const argv[], ulong buff,
-                                  en_boot_sys_t *sys, boot_medium_e *bootmod) {
-  ulong add_tmp, len;
+/*
+ * Time flushing dirty buffers of growing size line by line and with the
+ * whole cache ops, to pick CONFIG_K230_DCACHE_FULL_THRESHOLD.
+ */
+static int do_cachebench(struct cmd_tbl *cmdtp, int flag, int argc,
+                         char *const argv[]) {
+  ulong addr = CONFIG_SYS_LOAD_ADDR;
+  ulong max = SZ_32M;
+  ulong size, start, line_us, full_us, cross = 0;
+
+  if ((argc > 1) && (0 == strcmp(argv[1], "threshold"))) {
+    if (argc > 2)
+      k230_dcache_set_full_threshold(hextoul(argv[2], NULL));
+    printf("threshold 0x%lx\n", k230_dcache_get_full_threshold());
+    return 0;
+  }
 
-  if (argc < 3)
-    return CMD_RET_USAGE;
+  if (argc > 1)
+    addr = hextoul(argv[1], NULL);
+  if (argc > 2)
+    max = hextoul(argv[2], NULL);
+
+  printf("%10s %10s %10s\n", "size", "lines us", "full us");
+  for (size = SZ_4K; size <= max; size <<= 1) {
+    memset((void *)addr, 0x5a, size);
+    start = timer_get_us();
+    k230_dcache_flush_lines(addr, addr + size);
+    line_us = timer_get_us() - start;
+
+    memset((void *)addr, 0xa5, size);
+    start = timer_get_us();
+    k230_dcache_flush_full();
+    full_us = timer_get_us() - start;
+
+    printf("%10lx %10lu %10lu\n", size, line_us, full_us);
+    if (!cross && (full_us < line_us))
+      cross = size;
+  }
 
-  if (!strcmp(argv[1], "mem")) {
-    if (argc < 4)
-      return CMD_RET_USAGE;
-    add_tmp = simple_strtoul(argv[2], NULL, 0);
-    len = simple_strtoul(argv[3], NULL, 0);
-    if (add_tmp != buff) {
-      memmove((void *)buff, (void *)add_tmp, len);
-    }
-    *sys = BOOT_SYS_ADDR;
-    return 0;
-  } else if (!strcmp(argv[1], "sdio1"))
-    *bootmod = BOOT_MEDIUM_SDIO1;
-  else if (!strcmp(argv[1], "sdio0"))
-    *bootmod = BOOT_MEDIUM_SDIO0;
-  else if (!strcmp(argv[1], "spinor"))
-    *bootmod = BOOT_MEDIUM_NORFLASH;
-  else if (!strcmp(argv[1], "spinand"))
-    *bootmod = BOOT_MEDIUM_NANDFLASH;
-  else if (!strcmp(argv[1], "auto"))
-    *bootmod = g_boot_medium;
-
-  if (!strcmp(argv[2], "rtt"))
-    *sys = BOOT_SYS_RTT;
-  else if (!strcmp(argv[2], "linux"))
-    *sys = BOOT_SYS_LINUX;
-  else if (!strcmp(argv[2], "qbc"))
-    *sys = BOOT_QUICK_BOOT_CFG;
-  else if (!strcmp(argv[2], "fdb"))
-    *sys = BOOT_FACE_DB;
-  else if (!strcmp(argv[2], "sensor"))
-    *sys = BOOT_SENSOR_CFG;
-  else if (!strcmp(argv[2], "ai"))
-    *sys = BOOT_AI_MODE;
-  else if (!strcmp(argv[2], "speckle"))
-    *sys = BOOT_SPECKLE;
-  else if (!strcmp(argv[2], "rtapp"))
-    *sys = BOOT_RTAPP;
-  else if (!strcmp(argv[2], "uboot"))
-    *sys = BOOT_SYS_UBOOT;
-  else if (!strcmp(argv[2], "auto_boot"))
-    *sys = BOOT_SYS_AUTO;
+  if (cross)
+    printf("whole cache ops win from 0x%lx\n", cross);
+  printf("threshold 0x%lx\n", k230_dcache_get_full_threshold());
 
   return 0;
 }
 
-/**
- * @brief
- *
- * @param cmdtp
- * @param flag
- * @param argc
- * @param argv
- * @return int
+U_BOOT_CMD(cachebench, 3, 0, do_cachebench,
+           "compare line by line and whole cache flush cost",
+           "[addr [max_size]] - time flushes of 4K up to max_size at addr\n"
+           "cachebench threshold [size] - show or set the whole cache threshold");
+
+static ulong membench_rate(ulong size, ulong us) {
+  return us ? (ulong)((u64)size * 1000000 / 1024 / 1024 / us) : 0;
+}
+
+struct membench_impl {
+  const char *name;
+  void *(*cpy)(void *, const void *, __kernel_size_t);
+  void *(*move)(void *, const void *, __kernel_size_t);
+  void *(*set)(void *, int, __kernel_size_t);
+};
+
+static const struct membench_impl membench_impls[] = {
+    {"default", memcpy, memmove, memset},
+#if CONFIG_IS_ENABLED(RISCV_VECTOR_MEM)
+    {"scalar", __memcpy, __memmove, __memset},
+#endif
+};
+
+/*
+ * memcpy, memmove (overlapping, both directions) and memset throughput
+ * from 64 bytes up, to compare the vector and scalar string functions.
  */
-static int do_k230_boot(struct cmd_tbl *cmdtp, int flag, int argc,
-                        char *const argv[]) {
-  int ret = 0;
-  en_boot_sys_t sys;
-  boot_medium_e bootmod = g_boot_medium;
-  ulong cipher_addr = k230_get_encrypted_image_decrypt_addr();
-
-  ret = k230_boot_prepare_args(argc, argv, cipher_addr, &sys, &bootmod);
-  if (ret)
-    return ret;
-
-  g_boot_medium = bootmod;
-  if (sys == BOOT_SYS_ADDR)
-    ret = k230_img_boot_sys_bin((firmware_head_s *)cipher_addr);
-  else
-    ret = k230_img_load_boot_sys(sys);
-
-  return ret;
+static int do_membench(struct cmd_tbl *cmdtp, int flag, int argc,
+                       char *const argv[]) {
+  const struct membench_impl *impl;
+  ulong addr = CONFIG_SYS_LOAD_ADDR;
+  ulong max = SZ_16M;
+  ulong size, loops, i, start, cpy_us, fwd_us, bwd_us, set_us;
+  u8 *buf;
+
+  if (argc > 1)
+    addr = hextoul(argv[1], NULL);
+  if (argc > 2)
+    max = hextoul(argv[2], NULL);
+  buf = (u8 *)addr;
+
+  printf("%8s %10s %10s %10s %10s %10s (MB/s)\n", "", "size", "memcpy",
+         "mmove fwd", "mmove bwd", "memset");
+  for (size = 64; size <= max; size <<= 2) {
+    /* roughly 64MB moved per test */
+    loops = max_t(ulong, SZ_64M / size, 1);
+
+    for (impl = membench_impls;
+         impl < membench_impls + ARRAY_SIZE(membench_impls); impl++) {
+      start = timer_get_us();
+      for (i = 0; i < loops; i++)
+        impl->cpy(buf + max + 64, buf, size);
+      cpy_us = timer_get_us() - start;
+
+      start = timer_get_us();
+      for (i = 0; i < loops; i++)
+        impl->move(buf, buf + 8, size);
+      fwd_us = timer_get_us() - start;
+
+      start = timer_get_us();
+      for (i = 0; i < loops; i++)
+        impl->move(buf + 8, buf, size);
+      bwd_us = timer_get_us() - start;
+
+      start = timer_get_us();
+      for (i = 0; i < loops; i++)
+        impl->set(buf, (int)i, size);
+      set_us = timer_get_us() - start;
+
+      printf("%8s %10lx %10lu %10lu %10lu %10lu\n", impl->name, size,
+             membench_rate(size * loops, cpy_us),
+             membench_rate(size * loops, fwd_us),
+             membench_rate(size * loops, bwd_us),
+             membench_rate(size * loops, set_us));
+    }
+  }
+
+  return 0;
 }
 
-#define K230_BOOT_HELP                                                         \
-  " <auto|sdio1|sdio0|spinor|spinand|mem> "                                    \
-  "<auto_boot|rtt|linux|qbc|fdb|sensor|ai|speckle|rtapp|uboot|addr> [len]\n"   \
-  "qbc---quick boot cfg\n"                                                     \
-  "fdb---face database\n"                                                      \
-  "sensor---sensor cfg\n"                                                      \
-  "ai---ai mode cfg\n"                                                         \
-  "speckle---speckle cfg\n"                                                    \
-  "rtapp---rtt app\n"                                                          \
-  "auto_boot---auto boot\n"                                                    \
-  "uboot---boot uboot\n"
-
-U_BOOT_CMD_COMPLETE(k230_boot, 6, 0, do_k230_boot, NULL, K230_BOOT_HELP, NULL);
+U_BOOT_CMD(membench, 3, 0, do_membench, "memcpy/memmove/memset throughput",
+           "[addr [max_size]] - run on 2 * max_size + 64 bytes at addr");
+
+#if CONFIG_IS_ENABLED(K230_GZIP)
+static int do_k230_unzip_stats(struct cmd_tbl *cmdtp, int flag, int argc,
+                               char *const argv[]) {
+  k230_gunzip_print_stats();
+
+  return 0;
+}
+
+U_BOOT_CMD(k230_unzip_stats, 1, 0, do_k230_unzip_stats,
+           "gzip engine and software inflate decode counters", "");
+#endif
 
 typedef void (*func_app_entry)(void);
 static int k230_boot_baremetal(struct cmd_tbl *cmdtp, int flag, int argc,
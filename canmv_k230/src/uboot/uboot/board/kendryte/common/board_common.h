@@ -33,8 +33,8 @@
   #endif
 #endif
 
-// Fallback definition or other code
-#ifndef MYHEADER_EXISTS
+// Fallback definition or other code, sandbox has no SDK configuration
+#if !defined(MYHEADER_EXISTS) && !defined(CONFIG_SANDBOX)
   // Provide alternative definitions or inform about missing header
   #warning "sdk_autoconf.h not found. Default behavior will be used."
 #endif
@@ -122,13 +122,40 @@ extern int g_boot_medium;
 unsigned long k230_get_encrypted_image_load_addr(void);
 unsigned long k230_get_encrypted_image_decrypt_addr(void);
 
+/* bootstage records of the K230 boot flow */
+#define K230_BOOTSTAGE_FAST_BOOT (BOOTSTAGE_ID_USER + 0)
+#define K230_BOOTSTAGE_RTSMART (BOOTSTAGE_ID_USER + 1)
+#define K230_BOOTSTAGE_DEVICE_DISABLE (BOOTSTAGE_ID_USER + 2)
+#define K230_BOOTSTAGE_DDR (BOOTSTAGE_ID_USER + 3)
+#define K230_BOOTSTAGE_BOARD_INIT (BOOTSTAGE_ID_USER + 4)
+#define K230_BOOTSTAGE_MMC_INIT (BOOTSTAGE_ID_USER + 5)
+#define K230_BOOTSTAGE_UBOOT (BOOTSTAGE_ID_USER + 6)
+/* K230_BOOTSTAGE_UNZIP is in kendryte/k230_gunzip.h */
+
 int k230_img_boot_sys_bin(firmware_head_s *fhBUff);
 int k230_img_load_boot_sys(en_boot_sys_t sys);
 
 void board_ddr_init(void);
 int ddr_init_training(void);
 
+/*
+ * Hooks of the DDR init scripts for CONFIG_SPL_K230_DDR_CACHE: restore
+ * in place of the training firmware run, save once the PHY init is done
+ * and finish after board_ddr_init().
+ */
+#if defined(CONFIG_SPL_BUILD) && defined(CONFIG_SPL_K230_DDR_CACHE)
+bool k230_ddr_cache_restore_trained(u32 rate);
+void k230_ddr_cache_save_trained(void);
+void k230_ddr_cache_finish(void);
+int k230_ddr_cache_temp(void);
+#else
+static inline bool k230_ddr_cache_restore_trained(u32 rate) { return false; }
+static inline void k230_ddr_cache_save_trained(void) {}
+static inline void k230_ddr_cache_finish(void) {}
+#endif
+
 int kd_board_init(void);
+void k230_board_sd_init(void);
 
 #ifdef CONFIG_SPL_BUILD
 void spl_device_disable(void);
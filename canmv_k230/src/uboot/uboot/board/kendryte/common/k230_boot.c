@@ -22,26 +22,34 @@
  * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-#include <asm/asm.h>
+#include <abuf.h>
 #include <asm/io.h>
 #include <asm/spl.h>
 #include <asm/types.h>
+#include <bootstage.h>
 #include <command.h>
 #include <common.h>
 #include <cpu_func.h>
 #include <dm/device-internal.h>
 #include <gzip.h>
 #include <image.h>
+#include <kendryte/k230_gunzip.h>
 #include <linux/delay.h>
 #include <linux/kernel.h>
 #include <linux/mtd/mtd.h>
+#include <linux/sizes.h>
+#include <linux/zstd.h>
 #include <lmb.h>
+#include <mapmem.h>
 #include <mmc.h>
 #include <nand.h>
 #include <spi.h>
 #include <spi_flash.h>
 #include <spl.h>
 #include <stdio.h>
+#include <u-boot/lz4.h>
+#include <u-boot/sha256.h>
+#include <u-boot/zlib.h>
 
 #ifdef CONFIG_K230_PUFS
 #include "pufs_sm2.h"
@@ -66,10 +74,381 @@
 
 #endif
 
+#ifdef CONFIG_SANDBOX
+/* the emulated DRAM, whatever the SDK configuration says */
+#undef CONFIG_MEM_BASE_ADDR
+#undef CONFIG_MEM_TOTAL_SIZE
+#define CONFIG_MEM_BASE_ADDR CONFIG_SYS_SDRAM_BASE
+#define CONFIG_MEM_TOTAL_SIZE ((ulong)CONFIG_SANDBOX_RAM_SIZE_MB << 20)
+
+/* mmc1 of the test device tree, backed by mmc1.img */
+int g_boot_medium = BOOT_MEDIUM_SDIO1;
+#endif
+
+#define K230_BOOT_DECOMP_MAX_LEN 0x6000000
+
+/* DDR is mapped from 0 up to the SRAM which SPL runs from */
+#define K230_BOOT_DDR_END 0x80000000UL
+
+DECLARE_GLOBAL_DATA_PTR;
+
+/* Cut *@end back to @start if [@start, @stop) lies between @load and *@end */
+static bool k230_boot_room_clip(ulong load, ulong *end, ulong start,
+                                ulong stop) {
+  if ((start <= load) && (load < stop))
+    return false;
+  if ((load < start) && (start < *end))
+    *end = start;
+
+  return true;
+}
+
+/*
+ * The load address comes from the uImage header, which is only verified
+ * after the payload went there. Before anything is written to @load, work
+ * out how much room it has: up to the end of DRAM or the first region
+ * which has to survive the load, the image read at [@buf, @buf + @buf_len),
+ * the running U-Boot or the bootstage stash. Returns 0 if @load itself is
+ * not usable.
+ */
+static ulong k230_boot_load_room(ulong load, ulong buf, ulong buf_len) {
+  ulong end = K230_BOOT_DDR_END;
+
+  /* SPL has not sized DRAM, U-Boot proper has */
+  if (gd->ram_size)
+    end = gd->ram_base + gd->ram_size;
+
+  if ((load < CONFIG_MEM_BASE_ADDR) || (load >= end))
+    return 0;
+
+  if (buf_len && !k230_boot_room_clip(load, &end, buf, buf + buf_len))
+    return 0;
+
+#if !defined(CONFIG_SPL_BUILD) && !defined(CONFIG_SANDBOX)
+  /* stack, heap, fdt and code, like arch_lmb_reserve() from around the sp */
+  if (!k230_boot_room_clip(load, &end, (ulong)&end - SZ_16K, gd->ram_top))
+    return 0;
+#endif
+
+#ifdef CONFIG_BOOTSTAGE_STASH
+  if (!k230_boot_room_clip(load, &end, CONFIG_BOOTSTAGE_STASH_ADDR,
+                           CONFIG_BOOTSTAGE_STASH_ADDR +
+                               CONFIG_BOOTSTAGE_STASH_SIZE))
+    return 0;
+#endif
+
+  return end - load;
+}
+
 static int k230_boot_reset_big_hard_and_run(ulong core_run_addr);
 static int k230_boot_check_and_get_plain_data(firmware_head_s *pfh,
                                               ulong *pplain_addr);
 
+#ifdef CONFIG_K230_BOOT_STREAM
+/*
+ * The image used to be read whole, then hashed, then decompressed: three
+ * passes over up to 20MB. With streaming, each batch of blocks is hashed
+ * and fed to the decompressor right after it is read, while it is still
+ * in the cache. Images in the K230 private gzip format are decoded by the
+ * engine: its read chain is built as the batches arrive and it runs once
+ * the image is verified.
+ */
+enum k230_stream_state {
+  K230_STREAM_OFF,     /* secure image, the full buffer path handles it */
+  K230_STREAM_HEADER,  /* waiting for the uImage header */
+  K230_STREAM_RUN,     /* payload is decompressed as it arrives */
+  K230_STREAM_ENGINE,  /* engine chain built as it arrives, run after load */
+  K230_STREAM_DEFER,   /* hash only, decompress after the load */
+  K230_STREAM_DONE,    /* payload is at its load address */
+};
+
+struct k230_boot_stream {
+  enum k230_stream_state state;
+  sha256_context sha;
+
+  ulong plain; /* plain data in the load buffer, pfh + 1 */
+  ulong total; /* pfh->length */
+  ulong avail; /* plain bytes loaded and hashed so far */
+
+  image_header_t *uh;
+  ulong data; /* payload of the first sub image */
+  ulong len;
+  ulong fed; /* payload bytes consumed so far */
+  ulong room; /* bytes which may be written at the load address */
+  int comp;
+
+  z_stream zs;
+  bool zs_init;
+#if CONFIG_IS_ENABLED(K230_GZIP)
+  struct k230_gunzip_stream gs;
+#endif
+  ulong out_len;
+};
+
+static void k230_boot_stream_start(struct k230_boot_stream *bs,
+                                   firmware_head_s *pfh) {
+  memset(bs, 0, sizeof(*bs));
+
+  bs->plain = (ulong)(pfh + 1);
+  bs->total = pfh->length;
+
+#ifndef CONFIG_K230_PUFS
+  if (pfh->crypto_type == NONE_SECURITY) {
+    sha256_starts(&bs->sha);
+    bs->state = K230_STREAM_HEADER;
+  }
+#endif
+}
+
+/* Returns 1 once the payload is located, 0 while more data is needed */
+static int k230_boot_stream_header(struct k230_boot_stream *bs) {
+  image_header_t *uh = (image_header_t *)(bs->plain + 4);
+  ulong loaded_end = bs->plain + bs->avail;
+  const char *name;
+  uint32_t *size;
+  int off;
+
+  if (loaded_end < (ulong)uh + image_get_header_size())
+    return 0;
+
+  if (!image_check_magic(uh))
+    return -1;
+
+  name = image_get_name(uh);
+  if (0 == strcmp(name, "rtt")) {
+    /* the size table of a multi image ends with a zero entry */
+    for (size = (uint32_t *)image_get_data(uh);; size++) {
+      if ((ulong)(size + 1) > loaded_end)
+        return 0;
+      if (0 == *size)
+        break;
+    }
+    image_multi_getimg(uh, 0, &bs->data, &bs->len);
+  } else if (0 == strcmp(name, "uboot")) {
+    bs->data = image_get_data(uh);
+    bs->len = image_get_data_size(uh);
+  } else {
+    return -1;
+  }
+
+  bs->uh = uh;
+  bs->comp = image_get_comp(uh);
+  bs->room = k230_boot_load_room(
+      image_get_load(uh),
+      map_to_sysmem((void *)bs->plain) - sizeof(firmware_head_s),
+      roundup(bs->total + sizeof(firmware_head_s), BLKSZ));
+
+  if (IH_COMP_NONE == bs->comp) {
+    /* a placed image is already where it runs */
+    if ((image_get_load(uh) != map_to_sysmem((void *)bs->data)) &&
+        (bs->len > bs->room))
+      return -1;
+    bs->state = K230_STREAM_RUN;
+    return 1;
+  }
+
+  if (!bs->room)
+    return -1;
+
+  if (IH_COMP_GZIP != bs->comp)
+    return -1;
+
+  /* enough of the payload to hold the gzip header */
+  if (loaded_end < bs->data + min(bs->len, (ulong)SZ_4K))
+    return 0;
+
+  if (0x09 == ((u8 *)bs->data)[2]) {
+#if CONFIG_IS_ENABLED(K230_GZIP)
+    k230_gunzip_stream_start(&bs->gs, (void *)bs->data);
+    bs->state = K230_STREAM_ENGINE;
+    return 1;
+#else
+    /* no engine, the stream behind the K230 CM is plain deflate */
+    ((u8 *)bs->data)[2] = 0x08;
+#endif
+  }
+
+  off = gzip_parse_header((u8 *)bs->data, min(bs->len, (ulong)SZ_4K));
+  if (off < 0)
+    return -1;
+
+  bs->zs.zalloc = gzalloc;
+  bs->zs.zfree = gzfree;
+  if (Z_OK != inflateInit2(&bs->zs, -MAX_WBITS))
+    return -1;
+  bs->zs_init = true;
+
+  bs->zs.next_out = map_sysmem(image_get_load(uh), bs->room);
+  bs->zs.avail_out = min(bs->room, (ulong)K230_BOOT_DECOMP_MAX_LEN);
+  bs->fed = off;
+  bs->state = K230_STREAM_RUN;
+
+  return 1;
+}
+
+/* @avail plain bytes are in the load buffer now, consume the new ones */
+static void k230_boot_stream_feed(struct k230_boot_stream *bs, ulong avail) {
+  ulong load, end;
+  int r;
+
+  if (K230_STREAM_OFF == bs->state)
+    return;
+
+  if (avail > bs->total)
+    avail = bs->total;
+  if (avail <= bs->avail)
+    return;
+
+  sha256_update(&bs->sha, (const uint8_t *)(bs->plain + bs->avail),
+                avail - bs->avail);
+  bs->avail = avail;
+
+  if (K230_STREAM_HEADER == bs->state) {
+    r = k230_boot_stream_header(bs);
+    if (r < 0) {
+      /* hash on, let the full buffer path sort the image out */
+      bs->state = K230_STREAM_DEFER;
+      return;
+    }
+    if (0 == r)
+      return;
+  }
+
+  end = min(bs->data + bs->len, bs->plain + bs->avail) - bs->data;
+
+#if CONFIG_IS_ENABLED(K230_GZIP)
+  if (K230_STREAM_ENGINE == bs->state) {
+    k230_gunzip_stream_feed(&bs->gs, end);
+    return;
+  }
+#endif
+
+  if (K230_STREAM_RUN != bs->state)
+    return;
+
+  if (end <= bs->fed)
+    return;
+
+  load = (ulong)map_sysmem(image_get_load(bs->uh), bs->len);
+
+  if (IH_COMP_NONE == bs->comp) {
+    /* a placed image is already where it runs */
+    if (load != bs->data)
+      memmove((void *)(load + bs->fed), (void *)(bs->data + bs->fed),
+              end - bs->fed);
+    bs->fed = end;
+    if (bs->fed == bs->len) {
+      bs->out_len = bs->len;
+      bs->state = K230_STREAM_DONE;
+    }
+    return;
+  }
+
+  bs->zs.next_in = (u8 *)(bs->data + bs->fed);
+  bs->zs.avail_in = end - bs->fed;
+  r = inflate(&bs->zs, Z_NO_FLUSH);
+  bs->fed = end - bs->zs.avail_in;
+
+  if (Z_STREAM_END == r) {
+    bs->out_len = bs->zs.total_out;
+    bs->state = K230_STREAM_DONE;
+  } else if ((Z_OK != r) && (Z_BUF_ERROR != r)) {
+    printf("stream inflate failed %d, retry after load\n", r);
+    bs->state = K230_STREAM_DEFER;
+  }
+}
+
+#ifdef CONFIG_K230_BOOT_PLACE
+/*
+ * An uncompressed payload needs no work past hashing, so rather than
+ * reading the image into the load buffer and copying the payload out,
+ * the image is read to just below the load address of the payload, which
+ * then lands in place and is verified there. The image header ends up in
+ * the few hundred bytes below the load address and up to a block past the
+ * end of the payload is overwritten. All of that has to fit in the room at
+ * the load address, see k230_boot_load_room(), or the image is loaded at
+ * @pfh as usual.
+ *
+ * Called with the header blocks loaded at @pfh and fed to @bs. Returns
+ * the address the image was moved to, or 0 to load it at @pfh.
+ */
+static ulong k230_boot_place(struct k230_boot_stream *bs,
+                             firmware_head_s *pfh, ulong blks) {
+  ulong load, off, place;
+
+  if ((K230_STREAM_RUN != bs->state) || (IH_COMP_NONE != bs->comp))
+    return 0;
+
+  load = image_get_load(bs->uh);
+  off = bs->data - (ulong)pfh;
+  if (load < CONFIG_MEM_BASE_ADDR + off)
+    return 0;
+  place = load - off;
+
+  /* header below the payload and the tail of its last block past it */
+  if (k230_boot_load_room(place, 0, 0) < blks * BLKSZ)
+    return 0;
+
+  memmove(map_sysmem(place, HD_BLK_NUM * BLKSZ), pfh, HD_BLK_NUM * BLKSZ);
+
+  /*
+   * The rest is read by DMA from a byte offset which is not cache line
+   * aligned: write back the lines it shares with the header and with
+   * whatever follows the image so the invalidate keeps them.
+   */
+  flush_cache(place, HD_BLK_NUM * BLKSZ);
+  flush_cache(place + blks * BLKSZ - 1, 1);
+
+  k230_boot_stream_start(bs, map_sysmem(place, blks * BLKSZ));
+  k230_boot_stream_feed(bs, HD_BLK_NUM * BLKSZ - sizeof(*pfh));
+
+  debug("image placed at %lx, payload at %lx\n", place, load);
+
+  return place;
+}
+#endif
+
+static int k230_boot_stream_finish(struct k230_boot_stream *bs) {
+  uint8_t sha256[SHA256_SUM_LEN];
+  firmware_head_s *pfh = (firmware_head_s *)bs->plain - 1;
+
+  if (bs->zs_init) {
+    inflateEnd(&bs->zs);
+    bs->zs_init = false;
+  }
+
+  if (bs->avail != bs->total) {
+    printf("stream short load %lx of %lx\n", bs->avail, bs->total);
+    return -1;
+  }
+
+  sha256_finish(&bs->sha, sha256);
+  if (memcmp(sha256, pfh->verify.none_sec.signature, SHA256_SUM_LEN)) {
+    printf("sha256 error");
+    return -3;
+  }
+
+#if CONFIG_IS_ENABLED(K230_GZIP)
+  /* verified, the engine may run now */
+  if (K230_STREAM_ENGINE == bs->state) {
+    bs->out_len = bs->len;
+    if (k230_gunzip_stream_finish(
+            &bs->gs, map_sysmem(image_get_load(bs->uh), bs->room),
+            min(bs->room, (ulong)K230_BOOT_DECOMP_MAX_LEN), &bs->out_len)) {
+      printf("unzip fialed\n");
+      return -1;
+    }
+    bs->state = K230_STREAM_DONE;
+  }
+#endif
+
+  if (K230_STREAM_DONE == bs->state)
+    flush_cache(image_get_load(bs->uh), bs->out_len);
+
+  return 0;
+}
+#endif
+
 unsigned long k230_get_encrypted_image_load_addr(void) {
   return CONFIG_MEM_BASE_ADDR + CONFIG_MEM_TOTAL_SIZE -
          (CONFIG_MEM_TOTAL_SIZE / 3);
@@ -83,32 +462,99 @@ unsigned long k230_get_encrypted_image_decrypt_addr(void) {
 static int k230_boot_decomp_to_load_addr(image_header_t *pUh, ulong des_len,
                                          ulong data, ulong *plen) {
   int ret = 0;
+  ulong start = get_timer(0);
 
   int img_compress_algo = image_get_comp(pUh);
   ulong img_load_addr = (ulong)image_get_load(pUh);
+  ulong room;
+  void *dst;
 
   printf("image: %s load to %lx compress =%d src %lx len=%lx \n",
          image_get_name(pUh), img_load_addr, img_compress_algo, data, *plen);
 
+  if (img_load_addr != map_to_sysmem((void *)data)) {
+    room = k230_boot_load_room(img_load_addr, map_to_sysmem((void *)data),
+                               *plen);
+    if (!room || ((IH_COMP_NONE == img_compress_algo) && (*plen > room))) {
+      printf("Error, no room at load address %lx\n", img_load_addr);
+      return -1;
+    }
+    des_len = min(des_len, room);
+  }
+  dst = map_sysmem(img_load_addr, des_len);
+
   if (IH_COMP_GZIP == img_compress_algo) {
-    if (0x00 !=
-        (ret = gunzip((void *)img_load_addr, des_len, (void *)data, plen))) {
+#if !CONFIG_IS_ENABLED(K230_GZIP)
+    /* no engine, the stream behind the K230 CM is plain deflate */
+    if (0x09 == ((u8 *)data)[2])
+      ((u8 *)data)[2] = 0x08;
+#endif
+    if (0x00 != (ret = gunzip(dst, des_len, (void *)data, plen))) {
       printf("unzip fialed ret =%x\n", ret);
       return -1;
     }
   } else if (IH_COMP_NONE == img_compress_algo) {
-    memmove((void *)img_load_addr, (void *)data, *plen);
+    if (dst != (void *)data)
+      memmove(dst, (void *)data, *plen);
+#if CONFIG_IS_ENABLED(LZ4)
+  } else if (IH_COMP_LZ4 == img_compress_algo) {
+    size_t size = des_len;
+
+    if (0x00 !=
+        (ret = ulz4fn((void *)data, *plen, dst, &size))) {
+      printf("unlz4 failed ret =%d\n", ret);
+      return -1;
+    }
+    *plen = size;
+#endif
+#if CONFIG_IS_ENABLED(ZSTD)
+  } else if (IH_COMP_ZSTD == img_compress_algo) {
+    struct abuf in, out;
+
+    abuf_init_set(&in, (void *)data, *plen);
+    abuf_init_set(&out, dst, des_len);
+    ret = zstd_decompress(&in, &out);
+    if (ret < 0) {
+      printf("unzstd failed ret =%d\n", ret);
+      return -1;
+    }
+    *plen = ret;
+    ret = 0;
+#endif
   } else {
     printf("Error: Unsupport compress algo.\n");
     return -2;
   }
 
+  printf("image: %s decompressed %lx bytes in %lu ms\n", image_get_name(pUh),
+         *plen, get_timer(start));
+  bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "image_decomp");
+
   flush_cache(img_load_addr, *plen);
 
   return ret;
 }
 
-static int k230_boot_rtt_uimage(image_header_t *pUh) {
+/*
+ * Leave the records at CONFIG_BOOTSTAGE_STASH_ADDR: U-Boot proper picks up
+ * the SPL ones in initf_bootstage(), RT-Smart finds the whole boot there
+ * if it keeps that region out of its heap.
+ */
+static void k230_boot_stash_bootstage(void) {
+#ifdef CONFIG_BOOTSTAGE_STASH
+  int ret;
+
+  ret = bootstage_stash(map_sysmem(CONFIG_BOOTSTAGE_STASH_ADDR,
+                                   CONFIG_BOOTSTAGE_STASH_SIZE),
+                        CONFIG_BOOTSTAGE_STASH_SIZE);
+  if (ret)
+    printf("bootstage stash failed %d\n", ret);
+  else
+    flush_cache(CONFIG_BOOTSTAGE_STASH_ADDR, CONFIG_BOOTSTAGE_STASH_SIZE);
+#endif
+}
+
+static int k230_boot_rtt_uimage(image_header_t *pUh, bool loaded) {
   int ret = 0;
   ulong len = image_get_size(pUh);
   ulong data = image_get_data(pUh);
@@ -116,12 +562,24 @@ static int k230_boot_rtt_uimage(image_header_t *pUh) {
   // multi
   image_multi_getimg(pUh, 0, &data, &len);
 
-  if (0x00 ==
-      (ret = k230_boot_decomp_to_load_addr(pUh, 0x6000000, data, &len))) {
+  if (loaded || (0x00 == (ret = k230_boot_decomp_to_load_addr(
+                              pUh, K230_BOOT_DECOMP_MAX_LEN, data, &len)))) {
+    /* compare the SPL fast boot with the boot through uboot */
+    bootstage_mark_name(K230_BOOTSTAGE_RTSMART, "start_rtsmart");
+    printf("RT-Smart starts %lu ms after reset\n", timer_get_boot_us() / 1000);
+#if CONFIG_IS_ENABLED(BOOTSTAGE_REPORT)
+    bootstage_report();
+#endif
+    k230_boot_stash_bootstage();
     k230_boot_reset_big_hard_and_run(image_get_load(pUh));
+#ifdef CONFIG_SANDBOX
+    /* no big core, the payload stays at its load address */
+    return 0;
+#else
     while (1) {
       asm volatile("wfi");
     }
+#endif
   }
 
   printf("Boot RT-Smart failed. %d\n", ret);
@@ -129,21 +587,28 @@ static int k230_boot_rtt_uimage(image_header_t *pUh) {
   return ret;
 }
 
-static int k230_boot_uboot_uimage(image_header_t *pUh) {
+static int k230_boot_uboot_uimage(image_header_t *pUh, bool loaded) {
+#ifndef CONFIG_SANDBOX
   void (*uboot)(ulong hart, void *dtb);
+#endif
 
   int ret = 0;
   ulong len = image_get_data_size(pUh);
   ulong data = image_get_data(pUh);
 
-  if (0x00 ==
-      (ret = k230_boot_decomp_to_load_addr(pUh, 0x6000000, data, &len))) {
+  if (loaded || (0x00 == (ret = k230_boot_decomp_to_load_addr(
+                              pUh, K230_BOOT_DECOMP_MAX_LEN, data, &len)))) {
+    bootstage_mark_name(K230_BOOTSTAGE_UBOOT, "jump_uboot");
+    k230_boot_stash_bootstage();
+
+#ifndef CONFIG_SANDBOX
     icache_disable();
     dcache_disable();
 
     asm volatile(".long 0x0170000b\n" ::: "memory");
     uboot = (void (*)(ulong, void *))(ulong)image_get_load(pUh);
     uboot(0, 0);
+#endif
   }
 
   return ret;
@@ -166,15 +631,22 @@ __weak ulong get_blk_start_by_boot_firmre_type(en_boot_sys_t sys) {
   return blk_s;
 }
 
-static int k230_load_sys_from_mmc_or_sd(en_boot_sys_t sys,
-                                        ulong buff) //(ulong offset ,ulong buff)
+static int k230_load_sys_from_mmc_or_sd(en_boot_sys_t sys, ulong buff,
+                                        void *stream) //(ulong offset ,ulong buff)
 {
   static struct blk_desc *pblk_desc = NULL;
   ulong blk_s = get_blk_start_by_boot_firmre_type(sys);
   struct mmc *mmc = NULL;
   int ret = 0;
-  firmware_head_s *pfh = (firmware_head_s *)buff;
+  firmware_head_s *pfh = map_sysmem(buff, 0);
   ulong data_sect = 0;
+  ulong batch = data_sect, done = 0;
+#ifdef CONFIG_K230_BOOT_STREAM
+  struct k230_boot_stream *bs = stream;
+#endif
+#ifdef CONFIG_K230_BOOT_PLACE
+  ulong place;
+#endif
 
   if (IMG_PART_NOT_EXIT == blk_s)
     return IMG_PART_NOT_EXIT;
@@ -198,9 +670,10 @@ static int k230_load_sys_from_mmc_or_sd(en_boot_sys_t sys,
     if (NULL == pblk_desc) {
       return 3;
     }
+    bootstage_mark_name(K230_BOOTSTAGE_MMC_INIT, "mmc_init");
   }
 
-  ret = blk_dread(pblk_desc, blk_s, HD_BLK_NUM, (char *)buff);
+  ret = blk_dread(pblk_desc, blk_s, HD_BLK_NUM, pfh);
   if (ret != HD_BLK_NUM) {
     return 4;
   }
@@ -212,23 +685,48 @@ static int k230_load_sys_from_mmc_or_sd(en_boot_sys_t sys,
   }
 
   data_sect = DIV_ROUND_UP(pfh->length + sizeof(*pfh), BLKSZ) - HD_BLK_NUM;
+  batch = data_sect;
+
+#ifdef CONFIG_K230_BOOT_STREAM
+  if (bs) {
+    k230_boot_stream_start(bs, pfh);
+    k230_boot_stream_feed(bs, HD_BLK_NUM * BLKSZ - sizeof(*pfh));
+    if (K230_STREAM_OFF != bs->state)
+      batch = CONFIG_K230_BOOT_STREAM_BATCH;
+#ifdef CONFIG_K230_BOOT_PLACE
+    place = k230_boot_place(bs, pfh, HD_BLK_NUM + data_sect);
+    if (place)
+      pfh = map_sysmem(place, (HD_BLK_NUM + data_sect) * BLKSZ);
+#endif
+  }
+#endif
 
-  ret = blk_dread(pblk_desc, blk_s + HD_BLK_NUM, data_sect,
-                  (char *)buff + HD_BLK_NUM * BLKSZ);
+  while (done < data_sect) {
+    ulong n = min(batch, data_sect - done);
 
-  if (ret != data_sect) {
-    return 6;
+    ret = blk_dread(pblk_desc, blk_s + HD_BLK_NUM + done, n,
+                    (char *)pfh + (HD_BLK_NUM + done) * BLKSZ);
+    if (ret != n) {
+      return 6;
+    }
+    done += n;
+
+#ifdef CONFIG_K230_BOOT_STREAM
+    if (bs)
+      k230_boot_stream_feed(bs, (HD_BLK_NUM + done) * BLKSZ - sizeof(*pfh));
+#endif
   }
 
   return 0;
 }
 
-static int k230_img_load_sys_from_dev(en_boot_sys_t sys, ulong buff) {
+static int k230_img_load_sys_from_dev(en_boot_sys_t sys, ulong buff,
+                                      void *stream) {
   int ret = 0;
 
   if ((BOOT_MEDIUM_SDIO0 == g_boot_medium) ||
       (BOOT_MEDIUM_SDIO1 == g_boot_medium)) {
-    ret = k230_load_sys_from_mmc_or_sd(sys, buff);
+    ret = k230_load_sys_from_mmc_or_sd(sys, buff, stream);
   } else {
     ret = -1;
     printf("Error, Unsupport media type %d\n", sys);
@@ -247,19 +745,12 @@ static int k230_img_load_boot_sys_auot_boot(en_boot_sys_t sys) {
   return ret;
 }
 
-int k230_img_boot_sys_bin(firmware_head_s *fhBUff) {
+/* @loaded: the payload was already put at its load address while loading */
+static int k230_img_boot_plain(ulong plain_addr, bool loaded) {
   int ret = 0;
 
   image_header_t *pUh = NULL;
   const char *image_name = NULL;
-  ulong plain_addr = 0;
-
-  ret = k230_boot_check_and_get_plain_data((firmware_head_s *)fhBUff,
-                                           &plain_addr);
-  if (ret) {
-    printf("decrypt image failed.");
-    return ret;
-  }
 
   pUh = (image_header_t *)(plain_addr + 4);
   if (!image_check_magic(pUh)) {
@@ -270,9 +761,9 @@ int k230_img_boot_sys_bin(firmware_head_s *fhBUff) {
   image_name = image_get_name(pUh);
 
   if (0 == strcmp(image_name, "rtt")) {
-    ret = k230_boot_rtt_uimage(pUh);
+    ret = k230_boot_rtt_uimage(pUh, loaded);
   } else if (0 == strcmp(image_name, "uboot")) {
-    ret = k230_boot_uboot_uimage(pUh);
+    ret = k230_boot_uboot_uimage(pUh, loaded);
   } else {
     printf("Error, Unsupport image type %s\n", image_name);
     return -4;
@@ -281,17 +772,53 @@ int k230_img_boot_sys_bin(firmware_head_s *fhBUff) {
   return ret;
 }
 
+int k230_img_boot_sys_bin(firmware_head_s *fhBUff) {
+  int ret = 0;
+  ulong plain_addr = 0;
+
+  ret = k230_boot_check_and_get_plain_data((firmware_head_s *)fhBUff,
+                                           &plain_addr);
+  if (ret) {
+    printf("decrypt image failed.");
+    return ret;
+  }
+  bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "image_verify");
+
+  return k230_img_boot_plain(plain_addr, false);
+}
+
 int k230_img_load_boot_sys(en_boot_sys_t sys) {
   int ret = 0;
+  void *stream = NULL;
+  ulong start = get_timer(0);
 
   ulong img_load_addr = k230_get_encrypted_image_load_addr();
 
+#ifdef CONFIG_K230_BOOT_STREAM
+  struct k230_boot_stream bs;
+
+  bs.state = K230_STREAM_OFF;
+  stream = &bs;
+#endif
+
   if (sys == BOOT_SYS_AUTO) {
     ret = k230_img_load_boot_sys_auot_boot(sys);
   } else {
-    if (0x00 == (ret = k230_img_load_sys_from_dev(sys, img_load_addr))) {
-      if (0x00 !=
-          (ret = k230_img_boot_sys_bin((firmware_head_s *)img_load_addr))) {
+    if (0x00 == (ret = k230_img_load_sys_from_dev(sys, img_load_addr, stream))) {
+      debug("image loaded in %lu ms\n", get_timer(start));
+      bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "image_load");
+#ifdef CONFIG_K230_BOOT_STREAM
+      if (K230_STREAM_OFF != bs.state) {
+        /* hashed while loading, boot_sys_bin would hash it again */
+        if (0x00 == (ret = k230_boot_stream_finish(&bs))) {
+          bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "image_verify");
+          ret = k230_img_boot_plain(bs.plain, K230_STREAM_DONE == bs.state);
+        }
+      } else
+#endif
+      ret = k230_img_boot_sys_bin(map_sysmem(img_load_addr, 0));
+
+      if (0x00 != ret) {
         printf("Error, boot image failed.%d\n", ret);
       }
     } else {
@@ -305,10 +832,12 @@ int k230_img_load_boot_sys(en_boot_sys_t sys) {
 static int k230_boot_reset_big_hard_and_run(ulong core_run_addr) {
   printf("Jump to big hart\n");
 
+#ifndef CONFIG_SANDBOX
   writel(core_run_addr,   (void *)0x91102104ULL);
   writel(0x10001000,      (void *)0x9110100cULL);
   writel(0x10001,         (void *)0x9110100cULL);
   writel(0x10000,         (void *)0x9110100cULL);
+#endif
 
   return 0;
 }
@@ -511,3 +1040,103 @@ static int k230_boot_check_and_get_plain_data(firmware_head_s *pfh,
 
   return ret;
 }
+
+#ifndef CONFIG_SPL_BUILD
+static int k230_boot_prepare_args(int argc, char *const argv[], ulong buff,
+                                  en_boot_sys_t *sys, boot_medium_e *bootmod) {
+  ulong add_tmp, len;
+
+  if (argc < 3)
+    return CMD_RET_USAGE;
+
+  if (!strcmp(argv[1], "mem")) {
+    if (argc < 4)
+      return CMD_RET_USAGE;
+    add_tmp = simple_strtoul(argv[2], NULL, 0);
+    len = simple_strtoul(argv[3], NULL, 0);
+    if (add_tmp != buff) {
+      memmove(map_sysmem(buff, len), map_sysmem(add_tmp, len), len);
+    }
+    *sys = BOOT_SYS_ADDR;
+    return 0;
+  } else if (!strcmp(argv[1], "sdio1"))
+    *bootmod = BOOT_MEDIUM_SDIO1;
+  else if (!strcmp(argv[1], "sdio0"))
+    *bootmod = BOOT_MEDIUM_SDIO0;
+  else if (!strcmp(argv[1], "spinor"))
+    *bootmod = BOOT_MEDIUM_NORFLASH;
+  else if (!strcmp(argv[1], "spinand"))
+    *bootmod = BOOT_MEDIUM_NANDFLASH;
+  else if (!strcmp(argv[1], "auto"))
+    *bootmod = g_boot_medium;
+
+  if (!strcmp(argv[2], "rtt"))
+    *sys = BOOT_SYS_RTT;
+  else if (!strcmp(argv[2], "linux"))
+    *sys = BOOT_SYS_LINUX;
+  else if (!strcmp(argv[2], "qbc"))
+    *sys = BOOT_QUICK_BOOT_CFG;
+  else if (!strcmp(argv[2], "fdb"))
+    *sys = BOOT_FACE_DB;
+  else if (!strcmp(argv[2], "sensor"))
+    *sys = BOOT_SENSOR_CFG;
+  else if (!strcmp(argv[2], "ai"))
+    *sys = BOOT_AI_MODE;
+  else if (!strcmp(argv[2], "speckle"))
+    *sys = BOOT_SPECKLE;
+  else if (!strcmp(argv[2], "rtapp"))
+    *sys = BOOT_RTAPP;
+  else if (!strcmp(argv[2], "uboot"))
+    *sys = BOOT_SYS_UBOOT;
+  else if (!strcmp(argv[2], "auto_boot"))
+    *sys = BOOT_SYS_AUTO;
+
+  return 0;
+}
+
+/**
+ * @brief
+ *
+ * @param cmdtp
+ * @param flag
+ * @param argc
+ * @param argv
+ * @return int
+ */
+static int do_k230_boot(struct cmd_tbl *cmdtp, int flag, int argc,
+                        char *const argv[]) {
+  int ret = 0;
+  en_boot_sys_t sys;
+  boot_medium_e bootmod = g_boot_medium;
+  ulong cipher_addr = k230_get_encrypted_image_decrypt_addr();
+
+  /* the stages below are timed from here, not from the prompt */
+  bootstage_mark_name(BOOTSTAGE_ID_ALLOC, "k230_boot");
+
+  ret = k230_boot_prepare_args(argc, argv, cipher_addr, &sys, &bootmod);
+  if (ret)
+    return ret;
+
+  g_boot_medium = bootmod;
+  if (sys == BOOT_SYS_ADDR)
+    ret = k230_img_boot_sys_bin(map_sysmem(cipher_addr, 0));
+  else
+    ret = k230_img_load_boot_sys(sys);
+
+  return ret;
+}
+
+#define K230_BOOT_HELP                                                         \
+  " <auto|sdio1|sdio0|spinor|spinand|mem> "                                    \
+  "<auto_boot|rtt|linux|qbc|fdb|sensor|ai|speckle|rtapp|uboot|addr> [len]\n"   \
+  "qbc---quick boot cfg\n"                                                     \
+  "fdb---face database\n"                                                      \
+  "sensor---sensor cfg\n"                                                      \
+  "ai---ai mode cfg\n"                                                         \
+  "speckle---speckle cfg\n"                                                    \
+  "rtapp---rtt app\n"                                                          \
+  "auto_boot---auto boot\n"                                                    \
+  "uboot---boot uboot\n"
+
+U_BOOT_CMD_COMPLETE(k230_boot, 6, 0, do_k230_boot, NULL, K230_BOOT_HELP, NULL);
+#endif
@@ -0,0 +1,242 @@
+/* Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <asm/io.h>
+#include <blk.h>
+#include <common.h>
+#include <cpu_func.h>
+#include <malloc.h>
+#include <memalign.h>
+#include <mmc.h>
+#include <stdio.h>
+#include <u-boot/crc.h>
+
+#include <kendryte/k230_ddr_cache.h>
+
+#include "board_common.h"
+
+#define K230_DDR_PHY_BASE 0x9a000000UL
+
+/*
+ * PHY CSRs holding the training results, as listed by the PHY vendor for
+ * retention: delays, VREF, DFI latencies and the PIE sequence registers
+ * the firmware adjusts.
+ */
+static const u32 k230_ddr_trained_csr[] = {
+    0x200b2, 0x200cb, 0x10043, 0x10143, 0x11043, 0x11143, 0x12043, 0x12143,
+    0x13043, 0x13143, 0x00080, 0x01080, 0x02080, 0x03080, 0x04080, 0x05080,
+    0x06080, 0x07080, 0x08080, 0x09080, 0x10080, 0x10180, 0x11080, 0x11180,
+    0x12080, 0x12180, 0x13080, 0x13180, 0x10081, 0x10181, 0x11081, 0x11181,
+    0x12081, 0x12181, 0x13081, 0x13181, 0x100d0, 0x101d0, 0x110d0, 0x111d0,
+    0x120d0, 0x121d0, 0x130d0, 0x131d0, 0x100d1, 0x101d1, 0x110d1, 0x111d1,
+    0x120d1, 0x121d1, 0x130d1, 0x131d1, 0x10068, 0x10168, 0x10268, 0x10368,
+    0x10468, 0x10568, 0x10668, 0x10768, 0x10868, 0x11068, 0x11168, 0x11268,
+    0x11368, 0x11468, 0x11568, 0x11668, 0x11768, 0x11868, 0x12068, 0x12168,
+    0x12268, 0x12368, 0x12468, 0x12568, 0x12668, 0x12768, 0x12868, 0x13068,
+    0x13168, 0x13268, 0x13368, 0x13468, 0x13568, 0x13668, 0x13768, 0x13868,
+    0x10069, 0x10169, 0x10269, 0x10369, 0x10469, 0x10569, 0x10669, 0x10769,
+    0x10869, 0x11069, 0x11169, 0x11269, 0x11369, 0x11469, 0x11569, 0x11669,
+    0x11769, 0x11869, 0x12069, 0x12169, 0x12269, 0x12369, 0x12469, 0x12569,
+    0x12669, 0x12769, 0x12869, 0x13069, 0x13169, 0x13269, 0x13369, 0x13469,
+    0x13569, 0x13669, 0x13769, 0x13869, 0x1008c, 0x1018c, 0x1108c, 0x1118c,
+    0x1208c, 0x1218c, 0x1308c, 0x1318c, 0x1008d, 0x1018d, 0x1108d, 0x1118d,
+    0x1208d, 0x1218d, 0x1308d, 0x1318d, 0x100c0, 0x101c0, 0x102c0, 0x103c0,
+    0x104c0, 0x105c0, 0x106c0, 0x107c0, 0x108c0, 0x110c0, 0x111c0, 0x112c0,
+    0x113c0, 0x114c0, 0x115c0, 0x116c0, 0x117c0, 0x118c0, 0x120c0, 0x121c0,
+    0x122c0, 0x123c0, 0x124c0, 0x125c0, 0x126c0, 0x127c0, 0x128c0, 0x130c0,
+    0x131c0, 0x132c0, 0x133c0, 0x134c0, 0x135c0, 0x136c0, 0x137c0, 0x138c0,
+    0x100c1, 0x101c1, 0x102c1, 0x103c1, 0x104c1, 0x105c1, 0x106c1, 0x107c1,
+    0x108c1, 0x110c1, 0x111c1, 0x112c1, 0x113c1, 0x114c1, 0x115c1, 0x116c1,
+    0x117c1, 0x118c1, 0x120c1, 0x121c1, 0x122c1, 0x123c1, 0x124c1, 0x125c1,
+    0x126c1, 0x127c1, 0x128c1, 0x130c1, 0x131c1, 0x132c1, 0x133c1, 0x134c1,
+    0x135c1, 0x136c1, 0x137c1, 0x138c1, 0x10020, 0x11020, 0x12020, 0x13020,
+    0x20072, 0x20073, 0x20074, 0x100aa, 0x110aa, 0x120aa, 0x130aa, 0x20010,
+    0x20011, 0x100ae, 0x100af, 0x110ae, 0x110af, 0x120ae, 0x120af, 0x130ae,
+    0x130af, 0x20020, 0x100a0, 0x100a1, 0x100a2, 0x100a3, 0x100a4, 0x100a5,
+    0x100a6, 0x100a7, 0x110a0, 0x110a1, 0x110a2, 0x110a3, 0x110a4, 0x110a5,
+    0x110a6, 0x110a7, 0x120a0, 0x120a1, 0x120a2, 0x120a3, 0x120a4, 0x120a5,
+    0x120a6, 0x120a7, 0x130a0, 0x130a1, 0x130a2, 0x130a3, 0x130a4, 0x130a5,
+    0x130a6, 0x130a7, 0x2007c, 0x2007d, 0x400fd, 0x400c0, 0x90201, 0x90202,
+    0x90203, 0x90204, 0x90205, 0x90206, 0x90207, 0x90208, 0x10062, 0x10162,
+    0x10262, 0x10362, 0x10462, 0x10562, 0x10662, 0x10762, 0x10862, 0x11062,
+    0x11162, 0x11262, 0x11362, 0x11462, 0x11562, 0x11662, 0x11762, 0x11862,
+    0x12062, 0x12162, 0x12262, 0x12362, 0x12462, 0x12562, 0x12662, 0x12762,
+    0x12862, 0x13062, 0x13162, 0x13262, 0x13362, 0x13462, 0x13562, 0x13662,
+    0x13762, 0x13862, 0x20077, 0x10001, 0x11001, 0x12001, 0x13001, 0x10040,
+    0x10140, 0x10240, 0x10340, 0x10440, 0x10540, 0x10640, 0x10740, 0x10840,
+    0x10030, 0x10130, 0x10230, 0x10330, 0x10430, 0x10530, 0x10630, 0x10730,
+    0x10830, 0x11040, 0x11140, 0x11240, 0x11340, 0x11440, 0x11540, 0x11640,
+    0x11740, 0x11840, 0x11030, 0x11130, 0x11230, 0x11330, 0x11430, 0x11530,
+    0x11630, 0x11730, 0x11830, 0x12040, 0x12140, 0x12240, 0x12340, 0x12440,
+    0x12540, 0x12640, 0x12740, 0x12840, 0x12030, 0x12130, 0x12230, 0x12330,
+    0x12430, 0x12530, 0x12630, 0x12730, 0x12830, 0x13040, 0x13140, 0x13240,
+    0x13340, 0x13440, 0x13540, 0x13640, 0x13740, 0x13840, 0x13030, 0x13130,
+    0x13230, 0x13330, 0x13430, 0x13530, 0x13630, 0x13730, 0x13830,
+};
+
+/* address lines are probed over all of DRAM, the SDK knows its size */
+#ifdef CONFIG_MEM_TOTAL_SIZE
+#define K230_DDR_CACHE_DRAM_SIZE CONFIG_MEM_TOTAL_SIZE
+#else
+#define K230_DDR_CACHE_DRAM_SIZE CONFIG_K230_DDR_CACHE_TEST_SIZE
+#endif
+
+#define K230_DDR_CACHE_COUNT ARRAY_SIZE(k230_ddr_trained_csr)
+#define K230_DDR_CACHE_BLKS                                                    \
+  DIV_ROUND_UP(k230_ddr_cache_size(K230_DDR_CACHE_COUNT), BLKSZ)
+
+/* used before the BSS is cleared */
+static void *k230_ddr_cache_blob;
+static struct k230_ddr_cache_key k230_ddr_cache_key;
+static bool k230_ddr_cache_restored;
+static bool k230_ddr_cache_dirty;
+
+static u32 k230_ddr_phy_read(void *priv, u32 reg) {
+  return readl((void *)(K230_DDR_PHY_BASE + reg * 4));
+}
+
+static void k230_ddr_phy_write(void *priv, u32 reg, u32 val) {
+  writel(val, (void *)(K230_DDR_PHY_BASE + reg * 4));
+}
+
+static const struct k230_ddr_cache_ops k230_ddr_phy_ops = {
+    .read = k230_ddr_phy_read,
+    .write = k230_ddr_phy_write,
+};
+
+/* the PHY CSRs are only reachable with the training firmware halted */
+static void k230_ddr_phy_csr_access(bool on) {
+  if (on) {
+    k230_ddr_phy_write(NULL, 0xd0000, 0x0);
+    k230_ddr_phy_write(NULL, 0xc0080, 0x3);
+  } else {
+    k230_ddr_phy_write(NULL, 0xc0080, 0x2);
+    k230_ddr_phy_write(NULL, 0xd0000, 0x1);
+  }
+}
+
+__weak int k230_ddr_cache_temp(void) { return K230_DDR_TEMP_UNKNOWN; }
+
+static struct blk_desc *k230_ddr_cache_dev(void) {
+  int dev = g_boot_medium - BOOT_MEDIUM_SDIO0;
+  struct mmc *mmc;
+
+  if ((BOOT_MEDIUM_SDIO0 != g_boot_medium) &&
+      (BOOT_MEDIUM_SDIO1 != g_boot_medium))
+    return NULL;
+
+  if (mmc_init_device(dev))
+    return NULL;
+
+  mmc = find_mmc_device(dev);
+  if (!mmc || mmc_init(mmc))
+    return NULL;
+
+  return mmc_get_blk_desc(mmc);
+}
+
+bool k230_ddr_cache_restore_trained(u32 rate) {
+  struct blk_desc *desc;
+  ulong blk = CONFIG_K230_DDR_CACHE_OFFSET / BLKSZ;
+  int ret;
+
+  k230_ddr_cache_restored = false;
+  k230_ddr_cache_dirty = false;
+  k230_ddr_cache_key.board =
+      crc32(0, (const uchar *)CONFIG_SYS_BOARD, strlen(CONFIG_SYS_BOARD));
+  k230_ddr_cache_key.rate = rate;
+  k230_ddr_cache_key.temp = k230_ddr_cache_temp();
+
+  k230_ddr_cache_blob = memalign(ARCH_DMA_MINALIGN, K230_DDR_CACHE_BLKS * BLKSZ);
+  if (!k230_ddr_cache_blob)
+    return false;
+
+  desc = k230_ddr_cache_dev();
+  if (!desc || blk_dread(desc, blk, K230_DDR_CACHE_BLKS, k230_ddr_cache_blob) !=
+                   K230_DDR_CACHE_BLKS)
+    return false;
+
+  ret = k230_ddr_cache_check(k230_ddr_cache_blob, K230_DDR_CACHE_BLKS * BLKSZ,
+                             &k230_ddr_cache_key, k230_ddr_trained_csr,
+                             K230_DDR_CACHE_COUNT,
+                             CONFIG_K230_DDR_CACHE_TEMP_DELTA);
+  if (ret) {
+    printf("DDR training cache not used %d, training\n", ret);
+    return false;
+  }
+
+  k230_ddr_phy_csr_access(true);
+  k230_ddr_cache_restore(k230_ddr_cache_blob, &k230_ddr_phy_ops);
+  k230_ddr_phy_csr_access(false);
+  k230_ddr_cache_restored = true;
+
+  return true;
+}
+
+void k230_ddr_cache_save_trained(void) {
+  if (k230_ddr_cache_restored || !k230_ddr_cache_blob)
+    return;
+
+  k230_ddr_phy_csr_access(true);
+  k230_ddr_cache_dirty =
+      !k230_ddr_cache_save(k230_ddr_cache_blob, K230_DDR_CACHE_BLKS * BLKSZ,
+                           &k230_ddr_cache_key, k230_ddr_trained_csr,
+                           K230_DDR_CACHE_COUNT, &k230_ddr_phy_ops);
+  k230_ddr_phy_csr_access(false);
+}
+
+void k230_ddr_cache_finish(void) {
+  struct blk_desc *desc;
+  ulong blk = CONFIG_K230_DDR_CACHE_OFFSET / BLKSZ;
+
+  if (!k230_ddr_cache_restored && !k230_ddr_cache_dirty)
+    return;
+
+  if (k230_ddr_cache_memtest((void *)CONFIG_SYS_SDRAM_BASE,
+                             CONFIG_K230_DDR_CACHE_TEST_SIZE,
+                             K230_DDR_CACHE_DRAM_SIZE)) {
+    if (!k230_ddr_cache_restored) {
+      printf("DDR test failed, training not cached\n");
+      k230_ddr_cache_dirty = false;
+      return;
+    }
+
+    /* drop the record and reset, the next boot trains again */
+    printf("DDR test failed with the cached training, dropping it\n");
+    memset(k230_ddr_cache_blob, 0, BLKSZ);
+    desc = k230_ddr_cache_dev();
+    if (desc)
+      blk_dwrite(desc, blk, 1, k230_ddr_cache_blob);
+    reset_cpu();
+  }
+
+  if (!k230_ddr_cache_dirty)
+    return;
+
+  desc = k230_ddr_cache_dev();
+  if (!desc || blk_dwrite(desc, blk, K230_DDR_CACHE_BLKS, k230_ddr_cache_blob) !=
+                   K230_DDR_CACHE_BLKS)
+    printf("DDR training cache not saved\n");
+  k230_ddr_cache_dirty = false;
+}
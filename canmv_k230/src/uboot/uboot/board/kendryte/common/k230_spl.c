@@ -28,13 +28,17 @@
 #include <asm/spl.h>
 #include <asm/types.h>
 #include <asm/cache.h>
+#include <asm/gpio.h>
+#include <bootstage.h>
 #include <command.h>
 #include <common.h>
 #include <cpu_func.h>
+#include <env.h>
 #include <init.h>
 #include <linux/kernel.h>
 #include <lmb.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "board_common.h"
 
@@ -104,15 +108,96 @@ void spl_device_disable(void) {
   writel(value, (volatile void __iomem *)0x9110006c);
 }
 
+#ifdef CONFIG_K230_SPL_FAST_BOOT
+/*
+ * Fast boot starts RT-Smart from SPL, skipping U-Boot proper, its env
+ * and bootcmd. Any of these sends the boot through U-Boot instead.
+ */
+static bool k230_spl_fast_boot_escape(void) {
+#if CONFIG_K230_SPL_FAST_BOOT_KEY_MS > 0
+  ulong start = get_timer(0);
+
+  printf("Press any key for uboot\n");
+  while (get_timer(start) < CONFIG_K230_SPL_FAST_BOOT_KEY_MS) {
+    if (tstc()) {
+      getchar();
+      puts("fast boot: key pressed\n");
+      return true;
+    }
+  }
+#endif
+
+#if defined(CONFIG_K230_SPL_FAST_BOOT_GPIO) && \
+    (CONFIG_K230_SPL_FAST_BOOT_GPIO >= 0)
+  if (0x00 == gpio_request(CONFIG_K230_SPL_FAST_BOOT_GPIO, "fast_boot")) {
+    int val;
+
+    gpio_direction_input(CONFIG_K230_SPL_FAST_BOOT_GPIO);
+    val = gpio_get_value(CONFIG_K230_SPL_FAST_BOOT_GPIO);
+    gpio_free(CONFIG_K230_SPL_FAST_BOOT_GPIO);
+    if (IS_ENABLED(CONFIG_K230_SPL_FAST_BOOT_GPIO_ACTIVE_LOW) ? (0 == val)
+                                                              : (1 == val)) {
+      puts("fast boot: gpio set\n");
+      return true;
+    }
+  }
+#endif
+
+#ifdef CONFIG_K230_SPL_FAST_BOOT_ENV
+  if ((0x00 == env_init()) && (0x00 == env_load()) &&
+      (0 == env_get_yesno("k230_fast_boot"))) {
+    puts("fast boot: disabled by env\n");
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+/*
+ * What U-Boot proper sets up on the board before it starts RT-Smart:
+ * the SD host bits and kd_board_init() of board_init(), and
+ * board_late_init(), which sets the USB ID pull-ups and pulses the WiFi
+ * or eMMC reset on some boards. The pinmux is applied in SPL already,
+ * when the pre-reloc iomux node is bound. The rest of U-Boot's init only
+ * brings up its own drivers, the CPU, MMC and USB ones, which RT-Smart
+ * initializes again.
+ */
+static void k230_spl_fast_boot_board_init(void) {
+  k230_board_sd_init();
+  kd_board_init();
+#ifdef CONFIG_BOARD_LATE_INIT
+  board_late_init();
+#endif
+}
+#endif
+
 int spl_board_init_f(void) {
   int ret = 0;
 
+  /*
+   * Clear the BSS before DDR init: it is in SRAM, and the DDR training
+   * cache reads the boot medium, which needs the MMC driver state there.
+   */
+  memset(__bss_start, 0, (ulong)&__bss_end - (ulong)__bss_start);
+
   spl_device_disable();
+  bootstage_mark_name(K230_BOOTSTAGE_DEVICE_DISABLE, "spl_device_disable");
 
   /* init dram */
   ddr_init_training();
-  /* Clear the BSS. */
-  memset(__bss_start, 0, (ulong)&__bss_end - (ulong)__bss_start);
+  bootstage_mark_name(K230_BOOTSTAGE_DDR, "ddr_init_training");
+
+#ifdef CONFIG_K230_SPL_FAST_BOOT
+  if (!k230_spl_fast_boot_escape()) {
+    k230_spl_fast_boot_board_init();
+    bootstage_mark_name(K230_BOOTSTAGE_FAST_BOOT, "spl_fast_boot");
+    /* only comes back if RT-Smart could not be started */
+    ret = k230_img_load_boot_sys(BOOT_SYS_RTT);
+    printf("fast boot failed %d, continue with uboot\n", ret);
+    ret = 0;
+  }
+#endif
 
   ret += k230_img_load_boot_sys(CONFIG_UBOOT_SPL_BOOT_IMG_TYPE);
   if (ret) {
@@ -25,6 +25,7 @@ int ddr_init_training(void) {
   }
 
   board_ddr_init();
+  k230_ddr_cache_finish();
 
   return 0;
 }
@@ -24,6 +24,7 @@
  */
 #include <stdio.h>
 #include <asm/io.h>
+#include "board_common.h"
 //#include <k230.h>
 //#include <core_rv64.h>
 #define               DDR_REG_BASE 0x98000000
@@ -693,6 +694,8 @@ reg_write(   DDR_REG_BASE + 0x120a7*4+0x02000000,0x6); //
 
 
 
+/* trained CSRs of an earlier boot replace the training firmware run */
+if (!k230_ddr_cache_restore_trained(2667)) {
 reg_write(   DDR_REG_BASE + 0xd0000*4+0x02000000,0x0);
 reg_write(   DDR_REG_BASE +0x50000*4+0x02000000,0x114);
 reg_write(   DDR_REG_BASE +0x50001*4+0x02000000,0x0);
@@ -18013,6 +18016,7 @@ train_data=0;
 
 reg_write(   DDR_REG_BASE +   0x000d0099*4 +0x02000000 , 0x00000001  );
 reg_write(   DDR_REG_BASE +   0x000d0000*4 +0x02000000 , 0x00000000  );
+}
 //reg_write(   DDR_REG_BASE +   0x000d0000*4 +0x02000000 , 0x00000001  );
 
 
@@ -18591,6 +18595,7 @@ reg_read (   DDR_REG_BASE +  0x00020097*4+0x02000000 , data );
 
 
 //////////////////phy init end ////////////////////////////////////
+k230_ddr_cache_save_trained();
 
 reg_write( DDR_REG_BASE +  0x000001b0 , 0x00000034 );
 
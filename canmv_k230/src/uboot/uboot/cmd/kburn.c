@@ -16,9 +16,24 @@ static int do_kburn(struct cmd_tbl *cmdtp, int flag, int argc,
 	int ret, controller_index;
 	char *usb_controller;
 
-	if (argc < 1)
+	if (argc < 2)
 		return CMD_RET_USAGE;
 
+#if defined(CONFIG_KBURN_OVER_USB)
+	if (!strcmp(argv[1], "stats")) {
+		kburn_usb_print_stats();
+		return CMD_RET_SUCCESS;
+	}
+
+	kburn_usb_set_verbose(!strcmp(argv[1], "-v"));
+#endif
+
+	if (!strcmp(argv[1], "-v")) {
+		if (argc < 3)
+			return CMD_RET_USAGE;
+		argv++;
+	}
+
 	usb_controller = argv[1];
 	controller_index = simple_strtoul(usb_controller, NULL, 0);
 
@@ -45,9 +60,16 @@ static int do_kburn(struct cmd_tbl *cmdtp, int flag, int argc,
 		if (ctrlc())
 			break;
 		usb_gadget_handle_interrupts(controller_index);
+#if defined(CONFIG_KBURN_OVER_USB)
+		kburn_usb_poll();
+#endif
 	}
 	ret = CMD_RET_SUCCESS;
 
+#if defined(CONFIG_KBURN_OVER_USB)
+	kburn_usb_print_stats();
+#endif
+
 exit:
 	g_dnl_unregister();
 	g_dnl_clear_detach();
@@ -56,9 +78,10 @@ exit:
 	return ret;
 }
 
-U_BOOT_CMD(kburn, 2, 1, do_kburn,
+U_BOOT_CMD(kburn, 3, 1, do_kburn,
 	   "Canaan usb burner protocol",
-	   "<USB_controller> e.g. kburn 0\n"
+	   "[-v] <USB_controller> e.g. kburn 0, -v dumps every command packet\n"
+	   "kburn stats - show throughput and latency of the last session\n"
 );
 
 #if defined (CONFIG_CMD_KBURN_BENCHMARK)
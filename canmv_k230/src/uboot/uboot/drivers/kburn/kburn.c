@@ -1,6 +1,10 @@
 #include <common.h>
 #include <log.h>
 #include <malloc.h>
+#include <time.h>
+#include <asm/unaligned.h>
+#include <u-boot/crc.h>
+#include <u-boot/sha256.h>
 
 #include "kburn.h"
 
@@ -56,21 +60,191 @@ int kburn_read_medium(struct kburn *burn, u64 offset, void *buf, u64 *len)
 
 int kburn_write_medium(struct kburn *burn, u64 offset, const void *buf, u64 *len)
 {
+    u64 start;
+    int ret;
+
     if((NULL == burn) || (NULL == burn->write_medium)) {
         pr_err("invalid arg\n");
         return -1;
     }
-    return burn->write_medium(burn, offset, buf, len);
+
+    start = timer_get_us();
+    ret = burn->write_medium(burn, offset, buf, len);
+    burn->stats.write_us += timer_get_us() - start;
+
+    if(0x00 == ret) {
+        burn->stats.wr_bytes += *len;
+    } else {
+        burn->stats.errors++;
+    }
+
+    return ret;
 }
 
 int kburn_erase_medium(struct kburn *burn, u64 offset, u64 *len)
 {
+    u64 start;
+    int ret;
+
     if((NULL == burn) || (NULL == burn->erase_medium)) {
         pr_err("invalid arg\n");
         return -1;
     }
-    return burn->erase_medium(burn, offset, len);
+
+    start = timer_get_us();
+    ret = burn->erase_medium(burn, offset, len);
+    burn->stats.erase_us += timer_get_us() - start;
+
+    if(0x00 != ret) {
+        burn->stats.errors++;
+    }
+
+    return ret;
+}
+
+/*
+ * Mark [offset, offset + len) as don't care. Only the erase aligned interior
+ * is erased (blk_derase on MMC, block erase on MTD/SF) so data sharing an
+ * erase unit with the edges survives. *len returns the discarded size.
+ */
+int kburn_discard_medium(struct kburn *burn, u64 offset, u64 *len)
+{
+    u64 erase_size, start, end;
+
+    if((NULL == burn) || (NULL == len)) {
+        pr_err("invalid arg\n");
+        return -1;
+    }
+
+    erase_size = burn->medium_info.erase_size;
+    if((NULL == burn->erase_medium) || (0x00 == erase_size)) {
+        *len = 0;
+        return 0;
+    }
+
+    start = roundup(offset, erase_size);
+    end = rounddown(offset + *len, erase_size);
+
+    if(end <= start) {
+        *len = 0;
+        return 0;
+    }
+
+    *len = end - start;
+
+    return kburn_erase_medium(burn, start, len);
+}
+
+/*
+ * Fill [offset, offset + len) with a 32bit pattern. When the medium erases
+ * to 0xFF and the range is erase aligned this is a plain erase, otherwise
+ * buf (at least one blk_size, caller owned) is filled and written repeatedly.
+ */
+int kburn_fill_medium(struct kburn *burn, u64 offset, u64 len, u32 pattern,
+            void *buf, u64 buf_size)
+{
+    u64 erase_size, chunk, xfer;
+    u32 *pdata = buf;
+
+    if((NULL == burn) || (NULL == buf) || (0x00 == burn->medium_info.blk_size)) {
+        pr_err("invalid arg\n");
+        return -1;
+    }
+
+    erase_size = burn->medium_info.erase_size;
+
+    if((burn->flags & KBURN_FLAG_ERASED_FF) && (0xFFFFFFFF == pattern) && erase_size &&
+        (0x00 == (offset % erase_size)) && (0x00 == (len % erase_size))) {
+        return kburn_erase_medium(burn, offset, &len);
+    }
+
+    buf_size -= buf_size % burn->medium_info.blk_size;
+    if (0x00 == buf_size) {
+        pr_err("fill buffer too small\n");
+        return -1;
+    }
+
+    for (u64 i = 0; i < buf_size / sizeof(u32); i++)
+        pdata[i] = pattern;
+
+    while (len) {
+        chunk = len > buf_size ? buf_size : len;
+        xfer = chunk;
+
+        if(0x00 != kburn_write_medium(burn, offset, buf, &xfer)) {
+            pr_err("fill medium at 0x%llx failed\n", offset);
+            return -1;
+        }
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+#if defined(CONFIG_KBURN_VERIFY)
+/*
+ * Digest [offset, offset + len) as read back from the medium, buf (caller
+ * owned, at least one blk_size) is the read batch. CRC32 is returned little
+ * endian like every other integer in the protocol.
+ */
+int kburn_verify_medium(struct kburn *burn, u64 offset, u64 len, int algo,
+            void *buf, u64 buf_size, u8 *digest, u32 *digest_len)
+{
+    sha256_context ctx;
+    u32 crc = 0;
+    u64 chunk, xfer;
+
+    if((NULL == burn) || (NULL == buf) || (NULL == digest) || (0x00 == burn->medium_info.blk_size)) {
+        pr_err("invalid arg\n");
+        return -1;
+    }
+
+    if((KBURN_VERIFY_CRC32 != algo) && (KBURN_VERIFY_SHA256 != algo)) {
+        pr_err("verify algo %d not support\n", algo);
+        return -1;
+    }
+
+    /* mmc reads whole blocks, keep every batch inside buf */
+    buf_size -= buf_size % burn->medium_info.blk_size;
+    if (0x00 == buf_size) {
+        pr_err("verify buffer too small\n");
+        return -1;
+    }
+
+    if(KBURN_VERIFY_SHA256 == algo)
+        sha256_starts(&ctx);
+
+    while (len) {
+        chunk = len > buf_size ? buf_size : len;
+        xfer = chunk;
+
+        if(0x00 != kburn_read_medium(burn, offset, buf, &xfer)) {
+            pr_err("verify read at 0x%llx failed\n", offset);
+            return -1;
+        }
+
+        if(KBURN_VERIFY_SHA256 == algo)
+            sha256_update(&ctx, buf, (u32)chunk);
+        else
+            crc = crc32(crc, buf, (uint)chunk);
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    if(KBURN_VERIFY_SHA256 == algo) {
+        sha256_finish(&ctx, digest);
+        *digest_len = SHA256_SUM_LEN;
+    } else {
+        put_unaligned_le32(crc, digest);
+        *digest_len = sizeof(crc);
+    }
+
+    return 0;
 }
+#endif // CONFIG_KBURN_VERIFY
 
 void kburn_destory(struct kburn *burn)
 {
@@ -0,0 +1,492 @@
+#include <common.h>
+#include <image.h>
+#include <log.h>
+#include <asm/unaligned.h>
+#include <linux/zstd.h>
+#include <u-boot/lz4.h>
+#include <u-boot/zlib.h>
+
+#include "kburn.h"
+
+/*
+ * Streaming decompressor for kburn compressed writes. Input arrives in
+ * whatever pieces USB hands us and output is drained in medium-sized
+ * pieces, so every codec keeps its own state between calls. All memory,
+ * including the zlib allocations, comes from the caller's workspace.
+ */
+
+/* the largest window zstd -19 uses, anything bigger is refused */
+#define KBURN_ZSTD_WINDOW_MAX       (8 * 1024 * 1024)
+
+#define LZ4F_FLG_VERSION(f)         (((f) >> 6) & 0x03)
+#define LZ4F_FLG_BLOCK_INDEP        (1 << 5)
+#define LZ4F_FLG_BLOCK_CSUM         (1 << 4)
+#define LZ4F_FLG_CONTENT_SIZE       (1 << 3)
+#define LZ4F_FLG_CONTENT_CSUM       (1 << 2)
+#define LZ4F_FLG_DICT_ID            (1 << 0)
+#define LZ4F_BLOCK_UNCOMPRESSED     (0x80000000U)
+
+enum kburn_lz4_stage {
+    KBURN_LZ4_HEADER = 0,
+    KBURN_LZ4_BLOCK_SIZE,
+    KBURN_LZ4_BLOCK_DATA,
+    KBURN_LZ4_BLOCK_CSUM,
+    KBURN_LZ4_CONTENT_CSUM,
+    KBURN_LZ4_DONE,
+};
+
+struct kburn_lz4 {
+    enum kburn_lz4_stage stage;
+    u8 flags;
+    u32 block_max;
+
+    u8 hdr[19];
+    u32 hdr_fill;
+
+    u32 block_size;
+    u8 *in_buf;
+    u32 in_fill;
+
+    u8 *out_buf;
+    u32 out_pos;
+    u32 out_len;
+
+    u32 skip;
+};
+
+struct kburn_decomp_state {
+    u8 *work_pos;
+    u8 *work_end;
+
+    union {
+        z_stream zs;
+        ZSTD_DStream *zds;
+        struct kburn_lz4 lz4;
+    };
+};
+
+static void *kburn_decomp_alloc(struct kburn_decomp_state *st, size_t size)
+{
+    u8 *p = PTR_ALIGN(st->work_pos, 16);
+
+    if ((p > st->work_end) || (size > (size_t)(st->work_end - p)))
+        return NULL;
+
+    st->work_pos = p + size;
+    return p;
+}
+
+static void *kburn_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+    return kburn_decomp_alloc(opaque, (size_t)items * size);
+}
+
+static void kburn_zfree(void *opaque, void *addr, unsigned int nb)
+{
+    /* released with the whole workspace */
+}
+
+static int kburn_gzip_init(struct kburn_decomp_state *st)
+{
+    z_stream *zs = &st->zs;
+
+    memset(zs, 0, sizeof(*zs));
+    zs->zalloc = kburn_zalloc;
+    zs->zfree = kburn_zfree;
+    zs->opaque = st;
+
+    /* 16 + MAX_WBITS: expect a gzip wrapper and check its CRC32 */
+    if (Z_OK != inflateInit2(zs, 16 + MAX_WBITS))
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int kburn_gzip_run(struct kburn_decomp *d, u8 **in, size_t *in_len,
+            void *out, size_t *out_len)
+{
+    struct kburn_decomp_state *st = d->priv;
+    z_stream *zs = &st->zs;
+    int r;
+
+    /* k230_pack -z marks its streams with CM 0x09, same as gunzip() */
+    if ((d->in_bytes <= 2) && ((d->in_bytes + *in_len) > 2)) {
+        u8 *cm = *in + (2 - d->in_bytes);
+
+        if (0x09 == *cm)
+            *cm = 0x08;
+    }
+
+    zs->next_in = *in;
+    zs->avail_in = *in_len;
+    zs->next_out = out;
+    zs->avail_out = *out_len;
+
+    r = inflate(zs, Z_SYNC_FLUSH);
+
+    *in += *in_len - zs->avail_in;
+    *in_len = zs->avail_in;
+    *out_len -= zs->avail_out;
+
+    if (Z_STREAM_END == r)
+        return 1;
+
+    /* Z_BUF_ERROR only says no progress was possible with this input */
+    if ((Z_OK != r) && (Z_BUF_ERROR != r)) {
+        printf("kburn inflate failed %d\n", r);
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+static int kburn_zstd_init(struct kburn_decomp_state *st)
+{
+    size_t wsize = ZSTD_DStreamWorkspaceBound(KBURN_ZSTD_WINDOW_MAX);
+    void *ws = kburn_decomp_alloc(st, wsize);
+
+    if (NULL == ws) {
+        printf("kburn zstd needs 0x%zx bytes workspace\n", wsize);
+        return -ENOMEM;
+    }
+
+    st->zds = ZSTD_initDStream(KBURN_ZSTD_WINDOW_MAX, ws, wsize);
+    if (NULL == st->zds)
+        return -EPERM;
+
+    return 0;
+}
+
+static int kburn_zstd_run(struct kburn_decomp *d, u8 **in, size_t *in_len,
+            void *out, size_t *out_len)
+{
+    struct kburn_decomp_state *st = d->priv;
+    ZSTD_inBuffer in_buf;
+    ZSTD_outBuffer out_buf;
+    size_t res;
+
+    in_buf.src = *in;
+    in_buf.size = *in_len;
+    in_buf.pos = 0;
+
+    out_buf.dst = out;
+    out_buf.size = *out_len;
+    out_buf.pos = 0;
+
+    res = ZSTD_decompressStream(st->zds, &out_buf, &in_buf);
+
+    *in += in_buf.pos;
+    *in_len -= in_buf.pos;
+    *out_len = out_buf.pos;
+
+    if (ZSTD_isError(res)) {
+        printf("kburn zstd failed %d\n", ZSTD_getErrorCode(res));
+        return -EPROTO;
+    }
+
+    /* zero means the frame is decoded and fully flushed */
+    return (0x00 == res) ? 1 : 0;
+}
+
+/* Collect @need bytes into @dst across calls, true once complete */
+static bool kburn_lz4_take(u8 *dst, u32 *fill, u32 need, u8 **in, size_t *in_len)
+{
+    u32 n = min_t(size_t, need - *fill, *in_len);
+
+    memcpy(dst + *fill, *in, n);
+    *fill += n;
+    *in += n;
+    *in_len -= n;
+
+    return *fill == need;
+}
+
+static int kburn_lz4_header(struct kburn_decomp_state *st)
+{
+    struct kburn_lz4 *lz = &st->lz4;
+    u8 bd = lz->hdr[5];
+
+    if (LZ4F_MAGIC != get_unaligned_le32(&lz->hdr[0]) ||
+        (0x01 != LZ4F_FLG_VERSION(lz->flags)))
+        return -EPROTONOSUPPORT;
+
+    if ((lz->flags & 0x02) || (bd & 0x8f))
+        return -EINVAL;
+
+    /* linked blocks would need the previous 64K kept as dictionary */
+    if (0x00 == (lz->flags & LZ4F_FLG_BLOCK_INDEP)) {
+        printf("kburn lz4 needs independent blocks (lz4 -BI)\n");
+        return -EPROTONOSUPPORT;
+    }
+
+    lz->block_max = 1 << (8 + 2 * ((bd >> 4) & 0x07));
+    if (lz->block_max < (64 * 1024))
+        return -EINVAL;
+
+    lz->in_buf = kburn_decomp_alloc(st, lz->block_max);
+    lz->out_buf = kburn_decomp_alloc(st, lz->block_max);
+    if ((NULL == lz->in_buf) || (NULL == lz->out_buf)) {
+        printf("kburn lz4 needs 0x%x bytes workspace\n", 2 * lz->block_max);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int kburn_lz4_decode(struct kburn_lz4 *lz, const u8 *src, u32 size)
+{
+    int n;
+
+    if (lz->block_size & LZ4F_BLOCK_UNCOMPRESSED) {
+        memcpy(lz->out_buf, src, size);
+        n = size;
+    } else {
+        n = LZ4_decompress_safe((const char *)src, (char *)lz->out_buf,
+                    size, lz->block_max);
+        if (n < 0)
+            return -EPROTO;
+    }
+
+    lz->out_pos = 0;
+    lz->out_len = n;
+
+    return 0;
+}
+
+static int kburn_lz4_run(struct kburn_decomp *d, u8 **in, size_t *in_len,
+            void *out, size_t *out_len)
+{
+    struct kburn_decomp_state *st = d->priv;
+    struct kburn_lz4 *lz = &st->lz4;
+    size_t out_room = *out_len;
+    size_t produced = 0;
+    u32 need, size, n;
+    int ret;
+
+    while (1) {
+        /* drain the decoded block before reading any more input */
+        if (lz->out_pos < lz->out_len) {
+            n = min_t(size_t, lz->out_len - lz->out_pos, out_room - produced);
+            memcpy(out + produced, lz->out_buf + lz->out_pos, n);
+            lz->out_pos += n;
+            produced += n;
+
+            if (lz->out_pos < lz->out_len)
+                break;
+        }
+
+        if (KBURN_LZ4_DONE == lz->stage) {
+            *out_len = produced;
+            return 1;
+        }
+
+        if (0x00 == *in_len)
+            break;
+
+        switch (lz->stage) {
+        case KBURN_LZ4_HEADER:
+            /* magic, FLG and BD tell how long the rest of the header is */
+            need = 6;
+            if (lz->hdr_fill >= 6) {
+                lz->flags = lz->hdr[4];
+                need = 7;
+                if (lz->flags & LZ4F_FLG_CONTENT_SIZE)
+                    need += 8;
+                if (lz->flags & LZ4F_FLG_DICT_ID)
+                    need += 4;
+            }
+            if (!kburn_lz4_take(lz->hdr, &lz->hdr_fill, need, in, in_len))
+                break;
+            if (6 == need)
+                break;
+
+            ret = kburn_lz4_header(st);
+            if (ret)
+                return ret;
+
+            lz->hdr_fill = 0;
+            lz->stage = KBURN_LZ4_BLOCK_SIZE;
+            break;
+
+        case KBURN_LZ4_BLOCK_SIZE:
+            if (!kburn_lz4_take(lz->hdr, &lz->hdr_fill, 4, in, in_len))
+                break;
+            lz->hdr_fill = 0;
+            lz->block_size = get_unaligned_le32(&lz->hdr[0]);
+
+            if (0x00 == lz->block_size) {
+                lz->skip = 4;
+                if (lz->flags & LZ4F_FLG_CONTENT_CSUM)
+                    lz->stage = KBURN_LZ4_CONTENT_CSUM;
+                else
+                    lz->stage = KBURN_LZ4_DONE;
+                break;
+            }
+
+            if ((lz->block_size & ~LZ4F_BLOCK_UNCOMPRESSED) > lz->block_max)
+                return -EINVAL;
+
+            lz->in_fill = 0;
+            lz->stage = KBURN_LZ4_BLOCK_DATA;
+            break;
+
+        case KBURN_LZ4_BLOCK_DATA:
+            size = lz->block_size & ~LZ4F_BLOCK_UNCOMPRESSED;
+
+            if ((0x00 == lz->in_fill) && (*in_len >= size)) {
+                /* whole block in this piece, decode without staging it */
+                ret = kburn_lz4_decode(lz, *in, size);
+                *in += size;
+                *in_len -= size;
+            } else {
+                if (!kburn_lz4_take(lz->in_buf, &lz->in_fill, size, in, in_len))
+                    break;
+                ret = kburn_lz4_decode(lz, lz->in_buf, size);
+            }
+            if (ret)
+                return ret;
+
+            lz->skip = 4;
+            if (lz->flags & LZ4F_FLG_BLOCK_CSUM)
+                lz->stage = KBURN_LZ4_BLOCK_CSUM;
+            else
+                lz->stage = KBURN_LZ4_BLOCK_SIZE;
+            break;
+
+        case KBURN_LZ4_BLOCK_CSUM:
+        case KBURN_LZ4_CONTENT_CSUM:
+            n = min_t(size_t, lz->skip, *in_len);
+            lz->skip -= n;
+            *in += n;
+            *in_len -= n;
+
+            if (lz->skip)
+                break;
+
+            if (KBURN_LZ4_BLOCK_CSUM == lz->stage)
+                lz->stage = KBURN_LZ4_BLOCK_SIZE;
+            else
+                lz->stage = KBURN_LZ4_DONE;
+            break;
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    *out_len = produced;
+    return 0;
+}
+
+int kburn_decomp_init(struct kburn_decomp *d, enum KBURN_CODEC codec,
+            void *work, size_t work_size)
+{
+    struct kburn_decomp_state *st;
+    int ret;
+
+    if ((NULL == d) || (NULL == work) || (work_size < sizeof(*st))) {
+        pr_err("invalid arg\n");
+        return -EINVAL;
+    }
+
+    memset(d, 0, sizeof(*d));
+    d->codec = codec;
+
+    st = PTR_ALIGN(work, 16);
+    memset(st, 0, sizeof(*st));
+    st->work_pos = (u8 *)(st + 1);
+    st->work_end = (u8 *)work + work_size;
+
+    switch (codec) {
+#if defined(CONFIG_KBURN_DECOMP_GZIP)
+    case KBURN_CODEC_GZIP:
+        ret = kburn_gzip_init(st);
+        break;
+#endif
+#if defined(CONFIG_KBURN_DECOMP_LZ4)
+    case KBURN_CODEC_LZ4:
+        ret = 0; /* buffers are sized once the frame header is seen */
+        break;
+#endif
+#if defined(CONFIG_KBURN_DECOMP_ZSTD)
+    case KBURN_CODEC_ZSTD:
+        ret = kburn_zstd_init(st);
+        break;
+#endif
+    default:
+        printf("kburn codec %d not supported\n", codec);
+        ret = -EPROTONOSUPPORT;
+        break;
+    }
+
+    if (0x00 == ret)
+        d->priv = st;
+
+    return ret;
+}
+
+int kburn_decomp_run(struct kburn_decomp *d, void **in, size_t *in_len,
+            void *out, size_t *out_len)
+{
+    size_t in_size;
+    int ret;
+
+    if ((NULL == d) || (NULL == d->priv)) {
+        pr_err("invalid arg\n");
+        return -EINVAL;
+    }
+
+    if (d->finished) {
+        *out_len = 0;
+        return 1;
+    }
+
+    in_size = *in_len;
+
+    switch (d->codec) {
+#if defined(CONFIG_KBURN_DECOMP_GZIP)
+    case KBURN_CODEC_GZIP:
+        ret = kburn_gzip_run(d, (u8 **)in, in_len, out, out_len);
+        break;
+#endif
+#if defined(CONFIG_KBURN_DECOMP_LZ4)
+    case KBURN_CODEC_LZ4:
+        ret = kburn_lz4_run(d, (u8 **)in, in_len, out, out_len);
+        break;
+#endif
+#if defined(CONFIG_KBURN_DECOMP_ZSTD)
+    case KBURN_CODEC_ZSTD:
+        ret = kburn_zstd_run(d, (u8 **)in, in_len, out, out_len);
+        break;
+#endif
+    default:
+        ret = -EPROTONOSUPPORT;
+        break;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    d->in_bytes += in_size - *in_len;
+    d->out_bytes += *out_len;
+    if (ret)
+        d->finished = true;
+
+    return ret;
+}
+
+void kburn_decomp_end(struct kburn_decomp *d)
+{
+    struct kburn_decomp_state *st;
+
+    if ((NULL == d) || (NULL == d->priv))
+        return;
+
+    st = d->priv;
+#if defined(CONFIG_KBURN_DECOMP_GZIP)
+    if (KBURN_CODEC_GZIP == d->codec)
+        inflateEnd(&st->zs);
+#endif
+
+    d->priv = NULL;
+}
@@ -5,14 +5,34 @@
 #include <errno.h>
 #include <log.h>
 #include <malloc.h>
+#include <time.h>
 
 #include <mtd.h>
 
 #include <kburn.h>
 
+/*
+ * Bad blocks are skipped, so a logical offset maps to a physical one that
+ * depends on where the transfer started. A call continuing exactly where
+ * the previous one of the same kind stopped keeps that shift.
+ */
+struct kburn_mtd_cursor {
+    bool valid;
+    u64 logical;
+    u64 phys;
+};
+
 struct kburn_mtd_priv {
     struct mtd_info *mtd;
     int dev_num;
+
+    /* one bit per eraseblock, built once at probe */
+    u8 *bbt;
+    u32 nr_blocks;
+    u32 nr_bad;
+
+    struct kburn_mtd_cursor wr;
+    struct kburn_mtd_cursor rd;
 };
 
 static int mtd_get_medium_info(struct kburn *burn)
@@ -29,8 +49,9 @@ static int mtd_get_medium_info(struct kburn *burn)
     burn->medium_info.timeout_ms = 5000;
     burn->medium_info.type = KBURN_MEDIA_SPI_NAND;
 
-    pr_info("Device %s %d capacity %lld, erase size %lld, blk_sz %lld\n", \
-        mtd->name, priv->dev_num, burn->medium_info.capacity, burn->medium_info.erase_size, burn->medium_info.blk_size);
+    pr_info("Device %s %d capacity %lld, erase size %lld, blk_sz %lld, %u bad blocks\n", \
+        mtd->name, priv->dev_num, burn->medium_info.capacity, burn->medium_info.erase_size,
+        burn->medium_info.blk_size, priv->nr_bad);
 
     return 0;
 }
@@ -46,12 +67,12 @@ static bool mtd_is_aligned_with_block_size(struct mtd_info *mtd, u64 size)
 }
 
 /* Logic taken from cmd/mtd.c:mtd_oob_write_is_empty() */
-static bool mtd_page_is_empty(struct mtd_oob_ops *op)
+static bool mtd_page_is_empty(const u8 *buf, u32 len)
 {
 	int i;
 
-	for (i = 0; i < op->len; i++)
-		if (op->datbuf[i] != 0xff)
+	for (i = 0; i < len; i++)
+		if (buf[i] != 0xff)
 			return false;
 
 	/* oob is not used, with MTD_OPS_AUTO_OOB & ooblen=0 */
@@ -59,10 +80,120 @@ static bool mtd_page_is_empty(struct mtd_oob_ops *op)
 	return true;
 }
 
+static bool mtd_bbt_isbad(struct kburn_mtd_priv *priv, u64 off)
+{
+    u32 blk = mtd_div_by_eb(off, priv->mtd);
+
+    return !!(priv->bbt[blk >> 3] & (1 << (blk & 0x07)));
+}
+
+static void mtd_bbt_markbad(struct kburn_mtd_priv *priv, u64 off)
+{
+    u32 blk = mtd_div_by_eb(off, priv->mtd);
+
+    if (mtd_block_markbad(priv->mtd, off))
+        pr_err("Mark bad block at 0x%08llx failed\n", off);
+
+    if (!mtd_bbt_isbad(priv, off))
+        priv->nr_bad++;
+    priv->bbt[blk >> 3] |= 1 << (blk & 0x07);
+}
+
+static int mtd_bbt_build(struct kburn_mtd_priv *priv)
+{
+    struct mtd_info *mtd = priv->mtd;
+    u64 off;
+
+    priv->nr_blocks = mtd_div_by_eb(mtd->size, mtd);
+    priv->bbt = calloc(DIV_ROUND_UP(priv->nr_blocks, 8), 1);
+    if (NULL == priv->bbt) {
+        pr_err("alloc bbt failed\n");
+        return -1;
+    }
+
+    priv->nr_bad = 0;
+    for (off = 0; off < mtd->size; off += mtd->erasesize) {
+        if (mtd_block_isbad(mtd, off)) {
+            u32 blk = mtd_div_by_eb(off, mtd);
+
+            priv->bbt[blk >> 3] |= 1 << (blk & 0x07);
+            priv->nr_bad++;
+        }
+    }
+
+    return 0;
+}
+
+/* Physical start of a transfer, see struct kburn_mtd_cursor */
+static u64 mtd_cursor_start(struct kburn_mtd_cursor *cur, u64 offset)
+{
+    if (cur->valid && (cur->logical == offset))
+        return cur->phys;
+
+    return offset;
+}
+
+static void mtd_cursor_save(struct kburn_mtd_cursor *cur, u64 logical, u64 phys)
+{
+    cur->valid = true;
+    cur->logical = logical;
+    cur->phys = phys;
+}
+
+/*
+ * Bad blocks are skipped the same way mtd_write_medium() skips them, so
+ * reading back the range of a write returns what was written.
+ */
 static int mtd_read_medium(struct kburn *burn, u64 offset, void *buf, u64 *len)
 {
-    pr_err("TODO\n");
-    return -1;
+    struct kburn_mtd_priv *priv = (struct kburn_mtd_priv *)(burn->dev_priv);
+    struct mtd_info *mtd = priv->mtd;
+
+    u64 off, remaining = *len;
+    size_t retlen;
+    u64 size;
+    int ret;
+
+    if (!mtd_is_aligned_with_min_io_size(mtd, offset)) {
+		pr_err("Offset not aligned with a page (0x%x)\n",
+		       mtd->writesize);
+        return -1;
+	}
+
+    off = mtd_cursor_start(&priv->rd, offset);
+    priv->rd.valid = false;
+
+    while (remaining) {
+        if (off >= mtd->size) {
+            pr_err("Read exceeds device at 0x%llx\n", off);
+            return -1;
+        }
+
+		/* Skip the block if it is bad */
+		if (mtd_bbt_isbad(priv, off)) {
+			off = round_down(off, mtd->erasesize) + mtd->erasesize;
+			continue;
+		}
+
+        /* up to the end of this eraseblock */
+        size = mtd->erasesize - mtd_mod_by_eb(off, mtd);
+        if (size > remaining)
+            size = remaining;
+
+        ret = mtd_read(mtd, off, size, &retlen, buf);
+        if ((ret && !mtd_is_bitflip(ret)) || (retlen != size)) {
+            pr_err("Failure while reading at offset 0x%llx, %d\n", off, ret);
+            return -1;
+        }
+
+        off += size;
+        buf += size;
+        remaining -= size;
+    }
+
+    mtd_cursor_save(&priv->rd, offset + *len, off);
+
+    return 0;
 }
 
 static int mtd_erase_medium(struct kburn *burn, u64 offset, u64 *len)
@@ -98,21 +229,28 @@ static int mtd_erase_medium(struct kburn *burn, u64 offset, u64 *len)
 	erase_op.scrub = false;
 
     while (size) {
-		ret = mtd_erase(mtd, &erase_op);
-
-		if (ret) {
-			/* Abort if its not a bad block error */
-			if (ret != -EIO)
-				break;
-			pr_info("Skipping bad block at 0x%08llx\n",
-			       erase_op.addr);
-		}
+        if (mtd_bbt_isbad(priv, erase_op.addr)) {
+            pr_info("Skipping bad block at 0x%08llx\n",
+                erase_op.addr);
+        } else {
+            ret = mtd_erase(mtd, &erase_op);
+
+            if (ret) {
+                /* Abort if its not a bad block error */
+                if (ret != -EIO)
+                    break;
+                pr_info("Erase failed at 0x%08llx, mark bad\n",
+                    erase_op.addr);
+                mtd_bbt_markbad(priv, erase_op.addr);
+                ret = 0;
+            }
+        }
 
 		size -= mtd->erasesize;
 		erase_op.addr += mtd->erasesize;
 	}
 
-	if (ret && ret != -EIO) {
+	if (ret) {
         pr_err("Erase mtd failed. %d\n", ret);
         return -1;
     }
@@ -120,99 +258,143 @@ static int mtd_erase_medium(struct kburn *burn, u64 offset, u64 *len)
     return 0;
 }
 
+/* Program the pages of [off, off + size) which hold data, one call per run */
+static int mtd_write_pages(struct mtd_info *mtd, u64 off, const u8 *buf, u64 size)
+{
+	struct mtd_oob_ops io_op = {};
+    u64 run, pos = 0;
+    int ret;
+
+    io_op.mode = MTD_OPS_AUTO_OOB;
+	io_op.ooblen = 0;
+	io_op.oobbuf = NULL;
+
+    while (pos < size) {
+        /* erased pages already read back as 0xFF, leave them alone */
+        if (mtd_page_is_empty(buf + pos, mtd->writesize)) {
+            pos += mtd->writesize;
+            continue;
+        }
+
+        run = mtd->writesize;
+        while (((pos + run) < size) && !mtd_page_is_empty(buf + pos + run, mtd->writesize))
+            run += mtd->writesize;
+
+        /* the driver walks the pages with its fastest program load op */
+        io_op.len = run;
+        io_op.datbuf = (u8 *)buf + pos;
+        ret = mtd_write_oob(mtd, off + pos, &io_op);
+        if (ret || (io_op.retlen != run)) {
+            pr_err("Failure while writing at offset 0x%llx\n", off + pos);
+            return ret ? ret : -EIO;
+        }
+
+        pos += run;
+    }
+
+    return 0;
+}
+
+/*
+ * Each eraseblock is erased right before its first page is programmed,
+ * instead of erasing the whole range up front, and bad blocks come from
+ * the table built at probe.
+ */
 static int mtd_write_medium(struct kburn *burn, u64 offset, const void *buf, u64 *len)
 {
     struct kburn_mtd_priv *priv = (struct kburn_mtd_priv *)(burn->dev_priv);
     struct mtd_info *mtd = priv->mtd;
 
-	struct mtd_oob_ops io_op = {};
+	struct erase_info erase_op = {};
 
     int ret = -1;
-	u64 off = offset, size= *len, remaining = *len;
-    u64 lock_ofs = offset, lock_len = *len;
-
-	bool has_pages = mtd->type == MTD_NANDFLASH ||
-			 mtd->type == MTD_MLCNANDFLASH;
+	u64 off, size, remaining = *len;
+    bool fresh;
 
-    if (!mtd_is_aligned_with_min_io_size(mtd, off)) {
+    if (!mtd_is_aligned_with_min_io_size(mtd, offset)) {
 		pr_err("Offset not aligned with a page (0x%x)\n",
 		       mtd->writesize);
         return -1;
 	}
 
-	if (!mtd_is_aligned_with_min_io_size(mtd, size)) {
+	if (!mtd_is_aligned_with_min_io_size(mtd, remaining)) {
 		pr_err("Size not on a page boundary (0x%x), rounding to 0x%llx\n",
-		       mtd->writesize, size);
+		       mtd->writesize, remaining);
         return -1;
     }
 
-    pr_debug("Unlocking the mtd device\n");
-    ret = mtd_unlock(mtd, lock_ofs, lock_len);
-    if (ret && ret != -EOPNOTSUPP) {
-        printf("MTD device unlock failed\n");
-        return -1;
-    }
+    fresh = !priv->wr.valid || (priv->wr.logical != offset);
+    off = mtd_cursor_start(&priv->wr, offset);
+    priv->wr.valid = false;
 
-    if(0x00 != mtd_erase_medium(burn, offset, &size)) {
-        printf("MTD device erase failed\n");
-		mtd_lock(mtd, lock_ofs, lock_len);
+    /* a fresh transfer can not erase the part of a block before it */
+    if (fresh && !mtd_is_aligned_with_block_size(mtd, off)) {
+		pr_err("Offset not aligned with a block (0x%x)\n",
+		       mtd->erasesize);
         return -1;
     }
 
-    io_op.mode = MTD_OPS_AUTO_OOB;
-	io_op.len = size;
-	if (has_pages && io_op.len > mtd->writesize)
-		io_op.len = mtd->writesize;
-	io_op.ooblen = 0;
-	io_op.datbuf = buf;
-	io_op.oobbuf = NULL;
-
-	/* Search for the first good block after the given offset */
-	while (mtd_block_isbad(mtd, off))
-		off += mtd->erasesize;
+	erase_op.mtd = mtd;
+	erase_op.len = mtd->erasesize;
+	erase_op.scrub = false;
 
-	/* Loop over the pages to do the actual read/write */
 	while (remaining) {
+        if (off >= mtd->size) {
+            pr_err("Write exceeds device at 0x%llx\n", off);
+            return -1;
+        }
+
 		/* Skip the block if it is bad */
-		if (mtd_is_aligned_with_block_size(mtd, off) &&
-		    mtd_block_isbad(mtd, off)) {
-			off += mtd->erasesize;
+		if (mtd_bbt_isbad(priv, off)) {
+			off = round_down(off, mtd->erasesize) + mtd->erasesize;
 			continue;
 		}
 
-        if(has_pages && mtd_page_is_empty(&io_op)) {
-			ret = 0;
-			io_op.retlen = mtd->writesize;
-			io_op.oobretlen = mtd->oobsize;
-        } else {
-            ret = mtd_write_oob(mtd, off, &io_op);
+        if (mtd_is_aligned_with_block_size(mtd, off)) {
+            u64 t = timer_get_us();
+
+            erase_op.addr = off;
+            ret = mtd_erase(mtd, &erase_op);
+            burn->stats.erase_us += timer_get_us() - t;
+            if (-EIO == ret) {
+                pr_info("Erase failed at 0x%08llx, mark bad\n", off);
+                mtd_bbt_markbad(priv, off);
+                off += mtd->erasesize;
+                continue;
+            } else if (ret) {
+                pr_err("Erase mtd failed at 0x%08llx, %d\n", off, ret);
+                return -1;
+            }
         }
 
+        /* up to the end of this eraseblock */
+        size = mtd->erasesize - mtd_mod_by_eb(off, mtd);
+        if (size > remaining)
+            size = remaining;
+
+        ret = mtd_write_pages(mtd, off, buf, size);
 		if (ret) {
-			pr_err("Failure while writing at offset 0x%llx\n", off);
-			break;
+            printf("mtd write on %s failed with error %d\n", mtd->name, ret);
+            return -1;
 		}
 
-		off += io_op.retlen;
-		remaining -= io_op.retlen;
-		io_op.datbuf += io_op.retlen;
-		io_op.len = remaining;
-		if (has_pages && io_op.len > mtd->writesize)
-			io_op.len = mtd->writesize;
+		off += size;
+		buf += size;
+		remaining -= size;
 	}
 
-    mtd_lock(mtd, lock_ofs, lock_len);
-
-	if (ret) {
-		printf("mtd write on %s failed with error %d\n", mtd->name, ret);
-        return -1;
-	}
+    mtd_cursor_save(&priv->wr, offset + *len, off);
 
     return 0;
 }
 
 static int mtd_destory(struct kburn *burn)
 {
+    struct kburn_mtd_priv *priv = (struct kburn_mtd_priv *)(burn->dev_priv);
+
+    free(priv->bbt);
+    priv->bbt = NULL;
+
     return 0;
 }
 
@@ -223,6 +405,8 @@ struct kburn *kburn_mtd_probe(void)
     struct kburn *burner;
     struct kburn_mtd_priv *priv;
 
+    int ret;
+
     if(0x00 != uclass_first_device_err(UCLASS_MTD, &ud_mtd)) {
         pr_err("can not found mtd device");
         return NULL;
@@ -234,13 +418,33 @@ struct kburn *kburn_mtd_probe(void)
         pr_err("memaligin failed\n");
         return NULL;
     }
-    memset(burner, 0, sizeof(*burner));
+    memset(burner, 0, sizeof(*burner) + sizeof(*priv));
 
     priv = (struct kburn_mtd_priv *)((char *)burner + sizeof(*burner));
     priv->mtd = dev_get_uclass_priv(ud_mtd);
     priv->dev_num = dev_seq(ud_mtd_parent);
 
+    if(0x00 != mtd_bbt_build(priv)) {
+        free(burner);
+        return NULL;
+    }
+
+    /*
+     * Unlocked once for the whole session and not locked again in destory.
+     * The SPI-NAND core unlocks every block at init, and on devices with a
+     * lock op a whole-device lock would leave them write protected for
+     * what boots next.
+     */
+    ret = mtd_unlock(priv->mtd, 0, priv->mtd->size);
+    if (ret && ret != -EOPNOTSUPP) {
+        printf("MTD device unlock failed\n");
+        free(priv->bbt);
+        free(burner);
+        return NULL;
+    }
+
     burner->type = KBURN_MEDIA_SPI_NAND;
+    burner->flags = KBURN_FLAG_ERASED_FF | KBURN_FLAG_SKIP_BAD;
     burner->dev_priv = (void *)priv;
 
 	burner->get_medium_info = mtd_get_medium_info;
@@ -5,14 +5,37 @@
 #include <errno.h>
 #include <log.h>
 #include <malloc.h>
+#include <time.h>
 
 #include <spi_flash.h>
+#include <linux/mtd/spi-nor.h>
+#include <linux/sizes.h>
 
 #include <kburn.h>
 
+#include "../mtd/spi/sf_internal.h"
+
+/* Chunk size used to check whether an erase unit is already blank */
+#define KBURN_SF_BLANK_CHECK_SIZE   (4096)
+
+struct kburn_sf_erase_type {
+    u8 opcode;
+    u32 size;
+};
+
 struct kburn_sf_priv {
     struct spi_flash *flash;
     int dev_num;
+
+    /* erase opcodes usable on this flash, largest first */
+    struct kburn_sf_erase_type erase[3];
+    int nr_erase;
+
+    u8 *blank_buf;
+
+    /* [erased_start, erased_end) was erased and is not programmed yet */
+    u64 erased_start;
+    u64 erased_end;
 };
 
 static int sf_get_medium_info(struct kburn *burn)
@@ -37,8 +60,22 @@ static int sf_get_medium_info(struct kburn *burn)
 
 static int sf_read_medium(struct kburn *burn, u64 offset, void *buf, u64 *len)
 {
-    pr_err("TODO");
-    return -1;
+    struct kburn_sf_priv *priv = (struct kburn_sf_priv *)(burn->dev_priv);
+    struct spi_flash *flash = priv->flash;
+
+    int rc;
+
+    if ((offset + *len) > flash->size) {
+        pr_err("sf read exceed, offset %lld, size %lld\n", offset, *len);
+        return -1;
+    }
+
+    if(0x00 != (rc = spi_flash_read(flash, (u32)offset, (size_t)*len, buf))) {
+        pr_err("sf read failed %llx, err %d\n", offset, rc);
+        return -1;
+    }
+
+    return 0;
 }
 
 static bool sf_page_is_empty(const void *buf, u64 size)
@@ -47,106 +84,275 @@ static bool sf_page_is_empty(const void *buf, u64 size)
         const u64 *pdata = (u64*)buf;
         const u64 *pend = pdata + (size / 8);
 
-        do {
+        for (; pdata < pend; pdata++) {
             if(0xFFFFFFFFFFFFFFFFULL != pdata[0]) {
                 return false;
             }
-        } while(pdata++ < pend);
+        }
     } else {
         const u8 *pdata = (u8*)buf;
         const u8 *pend = pdata + size;
 
-        do {
+        for (; pdata < pend; pdata++) {
             if(0xFF != pdata[0]) {
                 return false;
             }
-        } while(pdata++ < pend);
+        }
     }
 
     return true;
 }
 
-static bool sf_is_aligned_with_min_io_size(struct spi_flash *flash, u64 size)
+static bool sf_is_aligned_with_block_size(struct spi_flash *flash, u64 size)
 {
-	return !do_div(size, flash->erase_size);
+	return !do_div(size, flash->page_size);
 }
 
-static bool sf_is_aligned_with_block_size(struct spi_flash *flash, u64 size)
+/*
+ * The core erases with one opcode of mtd->erasesize. Flashes with uniform
+ * 4K sectors also take the 32K and 4K block erase, which lets a range be
+ * erased with the fewest, largest commands that fit it.
+ */
+static void sf_erase_types_init(struct kburn_sf_priv *priv)
 {
-	return !do_div(size, flash->page_size);
+    struct spi_flash *flash = priv->flash;
+    bool addr4 = (SPINOR_OP_SE_4B == flash->erase_opcode);
+
+    priv->erase[0].opcode = flash->erase_opcode;
+    priv->erase[0].size = flash->mtd.erasesize;
+    priv->nr_erase = 1;
+
+    /* vendor specific erase hooks only know the native opcode */
+    if (flash->erase || (NULL == flash->info) || !(flash->info->flags & SECT_4K))
+        return;
+
+    if ((SZ_64K != flash->mtd.erasesize) ||
+        ((SPINOR_OP_SE != flash->erase_opcode) && !addr4))
+        return;
+
+    priv->erase[1].opcode = addr4 ? SPINOR_OP_BE_32K_4B : SPINOR_OP_BE_32K;
+    priv->erase[1].size = SZ_32K;
+    priv->erase[2].opcode = addr4 ? SPINOR_OP_BE_4K_4B : SPINOR_OP_BE_4K;
+    priv->erase[2].size = SZ_4K;
+    priv->nr_erase = 3;
+}
+
+static u32 sf_min_erase_size(struct kburn_sf_priv *priv)
+{
+    return priv->erase[priv->nr_erase - 1].size;
+}
+
+static bool sf_range_is_blank(struct kburn_sf_priv *priv, u32 addr, u32 size)
+{
+    u32 len;
+
+    while (size) {
+        len = size > KBURN_SF_BLANK_CHECK_SIZE ? KBURN_SF_BLANK_CHECK_SIZE : size;
+
+        if (0x00 != spi_flash_read(priv->flash, addr, len, priv->blank_buf))
+            return false;
+
+        if (!sf_page_is_empty(priv->blank_buf, len))
+            return false;
+
+        addr += len;
+        size -= len;
+    }
+
+    return true;
 }
 
+static int sf_erase_one(struct kburn_sf_priv *priv, const struct kburn_sf_erase_type *type, u32 addr)
+{
+    struct spi_flash *flash = priv->flash;
+    u8 opcode = flash->erase_opcode;
+    u32 erasesize = flash->mtd.erasesize;
+    int rc;
+
+    flash->erase_opcode = type->opcode;
+    flash->mtd.erasesize = type->size;
+
+    rc = spi_flash_erase(flash, addr, type->size);
+
+    flash->erase_opcode = opcode;
+    flash->mtd.erasesize = erasesize;
+
+    return rc;
+}
+
+/*
+ * Erase [start, end), both aligned to the smallest erase size. Each step
+ * uses the largest erase that is aligned and fits, units which already
+ * read back blank are not erased at all.
+ */
+static int sf_erase_range(struct kburn_sf_priv *priv, u64 start, u64 end)
+{
+    const struct kburn_sf_erase_type *type;
+    u32 nr_erased = 0, nr_blank = 0;
+    int i, rc;
+
+    pr_debug("Erasing 0x%08llx ... 0x%08llx\n", start, end - 1);
+
+    while (start < end) {
+        type = &priv->erase[priv->nr_erase - 1];
+
+        for (i = 0; i < priv->nr_erase; i++) {
+            if ((0x00 == (start % priv->erase[i].size)) &&
+                ((start + priv->erase[i].size) <= end)) {
+                type = &priv->erase[i];
+                break;
+            }
+        }
+
+        if (sf_range_is_blank(priv, (u32)start, type->size)) {
+            nr_blank++;
+        } else {
+            if(0x00 != (rc = sf_erase_one(priv, type, (u32)start))) {
+                pr_err("sf erase 0x%llx (0x%x) failed, %d\n", start, type->size, rc);
+                return -1;
+            }
+            nr_erased++;
+        }
+
+        start += type->size;
+    }
+
+    pr_debug("erased %u units, %u already blank\n", nr_erased, nr_blank);
+
+    return 0;
+}
+
+/* Program the pages of [off, off + size) which hold data, one call per run */
+static int sf_write_pages(struct spi_flash *flash, u64 off, const u8 *buf, u64 size)
+{
+    u64 run, pos = 0, page;
+    int rc;
+
+    while (pos < size) {
+        page = flash->page_size - ((off + pos) % flash->page_size);
+        if (page > (size - pos))
+            page = size - pos;
+
+        /* erased pages already read back as 0xFF, leave them alone */
+        if (sf_page_is_empty(buf + pos, page)) {
+            pos += page;
+            continue;
+        }
+
+        run = page;
+        while ((pos + run) < size) {
+            page = (size - pos - run) > flash->page_size ? flash->page_size : (size - pos - run);
+            if (sf_page_is_empty(buf + pos + run, page))
+                break;
+            run += page;
+        }
+
+        if(0x00 != (rc = spi_flash_write(flash, (u32)(off + pos), (size_t)run, buf + pos))) {
+            pr_err("sf wrtie failed %llx, err %d\n", off + pos, rc);
+            return -1;
+        }
+
+        pos += run;
+    }
+
+    return 0;
+}
+
+/*
+ * Sequential chunks erase ahead of themselves: the blank range left after
+ * one chunk is reused by the next, so only the part past it is erased.
+ */
 static int sf_write_medium(struct kburn *burn, u64 offset, const void *buf, u64 *len)
 {
     struct kburn_sf_priv *priv = (struct kburn_sf_priv *)(burn->dev_priv);
     struct spi_flash *flash = priv->flash;
 
-    int rc;
-    const void *buffer = buf;
-    u64 off = offset;
     u64 size = *len;
-    u64 remaining, send_len;
+    u64 start, end;
+    u32 min_erase = sf_min_erase_size(priv);
 
     pr_debug("sf write offset %lld, size %lld\n", offset, size);
 
-	if (!sf_is_aligned_with_min_io_size(flash, off)) {
-		pr_err("Offset not aligned with a block (0x%x)\n",
-		       flash->erase_size);
+	if (!sf_is_aligned_with_block_size(flash, size)) {
+		pr_err("Size not a multiple of a page (0x%x)\n",
+		       flash->page_size);
         return -1;
 	}
 
-	if (!sf_is_aligned_with_block_size(flash, size)) {
-		pr_err("Size not a multiple of a block (0x%x)\n",
-		       flash->erase_size);
+    if (!sf_is_aligned_with_block_size(flash, offset)) {
+        pr_err("Offset not aligned with a page (0x%x)\n",
+            flash->page_size);
         return -1;
-	}
+    }
 
-    if(0x00 != (rc = spi_flash_erase(flash, (u32)offset, size))) {
-        pr_err("sf write, erase %lld failed, %d\n", offset, rc);
+    if ((offset + size) > flash->size) {
+        pr_err("sf write exceed, offset %lld, size %lld\n", offset, size);
         return -1;
     }
 
-    pr_info("Erasing 0x%08llx ... 0x%08llx\n",
-	       off, off + size - 1);
+    if (!(burn->flags & KBURN_FLAG_PRE_ERASED)) {
+        if ((offset >= priv->erased_start) && (offset <= priv->erased_end) &&
+            (priv->erased_start != priv->erased_end)) {
+            start = priv->erased_end;
+        } else {
+            if (0x00 != (offset % min_erase)) {
+                pr_err("Offset not aligned with a block (0x%x)\n", min_erase);
+                return -1;
+            }
+            start = offset;
+            priv->erased_start = priv->erased_end = offset;
+        }
 
-    remaining = size;
-    send_len = remaining > 4096 ? 4096 : remaining;
+        end = roundup(offset + size, min_erase);
+        if (end > flash->size)
+            end = flash->size;
 
-    while(remaining) {
-        if(sf_page_is_empty(buffer, send_len)) {
-            off += send_len;
-            buffer += send_len;
-            remaining -= send_len;
-            send_len = remaining > 4096 ? 4096 : remaining;
-            continue;
-        }
+        if (end > start) {
+            u64 t = timer_get_us();
+            int rc = sf_erase_range(priv, start, end);
 
-        if(0x00 != (rc = spi_flash_write(flash, (u32)off, (size_t)send_len, buffer))) {
-            pr_err("sf wrtie failed %llx, err %d\n", off, rc);
-            return -1;
+            burn->stats.erase_us += timer_get_us() - t;
+            if (0x00 != rc) {
+                priv->erased_start = priv->erased_end = 0;
+                return -1;
+            }
+            priv->erased_end = end;
         }
-
-        off += send_len;
-        buffer += send_len;
-        remaining -= send_len;
-        send_len = remaining > 4096 ? 4096 : remaining;
     }
 
-    if(0x00 != rc) {
-        return -1;
+    /* what this write programs is no longer blank */
+    if ((offset < priv->erased_end) && ((offset + size) > priv->erased_start)) {
+        if (offset <= priv->erased_start)
+            priv->erased_start = min(offset + size, priv->erased_end);
+        else
+            priv->erased_end = offset;
     }
 
-    return 0;
+    return sf_write_pages(flash, offset, buf, size);
 }
 
 static int sf_erase_medium(struct kburn *burn, u64 offset, u64 *len)
 {
     struct kburn_sf_priv *priv = (struct kburn_sf_priv *)(burn->dev_priv);
     struct spi_flash *flash = priv->flash;
+    u32 min_erase = sf_min_erase_size(priv);
+    int rc;
 
     pr_info("erase medium start, offset %lld, size %lld\n", offset, *len);
 
-    int rc = spi_flash_erase(flash, (u32)offset, (size_t)*len);
+    if ((0x00 != (offset % min_erase)) || (0x00 != (*len % min_erase)) ||
+        ((offset + *len) > flash->size)) {
+        pr_err("erase range not aligned with a block (0x%x)\n", min_erase);
+        return -1;
+    }
+
+    rc = sf_erase_range(priv, offset, offset + *len);
+    if (0x00 == rc) {
+        priv->erased_start = offset;
+        priv->erased_end = offset + *len;
+    } else {
+        priv->erased_start = priv->erased_end = 0;
+    }
 
     pr_info("erase medium done, result %d\n", rc);
 
@@ -155,6 +361,11 @@ static int sf_erase_medium(struct kburn *burn, u64 offset, u64 *len)
 
 static int sf_destory(struct kburn *burn)
 {
+    struct kburn_sf_priv *priv = (struct kburn_sf_priv *)(burn->dev_priv);
+
+    free(priv->blank_buf);
+    priv->blank_buf = NULL;
+
     return 0;
 }
 
@@ -180,10 +391,20 @@ struct kburn *kburn_sf_probe(void)
     memset(burner, 0, sizeof(*burner));
 
     priv = (struct kburn_sf_priv *)((char *)burner + sizeof(*burner));
+    memset(priv, 0, sizeof(*priv));
     priv->flash = dev_get_uclass_priv(ud_sf);
     priv->dev_num = dev_seq(ud_sf_parent);
 
+    priv->blank_buf = memalign(CONFIG_SYS_CACHELINE_SIZE, KBURN_SF_BLANK_CHECK_SIZE);
+    if(NULL == priv->blank_buf) {
+        pr_err("memaligin failed\n");
+        free(burner);
+        return NULL;
+    }
+    sf_erase_types_init(priv);
+
     burner->type = KBURN_MEDIA_SPI_NOR;
+    burner->flags = KBURN_FLAG_ERASED_FF;
     burner->dev_priv = (void *)priv;
 
 	burner->get_medium_info = sf_get_medium_info;
@@ -13,20 +13,37 @@
 #include <linux/compiler.h>
 #include <g_dnl.h>
 #include <stddef.h>
+#include <div64.h>
+#include <time.h>
+#include <image-sparse.h>
+#include <mapmem.h>
 
 #include "kburn.h"
 
 static void tx_done_handler(struct usb_ep *ep, struct usb_request *req);
 static void rx_command_handler(struct usb_ep *ep, struct usb_request *req);
+static void rx_write_lba_handler(struct usb_ep *ep, struct usb_request *req);
+static void rx_drain_handler(struct usb_ep *ep, struct usb_request *req);
+struct kburn_usb_t;
+static void kburn_write_sparse(struct kburn_usb_t *kburn_usb);
+static void kburn_write_extents_end(struct kburn_usb_t *kburn_usb);
 
 enum kburn_pkt_cmd {
     KBURN_CMD_NONE = 0,
 
     KBURN_CMD_DEV_PROBE = 0x10,
 	KBURN_CMD_DEV_GET_INFO = 0x11,
+	KBURN_CMD_GET_STATS = 0x12,
+	KBURN_CMD_DEV_SYNC = 0x13,
 
 	KBURN_CMD_WRITE_LBA = 0x20,
 	KBURN_CMD_ERASE_LBA = 0x21,
+	KBURN_CMD_SKIP_LBA = 0x22,
+	KBURN_CMD_FILL_LBA = 0x23,
+	KBURN_CMD_WRITE_SPARSE = 0x24,
+	KBURN_CMD_WRITE_LBA_COMP = 0x25,
+	KBURN_CMD_VERIFY_LBA = 0x26,
+	KBURN_CMD_WRITE_EXTENTS = 0x27,
 
     KBURN_CMD_MAX,
 };
@@ -57,11 +74,49 @@ struct kburn_pkt_handler_t {
 	void (*cb)(struct usb_ep *ep, struct usb_request *req);
 };
 
+/* One (offset, size) range of a WRITE_EXTENTS batch */
+struct kburn_extent {
+	u64 offset;
+	u64 size;
+};
+
+/*
+ * One medium opened by DEV_PROBE. Several can be open at once, a plain
+ * WRITE_LBA in async mode keeps draining to its device while the host
+ * already streams to another one.
+ */
+struct kburn_usb_dev {
+	struct kburn *burner;
+	enum KBURN_MEDIA_TYPE type;
+	uint8_t index;
+
+	/* WRITE_LBA in flight on this device, zero when idle */
+	u64 dl_size;
+	u64 wr_bytes;
+	ulong wr_start;
+	bool async;
+	int error;
+};
+
+/* One staged bulk-OUT transfer waiting to be written to the medium */
+struct kburn_usb_chunk {
+	void *buf;
+	u64 offset;
+	u32 size;
+	u32 done;
+	ulong rx_us;
+	/* WRITE_LBA target, the selected device may change before it drains */
+	struct kburn_usb_dev *dev;
+};
+
 struct kburn_usb_t {
     struct usb_function usb_function;
 	struct usb_ep *in_ep, *out_ep;
 	struct usb_request *in_req, *out_req;
 
+	struct kburn_usb_dev devs[KBURN_USB_DEV_MAX];
+	/* device selected by the last DEV_PROBE, burner is its medium */
+	struct kburn_usb_dev *dev;
 	struct kburn *burner;
 
 	u64 offset;
@@ -70,8 +125,51 @@ struct kburn_usb_t {
 	u64 ul_size;
 	u64 ul_bytes;
 
-    void *buf;
 	void *buf_head;
+
+	struct kburn_usb_chunk chunks[KBURN_USB_BUFFER_COUNT];
+	unsigned int chunk_head;
+	unsigned int chunk_tail;
+	unsigned int chunk_count;
+	bool rx_paused;
+	/* the ring ran empty during a download, see kburn_usb_stats.rx_wait_us */
+	ulong rx_wait_start;
+	/* payload of an aborted download the host has still to send */
+	u64 drain_bytes;
+
+	u64 wr_bytes;
+	ulong wr_start;
+
+	/* zero-copy accounting, cp_bytes is expected to stay at zero */
+	u64 cp_bytes;
+	u64 wr_total;
+
+	/* android sparse image downloaded, waiting for kburn_usb_poll() */
+	bool sparse_pending;
+#if defined(CONFIG_KBURN_SPARSE)
+	/* download area of the sparse image */
+	void *sparse_buf;
+#endif
+
+	/* command the staged download answers to, WRITE_LBA or WRITE_LBA_COMP */
+	uint16_t dl_cmd;
+
+	/* WRITE_EXTENTS, the table arrives as the first block of the stream */
+	struct kburn_extent *extents;
+	u32 ext_count;
+	u32 ext_index;
+	u64 ext_done;
+	bool ext_ready;
+
+#if defined(CONFIG_KBURN_DECOMP)
+	/* compressed write, chunks are decompressed into comp_out */
+	bool comp;
+	struct kburn_decomp decomp;
+	void *comp_out;
+	u32 comp_fill;
+	u64 raw_offset;
+	u64 raw_size;
+#endif
 };
 
 static struct usb_endpoint_descriptor hs_ep_in = {
@@ -149,6 +247,10 @@ static struct usb_gadget_strings *kburn_strings[] = {
 
 static struct kburn_usb_t *s_kburn = NULL;
 
+/* outlives s_kburn, which is cleared on unbind, so "kburn stats" works after */
+static struct kburn_usb_stats s_kburn_stats;
+static bool s_kburn_verbose;
+
 static inline struct kburn_usb_t *func_to_kburn(struct usb_function *f)
 {
 	return container_of(f, struct kburn_usb_t, usb_function);
@@ -172,8 +274,10 @@ struct kburn_usb_t *get_kburn_usb(void)
 		if (!kburn_usb->buf_head)
 			return NULL;
 
-		kburn_usb->buf = kburn_usb->buf_head;
 		memset(kburn_usb->buf_head, 0, KBURN_USB_BUFFER_SIZE);
+
+		for (int i = 0; i < KBURN_USB_BUFFER_COUNT; i++)
+			kburn_usb->chunks[i].buf = kburn_usb->buf_head + i * KBURN_USB_EP_BUFFER_SZIE;
 	}
 
 	return kburn_usb;
@@ -265,7 +369,7 @@ static int kburn_handle_setup(struct usb_function *f, const struct usb_ctrlreque
 	return value;
 }
 
-static struct usb_request *kburn_start_ep(struct usb_ep *ep)
+static struct usb_request *kburn_start_ep(struct usb_ep *ep, void *buf)
 {
 	struct usb_request *req;
 
@@ -274,6 +378,13 @@ static struct usb_request *kburn_start_ep(struct usb_ep *ep)
 		return NULL;
 
 	req->length = KBURN_USB_EP_BUFFER_SZIE;
+
+	/* OUT requests are pointed at the staging area, see kburn_rx_arm() */
+	if (buf) {
+		req->buf = buf;
+		return req;
+	}
+
 	req->buf = memalign(CONFIG_SYS_CACHELINE_SIZE, KBURN_USB_EP_BUFFER_SZIE);
 	if (!req->buf) {
 		usb_ep_free_request(ep, req);
@@ -284,6 +395,17 @@ static struct usb_request *kburn_start_ep(struct usb_ep *ep)
 	return req;
 }
 
+/* Move the medium counters of a burner about to be destroyed into the session */
+static void kburn_stats_fold(struct kburn *burner)
+{
+	s_kburn_stats.wr_bytes += burner->stats.wr_bytes;
+	s_kburn_stats.write_us += burner->stats.write_us;
+	s_kburn_stats.erase_us += burner->stats.erase_us;
+	s_kburn_stats.wr_errors += burner->stats.errors;
+
+	memset(&burner->stats, 0, sizeof(burner->stats));
+}
+
 static void kburn_disable(struct usb_function *f)
 {
 	struct kburn_usb_t *f_kburn = func_to_kburn(f);
@@ -292,7 +414,6 @@ static void kburn_disable(struct usb_function *f)
 	usb_ep_disable(f_kburn->in_ep);
 
 	if (f_kburn->out_req) {
-		free(f_kburn->out_req->buf);
 		usb_ep_free_request(f_kburn->out_ep, f_kburn->out_req);
 		f_kburn->out_req = NULL;
 	}
@@ -306,13 +427,35 @@ static void kburn_disable(struct usb_function *f)
 	if (f_kburn->buf_head) {
 		free(f_kburn->buf_head);
 		f_kburn->buf_head = NULL;
-		f_kburn->buf = NULL;
 	}
 
-	if(f_kburn->burner) {
-		kburn_destory(f_kburn->burner);
-		f_kburn->burner = NULL;
+	memset(f_kburn->chunks, 0, sizeof(f_kburn->chunks));
+	f_kburn->chunk_head = 0;
+	f_kburn->chunk_tail = 0;
+	f_kburn->chunk_count = 0;
+	f_kburn->rx_paused = false;
+	f_kburn->drain_bytes = 0;
+	f_kburn->sparse_pending = false;
+	kburn_write_extents_end(f_kburn);
+
+#if defined(CONFIG_KBURN_DECOMP)
+	if (f_kburn->comp) {
+		kburn_decomp_end(&f_kburn->decomp);
+		f_kburn->comp = false;
+	}
+#endif
+
+	for (int i = 0; i < KBURN_USB_DEV_MAX; i++) {
+		struct kburn_usb_dev *dev = &f_kburn->devs[i];
+
+		if (dev->burner) {
+			kburn_stats_fold(dev->burner);
+			kburn_destory(dev->burner);
+		}
+		memset(dev, 0, sizeof(*dev));
 	}
+	f_kburn->dev = NULL;
+	f_kburn->burner = NULL;
 }
 
 static int kburn_set_alt(struct usb_function *f, unsigned interface, unsigned alt)
@@ -333,7 +476,13 @@ static int kburn_set_alt(struct usb_function *f, unsigned interface, unsigned al
 		return ret;
 	}
 
-	f_kburn->out_req = kburn_start_ep(f_kburn->out_ep);
+	if (!get_kburn_usb()) {
+		printf("failed to alloc staging buffer\n");
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	f_kburn->out_req = kburn_start_ep(f_kburn->out_ep, f_kburn->chunks[0].buf);
 	if (!f_kburn->out_req) {
 		printf("failed to alloc out req\n");
 		ret = -EINVAL;
@@ -348,7 +497,7 @@ static int kburn_set_alt(struct usb_function *f, unsigned interface, unsigned al
 		goto err;
 	}
 
-	f_kburn->in_req = kburn_start_ep(f_kburn->in_ep);
+	f_kburn->in_req = kburn_start_ep(f_kburn->in_ep, NULL);
 	if (!f_kburn->in_req) {
 		printf("failed alloc req in\n");
 		ret = -EINVAL;
@@ -403,8 +552,16 @@ static int kburn_add(struct usb_configuration *c)
 
 DECLARE_GADGET_BIND_CALLBACK(usb_dnl_kburn, kburn_add);
 
+void kburn_usb_set_verbose(bool verbose)
+{
+	s_kburn_verbose = verbose;
+}
+
 static void kburn_print_pkt(struct kburn_usb_pkt *pkt)
 {
+    if (!s_kburn_verbose)
+        return;
+
     printf("cmd 0x%04x, result 0x%04x, size %d, data: ", pkt->cmd, pkt->result, pkt->data_size);
     for(int i = 0; i < pkt->data_size; i++) {
         printf("%02x ", pkt->data[i]);
@@ -522,11 +679,19 @@ static void rx_command_handler(struct usb_ep *ep, struct usb_request *req)
 	usb_ep_queue(ep, req, 0);
 }
 
+/*
+ * Open the medium of type/index, or select it when it is open already.
+ * Index is always 0 for now, K230 has a single medium of each type.
+ * Each probed medium stays open until the gadget is disabled, so writes
+ * to several of them can be interleaved in one session.
+ */
 static void cb_probe_device(struct usb_ep *ep, struct usb_request *req)
 {
 	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
 
 	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	struct kburn_usb_dev *dev = NULL;
+	bool opened = false;
 
 	uint8_t index = 0;
 	enum KBURN_MEDIA_TYPE type = KBURN_MEDIA_NONE;
@@ -539,15 +704,53 @@ static void cb_probe_device(struct usb_ep *ep, struct usb_request *req)
 		return;
 	}
 
+	/* a download is still being received for the selected device */
+	if (kburn_usb->dl_size || kburn_usb->sparse_pending) {
+		kburn_tx_string_result(KBURN_CMD_DEV_PROBE, KBURN_RESULT_ERROR_MSG, "BUSY");
+		return;
+	}
+
 	type = cbw->data[0];
 	index = cbw->data[1];
-	if(kburn_usb->burner) {
-		kburn_destory(kburn_usb->burner);
-		kburn_usb->burner = NULL;
+
+	/* kburn_probe_media() opens the one medium there is of each type */
+	if (0x00 != index) {
+		kburn_tx_string_result(KBURN_CMD_DEV_PROBE, KBURN_RESULT_ERROR_MSG, "INDEX NOT SUPPORT");
+		return;
+	}
+
+	for (int i = 0; i < KBURN_USB_DEV_MAX; i++) {
+		if (kburn_usb->devs[i].burner) {
+			opened = true;
+			if ((type == kburn_usb->devs[i].type) && (index == kburn_usb->devs[i].index)) {
+				dev = &kburn_usb->devs[i];
+				break;
+			}
+		} else if (NULL == dev) {
+			dev = &kburn_usb->devs[i];
+		}
+	}
+
+	if (NULL == dev) {
+		kburn_tx_string_result(KBURN_CMD_DEV_PROBE, KBURN_RESULT_ERROR_MSG, "TOO MANY DEVICES");
+		return;
 	}
-	kburn_usb->burner = kburn_probe_media(type);
 
-	if (kburn_usb->burner) {
+	if (NULL == dev->burner) {
+		/* the first medium opened starts a new session */
+		if (!opened)
+			memset(&s_kburn_stats, 0, sizeof(s_kburn_stats));
+
+		memset(dev, 0, sizeof(*dev));
+		dev->burner = kburn_probe_media(type);
+		dev->type = type;
+		dev->index = index;
+	}
+
+	if (dev->burner) {
+		kburn_usb->dev = dev;
+		kburn_usb->burner = dev->burner;
+
 		kburn_tx_result(KBURN_CMD_DEV_PROBE, KBURN_RESULT_OK, (uint8_t *)&result[0], sizeof(result));
 	} else {
 		kburn_tx_string_result(KBURN_CMD_DEV_PROBE, KBURN_RESULT_ERROR_MSG, "PROBE FAILED");
@@ -572,10 +775,9 @@ static void cb_get_device_info(struct usb_ep *ep, struct usb_request *req)
 	}
 }
 
-static unsigned int rx_bytes_expected(struct usb_ep *ep)
+/* OUT request length for rx_remain bytes, rounded up to whole packets */
+static unsigned int rx_bytes_round(struct usb_ep *ep, u64 rx_remain)
 {
-	struct kburn_usb_t *kburn_usb = get_kburn_usb();
-	u64 rx_remain = kburn_usb->dl_size - kburn_usb->dl_bytes;
 	u64 rem;
 	u64 maxpacket = ep->maxpacket;
 
@@ -593,9 +795,66 @@ static unsigned int rx_bytes_expected(struct usb_ep *ep)
 	return (unsigned int)rx_remain;
 }
 
+static unsigned int rx_bytes_expected(struct usb_ep *ep)
+{
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+
+	return rx_bytes_round(ep, kburn_usb->dl_size - kburn_usb->dl_bytes);
+}
+
+/*
+ * Queue the OUT request on the next free staging slot. Both commands and
+ * WRITE_LBA payloads are received there; when every slot is still waiting
+ * for the medium the request is parked and kburn_usb_poll() re-arms it.
+ */
+static void kburn_rx_arm(struct kburn_usb_t *kburn_usb)
+{
+	struct usb_request *req = kburn_usb->out_req;
+
+	if (kburn_usb->chunk_count >= KBURN_USB_BUFFER_COUNT) {
+		if (!kburn_usb->rx_paused)
+			s_kburn_stats.rx_stalls++;
+		kburn_usb->rx_paused = true;
+		return;
+	}
+	kburn_usb->rx_paused = false;
+
+	req->buf = kburn_usb->chunks[kburn_usb->chunk_head].buf;
+	if (rx_write_lba_handler == req->complete)
+		req->length = rx_bytes_expected(kburn_usb->out_ep);
+	else if (rx_drain_handler == req->complete)
+		req->length = rx_bytes_round(kburn_usb->out_ep, kburn_usb->drain_bytes);
+	else
+		req->length = KBURN_USB_EP_BUFFER_SZIE;
+	req->actual = 0;
+
+	usb_ep_queue(kburn_usb->out_ep, req, 0);
+}
+
+/* The oldest chunk is on the medium, give its slot back to bulk-OUT */
+static void kburn_chunk_retire(struct kburn_usb_t *kburn_usb)
+{
+	struct kburn_usb_chunk *chunk = &kburn_usb->chunks[kburn_usb->chunk_tail];
+	u32 latency = timer_get_us() - chunk->rx_us;
+
+	if ((0x00 == s_kburn_stats.chunks) || (latency < s_kburn_stats.chunk_min_us))
+		s_kburn_stats.chunk_min_us = latency;
+	if (latency > s_kburn_stats.chunk_max_us)
+		s_kburn_stats.chunk_max_us = latency;
+	s_kburn_stats.chunk_total_us += latency;
+	s_kburn_stats.chunks++;
+
+	kburn_usb->chunk_tail = (kburn_usb->chunk_tail + 1) % KBURN_USB_BUFFER_COUNT;
+	kburn_usb->chunk_count--;
+
+	if (kburn_usb->rx_paused)
+		kburn_rx_arm(kburn_usb);
+}
+
 static void rx_write_lba_handler(struct usb_ep *ep, struct usb_request *req)
 {
 	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	struct kburn_usb_chunk *chunk;
 	unsigned int transfer_size = 0;
 	const unsigned char *buffer = req->buf;
 	unsigned int buffer_size = req->actual;
@@ -604,60 +863,484 @@ static void rx_write_lba_handler(struct usb_ep *ep, struct usb_request *req)
 
 	if (req->status != 0) {
 		printf("Bad status: %d\n", req->status);
-		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "ERROR STATUS");
+		s_kburn_stats.rx_errors++;
+		kburn_tx_string_result(kburn_usb->dl_cmd, KBURN_RESULT_ERROR_MSG, "ERROR STATUS");
 		return;
 	}
 
 	if (buffer_size < transfer_size)
 		transfer_size = buffer_size;
 
-	memcpy((void *)kburn_usb->buf, buffer, transfer_size);
+	chunk = &kburn_usb->chunks[kburn_usb->chunk_head];
+	if (buffer != chunk->buf) {
+		/* never expected, req->buf is always armed on chunk_head */
+		memcpy(chunk->buf, buffer, transfer_size);
+		kburn_usb->cp_bytes += transfer_size;
+	}
+	chunk->offset = kburn_usb->offset;
+	chunk->size = transfer_size;
+	chunk->done = 0;
+	chunk->rx_us = timer_get_us();
+	chunk->dev = kburn_usb->dev;
+
+	s_kburn_stats.rx_bytes += transfer_size;
+
+	kburn_usb->chunk_head = (kburn_usb->chunk_head + 1) % KBURN_USB_BUFFER_COUNT;
+	kburn_usb->chunk_count++;
+
 	kburn_usb->dl_bytes += transfer_size;
+	kburn_usb->offset += transfer_size;
+
+	/* everything received, kburn_usb_poll() reports WRITE DONE */
+	if (kburn_usb->dl_bytes >= kburn_usb->dl_size) {
+		req->complete = rx_command_handler;
+
+		/* async WRITE_LBA, the host may go on while the device drains */
+		if ((KBURN_CMD_WRITE_LBA == kburn_usb->dl_cmd) && kburn_usb->dev->async) {
+			kburn_usb->dl_size = 0;
+			kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_OK, "RECV DONE");
+		}
+	}
+
+	/* re-arm before the medium write so the host keeps streaming */
+	kburn_rx_arm(kburn_usb);
+}
+
+static void kburn_write_extents_end(struct kburn_usb_t *kburn_usb)
+{
+	if (kburn_usb->extents) {
+		free(kburn_usb->extents);
+		kburn_usb->extents = NULL;
+	}
+	kburn_usb->ext_count = 0;
+	kburn_usb->ext_ready = false;
+
+	if (kburn_usb->burner)
+		kburn_usb->burner->flags &= ~KBURN_FLAG_PRE_ERASED;
+}
+
+/*
+ * Payload of an aborted download is still on its way, it is received and
+ * dropped until the announced size is in, or the host ends the transfer
+ * with a short packet. Only then are OUT packets commands again.
+ */
+static void rx_drain_handler(struct usb_ep *ep, struct usb_request *req)
+{
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
 
-	u64 xfer_size = transfer_size;
-	int result = kburn_write_medium(kburn_usb->burner, kburn_usb->offset, kburn_usb->buf, &xfer_size);
-	if((0x00 != result) || (xfer_size != transfer_size)) {
-		printf("write failed %d, %lld != %d\n", result, xfer_size, transfer_size);
-		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "WRITE ERROR");
+	if (req->status != 0) {
+		printf("Bad status: %d\n", req->status);
+		s_kburn_stats.rx_errors++;
 		return;
 	}
 
-	kburn_usb->offset += transfer_size;
+	if ((req->actual < req->length) || (req->actual >= kburn_usb->drain_bytes))
+		kburn_usb->drain_bytes = 0;
+	else
+		kburn_usb->drain_bytes -= req->actual;
 
-	if (kburn_usb->dl_bytes >= kburn_usb->dl_size) {
+	if (0x00 == kburn_usb->drain_bytes) {
+		printf("aborted download drained\n");
 		req->complete = rx_command_handler;
-		req->length = KBURN_USB_EP_BUFFER_SZIE;
-		kburn_usb->buf = kburn_usb->buf_head;
+	}
+	kburn_rx_arm(kburn_usb);
+}
 
-		printf("write 0x%llx bytes done\n", kburn_usb->dl_size);
-		kburn_usb->dl_size = 0;
+static void kburn_write_lba_abort(struct kburn_usb_t *kburn_usb)
+{
+	struct usb_request *req = kburn_usb->out_req;
+	bool paused = kburn_usb->rx_paused;
+
+	req->complete = rx_command_handler;
+
+	if (!paused)
+		usb_ep_dequeue(kburn_usb->out_ep, req);
+
+	/* the rest of the payload must not be taken for commands */
+	if (kburn_usb->dl_bytes < kburn_usb->dl_size) {
+		kburn_usb->drain_bytes = kburn_usb->dl_size - kburn_usb->dl_bytes;
+		req->complete = rx_drain_handler;
+	}
+
+	kburn_usb->chunk_head = 0;
+	kburn_usb->chunk_tail = 0;
+	kburn_usb->chunk_count = 0;
+	kburn_usb->dl_size = 0;
+	kburn_usb->rx_wait_start = 0;
+
+	/* staged data of async writes is dropped with the ring */
+	for (int i = 0; i < KBURN_USB_DEV_MAX; i++) {
+		if (kburn_usb->devs[i].dl_size) {
+			kburn_usb->devs[i].dl_size = 0;
+			kburn_usb->devs[i].error = -EIO;
+		}
+	}
+
+	kburn_write_extents_end(kburn_usb);
+
+#if defined(CONFIG_KBURN_DECOMP)
+	if (kburn_usb->comp) {
+		kburn_decomp_end(&kburn_usb->decomp);
+		kburn_usb->comp = false;
+	}
+#endif
+
+	kburn_rx_arm(kburn_usb);
+}
+
+static void kburn_write_lba_report(struct kburn_usb_t *kburn_usb, u64 size, ulong start)
+{
+	ulong elapsed = get_timer(start);
+	u64 kbps;
+
+	if (0x00 == elapsed)
+		elapsed = 1;
+	kbps = lldiv(size * 1000, elapsed) / 1024;
+
+	printf("write 0x%llx bytes done, %lu ms, %llu.%02llu MB/s\n",
+		size, elapsed, kbps / 1024, ((kbps % 1024) * 100) / 1024);
+	printf("bytes copied 0x%llx, bytes written 0x%llx\n",
+		kburn_usb->cp_bytes, kburn_usb->wr_total);
+}
+
+#if defined(CONFIG_KBURN_DECOMP)
+#define KBURN_COMP_OUT_SIZE         KBURN_USB_EP_BUFFER_SZIE
+
+/* Write what has been decompressed so far, false on failure */
+static bool kburn_comp_flush(struct kburn_usb_t *kburn_usb)
+{
+	u64 xfer_size = kburn_usb->comp_fill;
+	int result;
+
+	if (0x00 == xfer_size)
+		return true;
+
+	if ((kburn_usb->wr_bytes + xfer_size) > kburn_usb->raw_size) {
+		printf("decompressed data exceeds 0x%llx bytes\n", kburn_usb->raw_size);
+		return false;
+	}
+
+	result = kburn_write_medium(kburn_usb->burner, kburn_usb->raw_offset + kburn_usb->wr_bytes,
+				    kburn_usb->comp_out, &xfer_size);
+	if((0x00 != result) || (xfer_size != kburn_usb->comp_fill)) {
+		printf("write failed %d, %lld != %d\n", result, xfer_size, kburn_usb->comp_fill);
+		return false;
+	}
+
+	kburn_usb->wr_bytes += xfer_size;
+	kburn_usb->wr_total += xfer_size;
+	kburn_usb->comp_fill = 0;
+
+	return true;
+}
+
+/*
+ * Compressed counterpart of the chunk drain in kburn_usb_poll(): decode the
+ * oldest staged chunk into comp_out and write it out every time it fills.
+ */
+static void kburn_usb_poll_comp(struct kburn_usb_t *kburn_usb)
+{
+	struct kburn_usb_chunk *chunk = &kburn_usb->chunks[kburn_usb->chunk_tail];
+	void *in = chunk->buf + chunk->done;
+	size_t in_len = chunk->size - chunk->done;
+	size_t out_room = KBURN_COMP_OUT_SIZE - kburn_usb->comp_fill;
+	size_t out_len = out_room;
+	char *err = "DECOMP ERROR";
+	int ret;
+
+	ret = kburn_decomp_run(&kburn_usb->decomp, &in, &in_len,
+			       kburn_usb->comp_out + kburn_usb->comp_fill, &out_len);
+	if (ret < 0)
+		goto abort;
+
+	chunk->done = chunk->size - in_len;
+	kburn_usb->comp_fill += out_len;
+
+	if ((KBURN_COMP_OUT_SIZE == kburn_usb->comp_fill) || (ret > 0)) {
+		err = "WRITE ERROR";
+		if (!kburn_comp_flush(kburn_usb))
+			goto abort;
+	}
+
+	/* keep the chunk while the decoder may still hold output for it */
+	if ((0x00 == in_len) && ((out_len < out_room) || (ret > 0)))
+		kburn_chunk_retire(kburn_usb);
+
+	if ((0x00 == ret) && (0x00 == kburn_usb->chunk_count) &&
+	    (kburn_usb->dl_bytes >= kburn_usb->dl_size)) {
+		err = "DATA TRUNCATED";
+		goto abort;
+	}
+
+	if (0x00 == ret)
+		return;
+
+	if (kburn_usb->wr_bytes != kburn_usb->raw_size) {
+		printf("decompressed 0x%llx bytes, expect 0x%llx\n",
+			kburn_usb->wr_bytes, kburn_usb->raw_size);
+		err = "DATA SIZE MISMATCH";
+		goto abort;
+	}
+
+	/* trailing bytes after the stream end are still in flight, drop them */
+	if ((kburn_usb->chunk_count) || (kburn_usb->dl_bytes < kburn_usb->dl_size)) {
+		err = "TRAILING DATA";
+		goto abort;
+	}
+
+	kburn_write_lba_report(kburn_usb, kburn_usb->dl_size, kburn_usb->wr_start);
+	printf("compressed 0x%llx -> 0x%llx bytes\n", kburn_usb->decomp.in_bytes,
+		kburn_usb->decomp.out_bytes);
+
+	kburn_decomp_end(&kburn_usb->decomp);
+	kburn_usb->comp = false;
+	kburn_usb->dl_size = 0;
+
+	kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_OK, "WRITE DONE");
+	return;
+
+abort:
+	kburn_write_lba_abort(kburn_usb);
+	kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_ERROR_MSG, err);
+}
+#endif // CONFIG_KBURN_DECOMP
+
+/*
+ * Take the extent table from the head of the WRITE_EXTENTS stream, check it
+ * against the announced stream size and erase everything up front on media
+ * which need it, so the payloads are only programmed afterwards. Media
+ * skipping bad blocks are left to erase inline, an extent spanning a bad
+ * block ends in a block past the erased range.
+ */
+static const char *kburn_write_extents_parse(struct kburn_usb_t *kburn_usb, const u8 *table)
+{
+	struct kburn *burner = kburn_usb->burner;
+	struct kburn_medium_info *info = &burner->medium_info;
+	u64 stream = KBURN_EXTENT_ALIGN;
+	u64 erase_len;
+	u32 i;
+
+	if (info->blk_size > KBURN_EXTENT_ALIGN)
+		return "BLOCK SIZE NOT SUPPORT";
+
+	for (i = 0; i < kburn_usb->ext_count; i++) {
+		struct kburn_extent *ext = &kburn_usb->extents[i];
+
+		ext->offset = get_unaligned_le64(&table[i * 16 + 0]);
+		ext->size = get_unaligned_le64(&table[i * 16 + 8]);
+
+		if ((0x00 == ext->size) || ((ext->offset + ext->size) > info->capacity))
+			return "DATA SIZE EXCEED";
+
+		if (ext->offset % info->blk_size)
+			return "EXTENT NOT ALIGNED";
+
+		if ((burner->flags & KBURN_FLAG_ERASED_FF) && (ext->offset % info->erase_size))
+			return "EXTENT NOT ALIGNED";
+
+		stream += ALIGN(ext->size, KBURN_EXTENT_ALIGN);
+	}
+
+	if (stream != kburn_usb->dl_size)
+		return "DATA SIZE MISMATCH";
 
-		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_OK, "WRITE DONE");
+	if ((0x00 == (burner->flags & KBURN_FLAG_ERASED_FF)) || (burner->flags & KBURN_FLAG_SKIP_BAD))
+		return NULL;
+
+	for (i = 0; i < kburn_usb->ext_count; i++) {
+		erase_len = roundup(kburn_usb->extents[i].size, info->erase_size);
+
+		if (0x00 != kburn_erase_medium(burner, kburn_usb->extents[i].offset, &erase_len))
+			return "ERASE ERROR";
+	}
+	burner->flags |= KBURN_FLAG_PRE_ERASED;
+
+	return NULL;
+}
+
+/*
+ * WRITE_EXTENTS counterpart of the chunk drain in kburn_usb_poll(). chunk
+ * offsets are stream positions here, the current extent maps them to the
+ * medium and its padding is consumed without being written.
+ */
+static void kburn_usb_poll_extents(struct kburn_usb_t *kburn_usb)
+{
+	struct kburn_usb_chunk *chunk = &kburn_usb->chunks[kburn_usb->chunk_tail];
+	struct kburn *burner = kburn_usb->burner;
+	struct kburn_extent *ext;
+	const char *err;
+	u64 padded, data, xfer_size;
+	u32 step;
+
+	if (!kburn_usb->ext_ready) {
+		/* the table block is always at the start of the first chunk */
+		err = kburn_write_extents_parse(kburn_usb, chunk->buf);
+		if (err)
+			goto abort;
+
+		kburn_usb->ext_ready = true;
+		step = KBURN_EXTENT_ALIGN;
 	} else {
-		req->length = rx_bytes_expected(ep);
-		if (kburn_usb->buf == kburn_usb->buf_head)
-			kburn_usb->buf = kburn_usb->buf_head + KBURN_USB_EP_BUFFER_SZIE;
-		else
-			kburn_usb->buf = kburn_usb->buf_head;
+		ext = &kburn_usb->extents[kburn_usb->ext_index];
+		padded = ALIGN(ext->size, KBURN_EXTENT_ALIGN);
+		data = ALIGN(ext->size, burner->medium_info.blk_size);
+
+		step = min_t(u64, chunk->size - chunk->done, padded - kburn_usb->ext_done);
+		if ((KBURN_MEDIA_eMMC == burner->type) && (step > KBURN_USB_WRITE_GRANULE))
+			step = KBURN_USB_WRITE_GRANULE;
+
+		if (kburn_usb->ext_done < data) {
+			xfer_size = min_t(u64, step, data - kburn_usb->ext_done);
+
+			if ((0x00 != kburn_write_medium(burner, ext->offset + kburn_usb->ext_done,
+							chunk->buf + chunk->done, &xfer_size))) {
+				printf("write extent %u at 0x%llx failed\n", kburn_usb->ext_index,
+					ext->offset + kburn_usb->ext_done);
+				err = "WRITE ERROR";
+				goto abort;
+			}
+			kburn_usb->wr_total += xfer_size;
+		}
 
-		// printf("remain %x bytes\n", req->length);
+		kburn_usb->ext_done += step;
+		if (kburn_usb->ext_done >= padded) {
+			kburn_usb->ext_index++;
+			kburn_usb->ext_done = 0;
+		}
 	}
 
-	req->actual = 0;
-	usb_ep_queue(ep, req, 0);
+	chunk->done += step;
+	kburn_usb->wr_bytes += step;
+
+	if (chunk->done < chunk->size)
+		return;
+
+	kburn_chunk_retire(kburn_usb);
+
+	if (kburn_usb->wr_bytes >= kburn_usb->dl_size) {
+		kburn_write_lba_report(kburn_usb, kburn_usb->dl_size, kburn_usb->wr_start);
+		printf("%u extents written\n", kburn_usb->ext_index);
+
+		kburn_write_extents_end(kburn_usb);
+		kburn_usb->dl_size = 0;
+
+		kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_OK, "WRITE DONE");
+	}
+	return;
+
+abort:
+	kburn_write_lba_abort(kburn_usb);
+	kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_ERROR_MSG, (char *)err);
+}
+
+/*
+ * Drain one granule of the oldest staged chunk to the medium. Called from
+ * the kburn command loop between USB interrupt servicing, so the controller
+ * keeps receiving the next chunk while the medium is programmed.
+ */
+void kburn_usb_poll(void)
+{
+	struct kburn_usb_t *kburn_usb = s_kburn;
+	struct kburn_usb_chunk *chunk;
+	struct kburn_usb_dev *dev;
+	u64 xfer_size;
+	u32 granule;
+	int result;
+
+	if (NULL == kburn_usb)
+		return;
+
+	if (kburn_usb->sparse_pending) {
+		kburn_write_sparse(kburn_usb);
+		return;
+	}
+
+	if (0x00 == kburn_usb->chunk_count) {
+		if ((kburn_usb->dl_bytes < kburn_usb->dl_size) && (0x00 == kburn_usb->rx_wait_start))
+			kburn_usb->rx_wait_start = timer_get_us();
+		return;
+	}
+
+	if (kburn_usb->rx_wait_start) {
+		s_kburn_stats.rx_wait_us += timer_get_us() - kburn_usb->rx_wait_start;
+		kburn_usb->rx_wait_start = 0;
+	}
+
+#if defined(CONFIG_KBURN_DECOMP)
+	if (kburn_usb->comp) {
+		kburn_usb_poll_comp(kburn_usb);
+		return;
+	}
+#endif
+
+	if (kburn_usb->extents) {
+		kburn_usb_poll_extents(kburn_usb);
+		return;
+	}
+
+	chunk = &kburn_usb->chunks[kburn_usb->chunk_tail];
+	dev = chunk->dev;
+
+	granule = chunk->size - chunk->done;
+	if ((KBURN_MEDIA_eMMC == dev->burner->type) && (granule > KBURN_USB_WRITE_GRANULE))
+		granule = KBURN_USB_WRITE_GRANULE;
+
+	/* an async write which failed already drops the rest of its data */
+	if (0x00 == dev->error) {
+		xfer_size = granule;
+		result = kburn_write_medium(dev->burner, chunk->offset + chunk->done, chunk->buf + chunk->done, &xfer_size);
+		if((0x00 != result) || (xfer_size != granule)) {
+			printf("write failed %d, %lld != %d\n", result, xfer_size, granule);
+			if (!dev->async) {
+				kburn_write_lba_abort(kburn_usb);
+				kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "WRITE ERROR");
+				return;
+			}
+			dev->error = -EIO;
+		} else {
+			kburn_usb->wr_total += granule;
+		}
+	}
+
+	chunk->done += granule;
+	dev->wr_bytes += granule;
+
+	if (chunk->done < chunk->size)
+		return;
+
+	kburn_chunk_retire(kburn_usb);
+
+	if (dev->dl_size && (dev->wr_bytes >= dev->dl_size)) {
+		if (0x00 == dev->error)
+			kburn_write_lba_report(kburn_usb, dev->dl_size, dev->wr_start);
+		dev->dl_size = 0;
+
+		/* async writes are collected with DEV_SYNC */
+		if (!dev->async) {
+			kburn_usb->dl_size = 0;
+			kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_OK, "WRITE DONE");
+		}
+	}
 }
 
+/*
+ * Data: offset, size (u64) and an optional flags byte. With bit 0 set the
+ * write is async: "RECV DONE" answers once everything is received and the
+ * result is collected later with DEV_SYNC, so the host can select another
+ * device and stream to it while this one is still programmed.
+ */
 static void cb_write_lba(struct usb_ep *ep, struct usb_request *req)
 {
 	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
 
 	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	struct kburn_usb_dev *dev = kburn_usb->dev;
 
 	u64 offset, size;
 
 	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
 
-	if(cbw->data_size != 16) {
+	if((cbw->data_size != 16) && (cbw->data_size != 17)) {
 		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
 		return;
 	}
@@ -665,17 +1348,23 @@ static void cb_write_lba(struct usb_ep *ep, struct usb_request *req)
 	offset = get_unaligned_le64(&cbw->data[0]);
 	size = get_unaligned_le64(&cbw->data[8]);
 
-	if(0x01 != kburn_usb->burner->medium_info.valid) {
+	if((NULL == dev) || (0x01 != dev->burner->medium_info.valid)) {
 		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "MEDIUM INFO INVALID");
 		return;
 	}
 
+	/* one download at a time, and one write in flight per device */
+	if (kburn_usb->dl_size || kburn_usb->sparse_pending || dev->dl_size) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "BUSY");
+		return;
+	}
+
 	if(0x00 == size) {
 		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "DATA SIZE INVALID");
 		return;
 	}
 
-	if ((offset + size) > kburn_usb->burner->medium_info.capacity) {
+	if ((offset + size) > dev->burner->medium_info.capacity) {
 		kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
 		return;
 	}
@@ -684,7 +1373,18 @@ static void cb_write_lba(struct usb_ep *ep, struct usb_request *req)
 	kburn_usb->dl_size = size;
 	kburn_usb->dl_bytes = 0;
 
-	printf("require write %llx bytes to offset %llx\n", kburn_usb->dl_size, kburn_usb->offset);
+	kburn_usb->wr_bytes = 0;
+	kburn_usb->wr_start = get_timer(0);
+	kburn_usb->dl_cmd = KBURN_CMD_WRITE_LBA;
+
+	dev->dl_size = size;
+	dev->wr_bytes = 0;
+	dev->wr_start = kburn_usb->wr_start;
+	dev->async = (17 == cbw->data_size) && (cbw->data[16] & 0x01);
+	dev->error = 0;
+
+	printf("require write %llx bytes to offset %llx%s\n", kburn_usb->dl_size, kburn_usb->offset,
+		dev->async ? ", async" : "");
 
 	kburn_tx_string_result(KBURN_CMD_WRITE_LBA, KBURN_RESULT_OK, "START DL");
 
@@ -692,6 +1392,72 @@ static void cb_write_lba(struct usb_ep *ep, struct usb_request *req)
 	req->length = rx_bytes_expected(ep);
 }
 
+/*
+ * Data: media type and index, or nothing for the selected device. Reply:
+ * state (0 idle, 1 writing, 2 the last async write failed) and the bytes
+ * of the current or last write drained so far (u64). Reading a failure
+ * clears it.
+ */
+static void cb_dev_sync(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	struct kburn_usb_dev *dev = NULL;
+	uint8_t data[9];
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if (0x00 == cbw->data_size) {
+		dev = kburn_usb->dev;
+	} else if (0x02 == cbw->data_size) {
+		for (int i = 0; i < KBURN_USB_DEV_MAX; i++) {
+			if (kburn_usb->devs[i].burner && (cbw->data[0] == kburn_usb->devs[i].type) &&
+			    (cbw->data[1] == kburn_usb->devs[i].index)) {
+				dev = &kburn_usb->devs[i];
+				break;
+			}
+		}
+	} else {
+		kburn_tx_string_result(KBURN_CMD_DEV_SYNC, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (NULL == dev) {
+		kburn_tx_string_result(KBURN_CMD_DEV_SYNC, KBURN_RESULT_ERROR_MSG, "NO SUCH DEVICE");
+		return;
+	}
+
+	if (dev->dl_size)
+		data[0] = 0x01;
+	else if (dev->error)
+		data[0] = 0x02;
+	else
+		data[0] = 0x00;
+	put_unaligned_le64(dev->wr_bytes, &data[1]);
+
+	if (0x02 == data[0])
+		dev->error = 0;
+
+	kburn_tx_result(KBURN_CMD_DEV_SYNC, 0x02 == data[0] ? KBURN_RESULT_ERROR : KBURN_RESULT_OK,
+		data, sizeof(data));
+}
+
+static bool kburn_usb_busy(struct kburn_usb_t *kburn_usb, uint16_t cmd)
+{
+	if ((NULL == kburn_usb->burner) || (0x01 != kburn_usb->burner->medium_info.valid)) {
+		kburn_tx_string_result(cmd, KBURN_RESULT_ERROR_MSG, "MEDIUM INFO INVALID");
+		return true;
+	}
+
+	if (kburn_usb->chunk_count || kburn_usb->sparse_pending) {
+		kburn_tx_string_result(cmd, KBURN_RESULT_ERROR_MSG, "BUSY");
+		return true;
+	}
+
+	return false;
+}
+
 static void cb_erase_lba(struct usb_ep *ep, struct usb_request *req)
 {
 	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
@@ -710,25 +1476,512 @@ static void cb_erase_lba(struct usb_ep *ep, struct usb_request *req)
 		return;
 	}
 
+	/* the staged chunks of an async write are still going to the medium */
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_ERASE_LBA))
+		return;
+
 	offset = get_unaligned_le64(&cbw->data[0]);
 	size = get_unaligned_le64(&cbw->data[8]);
 
-	if(kburn_usb->burner) {
-		if(0x00 != size) {
-			result = kburn_erase_medium(kburn_usb->burner, offset, &size);
-		}
-		put_unaligned_le64(offset, &data[0]);
-		put_unaligned_le64(size, &data[8]);
-
-		kburn_tx_result(KBURN_CMD_ERASE_LBA, 0x00 == result ? KBURN_RESULT_OK : KBURN_RESULT_ERROR, data, sizeof(data));
-	} else {
-		kburn_tx_string_result(KBURN_CMD_ERASE_LBA, KBURN_RESULT_ERROR_MSG, "RUNTIME ERROR");
+	if(0x00 != size) {
+		result = kburn_erase_medium(kburn_usb->burner, offset, &size);
 	}
-}
+	put_unaligned_le64(offset, &data[0]);
+	put_unaligned_le64(size, &data[8]);
 
-static void cb_not_support(struct usb_ep *ep, struct usb_request *req)
-{
-    kburn_tx_error_string("NOT SUPPORT FUNC");
+	kburn_tx_result(KBURN_CMD_ERASE_LBA, 0x00 == result ? KBURN_RESULT_OK : KBURN_RESULT_ERROR, data, sizeof(data));
+}
+
+static void cb_skip_lba(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+
+	int result = 0;
+	uint8_t data[16];
+
+	u64 offset, size;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 16) {
+		kburn_tx_string_result(KBURN_CMD_SKIP_LBA, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_SKIP_LBA))
+		return;
+
+	offset = get_unaligned_le64(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[8]);
+
+	if ((offset + size) > kburn_usb->burner->medium_info.capacity) {
+		kburn_tx_string_result(KBURN_CMD_SKIP_LBA, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
+		return;
+	}
+
+	/* skipped ranges are don't care, discard what can be cheaply discarded */
+	if(0x00 != size) {
+		result = kburn_discard_medium(kburn_usb->burner, offset, &size);
+	}
+	put_unaligned_le64(offset, &data[0]);
+	put_unaligned_le64(size, &data[8]);
+
+	kburn_tx_result(KBURN_CMD_SKIP_LBA, 0x00 == result ? KBURN_RESULT_OK : KBURN_RESULT_ERROR, data, sizeof(data));
+}
+
+static void cb_fill_lba(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	void *fill_buf;
+
+	int result = 0;
+	u64 offset, size;
+	u32 pattern;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 20) {
+		kburn_tx_string_result(KBURN_CMD_FILL_LBA, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_FILL_LBA))
+		return;
+
+	offset = get_unaligned_le64(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[8]);
+	pattern = get_unaligned_le32(&cbw->data[16]);
+
+	if ((offset + size) > kburn_usb->burner->medium_info.capacity) {
+		kburn_tx_string_result(KBURN_CMD_FILL_LBA, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
+		return;
+	}
+
+	/* ring is idle, borrow the slot after the one this command landed in */
+	fill_buf = kburn_usb->chunks[(kburn_usb->chunk_head + 1) % KBURN_USB_BUFFER_COUNT].buf;
+
+	if(0x00 != size) {
+		result = kburn_fill_medium(kburn_usb->burner, offset, size, pattern,
+					   fill_buf, KBURN_USB_EP_BUFFER_SZIE);
+	}
+
+	if (0x00 == result)
+		kburn_tx_string_result(KBURN_CMD_FILL_LBA, KBURN_RESULT_OK, "FILL DONE");
+	else
+		kburn_tx_string_result(KBURN_CMD_FILL_LBA, KBURN_RESULT_ERROR_MSG, "FILL ERROR");
+}
+
+/*
+ * One handshake for a whole image: the host announces how many extents and
+ * how long the stream is, then sends the table block and every payload
+ * back-to-back and gets a single WRITE DONE at the end.
+ */
+static void cb_write_extents(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+
+	u32 count;
+	u64 size;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 12) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_WRITE_EXTENTS))
+		return;
+
+	count = get_unaligned_le32(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[4]);
+
+	if ((0x00 == count) || (count > KBURN_EXTENTS_MAX) ||
+	    (size <= KBURN_EXTENT_ALIGN) || (size % KBURN_EXTENT_ALIGN)) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_ERROR_MSG, "DATA SIZE INVALID");
+		return;
+	}
+
+	kburn_usb->extents = calloc(count, sizeof(struct kburn_extent));
+	if (NULL == kburn_usb->extents) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_ERROR_MSG, "NO MEMORY");
+		return;
+	}
+	kburn_usb->ext_count = count;
+	kburn_usb->ext_index = 0;
+	kburn_usb->ext_done = 0;
+	kburn_usb->ext_ready = false;
+
+	kburn_usb->offset = 0;
+	kburn_usb->dl_size = size;
+	kburn_usb->dl_bytes = 0;
+
+	kburn_usb->wr_bytes = 0;
+	kburn_usb->wr_start = get_timer(0);
+	kburn_usb->dl_cmd = KBURN_CMD_WRITE_EXTENTS;
+
+	printf("require write %u extents, stream 0x%llx bytes\n", count, size);
+
+	kburn_tx_string_result(KBURN_CMD_WRITE_EXTENTS, KBURN_RESULT_OK, "START DL");
+
+	req->complete = rx_write_lba_handler;
+	req->length = rx_bytes_expected(ep);
+}
+
+#if defined(CONFIG_KBURN_VERIFY)
+static void cb_verify_lba(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	void *read_buf;
+	ulong start;
+
+	u8 digest[32];
+	u32 digest_len = 0;
+	u64 offset, size;
+	int algo;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 17) {
+		kburn_tx_string_result(KBURN_CMD_VERIFY_LBA, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_VERIFY_LBA))
+		return;
+
+	offset = get_unaligned_le64(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[8]);
+	algo = cbw->data[16];
+
+	if ((0x00 == size) || ((offset + size) > kburn_usb->burner->medium_info.capacity)) {
+		kburn_tx_string_result(KBURN_CMD_VERIFY_LBA, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
+		return;
+	}
+
+	/* ring is idle, read back through the slot after the one this command landed in */
+	read_buf = kburn_usb->chunks[(kburn_usb->chunk_head + 1) % KBURN_USB_BUFFER_COUNT].buf;
+
+	start = get_timer(0);
+	if (0x00 != kburn_verify_medium(kburn_usb->burner, offset, size, algo, read_buf,
+					KBURN_USB_EP_BUFFER_SZIE, digest, &digest_len)) {
+		kburn_tx_string_result(KBURN_CMD_VERIFY_LBA, KBURN_RESULT_ERROR_MSG, "VERIFY ERROR");
+		return;
+	}
+	printf("verify 0x%llx bytes at 0x%llx, %lu ms\n", size, offset, get_timer(start));
+
+	kburn_tx_result(KBURN_CMD_VERIFY_LBA, KBURN_RESULT_OK, digest, digest_len);
+}
+#endif // CONFIG_KBURN_VERIFY
+
+#if defined(CONFIG_KBURN_DECOMP)
+static void cb_write_lba_comp(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	void *work;
+
+	u64 offset, size, raw_size;
+	u8 codec;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 25) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	offset = get_unaligned_le64(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[8]);
+	raw_size = get_unaligned_le64(&cbw->data[16]);
+	codec = cbw->data[24];
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_WRITE_LBA_COMP))
+		return;
+
+	if((0x00 == size) || (0x00 == raw_size)) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_ERROR_MSG, "DATA SIZE INVALID");
+		return;
+	}
+
+	if ((offset + raw_size) > kburn_usb->burner->medium_info.capacity) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
+		return;
+	}
+
+	/* comp_out first, the codec state and window behind it */
+	kburn_usb->comp_out = map_sysmem(CONFIG_KBURN_DECOMP_BUF_ADDR, CONFIG_KBURN_DECOMP_BUF_SIZE);
+	work = kburn_usb->comp_out + KBURN_COMP_OUT_SIZE;
+
+	if (0x00 != kburn_decomp_init(&kburn_usb->decomp, codec, work,
+				      CONFIG_KBURN_DECOMP_BUF_SIZE - KBURN_COMP_OUT_SIZE)) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_ERROR_MSG, "CODEC NOT SUPPORT");
+		return;
+	}
+
+	kburn_usb->comp = true;
+	kburn_usb->comp_fill = 0;
+	kburn_usb->raw_offset = offset;
+	kburn_usb->raw_size = raw_size;
+
+	kburn_usb->offset = 0;
+	kburn_usb->dl_size = size;
+	kburn_usb->dl_bytes = 0;
+
+	kburn_usb->wr_bytes = 0;
+	kburn_usb->wr_start = get_timer(0);
+	kburn_usb->dl_cmd = KBURN_CMD_WRITE_LBA_COMP;
+
+	printf("require write %llx bytes (codec %d, %llx compressed) to offset %llx\n",
+		raw_size, codec, size, offset);
+
+	kburn_tx_string_result(KBURN_CMD_WRITE_LBA_COMP, KBURN_RESULT_OK, "START DL");
+
+	req->complete = rx_write_lba_handler;
+	req->length = rx_bytes_expected(ep);
+}
+#endif // CONFIG_KBURN_DECOMP
+
+#if defined(CONFIG_KBURN_SPARSE)
+static lbaint_t kburn_sparse_write(struct sparse_storage *info, lbaint_t blk,
+				   lbaint_t blkcnt, const void *buffer)
+{
+	struct kburn *burner = info->priv;
+	u64 len = (u64)blkcnt * info->blksz;
+
+	if (0x00 != kburn_write_medium(burner, (u64)blk * info->blksz, buffer, &len))
+		return 0;
+
+	/* a short write is reported as such, write_sparse_image() fails on it */
+	return lldiv(len, info->blksz);
+}
+
+static lbaint_t kburn_sparse_reserve(struct sparse_storage *info, lbaint_t blk,
+				     lbaint_t blkcnt)
+{
+	return blkcnt;
+}
+
+static void kburn_sparse_mssg(const char *str, char *response)
+{
+	printf("sparse: %s\n", str);
+}
+
+static void kburn_write_sparse(struct kburn_usb_t *kburn_usb)
+{
+	struct kburn *burner = kburn_usb->burner;
+	struct sparse_storage info;
+	int result;
+
+	kburn_usb->sparse_pending = false;
+
+	info.blksz = burner->medium_info.blk_size;
+	info.start = lldiv(kburn_usb->offset, info.blksz);
+	info.size = lldiv(burner->medium_info.capacity, info.blksz) - info.start;
+	info.priv = burner;
+	info.write = kburn_sparse_write;
+	info.reserve = kburn_sparse_reserve;
+	info.mssg = kburn_sparse_mssg;
+
+	result = write_sparse_image(&info, "kburn", kburn_usb->sparse_buf, NULL);
+	kburn_usb->dl_size = 0;
+
+	if (0x00 == result)
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_OK, "WRITE DONE");
+	else
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "WRITE ERROR");
+}
+
+static void rx_write_sparse_handler(struct usb_ep *ep, struct usb_request *req)
+{
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	unsigned int transfer_size = kburn_usb->dl_size - kburn_usb->dl_bytes;
+
+	if (req->status != 0) {
+		printf("Bad status: %d\n", req->status);
+		s_kburn_stats.rx_errors++;
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "ERROR STATUS");
+		return;
+	}
+
+	if (req->actual < transfer_size)
+		transfer_size = req->actual;
+	kburn_usb->dl_bytes += transfer_size;
+	s_kburn_stats.rx_bytes += transfer_size;
+
+	if (kburn_usb->dl_bytes >= kburn_usb->dl_size) {
+		if (!is_sparse_image(kburn_usb->sparse_buf)) {
+			kburn_usb->dl_size = 0;
+			kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "NOT SPARSE IMAGE");
+		} else {
+			kburn_usb->sparse_pending = true;
+		}
+
+		req->complete = rx_command_handler;
+		kburn_rx_arm(kburn_usb);
+		return;
+	}
+
+	/* the whole image is staged in DDR, receive straight into place */
+	req->buf = kburn_usb->sparse_buf + kburn_usb->dl_bytes;
+	req->length = rx_bytes_expected(ep);
+	req->actual = 0;
+	usb_ep_queue(ep, req, 0);
+}
+
+static void cb_write_sparse(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+
+	u64 offset, size;
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size != 16) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	if (kburn_usb_busy(kburn_usb, KBURN_CMD_WRITE_SPARSE))
+		return;
+
+	offset = get_unaligned_le64(&cbw->data[0]);
+	size = get_unaligned_le64(&cbw->data[8]);
+
+	if (0x00 == size) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "DATA SIZE INVALID");
+		return;
+	}
+
+	/* the whole image is staged, refuse it before any payload is received */
+	if (ALIGN(size, ep->maxpacket) > CONFIG_KBURN_SPARSE_BUF_SIZE) {
+		printf("sparse image %llx bytes, the buffer is %x\n", size, CONFIG_KBURN_SPARSE_BUF_SIZE);
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "SPARSE IMAGE TOO LARGE");
+		return;
+	}
+
+	if (offset >= kburn_usb->burner->medium_info.capacity) {
+		kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_ERROR_MSG, "DATA SIZE EXCEED");
+		return;
+	}
+
+	kburn_usb->offset = offset;
+	kburn_usb->dl_size = size;
+	kburn_usb->dl_bytes = 0;
+	kburn_usb->sparse_buf = map_sysmem(CONFIG_KBURN_SPARSE_BUF_ADDR, CONFIG_KBURN_SPARSE_BUF_SIZE);
+
+	printf("require sparse %llx bytes to offset %llx\n", kburn_usb->dl_size, kburn_usb->offset);
+
+	kburn_tx_string_result(KBURN_CMD_WRITE_SPARSE, KBURN_RESULT_OK, "START DL");
+
+	req->complete = rx_write_sparse_handler;
+	req->buf = kburn_usb->sparse_buf;
+	req->length = rx_bytes_expected(ep);
+}
+#else
+static void kburn_write_sparse(struct kburn_usb_t *kburn_usb)
+{
+	kburn_usb->sparse_pending = false;
+}
+#endif // CONFIG_KBURN_SPARSE
+
+void kburn_usb_get_stats(struct kburn_usb_stats *stats)
+{
+	struct kburn *burner;
+
+	memcpy(stats, &s_kburn_stats, sizeof(*stats));
+
+	for (int i = 0; s_kburn && (i < KBURN_USB_DEV_MAX); i++) {
+		burner = s_kburn->devs[i].burner;
+		if (NULL == burner)
+			continue;
+
+		stats->wr_bytes += burner->stats.wr_bytes;
+		stats->write_us += burner->stats.write_us;
+		stats->erase_us += burner->stats.erase_us;
+		stats->wr_errors += burner->stats.errors;
+	}
+}
+
+void kburn_usb_print_stats(void)
+{
+	struct kburn_usb_stats st;
+	u64 kbps = 0;
+
+	kburn_usb_get_stats(&st);
+
+	if (st.write_us)
+		kbps = lldiv(st.wr_bytes * 1000000, st.write_us) / 1024;
+
+	printf("usb rx   : 0x%llx bytes, waited %llu ms, %u stalls, %u errors\n",
+		st.rx_bytes, lldiv(st.rx_wait_us, 1000), st.rx_stalls, st.rx_errors);
+	printf("medium   : 0x%llx bytes, write %llu ms (%llu.%02llu MB/s), erase %llu ms, %u errors\n",
+		st.wr_bytes, lldiv(st.write_us, 1000), kbps / 1024, ((kbps % 1024) * 100) / 1024,
+		lldiv(st.erase_us, 1000), st.wr_errors);
+	printf("chunks   : %u, latency min %u us, avg %llu us, max %u us\n",
+		st.chunks, st.chunk_min_us,
+		st.chunks ? lldiv(st.chunk_total_us, st.chunks) : 0, st.chunk_max_us);
+}
+
+/*
+ * Reply: rx bytes and written bytes (u64), then rx wait, write and erase
+ * time in ms, chunk count, chunk latency min/avg/max in us, stalls and
+ * errors (u32). Bit 0 of the optional request byte resets the counters.
+ */
+static void cb_get_stats(struct usb_ep *ep, struct usb_request *req)
+{
+	ALLOC_CACHE_ALIGN_BUFFER(struct kburn_usb_pkt, cbw, KBUNR_USB_PKT_SIZE);
+
+	struct kburn_usb_t *kburn_usb = get_kburn_usb();
+	struct kburn_usb_stats st;
+	uint8_t data[52];
+
+	memcpy((char *)cbw, req->buf, KBUNR_USB_PKT_SIZE);
+
+	if(cbw->data_size > 1) {
+		kburn_tx_string_result(KBURN_CMD_GET_STATS, KBURN_RESULT_ERROR_MSG, "ERROR DATA SIZE");
+		return;
+	}
+
+	kburn_usb_get_stats(&st);
+
+	put_unaligned_le64(st.rx_bytes, &data[0]);
+	put_unaligned_le64(st.wr_bytes, &data[8]);
+	put_unaligned_le32(lldiv(st.rx_wait_us, 1000), &data[16]);
+	put_unaligned_le32(lldiv(st.write_us, 1000), &data[20]);
+	put_unaligned_le32(lldiv(st.erase_us, 1000), &data[24]);
+	put_unaligned_le32(st.chunks, &data[28]);
+	put_unaligned_le32(st.chunk_min_us, &data[32]);
+	put_unaligned_le32(st.chunks ? lldiv(st.chunk_total_us, st.chunks) : 0, &data[36]);
+	put_unaligned_le32(st.chunk_max_us, &data[40]);
+	put_unaligned_le32(st.rx_stalls, &data[44]);
+	put_unaligned_le32(st.rx_errors + st.wr_errors, &data[48]);
+
+	if ((0x01 == cbw->data_size) && (cbw->data[0] & 0x01)) {
+		memset(&s_kburn_stats, 0, sizeof(s_kburn_stats));
+		for (int i = 0; i < KBURN_USB_DEV_MAX; i++) {
+			if (kburn_usb->devs[i].burner)
+				memset(&kburn_usb->devs[i].burner->stats, 0, sizeof(struct kburn_stats));
+		}
+	}
+
+	kburn_tx_result(KBURN_CMD_GET_STATS, KBURN_RESULT_OK, data, sizeof(data));
+}
+
+static void cb_not_support(struct usb_ep *ep, struct usb_request *req)
+{
+    kburn_tx_error_string("NOT SUPPORT FUNC");
 }
 
 static const struct kburn_pkt_handler_t pkt_handlers[] = {
@@ -748,6 +2001,14 @@ static const struct kburn_pkt_handler_t pkt_handlers[] = {
 		.cmd = KBURN_CMD_DEV_GET_INFO,
 		.cb = cb_get_device_info,
 	},
+	{
+		.cmd = KBURN_CMD_GET_STATS,
+		.cb = cb_get_stats,
+	},
+	{
+		.cmd = KBURN_CMD_DEV_SYNC,
+		.cb = cb_dev_sync,
+	},
 	{
 		.cmd = KBURN_CMD_WRITE_LBA,
 		.cb = cb_write_lba,
@@ -756,6 +2017,36 @@ static const struct kburn_pkt_handler_t pkt_handlers[] = {
 		.cmd = KBURN_CMD_ERASE_LBA,
 		.cb = cb_erase_lba,
 	},
+	{
+		.cmd = KBURN_CMD_SKIP_LBA,
+		.cb = cb_skip_lba,
+	},
+	{
+		.cmd = KBURN_CMD_FILL_LBA,
+		.cb = cb_fill_lba,
+	},
+#if defined(CONFIG_KBURN_SPARSE)
+	{
+		.cmd = KBURN_CMD_WRITE_SPARSE,
+		.cb = cb_write_sparse,
+	},
+#endif
+#if defined(CONFIG_KBURN_DECOMP)
+	{
+		.cmd = KBURN_CMD_WRITE_LBA_COMP,
+		.cb = cb_write_lba_comp,
+	},
+#endif
+	{
+		.cmd = KBURN_CMD_WRITE_EXTENTS,
+		.cb = cb_write_extents,
+	},
+#if defined(CONFIG_KBURN_VERIFY)
+	{
+		.cmd = KBURN_CMD_VERIFY_LBA,
+		.cb = cb_verify_lba,
+	},
+#endif
     {
         // end of table
         .cb = NULL,
@@ -27,6 +27,8 @@
 
 #include <linux/sizes.h>
 
+#define CONFIG_SYS_SDRAM_BASE 0x0
+
 #define CONFIG_SYS_INIT_RAM_ADDR 0x80300000
 #define CONFIG_SYS_INIT_RAM_SIZE 0x100000
 
@@ -10,7 +10,56 @@
 #define KBURN_USB_INTF_PROTOCOL     (0x00)
 
 #define KBURN_USB_EP_BUFFER_SZIE    (128 * 1024)
-#define KBURN_USB_BUFFER_SIZE       (KBURN_USB_EP_BUFFER_SZIE * 2)
+/*
+ * Bulk-OUT requests are received straight into the slots of one staging
+ * area, which the medium is then written from without any copy.
+ */
+#define KBURN_USB_BUFFER_COUNT      (3)
+#define KBURN_USB_BUFFER_SIZE       (KBURN_USB_EP_BUFFER_SZIE * KBURN_USB_BUFFER_COUNT)
+
+/* Medium writes on MMC are split into granules so USB keeps receiving. */
+#define KBURN_USB_WRITE_GRANULE     (32 * 1024)
+
+/*
+ * WRITE_EXTENTS streams a table block followed by every payload, each
+ * padded to KBURN_EXTENT_ALIGN so it starts aligned in the staging slots.
+ */
+#define KBURN_EXTENT_ALIGN          (4096)
+#define KBURN_EXTENTS_MAX           (KBURN_EXTENT_ALIGN / 16)
+
+/* Media which can be open at once, e.g. eMMC, SD card and SPI-NOR */
+#define KBURN_USB_DEV_MAX           (4)
+
+void kburn_usb_poll(void);
+
+/*
+ * Pipeline statistics of the current session, reset by DEV_PROBE and
+ * read back with KBURN_CMD_GET_STATS or "kburn stats".
+ */
+struct kburn_usb_stats {
+    u64 rx_bytes;       /* payload received on bulk-OUT */
+    u64 rx_wait_us;     /* a download was running with nothing staged */
+    u32 rx_stalls;      /* every slot was busy, bulk-OUT paused */
+    u32 rx_errors;      /* bulk-OUT requests completed with an error */
+
+    /* receive to written-out latency of one staging slot */
+    u32 chunks;
+    u32 chunk_min_us;
+    u32 chunk_max_us;
+    u64 chunk_total_us;
+
+    u64 wr_bytes;
+    u64 write_us;       /* inside write_medium, erases done inline included */
+    u64 erase_us;
+    u32 wr_errors;
+};
+
+void kburn_usb_get_stats(struct kburn_usb_stats *stats);
+
+void kburn_usb_print_stats(void);
+
+/* dump every command packet received, off by default */
+void kburn_usb_set_verbose(bool verbose);
 
 #endif
 
@@ -33,10 +82,30 @@ struct kburn_medium_info {
     u64 valid:1;
 };
 
+/* Erasing leaves the medium filled with 0xFF, erase doubles as fill */
+#define KBURN_FLAG_ERASED_FF        (1 << 0)
+/* A batched write erased its ranges up front, write_medium only programs */
+#define KBURN_FLAG_PRE_ERASED       (1 << 1)
+/* write_medium moves past bad blocks and erases each block it programs */
+#define KBURN_FLAG_SKIP_BAD         (1 << 2)
+
+/*
+ * Kept by the kburn_*_medium() wrappers. Backends erasing inline from
+ * write_medium add that time to erase_us themselves.
+ */
+struct kburn_stats {
+    u64 wr_bytes;
+    u64 write_us;
+    u64 erase_us;
+    u32 errors;
+};
+
 struct kburn {
     enum KBURN_MEDIA_TYPE type;
     struct kburn_medium_info medium_info;
     void *dev_priv;
+    u32 flags;
+    struct kburn_stats stats;
 
 	int (*get_medium_info)(struct kburn *burn);
 
@@ -61,8 +130,47 @@ int kburn_write_medium(struct kburn *burn, u64 offset, const void *buf, u64 *len
 
 int kburn_erase_medium(struct kburn *burn, u64 offset, u64 *len);
 
+int kburn_discard_medium(struct kburn *burn, u64 offset, u64 *len);
+
+int kburn_fill_medium(struct kburn *burn, u64 offset, u64 len, u32 pattern,
+            void *buf, u64 buf_size);
+
+#define KBURN_VERIFY_CRC32          (0x00)
+#define KBURN_VERIFY_SHA256         (0x01)
+
+int kburn_verify_medium(struct kburn *burn, u64 offset, u64 len, int algo,
+            void *buf, u64 buf_size, u8 *digest, u32 *digest_len);
+
 void kburn_destory(struct kburn *burn);
 
+enum KBURN_CODEC {
+    KBURN_CODEC_NONE = 0x00,
+    KBURN_CODEC_GZIP = 0x01,
+    KBURN_CODEC_LZ4 = 0x02,
+    KBURN_CODEC_ZSTD = 0x03,
+};
+
+struct kburn_decomp {
+    enum KBURN_CODEC codec;
+    void *priv;
+    u64 in_bytes;
+    u64 out_bytes;
+    bool finished;
+};
+
+/*
+ * kburn_decomp_run() consumes from @in as far as it can and produces at
+ * most @out_len bytes. Returns 1 once the stream ended and all output was
+ * handed out, 0 when it wants more input or output room, negative on error.
+ */
+int kburn_decomp_init(struct kburn_decomp *d, enum KBURN_CODEC codec,
+            void *work, size_t work_size);
+
+int kburn_decomp_run(struct kburn_decomp *d, void **in, size_t *in_len,
+            void *out, size_t *out_len);
+
+void kburn_decomp_end(struct kburn_decomp *d);
+
 #if defined (CONFIG_KBURN_MMC)
 struct kburn *kburn_mmc_probe(uint8_t index);
 #endif // CONFIG_KBURN_MMC
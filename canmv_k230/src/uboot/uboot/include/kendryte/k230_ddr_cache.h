@@ -0,0 +1,103 @@
+/* Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _K230_DDR_CACHE_H_
+#define _K230_DDR_CACHE_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+/*
+ * DDR PHY training results saved by an earlier boot. A record holds the
+ * trained PHY CSRs as address/value pairs behind a header; it is only
+ * restored for the board, data rate and, if known, temperature it was
+ * trained at.
+ */
+#define K230_DDR_CACHE_MAGIC 0x43524444 /* "DDRC" */
+#define K230_DDR_CACHE_VERSION 1
+
+/* no temperature sensor reading, the key does not check it */
+#define K230_DDR_TEMP_UNKNOWN INT_MIN
+
+struct k230_ddr_cache_key {
+  u32 board;
+  u32 rate; /* MT/s */
+  s32 temp; /* degrees Celsius */
+};
+
+struct k230_ddr_cache_hdr {
+  u32 magic;
+  u32 version;
+  struct k230_ddr_cache_key key;
+  u32 count;
+  u32 crc; /* of the pairs that follow */
+};
+
+struct k230_ddr_cache_csr {
+  u32 reg;
+  u32 val;
+};
+
+/* PHY CSR access, by CSR number */
+struct k230_ddr_cache_ops {
+  u32 (*read)(void *priv, u32 reg);
+  void (*write)(void *priv, u32 reg, u32 val);
+  void *priv;
+};
+
+static inline size_t k230_ddr_cache_size(u32 count) {
+  return sizeof(struct k230_ddr_cache_hdr) +
+         count * sizeof(struct k230_ddr_cache_csr);
+}
+
+/* read the @count CSRs in @regs into a record in @blob */
+int k230_ddr_cache_save(void *blob, size_t size,
+                        const struct k230_ddr_cache_key *key, const u32 *regs,
+                        u32 count, const struct k230_ddr_cache_ops *ops);
+
+/*
+ * Check a record against the key of this boot and the CSR list it must
+ * hold. A temperature more than @temp_delta away from the saved one is a
+ * mismatch.
+ * Return: 0 if it can be restored, -ENOENT for no record, -EBADMSG for a
+ * corrupt one, -ESTALE if trained for other conditions, -EINVAL if the
+ * CSR list differs.
+ */
+int k230_ddr_cache_check(const void *blob, size_t size,
+                         const struct k230_ddr_cache_key *key, const u32 *regs,
+                         u32 count, int temp_delta);
+
+/* write back a record k230_ddr_cache_check() accepted */
+void k230_ddr_cache_restore(const void *blob,
+                            const struct k230_ddr_cache_ops *ops);
+
+/*
+ * Quick test of DRAM at @base: the data lines, every word of the first
+ * @window bytes and the address lines of @size bytes, a power of two.
+ * The content of the window and of the probed words is lost.
+ * Return: 0 if it passed, -EIO otherwise
+ */
+int k230_ddr_cache_memtest(void *base, ulong window, ulong size);
+
+#endif /* _K230_DDR_CACHE_H_ */
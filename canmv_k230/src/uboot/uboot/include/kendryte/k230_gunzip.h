@@ -0,0 +1,87 @@
+/* Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _K230_GUNZIP_H_
+#define _K230_GUNZIP_H_
+
+#include <bootstage.h>
+#include <linux/types.h>
+
+/* accumulated engine time, next to the K230_BOOTSTAGE_* of board_common.h */
+#define K230_BOOTSTAGE_UNZIP (BOOTSTAGE_ID_USER + 15)
+
+/* Decode counters of the gzip engine and of the software inflate */
+struct k230_gunzip_stats {
+  u32 hw_runs;
+  u32 hw_errors;
+  u64 hw_in;
+  u64 hw_out;
+  u64 hw_us;
+
+  u32 sw_runs;
+  u64 sw_in;
+  u64 sw_out;
+  u64 sw_us;
+};
+
+/*
+ * Chunked mode: the read chain of the engine is built while the
+ * compressed stream is still being loaded, one line per call as soon as
+ * it is complete, so only the decode itself is left once the load ends.
+ */
+struct k230_gunzip_stream {
+  unsigned char *src;
+  ulong fed;
+  u32 nodes;
+  bool ok;
+};
+
+/* engine only, no fallback */
+int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
+                    unsigned long *lenp);
+
+/*
+ * Decode a K230 private gzip stream, its CM byte already set back to
+ * deflate. Falls back to the software inflate if the engine fails.
+ * @lenp: in the compressed length, out the decoded length.
+ */
+int k230_gunzip(void *dst, int dstlen, unsigned char *src, unsigned long *lenp);
+
+void k230_gunzip_stream_start(struct k230_gunzip_stream *gs, void *src);
+
+/* @avail bytes of the compressed stream are in memory now */
+void k230_gunzip_stream_feed(struct k230_gunzip_stream *gs, ulong avail);
+
+/* @lenp: in the compressed length, out the decoded length */
+int k230_gunzip_stream_finish(struct k230_gunzip_stream *gs, void *dst,
+                              int dstlen, unsigned long *lenp);
+
+/* account a software gzip decode done outside of this driver */
+void k230_gunzip_account_sw(ulong in, ulong out, ulong us);
+
+void k230_gunzip_get_stats(struct k230_gunzip_stats *stats);
+
+void k230_gunzip_print_stats(void);
+
+#endif /* _K230_GUNZIP_H_ */
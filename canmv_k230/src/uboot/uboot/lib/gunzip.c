@@ -11,8 +11,10 @@
 #include <div64.h>
 #include <gzip.h>
 #include <image.h>
+#include <kendryte/k230_gunzip.h>
 #include <malloc.h>
 #include <memalign.h>
+#include <time.h>
 #include <u-boot/crc.h>
 #include <watchdog.h>
 #include <u-boot/zlib.h>
@@ -74,26 +76,16 @@ int gzip_parse_header(const unsigned char *src, unsigned long len)
 
 int gunzip(void *dst, int dstlen, unsigned char *src, unsigned long *lenp)
 {
-#if defined (CONFIG_K230_GZIP)
-extern int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
-                    unsigned long *lenp);
-
+#if CONFIG_IS_ENABLED(K230_GZIP)
 	char *pcm = (char *)(src + 2);
-	unsigned int length = 0;
+	ulong start = timer_get_us();
+	ulong in = *lenp;
 	int ret = 0;
 
 	if (*pcm == 0x09) {
 		*pcm = 0x08;
 
-		length = le32_to_cpu(*(u32 *)(src + (*lenp) - 4));
-		if (length > dstlen) {
-			puts("Error: k230 private gunzip out of the dest length\n");
-			return -4;
-		}
-		ret = k230_priv_unzip(dst, length, src, lenp);
-		*lenp = length;
-
-		return ret;
+		return k230_gunzip(dst, dstlen, src, lenp);
 	}
 #endif
 
@@ -102,7 +94,15 @@ extern int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
 	if (offset < 0)
 		return offset;
 
+#if CONFIG_IS_ENABLED(K230_GZIP)
+	ret = zunzip(dst, dstlen, src, lenp, 1, offset);
+	if (0 == ret)
+		k230_gunzip_account_sw(in, *lenp, timer_get_us() - start);
+
+	return ret;
+#else
 	return zunzip(dst, dstlen, src, lenp, 1, offset);
+#endif
 }
 
 #ifdef CONFIG_CMD_UNZIP
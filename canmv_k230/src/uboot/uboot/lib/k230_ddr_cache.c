@@ -0,0 +1,172 @@
+/* Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <common.h>
+#include <cpu_func.h>
+#include <errno.h>
+#include <kendryte/k230_ddr_cache.h>
+#include <u-boot/crc.h>
+
+int k230_ddr_cache_save(void *blob, size_t size,
+                        const struct k230_ddr_cache_key *key, const u32 *regs,
+                        u32 count, const struct k230_ddr_cache_ops *ops) {
+  struct k230_ddr_cache_hdr *hdr = blob;
+  struct k230_ddr_cache_csr *csr = (struct k230_ddr_cache_csr *)(hdr + 1);
+  u32 i;
+
+  if (size < k230_ddr_cache_size(count))
+    return -E2BIG;
+
+  for (i = 0; i < count; i++) {
+    csr[i].reg = regs[i];
+    csr[i].val = ops->read(ops->priv, regs[i]);
+  }
+
+  hdr->magic = K230_DDR_CACHE_MAGIC;
+  hdr->version = K230_DDR_CACHE_VERSION;
+  hdr->key = *key;
+  hdr->count = count;
+  hdr->crc = crc32(0, (const uchar *)csr, count * sizeof(*csr));
+
+  return 0;
+}
+
+int k230_ddr_cache_check(const void *blob, size_t size,
+                         const struct k230_ddr_cache_key *key, const u32 *regs,
+                         u32 count, int temp_delta) {
+  const struct k230_ddr_cache_hdr *hdr = blob;
+  const struct k230_ddr_cache_csr *csr =
+      (const struct k230_ddr_cache_csr *)(hdr + 1);
+  u32 i;
+
+  if (size < sizeof(*hdr) || hdr->magic != K230_DDR_CACHE_MAGIC)
+    return -ENOENT;
+
+  if (hdr->version != K230_DDR_CACHE_VERSION || hdr->count != count ||
+      size < k230_ddr_cache_size(count))
+    return -EINVAL;
+
+  if (hdr->crc != crc32(0, (const uchar *)csr, count * sizeof(*csr)))
+    return -EBADMSG;
+
+  if (hdr->key.board != key->board || hdr->key.rate != key->rate)
+    return -ESTALE;
+
+  /* a record without a temperature only fits a boot without one */
+  if ((hdr->key.temp == K230_DDR_TEMP_UNKNOWN) !=
+      (key->temp == K230_DDR_TEMP_UNKNOWN))
+    return -ESTALE;
+  if (key->temp != K230_DDR_TEMP_UNKNOWN &&
+      abs(hdr->key.temp - key->temp) > temp_delta)
+    return -ESTALE;
+
+  for (i = 0; i < count; i++) {
+    if (csr[i].reg != regs[i])
+      return -EINVAL;
+  }
+
+  return 0;
+}
+
+void k230_ddr_cache_restore(const void *blob,
+                            const struct k230_ddr_cache_ops *ops) {
+  const struct k230_ddr_cache_hdr *hdr = blob;
+  const struct k230_ddr_cache_csr *csr =
+      (const struct k230_ddr_cache_csr *)(hdr + 1);
+  u32 i;
+
+  for (i = 0; i < hdr->count; i++)
+    ops->write(ops->priv, csr[i].reg, csr[i].val);
+}
+
+/* write back and drop the line of @p, so the next read comes from DRAM */
+static void k230_ddr_cache_memtest_sync(volatile ulong *p) {
+  flush_dcache_range((ulong)p, (ulong)(p + 1));
+  invalidate_dcache_range((ulong)p, (ulong)(p + 1));
+}
+
+int k230_ddr_cache_memtest(void *base, ulong window, ulong size) {
+  volatile ulong *p = base;
+  ulong n = size / sizeof(ulong);
+  ulong w = window / sizeof(ulong);
+  ulong pattern = (ulong)0xaaaaaaaaaaaaaaaaULL;
+  ulong anti = ~pattern;
+  ulong off, test;
+
+  /* data lines: walking one, read back from DRAM rather than the cache */
+  for (test = 1; test; test <<= 1) {
+    p[0] = test;
+    p[1] = ~test;
+    flush_dcache_range((ulong)p, (ulong)(p + 2));
+    invalidate_dcache_range((ulong)p, (ulong)(p + 2));
+    if (p[0] != test || p[1] != ~test)
+      return -EIO;
+  }
+
+  /* the window: every word holds its own offset, then its complement */
+  for (test = 0; test < 2; test++) {
+    for (off = 0; off < w; off++)
+      p[off] = test ? ~off : off;
+    flush_dcache_range((ulong)p, (ulong)(p + w));
+    invalidate_dcache_range((ulong)p, (ulong)(p + w));
+    for (off = 0; off < w; off++) {
+      if (p[off] != (test ? ~off : off))
+        return -EIO;
+    }
+  }
+
+  /*
+   * address lines over the whole size: every power of two offset must
+   * hold its own value. Only the probed lines go through the cache
+   * maintenance, so this costs the same for any DRAM size.
+   */
+  for (off = 1; off < n; off <<= 1) {
+    p[off] = pattern;
+    k230_ddr_cache_memtest_sync(&p[off]);
+  }
+  p[0] = anti;
+  k230_ddr_cache_memtest_sync(&p[0]);
+  for (off = 1; off < n; off <<= 1) {
+    if (p[off] != pattern)
+      return -EIO;
+  }
+  p[0] = pattern;
+  k230_ddr_cache_memtest_sync(&p[0]);
+
+  for (test = 1; test < n; test <<= 1) {
+    p[test] = anti;
+    k230_ddr_cache_memtest_sync(&p[test]);
+    if (p[0] != pattern)
+      return -EIO;
+    for (off = 1; off < n; off <<= 1) {
+      k230_ddr_cache_memtest_sync(&p[off]);
+      if (off != test && p[off] != pattern)
+        return -EIO;
+    }
+    p[test] = pattern;
+    k230_ddr_cache_memtest_sync(&p[test]);
+  }
+
+  return 0;
+}
@@ -26,9 +26,13 @@
 #include <command.h>
 #include <common.h>
 #include <cpu_func.h>
+#include <gzip.h>
+#include <kendryte/k230_gunzip.h>
 #include <linux/delay.h>
 #include <malloc.h>
+#include <memalign.h>
 #include <stdio.h>
+#include <time.h>
 
 #define ZIP_LINE_SIZE (128 * 1024)
 #define ZIP_RD_CH DMA_CH_0
@@ -41,6 +45,10 @@
 #define SDMA_CH_CFG (0x80800050ULL)
 #define SDMA_CH_LENGTH 0x30
 
+#define ZIP_TIMEOUT_TICKS 80000000
+/* LLT nodes kept per channel, enough for 32MB, grown on demand */
+#define ZIP_LLT_POOL_NODES 256
+
 typedef struct sdma_llt {
   uint32_t reserved_0 : 28;
   uint32_t dimension : 1;
@@ -106,29 +114,47 @@ typedef struct gsdma_ctrl {
   uint32_t dma_weight;
 } gsdma_ctrl_t;
 
-sdma_llt_t *g_llt_list_w = NULL;
-sdma_llt_t *g_llt_list_r = NULL;
-static uint32_t *ugzip_llt_cal(uint8_t *addr, uint32_t length,
-                               ugzip_rw_e mode) {
-  int i;
-  uint32_t list_num;
-  sdma_llt_t *llt_list;
+struct ugzip_llt_pool {
+  sdma_llt_t *llt;
+  uint32_t num;
+};
 
-  list_num = (length - 1) / ZIP_LINE_SIZE + 1;
-  llt_list = (sdma_llt_t *)malloc(sizeof(sdma_llt_t) * list_num);
-  if (NULL == llt_list) {
-    printf("malloc error =\n");
-    return NULL;
-  }
+/*
+ * The chains used to be malloc'ed and freed on every call. They are kept
+ * instead, one pool per channel, and only grow if an image needs more.
+ */
+static struct ugzip_llt_pool g_llt_pool[2];
 
-  if (mode == UGZIP_RD) {
-    g_llt_list_r = llt_list;
-  } else {
-    g_llt_list_w = llt_list;
+static struct k230_gunzip_stats g_unzip_stats;
+
+static sdma_llt_t *ugzip_llt_get(ugzip_rw_e mode, uint32_t list_num) {
+  struct ugzip_llt_pool *pool = &g_llt_pool[mode];
+
+  if (list_num < ZIP_LLT_POOL_NODES)
+    list_num = ZIP_LLT_POOL_NODES;
+
+  if (pool->num < list_num) {
+    free(pool->llt);
+    pool->llt = memalign(ARCH_DMA_MINALIGN,
+                         ALIGN(sizeof(sdma_llt_t) * list_num,
+                               ARCH_DMA_MINALIGN));
+    if (NULL == pool->llt) {
+      printf("malloc error =\n");
+      pool->num = 0;
+      return NULL;
+    }
+    pool->num = list_num;
   }
 
-  memset(llt_list, 0, sizeof(sdma_llt_t) * list_num);
-  for (i = 0; i < list_num; i++) {
+  return pool->llt;
+}
+
+static void ugzip_llt_fill(sdma_llt_t *llt_list, uint32_t first,
+                           uint32_t list_num, uint8_t *addr, ugzip_rw_e mode) {
+  int i;
+
+  memset(&llt_list[first], 0, sizeof(sdma_llt_t) * (list_num - first));
+  for (i = first; i < list_num; i++) {
     llt_list[i].dimension = DIMENSION1;
     llt_list[i].pause = 0;
     llt_list[i].node_intr = 0;
@@ -141,23 +167,40 @@ static uint32_t *ugzip_llt_cal(uint8_t *addr, uint32_t length,
       llt_list[i].dst_addr = ((uint32_t)(uint64_t)addr + ZIP_LINE_SIZE * i);
     }
 
-    if (i == list_num - 1) {
-      llt_list[i].line_size = ZIP_LINE_SIZE;
-      llt_list[i].next_llt_addr = 0;
-    } else {
-      llt_list[i].line_size = ZIP_LINE_SIZE;
-      llt_list[i].next_llt_addr = (uint32_t)(uint64_t)(&llt_list[i + 1]);
-    }
+    /* linked to the next one, the tail is terminated by the caller */
+    llt_list[i].line_size = ZIP_LINE_SIZE;
+    llt_list[i].next_llt_addr = (uint32_t)(uint64_t)(&llt_list[i + 1]);
   }
 
-  flush_dcache_range((uint64_t)llt_list,
-                     (uint64_t)llt_list + sizeof(sdma_llt_t) * list_num);
+  flush_dcache_range((uint64_t)&llt_list[first],
+                     (uint64_t)&llt_list[list_num]);
+}
+
+static void ugzip_llt_terminate(sdma_llt_t *llt_list, uint32_t list_num) {
+  llt_list[list_num - 1].next_llt_addr = 0;
+
+  flush_dcache_range((uint64_t)&llt_list[list_num - 1],
+                     (uint64_t)&llt_list[list_num]);
+}
+
+static uint32_t *ugzip_llt_cal(uint8_t *addr, uint32_t length,
+                               ugzip_rw_e mode) {
+  uint32_t list_num;
+  sdma_llt_t *llt_list;
+
+  list_num = (length - 1) / ZIP_LINE_SIZE + 1;
+  llt_list = ugzip_llt_get(mode, list_num);
+  if (NULL == llt_list) {
+    return NULL;
+  }
+
+  ugzip_llt_fill(llt_list, 0, list_num, addr, mode);
+  ugzip_llt_terminate(llt_list, list_num);
 
   return (uint32_t *)llt_list;
 }
 
-static int ugzip_sdma_cfg(uint8_t ch, ugzip_rw_e mode, uint8_t *addr,
-                          uint32_t length) {
+static int ugzip_sdma_cfg(uint8_t ch, uint32_t *llt_list) {
   uint32_t unzip_list_add = 0;
   struct sdma_ch_cfg *ch_cfg = (struct sdma_ch_cfg *)SDMA_CH_CFG;
   struct gsdma_ctrl *gsct = (struct gsdma_ctrl *)GSDMA_CTRL_ADDR;
@@ -180,7 +223,7 @@ static int ugzip_sdma_cfg(uint8_t ch, ugzip_rw_e mode, uint8_t *addr,
            (volatile void *)((uint64_t)&ch_cfg->ch_cfg + ch * SDMA_CH_LENGTH));
   }
 
-  unzip_list_add = (uint32_t)(uint64_t)ugzip_llt_cal(addr, length, mode);
+  unzip_list_add = (uint32_t)(uint64_t)llt_list;
 
   writel(unzip_list_add, (volatile void *)((uint64_t)&ch_cfg->ch_llt_saddr +
                                            ch * SDMA_CH_LENGTH));
@@ -191,24 +234,35 @@ static int ugzip_sdma_cfg(uint8_t ch, ugzip_rw_e mode, uint8_t *addr,
   return 0;
 }
 
-int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
-                    unsigned long *lenp) {
+/* src must be written back already and the read chain set up */
+static int ugzip_run(void *dst, int dstlen, uint32_t *rd_llt,
+                     unsigned long srclen) {
   struct ugzip_reg *pUgzipReg = (struct ugzip_reg *)UGZIP_BASE_ADDR;
   struct sdma_ch_cfg *ch_cfg = (struct sdma_ch_cfg *)SDMA_CH_CFG;
   struct gsdma_ctrl *gsct = (struct gsdma_ctrl *)GSDMA_CTRL_ADDR;
 
   int ret = 3;
   uint64_t stime = get_ticks();
-  uint64_t etime = stime + 80000000;
+  uint64_t etime = stime + ZIP_TIMEOUT_TICKS;
   uint32_t int_stat, decomp_intstat;
   volatile uint32_t *p_rest_reg = NULL;
+  uint32_t *wr_llt;
+
+  wr_llt = ugzip_llt_cal(dst, dstlen, UGZIP_WR);
+  if ((NULL == rd_llt) || (NULL == wr_llt)) {
+    return 4;
+  }
+
+  bootstage_start(K230_BOOTSTAGE_UNZIP, "k230_unzip");
+
+  /* no dirty line of dst may be written back over the engine output */
+  flush_dcache_range((uint64_t)dst, (uint64_t)dst + dstlen);
 
-  flush_dcache_range((uint64_t)src, (uint64_t)src + (uint64_t)*lenp);
   writel(0x80000000, (volatile void *)&pUgzipReg->gzip_src_size);
-  ugzip_sdma_cfg(ZIP_RD_CH, UGZIP_RD, src, *lenp);
-  ugzip_sdma_cfg(ZIP_WR_CH, UGZIP_WR, dst, dstlen);
+  ugzip_sdma_cfg(ZIP_RD_CH, rd_llt);
+  ugzip_sdma_cfg(ZIP_WR_CH, wr_llt);
   writel(0x51f, (volatile void *)0x91302310ULL);
-  writel(*lenp | (0x1 << 31), (volatile void *)&pUgzipReg->gzip_src_size);
+  writel(srclen | (0x1 << 31), (volatile void *)&pUgzipReg->gzip_src_size);
   writel(dstlen, (volatile void *)&pUgzipReg->dma_out_size);
   writel(0x3, (volatile void *)&pUgzipReg->decomp_start);
 
@@ -240,14 +294,6 @@ int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
       break;
     }
   } while (1);
-  if (g_llt_list_r) {
-    free(g_llt_list_r);
-    g_llt_list_r = NULL;
-  }
-  if (g_llt_list_w) {
-    free(g_llt_list_w);
-    g_llt_list_w = NULL;
-  }
   invalidate_dcache_range((uint64_t)dst, (uint64_t)dst + dstlen);
   etime = get_ticks();
   if (ret) {
@@ -265,5 +311,152 @@ int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
   writel(0, (volatile void *)&pUgzipReg->gzip_src_size);
   writel(0, (volatile void *)((uint64_t)&ch_cfg->ch_cfg));
 
+  bootstage_accum(K230_BOOTSTAGE_UNZIP);
+
   return ret;
 }
+
+int k230_priv_unzip(void *dst, int dstlen, unsigned char *src,
+                    unsigned long *lenp) {
+  flush_dcache_range((uint64_t)src, (uint64_t)src + (uint64_t)*lenp);
+
+  return ugzip_run(dst, dstlen, ugzip_llt_cal(src, *lenp, UGZIP_RD), *lenp);
+}
+
+void k230_gunzip_account_sw(ulong in, ulong out, ulong us) {
+  g_unzip_stats.sw_runs++;
+  g_unzip_stats.sw_in += in;
+  g_unzip_stats.sw_out += out;
+  g_unzip_stats.sw_us += us;
+}
+
+static int k230_gunzip_sw(void *dst, int dstlen, unsigned char *src,
+                          unsigned long *lenp) {
+  ulong start = timer_get_us();
+  ulong in = *lenp;
+  int offset, ret;
+
+  offset = gzip_parse_header(src, *lenp);
+  if (offset < 0)
+    return offset;
+
+  ret = zunzip(dst, dstlen, src, lenp, 1, offset);
+  if (0 == ret)
+    k230_gunzip_account_sw(in, *lenp, timer_get_us() - start);
+
+  return ret;
+}
+
+/* the engine result for a stream of @in bytes, fall back on failure */
+static int k230_gunzip_done(int ret, ulong start, void *dst, int dstlen,
+                            unsigned char *src, unsigned long *lenp) {
+  ulong length = le32_to_cpu(*(u32 *)(src + (*lenp) - 4));
+
+  g_unzip_stats.hw_runs++;
+  if (0 == ret) {
+    g_unzip_stats.hw_in += *lenp;
+    g_unzip_stats.hw_out += length;
+    g_unzip_stats.hw_us += timer_get_us() - start;
+    *lenp = length;
+    return 0;
+  }
+
+  g_unzip_stats.hw_errors++;
+  printf("k230 unzip failed %d, retry in software\n", ret);
+
+  return k230_gunzip_sw(dst, dstlen, src, lenp);
+}
+
+int k230_gunzip(void *dst, int dstlen, unsigned char *src,
+                unsigned long *lenp) {
+  ulong start = timer_get_us();
+  unsigned int length;
+
+  length = le32_to_cpu(*(u32 *)(src + (*lenp) - 4));
+  if (length > dstlen) {
+    puts("Error: k230 private gunzip out of the dest length\n");
+    return -4;
+  }
+
+  return k230_gunzip_done(k230_priv_unzip(dst, length, src, lenp), start, dst,
+                          dstlen, src, lenp);
+}
+
+void k230_gunzip_stream_start(struct k230_gunzip_stream *gs, void *src) {
+  gs->src = src;
+  gs->fed = 0;
+  gs->nodes = 0;
+  gs->ok = (NULL != ugzip_llt_get(UGZIP_RD, ZIP_LLT_POOL_NODES));
+}
+
+void k230_gunzip_stream_feed(struct k230_gunzip_stream *gs, ulong avail) {
+  struct ugzip_llt_pool *pool = &g_llt_pool[UGZIP_RD];
+  uint32_t lines = avail / ZIP_LINE_SIZE;
+
+  if (!gs->ok || (lines <= gs->nodes))
+    return;
+
+  /* a bigger pool would lose the nodes built so far, build at the end */
+  if (lines > pool->num) {
+    gs->ok = false;
+    return;
+  }
+
+  flush_dcache_range((uint64_t)gs->src + gs->nodes * ZIP_LINE_SIZE,
+                     (uint64_t)gs->src + lines * ZIP_LINE_SIZE);
+  ugzip_llt_fill(pool->llt, gs->nodes, lines, gs->src, UGZIP_RD);
+  gs->nodes = lines;
+  gs->fed = lines * ZIP_LINE_SIZE;
+}
+
+int k230_gunzip_stream_finish(struct k230_gunzip_stream *gs, void *dst,
+                              int dstlen, unsigned long *lenp) {
+  struct ugzip_llt_pool *pool = &g_llt_pool[UGZIP_RD];
+  ulong start = timer_get_us();
+  uint32_t list_num = (*lenp - 1) / ZIP_LINE_SIZE + 1;
+  unsigned int length;
+
+  gs->src[2] = 0x08;
+
+  length = le32_to_cpu(*(u32 *)(gs->src + (*lenp) - 4));
+  if (length > dstlen) {
+    puts("Error: k230 private gunzip out of the dest length\n");
+    return -4;
+  }
+
+  if (!gs->ok || (list_num > pool->num))
+    return k230_gunzip(dst, dstlen, gs->src, lenp);
+
+  /* the CM byte changed, and the tail was not fed as a full line */
+  flush_dcache_range((uint64_t)gs->src, (uint64_t)gs->src + 1);
+  flush_dcache_range((uint64_t)gs->src + gs->fed, (uint64_t)gs->src + *lenp);
+  if (list_num > gs->nodes)
+    ugzip_llt_fill(pool->llt, gs->nodes, list_num, gs->src, UGZIP_RD);
+  ugzip_llt_terminate(pool->llt, list_num);
+
+  return k230_gunzip_done(
+      ugzip_run(dst, length, (uint32_t *)pool->llt, *lenp), start, dst,
+      dstlen, gs->src, lenp);
+}
+
+void k230_gunzip_get_stats(struct k230_gunzip_stats *stats) {
+  *stats = g_unzip_stats;
+}
+
+static void k230_gunzip_print_line(const char *name, u32 runs, u64 in, u64 out,
+                                   u64 us) {
+  printf("%s: %u runs, %llu -> %llu bytes in %llu us", name, runs, in, out,
+         us);
+  if (us)
+    printf(", %llu KB/s out", out * 1000000 / 1024 / us);
+  printf("\n");
+}
+
+void k230_gunzip_print_stats(void) {
+  struct k230_gunzip_stats *st = &g_unzip_stats;
+
+  k230_gunzip_print_line("hw", st->hw_runs, st->hw_in, st->hw_out, st->hw_us);
+  if (st->hw_errors)
+    printf("hw: %u failed, decoded in software\n", st->hw_errors);
+  k230_gunzip_print_line("sw", st->sw_runs, st->sw_in, st->sw_out, st->sw_us);
+}
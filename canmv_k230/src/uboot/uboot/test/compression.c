@@ -8,9 +8,11 @@
 #include <command.h>
 #include <gzip.h>
 #include <image.h>
+#include <kburn.h>
 #include <log.h>
 #include <malloc.h>
 #include <mapmem.h>
+#include <time.h>
 #include <asm/io.h>
 
 #include <u-boot/lz4.h>
@@ -440,6 +442,167 @@ static int compression_test_lz4(struct unit_test_state *uts)
 }
 COMPRESSION_TEST(compression_test_lz4, 0);
 
+#if IS_ENABLED(CONFIG_KBURN_DECOMP)
+/* zstd -19 -c /tmp/plain.txt > /tmp/plain.zst */
+static const char zstd_compressed[] =
+	"\x28\xb5\x2f\xfd\x64\x5e\x00\xad\x05\x00\x42\x4e\x26\x17\x90\x3b"
+	"\x07\x04\x5a\x13\x8b\xa7\x65\x34\x12\x21\x6d\xb0\x39\xbb\xae\xe8"
+	"\xba\xc9\xcd\x5e\x02\x49\xd0\x2b\xa9\xfa\x96\x92\xe7\x1f\x19\x19"
+	"\x7c\x8f\xf1\x9d\x54\x37\xfc\xd6\x0a\xf3\x0c\x93\x56\xc7\x52\x4f"
+	"\x0a\x62\x3e\xd1\xa5\x83\x17\x31\xab\x5d\x8f\x57\xf3\xcc\x3b\x58"
+	"\xf8\x91\x8c\xf1\x2a\x5c\x89\xdd\xf2\x9b\x15\xb7\x92\x5b\xbe\xba"
+	"\xab\xd5\xd1\x34\xdf\xf0\x02\x0e\x61\xcd\x7b\xd6\x01\xfc\xc2\xa7"
+	"\xd4\xd1\x3d\x26\x9c\x10\x49\xb8\x5b\xcd\xba\x7c\xf7\xac\x4b\xad"
+	"\xb7\x31\x1c\xbc\xf9\xcb\x62\x8e\x2e\x9b\x0f\xd3\x87\x57\x45\x12"
+	"\x16\xfa\x3a\x79\xde\x65\xf8\xcc\x48\xd5\x43\xa6\xbd\xc3\x91\x29"
+	"\x65\x29\xa7\x5b\x9a\x08\x08\x00\x60\x13\x00\x63\xa3\x8e\x28\x94"
+	"\x79\x41\x2a\x78\xc2\x91\x70\x9f\xaa\x6a\x21\x7a\xa1\xaa\x0c\xe4"
+	"\xf4\x6e\xfa";
+static const unsigned long zstd_compressed_size = 195;
+
+#define KBURN_DECOMP_WORK_SIZE	(9 << 20)
+#define KBURN_DECOMP_SPEED_SIZE	(4 << 20)
+
+/*
+ * Stand in for the host and f_kburn: hand @in to the streaming decompressor
+ * @piece bytes at a time, draining at most @out_piece bytes per call the
+ * way kburn_usb_poll() drains into medium writes.
+ */
+static int kburn_decomp_chunked(struct unit_test_state *uts,
+				enum KBURN_CODEC codec, void *in,
+				ulong in_size, ulong piece, ulong out_piece,
+				void *out, ulong out_max, ulong *out_size)
+{
+	struct kburn_decomp d;
+	ulong done = 0, produced = 0;
+	void *work;
+	int ret = 0;
+
+	work = malloc(KBURN_DECOMP_WORK_SIZE);
+	ut_assertnonnull(work);
+	ut_assertok(kburn_decomp_init(&d, codec, work, KBURN_DECOMP_WORK_SIZE));
+
+	while (!ret) {
+		size_t left = min(piece, in_size - done);
+		size_t len = left;
+		size_t out_len;
+		void *pos = in + done;
+
+		do {
+			size_t before = left;
+
+			out_len = min(out_piece, out_max - produced);
+			ret = kburn_decomp_run(&d, &pos, &left,
+					       out + produced, &out_len);
+			if (ret < 0)
+				break;
+			produced += out_len;
+
+			if (!ret && !out_len && left && left == before) {
+				ret = -ENOSPC;
+				break;
+			}
+		} while (!ret && (left || out_len == out_piece));
+
+		done += len - left;
+		if (!ret && done >= in_size)
+			ret = -EPIPE;
+	}
+
+	kburn_decomp_end(&d);
+	free(work);
+
+	*out_size = produced;
+	return ret < 0 ? ret : 0;
+}
+
+static int kburn_decomp_check(struct unit_test_state *uts, const char *name,
+			      enum KBURN_CODEC codec, const void *comp,
+			      ulong comp_size)
+{
+	static const ulong pieces[] = { 1, 7, 64 };
+	char out[TEST_BUFFER_SIZE];
+	void *in;
+	ulong size;
+	int i;
+
+	/* gzip streams get their CM byte patched, work on a copy */
+	in = malloc(comp_size);
+	ut_assertnonnull(in);
+
+	for (i = 0; i < ARRAY_SIZE(pieces); i++) {
+		printf(" testing kburn %s, %lu byte pieces ...\n", name,
+		       pieces[i]);
+		memcpy(in, comp, comp_size);
+		memset(out, 'A', sizeof(out));
+		ut_assertok(kburn_decomp_chunked(uts, codec, in, comp_size,
+						 pieces[i], 16, out,
+						 sizeof(out), &size));
+		ut_asserteq(strlen(plain), size);
+		ut_asserteq_mem(plain, out, size);
+		ut_asserteq('A', out[size]);
+	}
+	free(in);
+
+	return 0;
+}
+
+static int compression_test_kburn_decomp(struct unit_test_state *uts)
+{
+	char gz[TEST_BUFFER_SIZE];
+	unsigned long gz_size = sizeof(gz);
+
+	ut_assertok(gzip(gz, &gz_size, (void *)plain, strlen(plain)));
+	ut_assertok(kburn_decomp_check(uts, "gzip", KBURN_CODEC_GZIP, gz,
+				       gz_size));
+	ut_assertok(kburn_decomp_check(uts, "lz4", KBURN_CODEC_LZ4,
+				       lz4_compressed, lz4_compressed_size));
+	ut_assertok(kburn_decomp_check(uts, "zstd", KBURN_CODEC_ZSTD,
+				       zstd_compressed, zstd_compressed_size));
+
+	return 0;
+}
+COMPRESSION_TEST(compression_test_kburn_decomp, 0);
+
+/* Decompress a few MiB in USB sized pieces and report the rate */
+static int compression_test_kburn_decomp_speed(struct unit_test_state *uts)
+{
+	unsigned long comp_size = KBURN_DECOMP_SPEED_SIZE;
+	char *orig, *comp, *out;
+	ulong size, us, i;
+
+	orig = malloc(KBURN_DECOMP_SPEED_SIZE);
+	comp = malloc(KBURN_DECOMP_SPEED_SIZE);
+	out = malloc(KBURN_DECOMP_SPEED_SIZE);
+	ut_assertnonnull(orig);
+	ut_assertnonnull(comp);
+	ut_assertnonnull(out);
+
+	/* text with some variation so the ratio is not absurd */
+	for (i = 0; i < KBURN_DECOMP_SPEED_SIZE; i++)
+		orig[i] = plain[(i + i / 4093) % strlen(plain)] ^ ((i >> 12) & 1);
+	ut_assertok(gzip(comp, &comp_size, orig, KBURN_DECOMP_SPEED_SIZE));
+
+	us = timer_get_us();
+	ut_assertok(kburn_decomp_chunked(uts, KBURN_CODEC_GZIP, comp, comp_size,
+					 128 << 10, 128 << 10, out,
+					 KBURN_DECOMP_SPEED_SIZE, &size));
+	us = max(timer_get_us() - us, 1UL);
+
+	ut_asserteq(KBURN_DECOMP_SPEED_SIZE, size);
+	ut_asserteq_mem(orig, out, size);
+	printf("\tkburn gzip %lu -> %lu bytes, %lu us, %lu KiB/s\n",
+	       comp_size, size, us, (ulong)((u64)size * 1000000 / us / 1024));
+
+	free(out);
+	free(comp);
+	free(orig);
+
+	return 0;
+}
+COMPRESSION_TEST(compression_test_kburn_decomp_speed, 0);
+#endif
+
 static int compress_using_none(struct unit_test_state *uts,
 			       void *in, unsigned long in_size,
 			       void *out, unsigned long out_max,
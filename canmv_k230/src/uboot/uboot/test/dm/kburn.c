@@ -0,0 +1,691 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Tests for the KBURN USB function, driven through a fake UDC which also
+ * plays the host side of the bulk pipes
+ */
+
+#include <common.h>
+#include <dm.h>
+#include <g_dnl.h>
+#include <kburn.h>
+#include <malloc.h>
+#include <mtd.h>
+#include <asm/unaligned.h>
+#include <dm/device-internal.h>
+#include <dm/root.h>
+#include <dm/test.h>
+#include <linux/usb/composite.h>
+#include <linux/usb/gadget.h>
+#include <test/test.h>
+#include <test/ut.h>
+
+/* wire format of the host tool, see struct kburn_usb_pkt */
+#define TEST_PKT_SIZE		64
+#define TEST_PKT_DATA		5
+
+#define TEST_CMD_DEV_PROBE	0x10
+#define TEST_CMD_DEV_GET_INFO	0x11
+#define TEST_CMD_DEV_SYNC	0x13
+#define TEST_CMD_WRITE_LBA	0x20
+#define TEST_CMD_ERASE_LBA	0x21
+#define TEST_CMD_WRITE_EXTENTS	0x27
+#define TEST_RESULT_OK		1
+
+/* more polls than any transfer here needs, a hang fails instead */
+#define TEST_POLL_MAX		1000
+
+/*
+ * A request queued by the function stays parked on its endpoint until the
+ * test completes it, the way the controller would at the end of a bulk
+ * transfer.
+ */
+struct kburn_test_ep {
+	struct usb_ep ep;
+	struct usb_request *queued;
+	/* IN responses replaced before the host collected them */
+	int lost;
+};
+
+static struct kburn_test_udc {
+	struct usb_gadget gadget;
+	struct kburn_test_ep in;
+	struct kburn_test_ep out;
+	struct usb_composite_dev cdev;
+	struct usb_configuration config;
+	struct usb_function *func;
+	u8 rsp[TEST_PKT_SIZE];
+} udc;
+
+static struct kburn_test_ep *to_test_ep(struct usb_ep *ep)
+{
+	return container_of(ep, struct kburn_test_ep, ep);
+}
+
+static int kburn_test_ep_enable(struct usb_ep *ep,
+				const struct usb_endpoint_descriptor *desc)
+{
+	return 0;
+}
+
+static int kburn_test_ep_disable(struct usb_ep *ep)
+{
+	to_test_ep(ep)->queued = NULL;
+
+	return 0;
+}
+
+static struct usb_request *kburn_test_alloc_request(struct usb_ep *ep,
+						   gfp_t gfp_flags)
+{
+	return calloc(1, sizeof(struct usb_request));
+}
+
+static void kburn_test_free_request(struct usb_ep *ep, struct usb_request *req)
+{
+	free(req);
+}
+
+static int kburn_test_queue(struct usb_ep *ep, struct usb_request *req,
+			    gfp_t gfp_flags)
+{
+	struct kburn_test_ep *tep = to_test_ep(ep);
+
+	if (tep->queued)
+		return -EBUSY;
+	tep->queued = req;
+	req->status = -EINPROGRESS;
+
+	return 0;
+}
+
+static int kburn_test_dequeue(struct usb_ep *ep, struct usb_request *req)
+{
+	struct kburn_test_ep *tep = to_test_ep(ep);
+
+	if (tep->queued != req)
+		return -EINVAL;
+	if (&udc.in == tep)
+		tep->lost++;
+	tep->queued = NULL;
+
+	return 0;
+}
+
+static const struct usb_ep_ops kburn_test_ep_ops = {
+	.enable		= kburn_test_ep_enable,
+	.disable	= kburn_test_ep_disable,
+	.alloc_request	= kburn_test_alloc_request,
+	.free_request	= kburn_test_free_request,
+	.queue		= kburn_test_queue,
+	.dequeue	= kburn_test_dequeue,
+};
+
+static const struct usb_gadget_ops kburn_test_gadget_ops = {
+};
+
+static void kburn_test_ep_init(struct kburn_test_ep *tep, const char *name)
+{
+	memset(tep, 0, sizeof(*tep));
+	tep->ep.name = name;
+	tep->ep.ops = &kburn_test_ep_ops;
+	tep->ep.maxpacket = 512;
+	list_add_tail(&tep->ep.ep_list, &udc.gadget.ep_list);
+}
+
+/* Bind usb_dnl_kburn to the fake UDC and select its interface */
+static int kburn_test_bind(struct unit_test_state *uts)
+{
+	struct g_dnl_bind_callback *cb;
+	int n;
+
+	memset(&udc, 0, sizeof(udc));
+	udc.gadget.ops = &kburn_test_gadget_ops;
+	udc.gadget.name = "kburn_test_udc";
+	udc.gadget.speed = USB_SPEED_HIGH;
+	udc.gadget.max_speed = USB_SPEED_HIGH;
+	udc.gadget.is_dualspeed = 1;
+	INIT_LIST_HEAD(&udc.gadget.ep_list);
+	kburn_test_ep_init(&udc.in, "ep1in-bulk");
+	kburn_test_ep_init(&udc.out, "ep2out-bulk");
+
+	udc.cdev.gadget = &udc.gadget;
+	udc.config.cdev = &udc.cdev;
+	udc.config.label = "kburn test";
+	INIT_LIST_HEAD(&udc.config.functions);
+
+	cb = ll_entry_start(struct g_dnl_bind_callback, g_dnl_bind_callbacks);
+	n = ll_entry_count(struct g_dnl_bind_callback, g_dnl_bind_callbacks);
+	for (; n; n--, cb++) {
+		if (!strcmp(cb->usb_function_name, "usb_dnl_kburn"))
+			break;
+	}
+	ut_assert(n);
+
+	ut_assertok(cb->fptr(&udc.config));
+	udc.func = list_first_entry(&udc.config.functions, struct usb_function,
+				    list);
+	/* both endpoints were claimed by usb_ep_autoconfig() */
+	ut_assertnonnull(udc.in.ep.driver_data);
+	ut_assertnonnull(udc.out.ep.driver_data);
+
+	ut_assertok(udc.func->set_alt(udc.func, 0, 0));
+	ut_assertnonnull(udc.out.queued);
+
+	return 0;
+}
+
+static void kburn_test_unbind(void)
+{
+	udc.func->disable(udc.func);
+	udc.func->unbind(&udc.config, udc.func);
+}
+
+/* Complete the parked bulk-OUT request with @len bytes from the host */
+static bool kburn_test_out(const void *data, uint len)
+{
+	struct usb_request *req = udc.out.queued;
+
+	if (!req || (len > req->length))
+		return false;
+
+	udc.out.queued = NULL;
+	memcpy(req->buf, data, len);
+	req->actual = len;
+	req->status = 0;
+	req->complete(&udc.out.ep, req);
+
+	return true;
+}
+
+static bool kburn_test_cmd(u16 cmd, const void *data, u8 size)
+{
+	u8 pkt[TEST_PKT_SIZE] = { 0 };
+
+	put_unaligned_le16(cmd, &pkt[0]);
+	pkt[4] = size;
+	memcpy(&pkt[TEST_PKT_DATA], data, size);
+
+	return kburn_test_out(pkt, sizeof(pkt));
+}
+
+/* Collect the response on bulk-IN into udc.rsp, false when there is none */
+static bool kburn_test_rsp(void)
+{
+	struct usb_request *req = udc.in.queued;
+
+	if (!req)
+		return false;
+
+	udc.in.queued = NULL;
+	memcpy(udc.rsp, req->buf, sizeof(udc.rsp));
+	req->actual = req->length;
+	req->status = 0;
+	req->complete(&udc.in.ep, req);
+
+	return true;
+}
+
+static int kburn_test_expect(struct unit_test_state *uts, u16 cmd,
+			     const char *msg)
+{
+	ut_assert(kburn_test_rsp());
+	ut_asserteq(0x8000 | cmd, get_unaligned_le16(&udc.rsp[0]));
+	if (msg) {
+		ut_asserteq(strlen(msg), udc.rsp[4]);
+		ut_asserteq_mem(msg, &udc.rsp[TEST_PKT_DATA], strlen(msg));
+	} else {
+		ut_asserteq(TEST_RESULT_OK, get_unaligned_le16(&udc.rsp[2]));
+	}
+
+	return 0;
+}
+
+static int kburn_test_probe(struct unit_test_state *uts, u8 type, u8 index)
+{
+	u8 data[2] = { type, index };
+
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_PROBE, data, sizeof(data)));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_PROBE, NULL));
+
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_GET_INFO, NULL, 0));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_GET_INFO, NULL));
+
+	return 0;
+}
+
+static int kburn_test_write_lba(struct unit_test_state *uts, u64 offset,
+				u64 size, bool async)
+{
+	u8 data[17];
+
+	put_unaligned_le64(offset, &data[0]);
+	put_unaligned_le64(size, &data[8]);
+	data[16] = async ? 0x01 : 0x00;
+
+	ut_assert(kburn_test_cmd(TEST_CMD_WRITE_LBA, data, async ? 17 : 16));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_LBA, "START DL"));
+
+	return 0;
+}
+
+/* Sends the next piece of @buf when bulk-OUT is armed, drains otherwise */
+static void kburn_test_stream(const u8 *buf, u64 size, u64 *sent)
+{
+	struct usb_request *req = udc.out.queued;
+	uint len;
+
+	if (!req || (*sent >= size)) {
+		kburn_usb_poll();
+		return;
+	}
+
+	len = min_t(u64, req->length, size - *sent);
+	kburn_test_out(buf + *sent, len);
+	*sent += len;
+}
+
+static void kburn_test_fill(u8 *buf, u64 size, uint seed)
+{
+	u64 i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (i * 7 + (i >> 9) + seed) & 0xff;
+}
+
+/* Read back through a second burner on the same medium */
+static int kburn_test_check(struct unit_test_state *uts, u8 type,
+			    u64 offset, const u8 *expect, u64 size)
+{
+	struct kburn *burner;
+	u64 len = ALIGN(size, 512);
+	u8 *buf;
+
+	burner = kburn_probe_media(type);
+	ut_assertnonnull(burner);
+	buf = malloc(len);
+	ut_assertnonnull(buf);
+
+	ut_assertok(kburn_read_medium(burner, offset, buf, &len));
+	ut_asserteq_mem(expect, buf, size);
+
+	free(buf);
+	kburn_destory(burner);
+
+	return 0;
+}
+
+/*
+ * WRITE_LBA through the staging ring: bulk-OUT is re-armed on the next
+ * slot as soon as a chunk arrives, pauses once every slot waits for the
+ * medium and WRITE DONE only answers after the last chunk is written.
+ */
+static int dm_test_kburn_write_lba(struct unit_test_state *uts)
+{
+	const u64 offset = 0x10000;
+	const u64 size = 5 * KBURN_USB_EP_BUFFER_SZIE + 1000;
+	struct kburn_usb_stats st;
+	void *slot[KBURN_USB_BUFFER_COUNT];
+	u8 data[2];
+	u64 sent = 0;
+	u8 *buf;
+	int i;
+
+	buf = malloc(size);
+	ut_assertnonnull(buf);
+	kburn_test_fill(buf, size, 0);
+
+	ut_assertok(kburn_test_bind(uts));
+	ut_assertok(kburn_test_probe(uts, KBURN_MEDIA_eMMC, 0));
+
+	/* there is one medium of each type, it is not opened twice */
+	data[0] = KBURN_MEDIA_eMMC;
+	data[1] = 1;
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_PROBE, data, sizeof(data)));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_PROBE, "INDEX NOT SUPPORT"));
+
+	ut_assertok(kburn_test_write_lba(uts, offset, size, false));
+
+	/* the host fills every slot before the medium is written once */
+	for (i = 0; i < KBURN_USB_BUFFER_COUNT; i++) {
+		ut_assertnonnull(udc.out.queued);
+		slot[i] = udc.out.queued->buf;
+		ut_asserteq(KBURN_USB_EP_BUFFER_SZIE, udc.out.queued->length);
+		kburn_test_stream(buf, size, &sent);
+	}
+	ut_asserteq(KBURN_USB_BUFFER_COUNT * KBURN_USB_EP_BUFFER_SZIE, sent);
+	ut_assertnull(udc.out.queued);
+	ut_asserteq_ptr(NULL, udc.in.queued);
+	ut_assert(slot[0] != slot[1] && slot[1] != slot[2] && slot[0] != slot[2]);
+
+	kburn_usb_get_stats(&st);
+	ut_asserteq(1, st.rx_stalls);
+	ut_asserteq(0, st.chunks);
+
+	/* the oldest slot is handed back to bulk-OUT once it is written */
+	for (i = 0; i < TEST_POLL_MAX && !udc.out.queued; i++)
+		kburn_usb_poll();
+	ut_assertnonnull(udc.out.queued);
+	ut_asserteq_ptr(slot[0], udc.out.queued->buf);
+
+	for (i = 0; i < TEST_POLL_MAX && !udc.in.queued; i++)
+		kburn_test_stream(buf, size, &sent);
+	ut_asserteq(size, sent);
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_LBA, "WRITE DONE"));
+	ut_asserteq(0, udc.in.lost);
+
+	/* bulk-OUT is back on commands */
+	ut_assertnonnull(udc.out.queued);
+	ut_asserteq(KBURN_USB_EP_BUFFER_SZIE, udc.out.queued->length);
+
+	kburn_usb_get_stats(&st);
+	ut_asserteq(size, st.rx_bytes);
+	ut_asserteq(6, st.chunks);
+	ut_asserteq(0, st.rx_errors);
+	ut_asserteq(0, st.wr_errors);
+
+	kburn_test_unbind();
+	ut_assertok(kburn_test_check(uts, KBURN_MEDIA_eMMC, offset, buf, size));
+	free(buf);
+
+	return 0;
+}
+DM_TEST(dm_test_kburn_write_lba, UT_TESTF_SCAN_FDT);
+
+/*
+ * Async WRITE_LBA: RECV DONE answers once the last chunk is staged, the
+ * device drains afterwards while it keeps taking commands, and DEV_SYNC
+ * reports the progress instead of a WRITE DONE. Commands touching the
+ * medium are refused until the drain is done.
+ */
+static int dm_test_kburn_write_async(struct unit_test_state *uts)
+{
+	const u64 offset = 0x40000;
+	const u64 size = 4 * KBURN_USB_EP_BUFFER_SZIE;
+	u64 sent = 0;
+	u8 data[16];
+	u8 *buf;
+	int i;
+
+	buf = malloc(size);
+	ut_assertnonnull(buf);
+	kburn_test_fill(buf, size, 0x5a);
+	put_unaligned_le64(offset, &data[0]);
+	put_unaligned_le64(size, &data[8]);
+
+	ut_assertok(kburn_test_bind(uts));
+	ut_assertok(kburn_test_probe(uts, KBURN_MEDIA_eMMC, 0));
+	ut_assertok(kburn_test_write_lba(uts, offset, size, true));
+
+	for (i = 0; i < TEST_POLL_MAX && !udc.in.queued; i++)
+		kburn_test_stream(buf, size, &sent);
+	ut_asserteq(size, sent);
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_LBA, "RECV DONE"));
+
+	/* the last chunks are still staged, wait for a slot for the command */
+	for (i = 0; i < TEST_POLL_MAX && !udc.out.queued; i++)
+		kburn_usb_poll();
+
+	/* nothing else may touch the medium until the drain is done */
+	ut_assert(kburn_test_cmd(TEST_CMD_ERASE_LBA, data, sizeof(data)));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_ERASE_LBA, "BUSY"));
+
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_SYNC, NULL, 0));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_SYNC, NULL));
+	ut_asserteq(1, udc.rsp[TEST_PKT_DATA]);
+	ut_assert(get_unaligned_le64(&udc.rsp[TEST_PKT_DATA + 1]) < size);
+
+	for (i = 0; i < TEST_POLL_MAX; i++)
+		kburn_usb_poll();
+	ut_asserteq_ptr(NULL, udc.in.queued);
+
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_SYNC, NULL, 0));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_SYNC, NULL));
+	ut_asserteq(0, udc.rsp[TEST_PKT_DATA]);
+	ut_asserteq(size, get_unaligned_le64(&udc.rsp[TEST_PKT_DATA + 1]));
+	ut_asserteq(0, udc.in.lost);
+
+	kburn_test_unbind();
+	ut_assertok(kburn_test_check(uts, KBURN_MEDIA_eMMC, offset, buf, size));
+	free(buf);
+
+	return 0;
+}
+DM_TEST(dm_test_kburn_write_async, UT_TESTF_SCAN_FDT);
+
+/*
+ * A download aborted while the host is still sending: the rest of the
+ * payload is received and dropped, none of it is taken for a command,
+ * and commands are parsed again once the announced size is in.
+ */
+static int dm_test_kburn_abort_drain(struct unit_test_state *uts)
+{
+	const u64 size = 4 * KBURN_USB_EP_BUFFER_SZIE;
+	u64 sent = 0, pos;
+	u8 data[12];
+	u8 *buf;
+	int i;
+
+	/* one extent, which does not add up to the stream size */
+	buf = calloc(1, size);
+	ut_assertnonnull(buf);
+	put_unaligned_le64(0x10000, &buf[0]);
+	put_unaligned_le64(0x1000, &buf[8]);
+	/* every transfer of the payload starts like a command */
+	for (pos = KBURN_USB_EP_BUFFER_SZIE; pos < size; pos += KBURN_USB_EP_BUFFER_SZIE)
+		put_unaligned_le16(TEST_CMD_DEV_GET_INFO, &buf[pos]);
+
+	ut_assertok(kburn_test_bind(uts));
+	ut_assertok(kburn_test_probe(uts, KBURN_MEDIA_eMMC, 0));
+
+	put_unaligned_le32(1, &data[0]);
+	put_unaligned_le64(size, &data[4]);
+	ut_assert(kburn_test_cmd(TEST_CMD_WRITE_EXTENTS, data, sizeof(data)));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_EXTENTS, "START DL"));
+
+	for (i = 0; i < TEST_POLL_MAX && !udc.in.queued; i++)
+		kburn_test_stream(buf, size, &sent);
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_EXTENTS, "DATA SIZE MISMATCH"));
+	ut_assert(sent < size);
+
+	/* the host only reads the result once it has sent everything */
+	for (i = 0; i < TEST_POLL_MAX && sent < size; i++) {
+		ut_assertnonnull(udc.out.queued);
+		kburn_test_stream(buf, size, &sent);
+		ut_asserteq_ptr(NULL, udc.in.queued);
+	}
+	ut_asserteq(size, sent);
+
+	ut_assertnonnull(udc.out.queued);
+	ut_asserteq(KBURN_USB_EP_BUFFER_SZIE, udc.out.queued->length);
+	ut_assert(kburn_test_cmd(TEST_CMD_DEV_GET_INFO, NULL, 0));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_DEV_GET_INFO, NULL));
+
+	kburn_test_unbind();
+	free(buf);
+
+	return 0;
+}
+DM_TEST(dm_test_kburn_abort_drain, UT_TESTF_SCAN_FDT);
+
+#if IS_ENABLED(CONFIG_KBURN_MTD)
+#define TEST_NAND_PAGE		2048
+#define TEST_NAND_BLOCK		(32 * TEST_NAND_PAGE)
+#define TEST_NAND_BLOCKS	16
+#define TEST_NAND_SIZE		(TEST_NAND_BLOCKS * TEST_NAND_BLOCK)
+/* factory marked bad */
+#define TEST_NAND_BAD		2
+
+/*
+ * SPI-NAND model. Programming only clears bits and the array starts out
+ * as zeroes, so a page programmed without erasing its block first does
+ * not read back what was written.
+ */
+struct kburn_test_nand {
+	u8 data[TEST_NAND_SIZE];
+	bool bad[TEST_NAND_BLOCKS];
+	int erases;
+};
+
+static int kburn_test_nand_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+	struct kburn_test_nand *nand = mtd->priv;
+
+	if (nand->bad[instr->addr / TEST_NAND_BLOCK])
+		return -EIO;
+
+	memset(nand->data + instr->addr, 0xff, instr->len);
+	nand->erases++;
+	instr->state = MTD_ERASE_DONE;
+
+	return 0;
+}
+
+static int kburn_test_nand_read(struct mtd_info *mtd, loff_t from, size_t len,
+				size_t *retlen, u_char *buf)
+{
+	struct kburn_test_nand *nand = mtd->priv;
+
+	memcpy(buf, nand->data + from, len);
+	*retlen = len;
+
+	return 0;
+}
+
+static int kburn_test_nand_write_oob(struct mtd_info *mtd, loff_t to,
+				     struct mtd_oob_ops *ops)
+{
+	struct kburn_test_nand *nand = mtd->priv;
+	size_t i;
+
+	for (i = 0; i < ops->len; i++)
+		nand->data[to + i] &= ops->datbuf[i];
+	ops->retlen = ops->len;
+
+	return 0;
+}
+
+static int kburn_test_nand_isbad(struct mtd_info *mtd, loff_t ofs)
+{
+	struct kburn_test_nand *nand = mtd->priv;
+
+	return nand->bad[ofs / TEST_NAND_BLOCK];
+}
+
+static int kburn_test_nand_markbad(struct mtd_info *mtd, loff_t ofs)
+{
+	struct kburn_test_nand *nand = mtd->priv;
+
+	nand->bad[ofs / TEST_NAND_BLOCK] = true;
+
+	return 0;
+}
+
+static int kburn_test_nand_probe(struct udevice *dev)
+{
+	struct kburn_test_nand *nand = dev_get_priv(dev);
+	struct mtd_info *mtd = dev_get_uclass_priv(dev);
+
+	nand->bad[TEST_NAND_BAD] = true;
+
+	mtd->dev = dev;
+	mtd->priv = nand;
+	mtd->name = "kburn-test-nand";
+	mtd->type = MTD_NANDFLASH;
+	mtd->flags = MTD_CAP_NANDFLASH;
+	mtd->size = TEST_NAND_SIZE;
+	mtd->erasesize = TEST_NAND_BLOCK;
+	mtd->writesize = TEST_NAND_PAGE;
+	mtd->writebufsize = TEST_NAND_PAGE;
+
+	mtd->_erase = kburn_test_nand_erase;
+	mtd->_read = kburn_test_nand_read;
+	mtd->_write_oob = kburn_test_nand_write_oob;
+	mtd->_block_isbad = kburn_test_nand_isbad;
+	mtd->_block_markbad = kburn_test_nand_markbad;
+
+	return 0;
+}
+
+U_BOOT_DRIVER(kburn_test_nand) = {
+	.name		= "kburn_test_nand",
+	.id		= UCLASS_MTD,
+	.probe		= kburn_test_nand_probe,
+	.priv_auto	= sizeof(struct kburn_test_nand),
+};
+
+/*
+ * WRITE_EXTENTS to SPI-NAND with a bad block inside the first extent. The
+ * write moves past the bad block, so the tail of the extent lands in the
+ * next good block, which must have been erased as well.
+ */
+static int dm_test_kburn_extents_bad_block(struct unit_test_state *uts)
+{
+	const struct {
+		u64 offset;
+		u64 size;
+	} ext[] = {
+		{ (TEST_NAND_BAD - 1) * TEST_NAND_BLOCK, 3 * TEST_NAND_BLOCK / 2 },
+		{ 8 * TEST_NAND_BLOCK, 0x1000 },
+	};
+	const u64 size = KBURN_EXTENT_ALIGN + ALIGN(ext[0].size, KBURN_EXTENT_ALIGN) +
+			 ALIGN(ext[1].size, KBURN_EXTENT_ALIGN);
+	struct kburn_test_nand *nand;
+	struct udevice *dev;
+	u64 sent = 0, pos;
+	u8 data[12];
+	u8 *buf;
+	int i;
+
+	ut_assertok(device_bind(dm_root(), DM_DRIVER_GET(kburn_test_nand),
+				"kburn-test-nand", NULL, ofnode_null(), &dev));
+	ut_assertok(device_probe(dev));
+	nand = dev_get_priv(dev);
+
+	/* table block, then every payload padded to KBURN_EXTENT_ALIGN */
+	buf = calloc(1, size);
+	ut_assertnonnull(buf);
+	pos = KBURN_EXTENT_ALIGN;
+	for (i = 0; i < ARRAY_SIZE(ext); i++) {
+		put_unaligned_le64(ext[i].offset, &buf[i * 16 + 0]);
+		put_unaligned_le64(ext[i].size, &buf[i * 16 + 8]);
+		kburn_test_fill(buf + pos, ext[i].size, i + 1);
+		pos += ALIGN(ext[i].size, KBURN_EXTENT_ALIGN);
+	}
+
+	ut_assertok(kburn_test_bind(uts));
+	ut_assertok(kburn_test_probe(uts, KBURN_MEDIA_SPI_NAND, 0));
+
+	put_unaligned_le32(ARRAY_SIZE(ext), &data[0]);
+	put_unaligned_le64(size, &data[4]);
+	ut_assert(kburn_test_cmd(TEST_CMD_WRITE_EXTENTS, data, sizeof(data)));
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_EXTENTS, "START DL"));
+
+	for (i = 0; i < TEST_POLL_MAX && !udc.in.queued; i++)
+		kburn_test_stream(buf, size, &sent);
+	ut_asserteq(size, sent);
+	ut_assertok(kburn_test_expect(uts, TEST_CMD_WRITE_EXTENTS, "WRITE DONE"));
+
+	kburn_test_unbind();
+
+	/* the bad block was neither erased nor programmed */
+	for (i = 0; i < TEST_NAND_BLOCK; i++)
+		ut_asserteq(0, nand->data[TEST_NAND_BAD * TEST_NAND_BLOCK + i]);
+
+	/* the extent continues in the block after the bad one */
+	pos = KBURN_EXTENT_ALIGN;
+	ut_asserteq_mem(buf + pos, nand->data + ext[0].offset, TEST_NAND_BLOCK);
+	ut_asserteq_mem(buf + pos + TEST_NAND_BLOCK,
+			nand->data + (TEST_NAND_BAD + 1) * TEST_NAND_BLOCK,
+			ext[0].size - TEST_NAND_BLOCK);
+	ut_assertok(kburn_test_check(uts, KBURN_MEDIA_SPI_NAND, ext[0].offset,
+				     buf + pos, ext[0].size));
+
+	pos += ALIGN(ext[0].size, KBURN_EXTENT_ALIGN);
+	ut_asserteq_mem(buf + pos, nand->data + ext[1].offset, ext[1].size);
+
+	free(buf);
+
+	return 0;
+}
+DM_TEST(dm_test_kburn_extents_bad_block, UT_TESTF_SCAN_FDT);
+#endif
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Tests for the K230 DDR training cache records, against a modeled PHY
+ * register file
+ */
+
+#include <common.h>
+#include <errno.h>
+#include <kendryte/k230_ddr_cache.h>
+#include <test/lib.h>
+#include <test/test.h>
+#include <test/ut.h>
+
+#define TEST_CSRS	8
+/* k230_ddr_cache_size(TEST_CSRS), as a constant for the record buffers */
+#define TEST_BLOB_SIZE	(sizeof(struct k230_ddr_cache_hdr) + \
+			 TEST_CSRS * sizeof(struct k230_ddr_cache_csr))
+
+static const u32 test_regs[TEST_CSRS] = {
+	0x200b2, 0x10043, 0x100d0, 0x110d0, 0x10068, 0x20072, 0x90201, 0x13830,
+};
+
+/* modeled PHY: one value per entry of test_regs */
+struct test_phy {
+	u32 val[TEST_CSRS];
+	int reads;
+	int writes;
+};
+
+static int test_phy_index(u32 reg)
+{
+	int i;
+
+	for (i = 0; i < TEST_CSRS; i++) {
+		if (test_regs[i] == reg)
+			return i;
+	}
+
+	return -1;
+}
+
+static u32 test_phy_read(void *priv, u32 reg)
+{
+	struct test_phy *phy = priv;
+	int i = test_phy_index(reg);
+
+	phy->reads++;
+
+	return i < 0 ? 0xdeadbeef : phy->val[i];
+}
+
+static void test_phy_write(void *priv, u32 reg, u32 val)
+{
+	struct test_phy *phy = priv;
+	int i = test_phy_index(reg);
+
+	phy->writes++;
+	if (i >= 0)
+		phy->val[i] = val;
+}
+
+static void test_phy_init(struct test_phy *phy, struct k230_ddr_cache_ops *ops,
+			  u32 seed)
+{
+	int i;
+
+	memset(phy, 0, sizeof(*phy));
+	for (i = 0; i < TEST_CSRS; i++)
+		phy->val[i] = seed * 0x1000 + i;
+	ops->read = test_phy_read;
+	ops->write = test_phy_write;
+	ops->priv = phy;
+}
+
+static const struct k230_ddr_cache_key test_key = {
+	.board = 0x12345678,
+	.rate = 2667,
+	.temp = 40,
+};
+
+/* Test that a saved record restores the trained values */
+static int lib_test_k230_ddr_cache_restore(struct unit_test_state *uts)
+{
+	u8 blob[TEST_BLOB_SIZE] __aligned(8);
+	struct k230_ddr_cache_ops ops;
+	struct test_phy trained, cold;
+
+	test_phy_init(&trained, &ops, 1);
+	ut_assertok(k230_ddr_cache_save(blob, sizeof(blob), &test_key,
+					test_regs, TEST_CSRS, &ops));
+	ut_asserteq(TEST_CSRS, trained.reads);
+
+	test_phy_init(&cold, &ops, 2);
+	ut_assertok(k230_ddr_cache_check(blob, sizeof(blob), &test_key,
+					 test_regs, TEST_CSRS, 10));
+	k230_ddr_cache_restore(blob, &ops);
+	ut_asserteq(TEST_CSRS, cold.writes);
+	ut_asserteq_mem(trained.val, cold.val, sizeof(trained.val));
+
+	return 0;
+}
+LIB_TEST(lib_test_k230_ddr_cache_restore, 0);
+
+/* Test that damaged or foreign records are refused */
+static int lib_test_k230_ddr_cache_check(struct unit_test_state *uts)
+{
+	u8 blob[TEST_BLOB_SIZE] __aligned(8);
+	struct k230_ddr_cache_hdr *hdr = (struct k230_ddr_cache_hdr *)blob;
+	struct k230_ddr_cache_ops ops;
+	struct k230_ddr_cache_key key;
+	struct test_phy phy;
+	u32 regs[TEST_CSRS];
+
+	test_phy_init(&phy, &ops, 1);
+	ut_asserteq(-E2BIG, k230_ddr_cache_save(blob, sizeof(blob) - 1,
+						&test_key, test_regs,
+						TEST_CSRS, &ops));
+
+	/* blank storage */
+	memset(blob, 0xff, sizeof(blob));
+	ut_asserteq(-ENOENT, k230_ddr_cache_check(blob, sizeof(blob),
+						  &test_key, test_regs,
+						  TEST_CSRS, 10));
+
+	ut_assertok(k230_ddr_cache_save(blob, sizeof(blob), &test_key,
+					test_regs, TEST_CSRS, &ops));
+	ut_asserteq(-EINVAL, k230_ddr_cache_check(blob, sizeof(blob) - 1,
+						  &test_key, test_regs,
+						  TEST_CSRS, 10));
+
+	/* a flipped bit in the values */
+	blob[sizeof(blob) - 1] ^= 0x10;
+	ut_asserteq(-EBADMSG, k230_ddr_cache_check(blob, sizeof(blob),
+						   &test_key, test_regs,
+						   TEST_CSRS, 10));
+	blob[sizeof(blob) - 1] ^= 0x10;
+	ut_assertok(k230_ddr_cache_check(blob, sizeof(blob), &test_key,
+					 test_regs, TEST_CSRS, 10));
+
+	/* other board, data rate, temperature */
+	key = test_key;
+	key.board++;
+	ut_asserteq(-ESTALE, k230_ddr_cache_check(blob, sizeof(blob), &key,
+						  test_regs, TEST_CSRS, 10));
+	key = test_key;
+	key.rate = 3200;
+	ut_asserteq(-ESTALE, k230_ddr_cache_check(blob, sizeof(blob), &key,
+						  test_regs, TEST_CSRS, 10));
+	key = test_key;
+	key.temp = test_key.temp - 10;
+	ut_assertok(k230_ddr_cache_check(blob, sizeof(blob), &key,
+					 test_regs, TEST_CSRS, 10));
+	key.temp = test_key.temp + 11;
+	ut_asserteq(-ESTALE, k230_ddr_cache_check(blob, sizeof(blob), &key,
+						  test_regs, TEST_CSRS, 10));
+	key.temp = K230_DDR_TEMP_UNKNOWN;
+	ut_asserteq(-ESTALE, k230_ddr_cache_check(blob, sizeof(blob), &key,
+						  test_regs, TEST_CSRS, 10));
+
+	/* the CSR list changed */
+	memcpy(regs, test_regs, sizeof(regs));
+	regs[3]++;
+	ut_asserteq(-EINVAL, k230_ddr_cache_check(blob, sizeof(blob),
+						  &test_key, regs, TEST_CSRS,
+						  10));
+	ut_asserteq(-EINVAL, k230_ddr_cache_check(blob, sizeof(blob),
+						  &test_key, test_regs,
+						  TEST_CSRS - 1, 10));
+
+	hdr->version++;
+	ut_asserteq(-EINVAL, k230_ddr_cache_check(blob, sizeof(blob),
+						  &test_key, test_regs,
+						  TEST_CSRS, 10));
+
+	return 0;
+}
+LIB_TEST(lib_test_k230_ddr_cache_check, 0);
+
+/* Test the quick memory test on working memory */
+static int lib_test_k230_ddr_cache_memtest(struct unit_test_state *uts)
+{
+	const ulong size = 0x10000;
+	void *buf;
+
+	buf = malloc(size);
+	ut_assertnonnull(buf);
+	ut_assertok(k230_ddr_cache_memtest(buf, size / 4, size));
+	free(buf);
+
+	return 0;
+}
+LIB_TEST(lib_test_k230_ddr_cache_memtest, 0);
@@ -196,6 +196,152 @@ static int lib_memmove(struct unit_test_state *uts)
 
 LIB_TEST(lib_memmove, 0);
 
+/*
+ * Vector implementations only kick in for longer regions and split them
+ * in chunks of the vector register group size, so cover the lengths
+ * around the usual group sizes as well.
+ */
+static const int long_lens[] = {
+	63, 64, 65, 127, 128, 129, 255, 256, 257, 511, 512, 513,
+	1023, 1024, 1025, 2049, 4095,
+};
+
+/* Distances for the overlapping moves, within and beyond one group */
+static const int move_offs[] = { 0, 1, 3, 8, 15, 31, 64, 129, 200 };
+
+/* Longest length above plus room for the offsets */
+#define LONG_BUFLEN (4096 + 256)
+
+static u8 long_buf1[LONG_BUFLEN];
+static u8 long_buf2[LONG_BUFLEN];
+
+static void init_long_buffer(u8 buf[], u8 mask)
+{
+	int i;
+
+	for (i = 0; i < LONG_BUFLEN; ++i)
+		buf[i] = (i + i / 251) ^ mask;
+}
+
+/**
+ * check_long_buffer() - test result of a long memset(), memcpy() or memmove()
+ *
+ * @uts:	unit test state
+ * @buf:	buffer
+ * @ref:	contents the buffer must match outside of the changed region
+ * @offset:	relative start of the changed region in buffer
+ * @len:	length of the changed region
+ * @expect:	contents of the changed region
+ * Return:	0 = success, 1 = failure
+ */
+static int check_long_buffer(struct unit_test_state *uts, u8 buf[], u8 ref[],
+			     int offset, int len, u8 expect[])
+{
+	ut_asserteq_mem(ref, buf, offset);
+	ut_asserteq_mem(expect, buf + offset, len);
+	ut_asserteq_mem(ref + offset + len, buf + offset + len,
+			LONG_BUFLEN - offset - len);
+
+	return 0;
+}
+
+/** lib_memset_long() - unit test for memset() on long regions */
+static int lib_memset_long(struct unit_test_state *uts)
+{
+	static u8 ref[LONG_BUFLEN], expect[LONG_BUFLEN];
+	int i, offset, len;
+
+	init_long_buffer(ref, 0);
+	memset(expect, MASK, sizeof(expect));
+	for (i = 0; i < ARRAY_SIZE(long_lens); ++i) {
+		len = long_lens[i];
+		for (offset = 0; offset <= SWEEP; ++offset) {
+			init_long_buffer(long_buf1, 0);
+			ut_asserteq_ptr(long_buf1 + offset,
+					memset(long_buf1 + offset, MASK, len));
+			if (check_long_buffer(uts, long_buf1, ref, offset, len,
+					      expect)) {
+				debug("%s: failure %d, %d\n",
+				      __func__, offset, len);
+				return CMD_RET_FAILURE;
+			}
+		}
+	}
+	return 0;
+}
+
+LIB_TEST(lib_memset_long, 0);
+
+/** lib_memcpy_long() - unit test for memcpy() on long regions */
+static int lib_memcpy_long(struct unit_test_state *uts)
+{
+	static u8 ref[LONG_BUFLEN];
+	int i, offset1, offset2, len;
+
+	init_long_buffer(ref, 0);
+	init_long_buffer(long_buf1, MASK);
+	for (i = 0; i < ARRAY_SIZE(long_lens); ++i) {
+		len = long_lens[i];
+		for (offset1 = 0; offset1 <= SWEEP; ++offset1) {
+			for (offset2 = 0; offset2 <= SWEEP; ++offset2) {
+				init_long_buffer(long_buf2, 0);
+				ut_asserteq_ptr(long_buf2 + offset2,
+						memcpy(long_buf2 + offset2,
+						       long_buf1 + offset1,
+						       len));
+				if (check_long_buffer(uts, long_buf2, ref,
+						      offset2, len,
+						      long_buf1 + offset1)) {
+					debug("%s: failure %d, %d, %d\n",
+					      __func__, offset1, offset2, len);
+					return CMD_RET_FAILURE;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+LIB_TEST(lib_memcpy_long, 0);
+
+/**
+ * lib_memmove_long() - unit test for memmove() on long regions
+ *
+ * Source and destination overlap in both directions, by less and by more
+ * than one vector register group.
+ */
+static int lib_memmove_long(struct unit_test_state *uts)
+{
+	static u8 ref[LONG_BUFLEN];
+	int i, j, k, offset1, offset2, len;
+
+	init_long_buffer(ref, 0);
+	for (i = 0; i < ARRAY_SIZE(long_lens); ++i) {
+		len = long_lens[i];
+		for (j = 0; j < ARRAY_SIZE(move_offs); ++j) {
+			for (k = 0; k < ARRAY_SIZE(move_offs); ++k) {
+				offset1 = move_offs[j];
+				offset2 = move_offs[k];
+				init_long_buffer(long_buf1, 0);
+				ut_asserteq_ptr(long_buf1 + offset2,
+						memmove(long_buf1 + offset2,
+							long_buf1 + offset1,
+							len));
+				if (check_long_buffer(uts, long_buf1, ref,
+						      offset2, len,
+						      ref + offset1)) {
+					debug("%s: failure %d, %d, %d\n",
+					      __func__, offset1, offset2, len);
+					return CMD_RET_FAILURE;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+LIB_TEST(lib_memmove_long, 0);
+
 /** lib_memdup() - unit test for memdup() */
 static int lib_memdup(struct unit_test_state *uts)
 {
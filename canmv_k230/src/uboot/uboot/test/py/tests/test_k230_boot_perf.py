@@ -0,0 +1,286 @@
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+
+"""Boot time regression test of the K230 boot chain.
+
+The stages recorded with bootstage by SPL, k230_boot and the gzip engine
+are compared with a baseline from the board environment, and the test
+fails if any of them got slower than the tolerance allows. For example:
+
+env__k230_boot_perf = {
+    # Elapsed time of each stage in microseconds, as printed by
+    # 'bootstage report'. A stage recorded more than once is named
+    # 'stage#2', 'stage#3' and so on from the second time. Stages without
+    # a baseline are only logged.
+    'stages': {
+        'spl_device_disable': 2000,
+        'ddr_init_training': 160000,
+        'mmc_init': 40000,
+        'image_load': 90000,
+        'image_verify': 5000,
+        'image_load#2': 250000,
+    },
+    # Accumulated times, in microseconds as well.
+    'accumulated': {
+        'k230_unzip': 60000,
+    },
+    # Allowed regression: a stage fails once it is slower than the
+    # baseline by both tolerance_pct percent and tolerance_us.
+    'tolerance_pct': 10,
+    'tolerance_us': 2000,
+    # Also time loading RT-Smart with 'k230_boot auto rtt'. U-Boot is gone
+    # once the big core starts, the board is reset afterwards.
+    'boot_rtsmart': True,
+}
+
+On sandbox, CONFIG_SANDBOX_K230_BOOT builds k230_boot against the
+file-backed mmc1 of the test device tree. Images are made with k230_pack
+like gen_image.sh does and are booted from mmc1.img and from memory, with
+the big core reset and the jump to U-Boot left out. The baseline is
+env__k230_boot_perf_sandbox, which takes 'stages' per image and the
+tolerances as above. Without it, the first run records the times in the
+persistent data directory and later runs are checked against them:
+
+env__k230_boot_perf_sandbox = {
+    'stages': {
+        'rtt_sd': {'image_load': 40000, 'image_verify': 100},
+        'uboot_sd': {'image_load': 20000, 'image_verify': 100},
+        'rtt_mem': {'image_verify': 20000, 'image_decomp': 30000},
+    },
+    'tolerance_pct': 50,
+    'tolerance_us': 10000,
+}
+"""
+
+import json
+import os
+import random
+import re
+import zlib
+import pytest
+import u_boot_utils
+
+re_mark = re.compile(r'^\s*([\d,]+)\s+([\d,]+)\s+(\S+)\s*$')
+re_accum = re.compile(r'^\s*([\d,]+)\s+(\S+)\s*$')
+
+def parse_report(output):
+    """Parse the output of bootstage_report()
+
+    Args:
+        output: Console output holding the report
+
+    Returns:
+        tuple:
+            dict of elapsed time per stage, in microseconds
+            dict of accumulated time per stage, in microseconds
+    """
+    stages = {}
+    accum = {}
+    in_accum = False
+    for line in output.splitlines():
+        if line.startswith('Accumulated time:'):
+            in_accum = True
+            continue
+        if in_accum:
+            m = re_accum.match(line)
+            if m:
+                accum[m.group(2)] = int(m.group(1).replace(',', ''))
+            continue
+        m = re_mark.match(line)
+        if not m:
+            continue
+        name = m.group(3)
+        seen = 1
+        while name in stages:
+            seen += 1
+            name = '%s#%d' % (m.group(3), seen)
+        stages[name] = int(m.group(2).replace(',', ''))
+    return stages, accum
+
+def check_stages(u_boot_console, measured, baseline, f=None):
+    """Check measured times against their baseline
+
+    Args:
+        u_boot_console: A U-Boot console connection
+        measured: dict of measured time per stage
+        baseline: dict of expected time per stage
+        f: dict holding the tolerances, env__k230_boot_perf by default
+
+    Returns:
+        list of messages for the stages which regressed
+    """
+    if f is None:
+        f = u_boot_console.config.env.get('env__k230_boot_perf', {})
+    pct = f.get('tolerance_pct', 10)
+    slack = f.get('tolerance_us', 2000)
+    failed = []
+    for name, us in measured.items():
+        base = baseline.get(name)
+        if base is None:
+            u_boot_console.log.info('%s: %d us, no baseline' % (name, us))
+            continue
+        u_boot_console.log.info('%s: %d us, baseline %d us' % (name, us, base))
+        if us > base + max(base * pct // 100, slack):
+            failed.append('%s took %d us, baseline %d us' % (name, us, base))
+    for name in baseline:
+        if name not in measured:
+            failed.append('%s was not recorded' % name)
+    return failed
+
+def check_report(u_boot_console, output):
+    f = u_boot_console.config.env.get('env__k230_boot_perf', None)
+    if not f:
+        pytest.skip('No K230 boot time baseline')
+
+    stages, accum = parse_report(output)
+    assert stages, 'No bootstage report'
+    failed = check_stages(u_boot_console, stages, f.get('stages', {}))
+    failed += check_stages(u_boot_console, accum, f.get('accumulated', {}))
+    assert not failed, 'Boot time regressed:\n' + '\n'.join(failed)
+
+@pytest.mark.buildconfigspec('kendryte_k230')
+@pytest.mark.buildconfigspec('cmd_bootstage')
+def test_k230_boot_perf_uboot(u_boot_console):
+    """Check the stages up to the U-Boot prompt, SPL ones included."""
+    f = u_boot_console.config.env.get('env__k230_boot_perf', None)
+    if not f:
+        pytest.skip('No K230 boot time baseline')
+
+    # the stages of the current boot only
+    u_boot_console.restart_uboot()
+    output = u_boot_console.run_command('bootstage report')
+    check_report(u_boot_console, output)
+
+@pytest.mark.buildconfigspec('kendryte_k230')
+@pytest.mark.buildconfigspec('bootstage_report')
+def test_k230_boot_perf_rtsmart(u_boot_console):
+    """Check the stages up to the start of RT-Smart."""
+    f = u_boot_console.config.env.get('env__k230_boot_perf', None)
+    if not f or not f.get('boot_rtsmart', False):
+        pytest.skip('RT-Smart boot time not tested')
+
+    u_boot_console.restart_uboot()
+    try:
+        u_boot_console.run_command('k230_boot auto rtt', wait_for_prompt=False)
+        u_boot_console.wait_for('Jump to big hart')
+        output = u_boot_console.p.before
+    finally:
+        u_boot_console.restart_uboot()
+    check_report(u_boot_console, output)
+
+# Images of the sandbox test: name, k230_pack arguments, mmc1.img offset.
+# The offsets are the ones k230_boot reads U-Boot and RT-Smart from.
+SANDBOX_IMAGES = (
+    ('rtt', '-z -O opensbi -T multi -a 0x1000000 -e 0x1000000 -n rtt',
+     10 << 20),
+    ('uboot', '-O u-boot -T firmware -a 0x8000000 -e 0x8000000 -n uboot',
+     2 << 20),
+)
+SANDBOX_LOAD = {'rtt': 0x1000000, 'uboot': 0x8000000}
+SANDBOX_BUF = 0x2000000
+SANDBOX_STAGES = ('mmc_init', 'image_load', 'image_verify', 'image_decomp')
+
+def sandbox_payload(size):
+    """Make a payload which compresses about like a kernel does"""
+    rnd = random.Random(230)
+    words = [bytes(rnd.getrandbits(8) for _ in range(rnd.randint(2, 12)))
+             for _ in range(4096)]
+    out = bytearray()
+    while len(out) < size:
+        out += b''.join(rnd.choices(words, k=1024))
+    return bytes(out[:size])
+
+def sandbox_images(cons, mmc_img):
+    """Pack the images with k230_pack and put them into mmc_img
+
+    Returns:
+        dict of image name to (payload, packed image file)
+    """
+    k230_pack = os.path.join(cons.config.build_dir, 'tools', 'k230_pack')
+    payload = sandbox_payload(4 << 20)
+    images = {}
+    with open(mmc_img, 'wb') as mmc:
+        mmc.truncate(20 << 20)
+        for name, args, offset in SANDBOX_IMAGES:
+            data = os.path.join(cons.config.result_dir, 'k230_%s.bin' % name)
+            packed = os.path.join(cons.config.result_dir,
+                                  'fn_k230_%s.bin' % name)
+            with open(data, 'wb') as fd:
+                fd.write(payload)
+            u_boot_utils.run_and_log(cons, '%s -A riscv %s -d %s -N %s' %
+                                     (k230_pack, args, data, packed))
+            with open(packed, 'rb') as fd:
+                mmc.seek(offset)
+                mmc.write(fd.read())
+            images[name] = (payload, packed)
+    return images
+
+def sandbox_boot(cons, cmds, name, payload):
+    """Boot an image with k230_boot, check it landed and report its stages
+
+    Returns:
+        dict of elapsed time per K230 stage, in microseconds
+    """
+    cons.restart_uboot()
+    for cmd in cmds:
+        output = cons.run_command(cmd)
+        assert 'Error' not in output, output
+    output = cons.run_command('crc32 %x %x' % (SANDBOX_LOAD[name],
+                                               len(payload)))
+    assert '==> %08x' % zlib.crc32(payload) in output, 'bad payload'
+    stages, _ = parse_report(cons.run_command('bootstage report'))
+    return {k: v for k, v in stages.items() if k in SANDBOX_STAGES}
+
+@pytest.mark.boardspec('sandbox')
+@pytest.mark.buildconfigspec('sandbox_k230_boot')
+@pytest.mark.buildconfigspec('cmd_bootstage')
+@pytest.mark.buildconfigspec('cmd_crc32')
+def test_k230_boot_perf_sandbox(u_boot_console):
+    """Time loading images made by k230_pack from a file-backed SD card."""
+    cons = u_boot_console
+    mmc_img = os.path.join(cons.config.source_dir, 'mmc1.img')
+    saved = mmc_img + '.k230'
+    measured = {}
+
+    # mmc1.img belongs to the bootstd tests, put it back afterwards
+    if os.path.exists(mmc_img):
+        os.rename(mmc_img, saved)
+    try:
+        images = sandbox_images(cons, mmc_img)
+        rtt, rtt_file = images['rtt']
+        uboot, _ = images['uboot']
+        measured['rtt_sd'] = sandbox_boot(cons, ['k230_boot sdio1 rtt'],
+                                          'rtt', rtt)
+        measured['uboot_sd'] = sandbox_boot(cons, ['k230_boot sdio1 uboot'],
+                                            'uboot', uboot)
+        # the whole image in memory, k230_img_boot_sys_bin() on its own
+        cmds = ['host load hostfs - %x %s' % (SANDBOX_BUF, rtt_file),
+                'k230_boot mem %x $filesize' % SANDBOX_BUF]
+        measured['rtt_mem'] = sandbox_boot(cons, cmds, 'rtt', rtt)
+    finally:
+        if os.path.exists(mmc_img):
+            os.remove(mmc_img)
+        if os.path.exists(saved):
+            os.rename(saved, mmc_img)
+        cons.restart_uboot()
+
+    f = cons.config.env.get('env__k230_boot_perf_sandbox', None)
+    if not f:
+        fname = os.path.join(cons.config.persistent_data_dir,
+                             'k230_boot_perf.json')
+        if not os.path.exists(fname):
+            with open(fname, 'w') as fd:
+                json.dump({'stages': measured}, fd, indent=4)
+            cons.log.info('Recorded the baseline in %s' % fname)
+            return
+        with open(fname) as fd:
+            f = json.load(fd)
+        f.setdefault('tolerance_pct', 50)
+        f.setdefault('tolerance_us', 10000)
+
+    failed = []
+    for run, stages in measured.items():
+        baseline = f.get('stages', {}).get(run, {})
+        failed += ['%s: %s' % (run, msg) for msg in
+                   check_stages(cons, stages, baseline, f)]
+    assert not failed, 'Boot time regressed:\n' + '\n'.join(failed)
@@ -0,0 +1,116 @@
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+
+"""Round trip of k230_pack images through k230_boot on sandbox.
+
+Images are packed on the host with k230_pack, with and without the K230
+gzip format, and booted from memory and from the file-backed mmc1 of the
+test device tree. The payload has to come out unchanged at the load
+address of the legacy image header.
+"""
+
+import os
+import random
+import re
+import pytest
+import u_boot_utils
+import test_k230_boot_perf as perf
+
+# name, payload, k230_pack arguments
+PACK_CASES = (
+    ('rtt_l8', 'kernel', '-z'),
+    ('rtt_l1', 'kernel', '-z -l 1'),
+    ('rtt_l9', 'kernel', '-z -l 9'),
+    ('rtt_levels', 'kernel', '-z -l 9,1,6'),
+    # zlib makes stored blocks of these, k230_pack codes them again
+    ('rtt_random', 'random', '-z'),
+    # and a fixed block of this one
+    ('rtt_tiny', 'tiny', '-z'),
+    ('rtt_zeros', 'zeros', '-z'),
+    ('rtt_plain', 'kernel', ''),
+    ('uboot_gz', 'kernel', '-z'),
+    ('uboot_plain', 'kernel', ''),
+)
+PACK_ARGS = {
+    'rtt': '-O opensbi -T multi -a 0x1000000 -e 0x1000000 -n rtt',
+    'uboot': '-O u-boot -T firmware -a 0x8000000 -e 0x8000000 -n uboot',
+}
+PACK_OFFSET = {'rtt': 10 << 20, 'uboot': 2 << 20}
+# cases which have to go through the recoder
+PACK_RECODED = ('rtt_random', 'rtt_tiny')
+
+re_used = re.compile(r'K230 gzip level (\d+),')
+re_level = re.compile(r'^level (\d+): ok, \d+ blocks, (\d+) recoded', re.M)
+
+def recoded_blocks(output):
+    """Number of blocks recoded at the level k230_pack chose, from its -v output"""
+    used = re_used.search(output)
+    assert used, 'No K230 gzip stream made'
+    levels = {m.group(1): int(m.group(2)) for m in re_level.finditer(output)}
+    return levels[used.group(1)]
+
+def pack_payload(kind):
+    """Make the payload of a test case"""
+    if kind == 'kernel':
+        return perf.sandbox_payload(1 << 20)
+    if kind == 'random':
+        rnd = random.Random(230)
+        return bytes(rnd.getrandbits(8) for _ in range(256 << 10))
+    if kind == 'tiny':
+        return b'k230_pack round trip\n'
+    return bytes(1 << 20)
+
+def pack_image(cons, case, kind, args):
+    """Pack the payload of a test case with k230_pack
+
+    Returns:
+        tuple: payload, name of the image in k230_boot, packed image file,
+            output of k230_pack
+    """
+    name = case.split('_')[0]
+    payload = pack_payload(kind)
+    data = os.path.join(cons.config.result_dir, 'k230_pack_%s.bin' % case)
+    packed = os.path.join(cons.config.result_dir,
+                          'fn_k230_pack_%s.bin' % case)
+    with open(data, 'wb') as fd:
+        fd.write(payload)
+    k230_pack = os.path.join(cons.config.build_dir, 'tools', 'k230_pack')
+    output = u_boot_utils.run_and_log(cons, '%s -A riscv %s %s -v -d %s -N %s'
+                                      % (k230_pack, PACK_ARGS[name], args,
+                                         data, packed))
+    return payload, name, packed, output
+
+@pytest.mark.boardspec('sandbox')
+@pytest.mark.buildconfigspec('sandbox_k230_boot')
+@pytest.mark.buildconfigspec('cmd_bootstage')
+@pytest.mark.buildconfigspec('cmd_crc32')
+@pytest.mark.parametrize('case,kind,args', PACK_CASES)
+def test_k230_pack_round_trip(u_boot_console, case, kind, args):
+    """Boot a k230_pack image from memory and from the SD card."""
+    cons = u_boot_console
+    payload, name, packed, output = pack_image(cons, case, kind, args)
+    if case in PACK_RECODED:
+        assert recoded_blocks(output), 'No block of %s was recoded' % case
+
+    cmds = ['host load hostfs - %x %s' % (perf.SANDBOX_BUF, packed),
+            'k230_boot mem %x $filesize' % perf.SANDBOX_BUF]
+    perf.sandbox_boot(cons, cmds, name, payload)
+
+    mmc_img = os.path.join(cons.config.source_dir, 'mmc1.img')
+    saved = mmc_img + '.k230'
+
+    # mmc1.img belongs to the bootstd tests, put it back afterwards
+    if os.path.exists(mmc_img):
+        os.rename(mmc_img, saved)
+    try:
+        with open(mmc_img, 'wb') as mmc, open(packed, 'rb') as fd:
+            mmc.truncate(20 << 20)
+            mmc.seek(PACK_OFFSET[name])
+            mmc.write(fd.read())
+        perf.sandbox_boot(cons, ['k230_boot sdio1 %s' % name], name, payload)
+    finally:
+        if os.path.exists(mmc_img):
+            os.remove(mmc_img)
+        if os.path.exists(saved):
+            os.rename(saved, mmc_img)
+        cons.restart_uboot()
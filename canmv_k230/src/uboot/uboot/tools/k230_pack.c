@@ -0,0 +1,1628 @@
+/* Copyright (c) 2023, Canaan Bright Sight Co., Ltd
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * k230_pack - build K230 boot images in one pass
+ *
+ * Does what k230_priv_gzip, mkimage and firmware_gen.py used to do one
+ * after the other: the input is read once, optionally compressed in the
+ * K230 gzip format, put behind a legacy image header and wrapped in the
+ * firmware_head_s header checked by the boot ROM and k230_boot. The
+ * wrapper is a plain sha256, SM4-CBC + SM2 or AES-GCM + RSA-2048.
+ *
+ * The gzip engine only decodes deflate blocks with complete dynamic
+ * Huffman codes, and it is told a K230 stream by CM 9 in the gzip header.
+ * k230_priv_gzip was a gzip that never emits stored or fixed blocks. Here
+ * zlib compresses and the blocks the engine cannot take are coded again
+ * as dynamic ones. The levels are tried in parallel, and the first one in
+ * the preference list whose stream keeps to the engine constraints and
+ * inflates back to the input is used.
+ */
+#define OPENSSL_API_COMPAT 0x10101000L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rsa.h>
+
+/* zlib's crc32() prototype clashes with the one of lib/crc32.c */
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+
+#include "compiler.h"
+#include <image.h>
+#include <u-boot/crc.h>
+
+#if !defined(OPENSSL_NO_SM2) && !defined(OPENSSL_NO_SM3) && \
+    !defined(OPENSSL_NO_SM4)
+#define K230_PACK_SM
+#endif
+
+#define K230_IMAGE_MAGIC_NUM 0x3033324B /* "K230" */
+#define K230_GZIP_CM 0x09
+/* gzip_src_size and dma_out_size of the engine, bit 31 is a control bit */
+#define K230_GZIP_MAX_SIZE 0x7fffffffUL
+
+#define PACK_MAX_LEVELS 9
+#define PACK_CHUNK (1 << 20)
+
+/* firmware_head_s of board/kendryte/common/board_common.h */
+enum k230_crypto {
+  K230_CRYPTO_NONE = 0,
+  K230_CRYPTO_SM4 = 1,
+  K230_CRYPTO_AES = 2,
+  K230_CRYPTO_NUM,
+};
+
+struct k230_fw_head {
+  uint32_t magic;
+  uint32_t length;
+  uint32_t crypto_type;
+  union {
+    struct {
+      uint8_t n[256];
+      uint32_t e;
+      uint8_t signature[256];
+    } rsa;
+    struct {
+      uint32_t idlen;
+      uint8_t id[512 - 32 * 4];
+      uint8_t pukx[32];
+      uint8_t puky[32];
+      uint8_t r[32];
+      uint8_t s[32];
+    } sm2;
+    struct {
+      uint8_t signature[32];
+      uint8_t reserved[516 - 32];
+    } none_sec;
+  } verify;
+} __attribute__((packed));
+
+/* development keys, the same as firmware_gen.py */
+static const uint8_t aes_key[32] = {
+    0x24, 0x50, 0x1a, 0xd3, 0x84, 0xe4, 0x73, 0x96, 0x3d, 0x47, 0x6e,
+    0xdc, 0xfe, 0x08, 0x20, 0x52, 0x37, 0xac, 0xfd, 0x49, 0xb5, 0xb8,
+    0xf3, 0x38, 0x57, 0xf8, 0x11, 0x4e, 0x86, 0x3f, 0xec, 0x7f,
+};
+
+static const uint8_t aes_iv[12] = {
+    0x9f, 0xf1, 0x85, 0x63, 0xb9, 0x78, 0xec, 0x28, 0x1b, 0x3f, 0x27, 0x94,
+};
+
+static const uint8_t rsa_n[256] = {
+    0xce, 0xa8, 0x04, 0x75, 0x32, 0x4c, 0x1d, 0xc8, 0x34, 0x78, 0x27, 0x81,
+    0x8d, 0xa5, 0x8b, 0xac, 0x06, 0x9d, 0x34, 0x19, 0xc6, 0x14, 0xa6, 0xea,
+    0x1a, 0xc6, 0xa3, 0xb5, 0x10, 0xdc, 0xd7, 0x2c, 0xc5, 0x16, 0x95, 0x49,
+    0x05, 0xe9, 0xfe, 0xf9, 0x08, 0xd4, 0x5e, 0x13, 0x00, 0x6a, 0xdf, 0x27,
+    0xd4, 0x67, 0xa7, 0xd8, 0x3c, 0x11, 0x1d, 0x1a, 0x5d, 0xf1, 0x5e, 0xf2,
+    0x93, 0x77, 0x1a, 0xef, 0xb9, 0x20, 0x03, 0x2a, 0x5b, 0xb9, 0x89, 0xf8,
+    0xe4, 0xf5, 0xe1, 0xb0, 0x50, 0x93, 0xd3, 0xf1, 0x30, 0xf9, 0x84, 0xc0,
+    0x7a, 0x77, 0x2a, 0x36, 0x83, 0xf4, 0xdc, 0x6f, 0xb2, 0x8a, 0x96, 0x81,
+    0x5b, 0x32, 0x12, 0x3c, 0xcd, 0xd1, 0x39, 0x54, 0xf1, 0x9d, 0x5b, 0x8b,
+    0x24, 0xa1, 0x03, 0xe7, 0x71, 0xa3, 0x4c, 0x32, 0x87, 0x55, 0xc6, 0x5e,
+    0xd6, 0x4e, 0x19, 0x24, 0xff, 0xd0, 0x4d, 0x30, 0xb2, 0x14, 0x2c, 0xc2,
+    0x62, 0xf6, 0xe0, 0x04, 0x8f, 0xef, 0x6d, 0xbc, 0x65, 0x2f, 0x21, 0x47,
+    0x9e, 0xa1, 0xc4, 0xb1, 0xd6, 0x6d, 0x28, 0xf4, 0xd4, 0x6e, 0xf7, 0x18,
+    0x5e, 0x39, 0x0c, 0xbf, 0xa2, 0xe0, 0x23, 0x80, 0x58, 0x2f, 0x31, 0x88,
+    0xbb, 0x94, 0xeb, 0xbf, 0x05, 0xd3, 0x14, 0x87, 0xa0, 0x9a, 0xff, 0x01,
+    0xfc, 0xbb, 0x4c, 0xd4, 0xbf, 0xd1, 0xf0, 0xa8, 0x33, 0xb3, 0x8c, 0x11,
+    0x81, 0x3c, 0x84, 0x36, 0x0b, 0xb5, 0x3c, 0x7d, 0x44, 0x81, 0x03, 0x1c,
+    0x40, 0xba, 0xd8, 0x71, 0x3b, 0xb6, 0xb8, 0x35, 0xcb, 0x08, 0x09, 0x8e,
+    0xd1, 0x5b, 0xa3, 0x1e, 0xe4, 0xba, 0x72, 0x8a, 0x8c, 0x8e, 0x10, 0xf7,
+    0x29, 0x4e, 0x1b, 0x41, 0x63, 0xb7, 0xae, 0xe5, 0x72, 0x77, 0xbf, 0xd8,
+    0x81, 0xa6, 0xf9, 0xd4, 0x3e, 0x02, 0xc6, 0x92, 0x5a, 0xa3, 0xa0, 0x43,
+    0xfb, 0x7f, 0xb7, 0x8d,
+};
+
+static const uint32_t rsa_e = 0x260445;
+
+static const uint8_t rsa_d[256] = {
+    0x09, 0x97, 0x63, 0x4c, 0x47, 0x7c, 0x1a, 0x03, 0x9d, 0x44, 0xc8, 0x10,
+    0xb2, 0xaa, 0xa3, 0xc7, 0x86, 0x2b, 0x0b, 0x88, 0xd3, 0x70, 0x82, 0x72,
+    0xe1, 0xe1, 0x5f, 0x66, 0xfc, 0x93, 0x89, 0x70, 0x9f, 0x8a, 0x11, 0xf3,
+    0xea, 0x6a, 0x5a, 0xf7, 0xef, 0xfa, 0x2d, 0x01, 0xc1, 0x89, 0xc5, 0x0f,
+    0x0d, 0x5b, 0xcb, 0xe3, 0xfa, 0x27, 0x2e, 0x56, 0xcf, 0xc4, 0xa4, 0xe1,
+    0xd3, 0x88, 0xa9, 0xdc, 0xd6, 0x5d, 0xf8, 0x62, 0x89, 0x02, 0x55, 0x6c,
+    0x8b, 0x6b, 0xb6, 0xa6, 0x41, 0x70, 0x9b, 0x5a, 0x35, 0xdd, 0x26, 0x22,
+    0xc7, 0x3d, 0x46, 0x40, 0xbf, 0xa1, 0x35, 0x9d, 0x0e, 0x76, 0xe1, 0xf2,
+    0x19, 0xf8, 0xe3, 0x3e, 0xb9, 0xbd, 0x0b, 0x59, 0xec, 0x19, 0x8e, 0xb2,
+    0xfc, 0xca, 0xae, 0x03, 0x46, 0xbd, 0x8b, 0x40, 0x1e, 0x12, 0xe3, 0xc6,
+    0x7c, 0xb6, 0x29, 0x56, 0x9c, 0x18, 0x5a, 0x2e, 0x0f, 0x35, 0xa2, 0xf7,
+    0x41, 0x64, 0x4c, 0x1c, 0xca, 0x5e, 0xbb, 0x13, 0x9d, 0x77, 0xa8, 0x9a,
+    0x29, 0x53, 0xfc, 0x5e, 0x30, 0x04, 0x8c, 0x0e, 0x61, 0x9f, 0x07, 0xc8,
+    0xd2, 0x1d, 0x1e, 0x56, 0xb8, 0xaf, 0x07, 0x19, 0x3d, 0x0f, 0xdf, 0x3f,
+    0x49, 0xcd, 0x49, 0xf2, 0xef, 0x31, 0x38, 0xb5, 0x13, 0x88, 0x62, 0xf1,
+    0x47, 0x0b, 0xd2, 0xd1, 0x6e, 0x34, 0xa2, 0xb9, 0xe7, 0x77, 0x7a, 0x6c,
+    0x8c, 0x8d, 0x4c, 0xb9, 0x4b, 0x4e, 0x8b, 0x5d, 0x61, 0x6c, 0xd5, 0x39,
+    0x37, 0x53, 0xe7, 0xb0, 0xf3, 0x1c, 0xc7, 0xda, 0x55, 0x9b, 0xa8, 0xe9,
+    0x8d, 0x88, 0x89, 0x14, 0xe3, 0x34, 0x77, 0x3b, 0xaf, 0x49, 0x8a, 0xd8,
+    0x8d, 0x96, 0x31, 0xeb, 0x5f, 0xe3, 0x2e, 0x53, 0xa4, 0x14, 0x5b, 0xf0,
+    0xba, 0x54, 0x8b, 0xf2, 0xb0, 0xa5, 0x0c, 0x63, 0xf6, 0x7b, 0x14, 0xe3,
+    0x98, 0xa3, 0x4b, 0x0d,
+};
+
+#ifdef K230_PACK_SM
+static const uint8_t sm4_key[16] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+    0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+};
+
+static const uint8_t sm4_iv[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+
+static const uint8_t sm2_priv[32] = {
+    0x39, 0x45, 0x20, 0x8f, 0x7b, 0x21, 0x44, 0xb1, 0x3f, 0x36, 0xe3,
+    0x8a, 0xc6, 0xd3, 0x9f, 0x95, 0x88, 0x93, 0x93, 0x69, 0x28, 0x60,
+    0xb5, 0x1a, 0x42, 0xfb, 0x81, 0xef, 0x4d, 0xf7, 0xc5, 0xb8,
+};
+
+/* the nonce is fixed so that the images are reproducible */
+static const uint8_t sm2_k[32] = {
+    0x59, 0x27, 0x6e, 0x27, 0xd5, 0x06, 0x86, 0x1a, 0x16, 0x68, 0x0f,
+    0x3a, 0xd9, 0xc0, 0x2d, 0xcc, 0xef, 0x3c, 0xc1, 0xfa, 0x3c, 0xdb,
+    0xe4, 0xce, 0x6d, 0x54, 0xb8, 0x0d, 0xea, 0xc1, 0xbc, 0x21,
+};
+#endif
+
+static const uint8_t sm2_pukx[32] = {
+    0x09, 0xf9, 0xdf, 0x31, 0x1e, 0x54, 0x21, 0xa1, 0x50, 0xdd, 0x7d,
+    0x16, 0x1e, 0x4b, 0xc5, 0xc6, 0x72, 0x17, 0x9f, 0xad, 0x18, 0x33,
+    0xfc, 0x07, 0x6b, 0xb0, 0x8f, 0xf3, 0x56, 0xf3, 0x50, 0x20,
+};
+
+static const uint8_t sm2_puky[32] = {
+    0xcc, 0xea, 0x49, 0x0c, 0xe2, 0x67, 0x75, 0xa5, 0x2d, 0xc6, 0xea,
+    0x71, 0x8c, 0xc1, 0xaa, 0x60, 0x0a, 0xed, 0x05, 0xfb, 0xf3, 0x5e,
+    0x08, 0x4a, 0x66, 0x32, 0xf6, 0x07, 0x2d, 0xa9, 0xad, 0x13,
+};
+
+static const char sm2_id[] = "1234567812345678";
+
+struct pack_params {
+  const char *cmdname;
+  const char *datafile;
+  const char *outfile[K230_CRYPTO_NUM];
+  int raw;      /* no legacy image header */
+  int compress; /* compress the input in the K230 gzip format */
+  int levels[PACK_MAX_LEVELS];
+  int nlevels;
+  int verbose;
+  int os;
+  int arch;
+  int type;
+  int comp;
+  uint32_t addr;
+  uint32_t ep;
+  const char *name;
+};
+
+/*
+ * Deflate streams
+ */
+
+static const uint16_t len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const uint16_t dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577,
+};
+
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static const uint8_t cl_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+#define HUFF_MAX_BITS 15
+#define HUFF_CL_MAX_BITS 7
+#define HUFF_LIT_CODES 286
+#define HUFF_DIST_CODES 30
+
+/* a literal (dist == 0) or a match */
+struct lz_sym {
+  uint16_t len;
+  uint16_t dist;
+};
+
+struct bit_reader {
+  const uint8_t *buf; /* followed by 8 readable bytes */
+  uint64_t pos;
+  uint64_t end;
+};
+
+struct bit_writer {
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  uint64_t acc;
+  int n;
+};
+
+/* entries are sym << 4 | code length, 0 for unused codes */
+struct huff_table {
+  uint16_t entry[1 << HUFF_MAX_BITS];
+  int bits;
+};
+
+static inline uint32_t br_peek(const struct bit_reader *br, int n) {
+  uint64_t v;
+
+  memcpy(&v, br->buf + (br->pos >> 3), sizeof(v));
+  v = le64_to_cpu(v);
+
+  return (v >> (br->pos & 7)) & ((1ULL << n) - 1);
+}
+
+static inline uint32_t br_get(struct bit_reader *br, int n) {
+  uint32_t v = br_peek(br, n);
+
+  br->pos += n;
+  return v;
+}
+
+static inline int br_decode(struct bit_reader *br,
+                            const struct huff_table *t) {
+  uint16_t e = t->entry[br_peek(br, t->bits)];
+
+  if (!(e & 15))
+    return -1;
+  br->pos += e & 15;
+  return e >> 4;
+}
+
+static int bw_reserve(struct bit_writer *bw, size_t bytes) {
+  uint8_t *buf;
+  size_t cap;
+
+  if (bw->len + bytes + 8 <= bw->cap)
+    return 0;
+
+  cap = bw->cap * 2 + bytes + 8;
+  buf = realloc(bw->buf, cap);
+  if (!buf)
+    return -ENOMEM;
+  bw->buf = buf;
+  bw->cap = cap;
+  return 0;
+}
+
+/* callers reserve room first, n is at most 32 */
+static inline void bw_put(struct bit_writer *bw, uint32_t bits, int n) {
+  bw->acc |= (uint64_t)bits << bw->n;
+  bw->n += n;
+  while (bw->n >= 8) {
+    bw->buf[bw->len++] = bw->acc;
+    bw->acc >>= 8;
+    bw->n -= 8;
+  }
+}
+
+static void bw_flush(struct bit_writer *bw) {
+  if (bw->n)
+    bw->buf[bw->len++] = bw->acc;
+  bw->acc = 0;
+  bw->n = 0;
+}
+
+static void bw_copy(struct bit_writer *bw, struct bit_reader *br,
+                    uint64_t from, uint64_t to) {
+  uint64_t pos = br->pos;
+
+  br->pos = from;
+  while (to - br->pos >= 32)
+    bw_put(bw, br_get(br, 32), 32);
+  if (to > br->pos)
+    bw_put(bw, br_get(br, to - br->pos), to - br->pos);
+  br->pos = pos;
+}
+
+static uint16_t bit_reverse(uint16_t code, int len) {
+  uint16_t r = 0;
+
+  while (len--) {
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+/* canonical codes, bit reversed as deflate sends them LSB first */
+static void huff_codes(const uint8_t *lens, int n, uint16_t *codes) {
+  uint16_t count[HUFF_MAX_BITS + 1] = {0};
+  uint16_t next[HUFF_MAX_BITS + 1];
+  uint16_t code = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    count[lens[i]]++;
+  count[0] = 0;
+  for (i = 1; i <= HUFF_MAX_BITS; i++) {
+    code = (code + count[i - 1]) << 1;
+    next[i] = code;
+  }
+  for (i = 0; i < n; i++)
+    codes[i] = lens[i] ? bit_reverse(next[lens[i]]++, lens[i]) : 0;
+}
+
+/*
+ * Build the decode table of a code, returns 1 if the code is complete,
+ * 0 if not and -1 if it is over-subscribed.
+ */
+static int huff_build(struct huff_table *t, const uint8_t *lens, int n) {
+  uint16_t codes[HUFF_LIT_CODES + 2];
+  uint32_t kraft = 0;
+  int i, j;
+
+  t->bits = 0;
+  for (i = 0; i < n; i++) {
+    if (lens[i] > t->bits)
+      t->bits = lens[i];
+  }
+  if (!t->bits)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    if (lens[i])
+      kraft += 1U << (HUFF_MAX_BITS - lens[i]);
+  }
+  if (kraft > 1U << HUFF_MAX_BITS)
+    return -1;
+
+  huff_codes(lens, n, codes);
+  memset(t->entry, 0, sizeof(t->entry[0]) << t->bits);
+  for (i = 0; i < n; i++) {
+    if (!lens[i])
+      continue;
+    for (j = codes[i]; j < 1 << t->bits; j += 1 << lens[i])
+      t->entry[j] = i << 4 | lens[i];
+  }
+
+  return kraft == 1U << HUFF_MAX_BITS;
+}
+
+/*
+ * Code lengths of at most maxbits for the symbols of freq, the code is
+ * always complete. Lengths come from a Huffman tree, and if it is too
+ * deep, the longest codes are clamped and the shortest ones made longer
+ * until the Kraft sum is one again.
+ */
+static void huff_lengths(const uint32_t *freq, int n, int maxbits,
+                         uint8_t *lens) {
+  int sym[HUFF_LIT_CODES];
+  uint64_t w[2 * HUFF_LIT_CODES];
+  int parent[2 * HUFF_LIT_CODES];
+  int depth[2 * HUFF_LIT_CODES];
+  int count[HUFF_MAX_BITS + 1] = {0};
+  int leaf, node, next;
+  int i, j, m = 0;
+  uint32_t total = 0;
+
+  memset(lens, 0, n);
+  for (i = 0; i < n; i++) {
+    if (!freq[i])
+      continue;
+    /* insertion sort by frequency, ties by symbol */
+    for (j = m++; j > 0 && freq[sym[j - 1]] > freq[i]; j--)
+      sym[j] = sym[j - 1];
+    sym[j] = i;
+  }
+  for (i = 0; i < m; i++)
+    w[i] = freq[sym[i]];
+
+  /* two queue Huffman: sorted leaves, then nodes in creation order */
+  leaf = 0;
+  node = m;
+  for (next = m; next < 2 * m - 1; next++) {
+    int pick[2];
+
+    for (j = 0; j < 2; j++) {
+      if (leaf < m && (node >= next || w[leaf] <= w[node]))
+        pick[j] = leaf++;
+      else
+        pick[j] = node++;
+      parent[pick[j]] = next;
+    }
+    w[next] = w[pick[0]] + w[pick[1]];
+  }
+
+  depth[2 * m - 2] = 0;
+  for (i = 2 * m - 3; i >= 0; i--)
+    depth[i] = depth[parent[i]] + 1;
+
+  for (i = 0; i < m; i++)
+    count[depth[i] > maxbits ? maxbits : depth[i]]++;
+  for (i = 1; i <= maxbits; i++)
+    total += count[i] << (maxbits - i);
+  while (total > 1U << maxbits) {
+    count[maxbits]--;
+    for (i = maxbits - 1; i > 0; i--) {
+      if (count[i]) {
+        count[i]--;
+        count[i + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  /* the least frequent symbols get the longest codes */
+  for (i = maxbits, j = 0; i > 0; i--) {
+    for (; count[i]; count[i]--)
+      lens[sym[j++]] = i;
+  }
+}
+
+/* a Huffman code needs two symbols, the same as gzip and zlib do */
+static void huff_two_codes(uint32_t *freq, int n) {
+  int i, used = 0;
+
+  for (i = 0; i < n; i++)
+    used += !!freq[i];
+  for (i = 0; used < 2 && i < n; i++) {
+    if (!freq[i]) {
+      freq[i] = 1;
+      used++;
+    }
+  }
+}
+
+static int len_code(int len) {
+  int i = 28;
+
+  while (len_base[i] > len)
+    i--;
+  return i;
+}
+
+static int dist_code(int dist) {
+  int i = 29;
+
+  while (dist_base[i] > dist)
+    i--;
+  return i;
+}
+
+/* run length code the code lengths of a dynamic block header */
+static int cl_encode(const uint8_t *lens, int n, uint8_t *sym, uint8_t *extra) {
+  int i = 0, k = 0;
+
+  while (i < n) {
+    int v = lens[i];
+    int run = 1;
+
+    while (i + run < n && lens[i + run] == v)
+      run++;
+    i += run;
+
+    if (!v) {
+      while (run >= 11) {
+        int r = run > 138 ? 138 : run;
+
+        sym[k] = 18;
+        extra[k++] = r - 11;
+        run -= r;
+      }
+      if (run >= 3) {
+        sym[k] = 17;
+        extra[k++] = run - 3;
+        run = 0;
+      }
+    } else {
+      sym[k++] = v;
+      run--;
+      while (run >= 3) {
+        int r = run > 6 ? 6 : run;
+
+        sym[k] = 16;
+        extra[k++] = r - 3;
+        run -= r;
+      }
+    }
+    while (run--)
+      sym[k++] = v;
+  }
+
+  return k;
+}
+
+static int deflate_put_dynamic(struct bit_writer *bw,
+                               const struct lz_sym *syms, size_t nsyms,
+                               int final) {
+  static const uint8_t cl_extra_bits[3] = {2, 3, 7};
+  uint32_t lfreq[HUFF_LIT_CODES] = {0}, dfreq[HUFF_DIST_CODES] = {0};
+  uint32_t clfreq[19] = {0};
+  uint8_t lens[HUFF_LIT_CODES + HUFF_DIST_CODES];
+  uint8_t *llen = lens, dlen[HUFF_DIST_CODES], cllen[19];
+  uint16_t lcode[HUFF_LIT_CODES], dcode[HUFF_DIST_CODES], clcode[19];
+  uint8_t clsym[HUFF_LIT_CODES + HUFF_DIST_CODES];
+  uint8_t clext[HUFF_LIT_CODES + HUFF_DIST_CODES];
+  int hlit, hdist, hclen, ncl;
+  size_t i;
+  int ret;
+
+  for (i = 0; i < nsyms; i++) {
+    if (!syms[i].dist) {
+      lfreq[syms[i].len]++;
+    } else {
+      lfreq[257 + len_code(syms[i].len)]++;
+      dfreq[dist_code(syms[i].dist)]++;
+    }
+  }
+  lfreq[256] = 1;
+  huff_two_codes(lfreq, HUFF_LIT_CODES);
+  huff_two_codes(dfreq, HUFF_DIST_CODES);
+  huff_lengths(lfreq, HUFF_LIT_CODES, HUFF_MAX_BITS, llen);
+  huff_lengths(dfreq, HUFF_DIST_CODES, HUFF_MAX_BITS, dlen);
+
+  for (hlit = HUFF_LIT_CODES; hlit > 257 && !llen[hlit - 1]; hlit--)
+    ;
+  for (hdist = HUFF_DIST_CODES; hdist > 1 && !dlen[hdist - 1]; hdist--)
+    ;
+  memmove(lens + hlit, dlen, hdist);
+
+  ncl = cl_encode(lens, hlit + hdist, clsym, clext);
+  for (i = 0; i < ncl; i++)
+    clfreq[clsym[i]]++;
+  huff_two_codes(clfreq, 19);
+  huff_lengths(clfreq, 19, HUFF_CL_MAX_BITS, cllen);
+  for (hclen = 19; hclen > 4 && !cllen[cl_order[hclen - 1]]; hclen--)
+    ;
+
+  memmove(dlen, lens + hlit, hdist);
+  memset(dlen + hdist, 0, HUFF_DIST_CODES - hdist);
+  huff_codes(llen, hlit, lcode);
+  huff_codes(dlen, HUFF_DIST_CODES, dcode);
+  huff_codes(cllen, 19, clcode);
+
+  /* at most 48 bits a symbol, plus the header */
+  ret = bw_reserve(bw, nsyms * 6 + 512);
+  if (ret)
+    return ret;
+
+  bw_put(bw, final, 1);
+  bw_put(bw, 2, 2);
+  bw_put(bw, hlit - 257, 5);
+  bw_put(bw, hdist - 1, 5);
+  bw_put(bw, hclen - 4, 4);
+  for (i = 0; i < hclen; i++)
+    bw_put(bw, cllen[cl_order[i]], 3);
+  for (i = 0; i < ncl; i++) {
+    bw_put(bw, clcode[clsym[i]], cllen[clsym[i]]);
+    if (clsym[i] >= 16)
+      bw_put(bw, clext[i], cl_extra_bits[clsym[i] - 16]);
+  }
+
+  for (i = 0; i < nsyms; i++) {
+    const struct lz_sym *s = &syms[i];
+    int c;
+
+    if (!s->dist) {
+      bw_put(bw, lcode[s->len], llen[s->len]);
+      continue;
+    }
+    c = len_code(s->len);
+    bw_put(bw, lcode[257 + c], llen[257 + c]);
+    bw_put(bw, s->len - len_base[c], len_extra[c]);
+    c = dist_code(s->dist);
+    bw_put(bw, dcode[c], dlen[c]);
+    bw_put(bw, s->dist - dist_base[c], dist_extra[c]);
+  }
+  bw_put(bw, lcode[256], llen[256]);
+
+  return 0;
+}
+
+struct gz_job {
+  int index; /* in the preference list */
+  int level;
+  const uint8_t *in;
+  size_t in_len;
+  uint8_t *out; /* raw deflate stream */
+  size_t out_len;
+  unsigned int blocks;
+  unsigned int recoded;
+  int ret;
+  struct gz_shared *shared;
+  /* scratch for the recoder */
+  struct huff_table lit, dist, cl;
+  struct lz_sym *syms;
+  size_t syms_cap;
+};
+
+struct gz_shared {
+  pthread_mutex_t lock;
+  struct gz_job *jobs;
+  int njobs;
+  int next; /* next job to start */
+  int best; /* best index that succeeded so far */
+};
+
+static int gz_job_cancelled(struct gz_job *job) {
+  int best;
+
+  pthread_mutex_lock(&job->shared->lock);
+  best = job->shared->best;
+  pthread_mutex_unlock(&job->shared->lock);
+
+  return best < job->index;
+}
+
+static int gz_job_add_sym(struct gz_job *job, size_t *n, int len, int dist) {
+  if (*n == job->syms_cap) {
+    size_t cap = job->syms_cap ? job->syms_cap * 2 : 65536;
+    struct lz_sym *syms = realloc(job->syms, cap * sizeof(*syms));
+
+    if (!syms)
+      return -ENOMEM;
+    job->syms = syms;
+    job->syms_cap = cap;
+  }
+  job->syms[*n].len = len;
+  job->syms[(*n)++].dist = dist;
+  return 0;
+}
+
+/* decode the symbols of a Huffman coded block into job->syms */
+static int gz_read_block(struct gz_job *job, struct bit_reader *br,
+                         size_t *nsyms) {
+  int ret;
+
+  *nsyms = 0;
+  for (;;) {
+    int sym = br_decode(br, &job->lit);
+    int len, dist;
+
+    if (sym < 0 || br->pos > br->end)
+      return -EINVAL;
+    if (sym < 256) {
+      ret = gz_job_add_sym(job, nsyms, sym, 0);
+    } else if (sym == 256) {
+      return 0;
+    } else {
+      sym -= 257;
+      if (sym >= 29)
+        return -EINVAL;
+      len = len_base[sym] + br_get(br, len_extra[sym]);
+      sym = br_decode(br, &job->dist);
+      if (sym < 0 || sym >= 30)
+        return -EINVAL;
+      dist = dist_base[sym] + br_get(br, dist_extra[sym]);
+      ret = gz_job_add_sym(job, nsyms, len, dist);
+    }
+    if (ret)
+      return ret;
+  }
+}
+
+/* read the code lengths of a dynamic block, returns 1 if both codes are complete */
+static int gz_read_dynamic_header(struct gz_job *job, struct bit_reader *br) {
+  uint8_t lens[HUFF_LIT_CODES + 2 + HUFF_DIST_CODES + 2] = {0};
+  uint8_t cllen[19] = {0};
+  int hlit = br_get(br, 5) + 257;
+  int hdist = br_get(br, 5) + 1;
+  int hclen = br_get(br, 4) + 4;
+  int i, lc, dc;
+
+  if (hlit > HUFF_LIT_CODES + 2 || hdist > HUFF_DIST_CODES + 2)
+    return -EINVAL;
+  for (i = 0; i < hclen; i++)
+    cllen[cl_order[i]] = br_get(br, 3);
+  if (huff_build(&job->cl, cllen, 19) < 0)
+    return -EINVAL;
+
+  for (i = 0; i < hlit + hdist;) {
+    int sym = br_decode(br, &job->cl);
+    int v = 0, run;
+
+    if (sym < 0)
+      return -EINVAL;
+    if (sym < 16) {
+      lens[i++] = sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (!i)
+        return -EINVAL;
+      v = lens[i - 1];
+      run = 3 + br_get(br, 2);
+    } else if (sym == 17) {
+      run = 3 + br_get(br, 3);
+    } else {
+      run = 11 + br_get(br, 7);
+    }
+    if (i + run > hlit + hdist)
+      return -EINVAL;
+    while (run--)
+      lens[i++] = v;
+  }
+
+  lc = huff_build(&job->lit, lens, hlit);
+  dc = huff_build(&job->dist, lens + hlit, hdist);
+  if (lc < 0 || dc < 0 || !lens[256])
+    return -EINVAL;
+
+  return lc == 1 && dc == 1;
+}
+
+static void gz_fixed_tables(struct gz_job *job) {
+  uint8_t lens[288];
+  int i;
+
+  for (i = 0; i < 288; i++)
+    lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  huff_build(&job->lit, lens, 288);
+  memset(lens, 5, 30);
+  huff_build(&job->dist, lens, 30);
+}
+
+/*
+ * Copy the dynamic blocks of the zlib stream, and code the stored and
+ * fixed blocks, or ones with incomplete codes, again as dynamic blocks.
+ */
+static int gz_recode(struct gz_job *job, const uint8_t *raw, size_t raw_len,
+                     struct bit_writer *bw) {
+  struct bit_reader br = {raw, 0, (uint64_t)raw_len * 8};
+  size_t nsyms, i;
+  int final, type, ret;
+
+  do {
+    uint64_t start = br.pos;
+
+    if (br.pos + 3 > br.end)
+      return -EINVAL;
+    final = br_get(&br, 1);
+    type = br_get(&br, 2);
+    job->blocks++;
+
+    if (type == 2) {
+      ret = gz_read_dynamic_header(job, &br);
+      if (ret < 0)
+        return ret;
+      if (ret == 1) {
+        ret = gz_read_block(job, &br, &nsyms);
+        if (ret)
+          return ret;
+        ret = bw_reserve(bw, (br.pos - start) / 8 + 1);
+        if (ret)
+          return ret;
+        bw_copy(bw, &br, start, br.pos);
+        continue;
+      }
+      ret = gz_read_block(job, &br, &nsyms);
+    } else if (type == 1) {
+      gz_fixed_tables(job);
+      ret = gz_read_block(job, &br, &nsyms);
+    } else if (type == 0) {
+      uint32_t len, nlen;
+
+      br.pos = (br.pos + 7) & ~7ULL;
+      len = br_get(&br, 16);
+      nlen = br_get(&br, 16);
+      if ((len ^ 0xffff) != nlen || br.pos + len * 8 > br.end)
+        return -EINVAL;
+      nsyms = 0;
+      for (i = 0, ret = 0; i < len && !ret; i++)
+        ret = gz_job_add_sym(job, &nsyms, raw[br.pos / 8 + i], 0);
+      br.pos += len * 8;
+      /* empty stored blocks are only there to byte align */
+      if (!ret && !len && !final)
+        continue;
+    } else {
+      return -EINVAL;
+    }
+    if (ret)
+      return ret;
+
+    ret = deflate_put_dynamic(bw, job->syms, nsyms, final);
+    if (ret)
+      return ret;
+    job->recoded++;
+  } while (!final);
+
+  bw_flush(bw);
+  return 0;
+}
+
+/*
+ * Walk the recoded stream as the engine will: every block has to be a
+ * dynamic one with complete codes, and the last one has to end it.
+ */
+static int gz_check_engine(struct gz_job *job, const uint8_t *stream,
+                           size_t len) {
+  struct bit_reader br = {stream, 0, (uint64_t)len * 8};
+  size_t nsyms;
+  int final, ret;
+
+  do {
+    if (br.pos + 3 > br.end)
+      return -EINVAL;
+    final = br_get(&br, 1);
+    if (br_get(&br, 2) != 2)
+      return -EINVAL;
+    ret = gz_read_dynamic_header(job, &br);
+    if (ret != 1)
+      return -EINVAL;
+    ret = gz_read_block(job, &br, &nsyms);
+    if (ret)
+      return ret;
+  } while (!final);
+
+  return (br.end - br.pos) < 8 ? 0 : -EINVAL;
+}
+
+/* inflate the stream back and compare it with the input */
+static int gz_verify(const uint8_t *stream, size_t len, const uint8_t *in,
+                     size_t in_len) {
+  uint8_t *buf = malloc(PACK_CHUNK);
+  size_t done = 0;
+  z_stream zs;
+  int ret;
+
+  if (!buf)
+    return -ENOMEM;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+    free(buf);
+    return -ENOMEM;
+  }
+
+  zs.next_in = (uint8_t *)stream;
+  zs.avail_in = len;
+  do {
+    zs.next_out = buf;
+    zs.avail_out = PACK_CHUNK;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END)
+      break;
+    len = PACK_CHUNK - zs.avail_out;
+    if (done + len > in_len || memcmp(buf, in + done, len)) {
+      ret = Z_DATA_ERROR;
+      break;
+    }
+    done += len;
+  } while (ret != Z_STREAM_END);
+
+  inflateEnd(&zs);
+  free(buf);
+
+  return ret == Z_STREAM_END && done == in_len && !zs.avail_in ? 0 : -EINVAL;
+}
+
+static int gz_job_run(struct gz_job *job) {
+  struct bit_writer bw = {0};
+  uint8_t *raw;
+  size_t bound, off = 0;
+  z_stream zs;
+  int ret;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, job->level, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return -ENOMEM;
+
+  /* 8 spare bytes for br_peek() */
+  bound = deflateBound(&zs, job->in_len) + 8;
+  raw = calloc(1, bound);
+  if (!raw) {
+    deflateEnd(&zs);
+    return -ENOMEM;
+  }
+
+  zs.next_out = raw;
+  zs.avail_out = bound - 8;
+  do {
+    size_t n = job->in_len - off > PACK_CHUNK ? PACK_CHUNK : job->in_len - off;
+
+    if (gz_job_cancelled(job)) {
+      ret = -ECANCELED;
+      goto out;
+    }
+    zs.next_in = (uint8_t *)job->in + off;
+    zs.avail_in = n;
+    off += n;
+    ret = deflate(&zs, off == job->in_len ? Z_FINISH : Z_NO_FLUSH);
+  } while (ret == Z_OK && off < job->in_len);
+  if (ret != Z_STREAM_END) {
+    ret = -EINVAL;
+    goto out;
+  }
+
+  ret = bw_reserve(&bw, zs.total_out + zs.total_out / 64 + 1024);
+  if (!ret)
+    ret = gz_recode(job, raw, zs.total_out, &bw);
+  /* zeroed spare bytes for br_peek() */
+  if (!ret)
+    ret = bw_reserve(&bw, 8);
+  if (!ret && !gz_job_cancelled(job)) {
+    memset(bw.buf + bw.len, 0, 8);
+    ret = gz_check_engine(job, bw.buf, bw.len);
+    if (!ret)
+      ret = gz_verify(bw.buf, bw.len, job->in, job->in_len);
+  }
+  if (!ret && bw.len + 18 > K230_GZIP_MAX_SIZE)
+    ret = -EFBIG;
+
+out:
+  deflateEnd(&zs);
+  free(raw);
+  if (ret) {
+    free(bw.buf);
+    return ret;
+  }
+  job->out = bw.buf;
+  job->out_len = bw.len;
+  return 0;
+}
+
+/* workers take the levels in order of preference */
+static void *gz_worker(void *arg) {
+  struct gz_shared *shared = arg;
+  struct gz_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&shared->lock);
+    job = shared->next < shared->njobs ? &shared->jobs[shared->next++] : NULL;
+    pthread_mutex_unlock(&shared->lock);
+    if (!job)
+      return NULL;
+
+    job->ret = gz_job_cancelled(job) ? -ECANCELED : gz_job_run(job);
+    if (!job->ret) {
+      pthread_mutex_lock(&shared->lock);
+      if (job->index < shared->best)
+        shared->best = job->index;
+      pthread_mutex_unlock(&shared->lock);
+    }
+    free(job->syms);
+    job->syms = NULL;
+  }
+}
+
+/*
+ * Compress in the K230 gzip format, returns the gzip member in *out. The
+ * levels run on up to one thread per CPU, a level is dropped once one
+ * earlier in the list has made it.
+ */
+static int k230_gzip(struct pack_params *params, const uint8_t *in,
+                     size_t in_len, uint8_t **out, size_t *out_len) {
+  struct gz_shared shared = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .njobs = params->nlevels,
+      .best = params->nlevels,
+  };
+  pthread_t threads[PACK_MAX_LEVELS];
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct gz_job *jobs;
+  struct gz_job *job = NULL;
+  uint32_t crc;
+  uint8_t *buf;
+  int i, n, ret = 0;
+
+  if (in_len > K230_GZIP_MAX_SIZE) {
+    fprintf(stderr, "%s: %s is too large for the gzip engine\n",
+            params->cmdname, params->datafile);
+    return -EFBIG;
+  }
+
+  jobs = calloc(params->nlevels, sizeof(*jobs));
+  if (!jobs)
+    return -ENOMEM;
+
+  for (i = 0; i < params->nlevels; i++) {
+    jobs[i].index = i;
+    jobs[i].level = params->levels[i];
+    jobs[i].in = in;
+    jobs[i].in_len = in_len;
+    jobs[i].shared = &shared;
+  }
+  shared.jobs = jobs;
+
+  if (nthreads < 1 || nthreads > params->nlevels)
+    nthreads = params->nlevels;
+  for (n = 0; n < nthreads; n++) {
+    if (pthread_create(&threads[n], NULL, gz_worker, &shared))
+      break;
+  }
+  /* no threads at all, do it here */
+  if (!n)
+    gz_worker(&shared);
+  while (n--)
+    pthread_join(threads[n], NULL);
+
+  for (i = 0; i < params->nlevels; i++) {
+    if (params->verbose && jobs[i].ret != -ECANCELED)
+      printf("level %d: %s, %u blocks, %u recoded, %zu bytes\n",
+             jobs[i].level, jobs[i].ret ? strerror(-jobs[i].ret) : "ok",
+             jobs[i].blocks, jobs[i].recoded, jobs[i].out_len);
+    if (!job && !jobs[i].ret)
+      job = &jobs[i];
+  }
+
+  if (!job) {
+    fprintf(stderr, "%s: no level made a valid K230 gzip stream of %s\n",
+            params->cmdname, params->datafile);
+    ret = -EINVAL;
+    goto out;
+  }
+
+  buf = malloc(job->out_len + 18);
+  if (!buf) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  /* no name and no time stamp, the same as gzip -n */
+  memset(buf, 0, 10);
+  buf[0] = 0x1f;
+  buf[1] = 0x8b;
+  buf[2] = K230_GZIP_CM;
+  buf[8] = job->level == 9 ? 2 : job->level == 1 ? 4 : 0;
+  buf[9] = 3;
+  memcpy(buf + 10, job->out, job->out_len);
+  crc = cpu_to_le32(crc32(0, in, in_len));
+  memcpy(buf + 10 + job->out_len, &crc, 4);
+  crc = cpu_to_le32(in_len);
+  memcpy(buf + 14 + job->out_len, &crc, 4);
+
+  *out = buf;
+  *out_len = job->out_len + 18;
+  printf("%s: K230 gzip level %d, %zu -> %zu bytes\n", params->datafile,
+         job->level, in_len, *out_len);
+
+out:
+  for (i = 0; i < params->nlevels; i++)
+    free(jobs[i].out);
+  free(jobs);
+  return ret;
+}
+
+/*
+ * Legacy image
+ */
+
+static time_t pack_image_time(struct pack_params *params) {
+  char *epoch = getenv("SOURCE_DATE_EPOCH");
+  time_t t;
+
+  if (!epoch)
+    return time(NULL);
+
+  t = (time_t)strtol(epoch, NULL, 10);
+  if (!gmtime(&t)) {
+    fprintf(stderr, "%s: SOURCE_DATE_EPOCH is not valid\n", params->cmdname);
+    t = 0;
+  }
+  return t;
+}
+
+/*
+ * Lay out the payload of the firmware header: a zero version word, then
+ * the legacy image, or the data as is with -r.
+ */
+static uint8_t *pack_payload(struct pack_params *params, const uint8_t *data,
+                             size_t len, size_t *payload_len) {
+  int table = params->type == IH_TYPE_MULTI || params->type == IH_TYPE_SCRIPT;
+  size_t hdr_len = params->raw ? 0 : sizeof(image_header_t) + (table ? 8 : 0);
+  image_header_t *hdr;
+  uint8_t *buf;
+
+  *payload_len = 4 + hdr_len + len;
+  buf = calloc(1, *payload_len);
+  if (!buf)
+    return NULL;
+  memcpy(buf + 4 + hdr_len, data, len);
+  if (params->raw)
+    return buf;
+
+  /* a multi file image with one file: its size, then the end mark */
+  hdr = (image_header_t *)(buf + 4);
+  if (table)
+    *(uint32_t *)(hdr + 1) = cpu_to_be32(len);
+
+  image_set_magic(hdr, IH_MAGIC);
+  image_set_time(hdr, pack_image_time(params));
+  image_set_size(hdr, hdr_len - sizeof(image_header_t) + len);
+  image_set_load(hdr, params->addr);
+  image_set_ep(hdr, params->ep);
+  image_set_dcrc(hdr, crc32(0, (uint8_t *)(hdr + 1),
+                            hdr_len - sizeof(image_header_t) + len));
+  image_set_os(hdr, params->os);
+  image_set_arch(hdr, params->arch);
+  image_set_type(hdr, params->type);
+  image_set_comp(hdr, params->comp);
+  image_set_name(hdr, params->name);
+  image_set_hcrc(hdr, crc32(0, (uint8_t *)hdr, sizeof(image_header_t)));
+
+  return buf;
+}
+
+/*
+ * Firmware headers
+ */
+
+static int pack_digest(const EVP_MD *md, const uint8_t *data, size_t len,
+                       uint8_t *out) {
+  return EVP_Digest(data, len, out, NULL, md, NULL) ? 0 : -EINVAL;
+}
+
+static int pack_head_none(struct k230_fw_head *head, const uint8_t *payload,
+                          size_t len, uint8_t **body, size_t *body_len) {
+  head->length = cpu_to_le32(len);
+  head->crypto_type = cpu_to_le32(K230_CRYPTO_NONE);
+  *body = (uint8_t *)payload;
+  *body_len = len;
+
+  return pack_digest(EVP_sha256(), payload, len, head->verify.none_sec.signature);
+}
+
+static int pack_head_aes(struct k230_fw_head *head, const uint8_t *payload,
+                         size_t len, uint8_t **body, size_t *body_len) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  uint8_t dgst[32];
+  unsigned int siglen;
+  uint8_t *buf = malloc(len + 16 + 16);
+  BIGNUM *n, *e, *d;
+  RSA *rsa = NULL;
+  int outl, ret = -EINVAL;
+
+  if (!ctx || !buf)
+    goto out;
+  if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
+      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sizeof(aes_iv), NULL) ||
+      !EVP_EncryptInit_ex(ctx, NULL, NULL, aes_key, aes_iv) ||
+      !EVP_EncryptUpdate(ctx, buf, &outl, payload, len) ||
+      !EVP_EncryptFinal_ex(ctx, buf + outl, &outl) ||
+      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, buf + len))
+    goto out;
+
+  /* the ciphertext and the tag are loaded, the tag is what is signed */
+  head->length = cpu_to_le32(len + 16);
+  head->crypto_type = cpu_to_le32(K230_CRYPTO_AES);
+  memcpy(head->verify.rsa.n, rsa_n, sizeof(rsa_n));
+  head->verify.rsa.e = cpu_to_le32(rsa_e);
+
+  rsa = RSA_new();
+  n = BN_bin2bn(rsa_n, sizeof(rsa_n), NULL);
+  e = BN_new();
+  d = BN_bin2bn(rsa_d, sizeof(rsa_d), NULL);
+  if (!rsa || !n || !e || !d || !BN_set_word(e, rsa_e) ||
+      !RSA_set0_key(rsa, n, e, d)) {
+    BN_free(n);
+    BN_free(e);
+    BN_free(d);
+    goto out;
+  }
+  if (pack_digest(EVP_sha256(), buf + len, 16, dgst) ||
+      !RSA_sign(NID_sha256, dgst, sizeof(dgst), head->verify.rsa.signature,
+                &siglen, rsa) ||
+      siglen != sizeof(head->verify.rsa.signature))
+    goto out;
+
+  *body = buf;
+  *body_len = len + 16;
+  buf = NULL;
+  ret = 0;
+out:
+  RSA_free(rsa);
+  EVP_CIPHER_CTX_free(ctx);
+  free(buf);
+  return ret;
+}
+
+#ifdef K230_PACK_SM
+/* SM2 signature with the fixed nonce, over e = SM3(Z || M) */
+static int sm2_sign(const uint8_t *msg, size_t len, uint8_t *r_out,
+                    uint8_t *s_out) {
+  EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_sm2);
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  BN_CTX *ctx = BN_CTX_new();
+  EC_POINT *pt = NULL;
+  BIGNUM *v[4], *x, *y, *e, *k, *d, *r, *s;
+  const uint8_t entl[2] = {0, (sizeof(sm2_id) - 1) * 8};
+  uint8_t z[32], buf[32];
+  int i, ret = -EINVAL;
+
+  if (!group || !md || !ctx)
+    goto out;
+  BN_CTX_start(ctx);
+  for (i = 0; i < 4; i++)
+    v[i] = BN_CTX_get(ctx);
+  x = BN_CTX_get(ctx);
+  y = BN_CTX_get(ctx);
+  e = BN_CTX_get(ctx);
+  k = BN_CTX_get(ctx);
+  d = BN_CTX_get(ctx);
+  r = BN_CTX_get(ctx);
+  s = BN_CTX_get(ctx);
+  pt = EC_POINT_new(group);
+  if (!s || !pt)
+    goto out;
+
+  /* Z = SM3(ENTL || ID || a || b || xG || yG || xA || yA) */
+  if (!EC_GROUP_get_curve(group, x, v[0], v[1], ctx) ||
+      !EC_POINT_get_affine_coordinates(group, EC_GROUP_get0_generator(group),
+                                       v[2], v[3], ctx) ||
+      !EVP_DigestInit_ex(md, EVP_sm3(), NULL) ||
+      !EVP_DigestUpdate(md, entl, sizeof(entl)) ||
+      !EVP_DigestUpdate(md, sm2_id, sizeof(sm2_id) - 1))
+    goto out;
+  for (i = 0; i < 4; i++) {
+    if (BN_bn2binpad(v[i], buf, sizeof(buf)) < 0 ||
+        !EVP_DigestUpdate(md, buf, sizeof(buf)))
+      goto out;
+  }
+  if (!EVP_DigestUpdate(md, sm2_pukx, sizeof(sm2_pukx)) ||
+      !EVP_DigestUpdate(md, sm2_puky, sizeof(sm2_puky)) ||
+      !EVP_DigestFinal_ex(md, z, NULL) ||
+      !EVP_DigestInit_ex(md, EVP_sm3(), NULL) ||
+      !EVP_DigestUpdate(md, z, sizeof(z)) ||
+      !EVP_DigestUpdate(md, msg, len) ||
+      !EVP_DigestFinal_ex(md, buf, NULL) ||
+      !BN_bin2bn(buf, sizeof(buf), e))
+    goto out;
+
+  /* r = (e + x1) mod n, s = ((k + r) / (1 + d) - r) mod n */
+  if (!BN_bin2bn(sm2_k, sizeof(sm2_k), k) ||
+      !BN_bin2bn(sm2_priv, sizeof(sm2_priv), d) ||
+      !EC_POINT_mul(group, pt, k, NULL, NULL, ctx) ||
+      !EC_POINT_get_affine_coordinates(group, pt, x, y, ctx) ||
+      !BN_mod_add(r, e, x, EC_GROUP_get0_order(group), ctx) ||
+      !BN_add(d, d, BN_value_one()) ||
+      !BN_mod_inverse(d, d, EC_GROUP_get0_order(group), ctx) ||
+      !BN_mod_add(s, k, r, EC_GROUP_get0_order(group), ctx) ||
+      !BN_mod_mul(s, s, d, EC_GROUP_get0_order(group), ctx) ||
+      !BN_mod_sub(s, s, r, EC_GROUP_get0_order(group), ctx) ||
+      BN_bn2binpad(r, r_out, 32) < 0 || BN_bn2binpad(s, s_out, 32) < 0)
+    goto out;
+
+  ret = 0;
+out:
+  EC_POINT_free(pt);
+  if (ctx)
+    BN_CTX_end(ctx);
+  BN_CTX_free(ctx);
+  EVP_MD_CTX_free(md);
+  EC_GROUP_free(group);
+  return ret;
+}
+
+static int pack_head_sm4(struct k230_fw_head *head, const uint8_t *payload,
+                         size_t len, uint8_t **body, size_t *body_len) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  uint8_t *buf = malloc(len + 16);
+  int outl, finl, ret = -EINVAL;
+
+  /* PKCS#7 padded, the padding is loaded and signed too */
+  if (!ctx || !buf ||
+      !EVP_EncryptInit_ex(ctx, EVP_sm4_cbc(), NULL, sm4_key, sm4_iv) ||
+      !EVP_EncryptUpdate(ctx, buf, &outl, payload, len) ||
+      !EVP_EncryptFinal_ex(ctx, buf + outl, &finl))
+    goto out;
+
+  head->length = cpu_to_le32(outl + finl);
+  head->crypto_type = cpu_to_le32(K230_CRYPTO_SM4);
+  head->verify.sm2.idlen = cpu_to_le32(sizeof(sm2_id) - 1);
+  memcpy(head->verify.sm2.id, sm2_id, sizeof(sm2_id) - 1);
+  memcpy(head->verify.sm2.pukx, sm2_pukx, sizeof(sm2_pukx));
+  memcpy(head->verify.sm2.puky, sm2_puky, sizeof(sm2_puky));
+  if (sm2_sign(buf, outl + finl, head->verify.sm2.r, head->verify.sm2.s))
+    goto out;
+
+  *body = buf;
+  *body_len = outl + finl;
+  buf = NULL;
+  ret = 0;
+out:
+  EVP_CIPHER_CTX_free(ctx);
+  free(buf);
+  return ret;
+}
+#endif
+
+static int pack_write(struct pack_params *params, const char *file,
+                      const void *head, size_t head_len, const void *body,
+                      size_t body_len) {
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ret = 0;
+
+  if (fd < 0) {
+    fprintf(stderr, "%s: Can't open %s: %s\n", params->cmdname, file,
+            strerror(errno));
+    return -errno;
+  }
+  if (write(fd, head, head_len) != head_len ||
+      write(fd, body, body_len) != body_len) {
+    fprintf(stderr, "%s: Write error on %s: %s\n", params->cmdname, file,
+            strerror(errno));
+    ret = -EIO;
+  }
+  if (close(fd) && !ret)
+    ret = -errno;
+
+  return ret;
+}
+
+static int pack_firmware(struct pack_params *params, const uint8_t *payload,
+                         size_t len) {
+  static const char *const names[K230_CRYPTO_NUM] = {
+      "sha256", "SM4-CBC + SM2", "AES-GCM + RSA-2048"};
+  int i, ret;
+
+  for (i = 0; i < K230_CRYPTO_NUM; i++) {
+    struct k230_fw_head head;
+    uint8_t *body = NULL;
+    size_t body_len;
+
+    if (!params->outfile[i])
+      continue;
+
+    memset(&head, 0, sizeof(head));
+    head.magic = cpu_to_le32(K230_IMAGE_MAGIC_NUM);
+    if (i == K230_CRYPTO_NONE)
+      ret = pack_head_none(&head, payload, len, &body, &body_len);
+    else if (i == K230_CRYPTO_AES)
+      ret = pack_head_aes(&head, payload, len, &body, &body_len);
+#ifdef K230_PACK_SM
+    else
+      ret = pack_head_sm4(&head, payload, len, &body, &body_len);
+#else
+    else
+      ret = -ENOSYS;
+#endif
+    if (ret) {
+      fprintf(stderr, "%s: %s of %s failed: %s\n", params->cmdname, names[i],
+              params->outfile[i], strerror(-ret));
+      return ret;
+    }
+
+    ret = pack_write(params, params->outfile[i], &head, sizeof(head), body,
+                     body_len);
+    if (body != payload)
+      free(body);
+    if (ret)
+      return ret;
+    if (params->verbose)
+      printf("%s: %s, %zu bytes\n", params->outfile[i], names[i],
+             sizeof(head) + body_len);
+  }
+
+  return 0;
+}
+
+static uint8_t *pack_read(struct pack_params *params, size_t *len) {
+  struct stat sbuf;
+  uint8_t *buf = NULL;
+  size_t done = 0;
+  ssize_t n;
+  int fd;
+
+  fd = open(params->datafile, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sbuf) < 0) {
+    fprintf(stderr, "%s: Can't open %s: %s\n", params->cmdname,
+            params->datafile, strerror(errno));
+    goto err;
+  }
+
+  *len = sbuf.st_size;
+  buf = malloc(*len ? *len : 1);
+  if (!buf)
+    goto err;
+  while (done < *len) {
+    n = read(fd, buf + done, *len - done);
+    if (n <= 0) {
+      fprintf(stderr, "%s: Read error on %s: %s\n", params->cmdname,
+              params->datafile, n ? strerror(errno) : "short read");
+      goto err;
+    }
+    done += n;
+  }
+  close(fd);
+
+  return buf;
+err:
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  return NULL;
+}
+
+static int parse_levels(struct pack_params *params, const char *arg) {
+  char *end;
+
+  params->nlevels = 0;
+  do {
+    long level = strtol(arg, &end, 10);
+
+    if (end == arg || level < 1 || level > 9 ||
+        params->nlevels == PACK_MAX_LEVELS || (*end && *end != ','))
+      return -EINVAL;
+    params->levels[params->nlevels++] = level;
+    arg = end + 1;
+  } while (*end);
+
+  return 0;
+}
+
+static void usage(const char *cmdname) {
+  fprintf(stderr,
+          "Usage: %s [-A arch] [-O os] [-T type] [-C comp | -z] [-a addr] "
+          "[-e ep] [-n name]\n"
+          "          [-r] [-l levels] [-v] -d data_file [-N file] [-S file] "
+          "[-G file]\n"
+          "          -A ==> set architecture to 'arch' (default riscv)\n"
+          "          -O ==> set operating system to 'os'\n"
+          "          -T ==> set image type to 'type'\n"
+          "          -C ==> data_file is compressed with 'comp'\n"
+          "          -z ==> compress data_file in the K230 gzip format\n"
+          "          -a ==> set load address to 'addr' (hex)\n"
+          "          -e ==> set entry point to 'ep' (hex)\n"
+          "          -n ==> set image name to 'name'\n"
+          "          -r ==> no legacy image header, firmware header only\n"
+          "          -l ==> gzip levels to try, by preference (default "
+          "8,9,7,6,5,4)\n"
+          "          -v ==> verbose\n"
+          "          -N ==> write 'file' with a sha256 firmware header\n"
+          "          -S ==> write 'file' encrypted with SM4-CBC, SM2 signed\n"
+          "          -G ==> write 'file' encrypted with AES-GCM, RSA-2048 "
+          "signed\n",
+          cmdname);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  struct pack_params params = {
+      .levels = {8, 9, 7, 6, 5, 4},
+      .nlevels = 6,
+      .os = IH_OS_LINUX,
+      .arch = IH_ARCH_RISCV,
+      .type = IH_TYPE_KERNEL,
+      .comp = IH_COMP_NONE,
+      .name = "",
+  };
+  uint8_t *data, *gz = NULL, *payload;
+  size_t len, payload_len;
+  int opt, ret;
+
+  params.cmdname = strrchr(argv[0], '/');
+  params.cmdname = params.cmdname ? params.cmdname + 1 : argv[0];
+
+  while ((opt = getopt(argc, argv, "A:O:T:C:a:e:n:zrl:vd:N:S:G:h")) != -1) {
+    switch (opt) {
+    case 'A':
+      params.arch = genimg_get_arch_id(optarg);
+      if (params.arch < 0)
+        usage(params.cmdname);
+      break;
+    case 'O':
+      params.os = genimg_get_os_id(optarg);
+      if (params.os < 0)
+        usage(params.cmdname);
+      break;
+    case 'T':
+      params.type = genimg_get_type_id(optarg);
+      if (params.type < 0)
+        usage(params.cmdname);
+      break;
+    case 'C':
+      params.comp = genimg_get_comp_id(optarg);
+      if (params.comp < 0)
+        usage(params.cmdname);
+      break;
+    case 'a':
+      params.addr = strtoull(optarg, NULL, 16);
+      break;
+    case 'e':
+      params.ep = strtoull(optarg, NULL, 16);
+      break;
+    case 'n':
+      params.name = optarg;
+      break;
+    case 'z':
+      params.compress = 1;
+      break;
+    case 'r':
+      params.raw = 1;
+      break;
+    case 'l':
+      if (parse_levels(&params, optarg))
+        usage(params.cmdname);
+      break;
+    case 'v':
+      params.verbose = 1;
+      break;
+    case 'd':
+      params.datafile = optarg;
+      break;
+    case 'N':
+      params.outfile[K230_CRYPTO_NONE] = optarg;
+      break;
+    case 'S':
+      params.outfile[K230_CRYPTO_SM4] = optarg;
+      break;
+    case 'G':
+      params.outfile[K230_CRYPTO_AES] = optarg;
+      break;
+    default:
+      usage(params.cmdname);
+    }
+  }
+
+  if (optind != argc || !params.datafile ||
+      (params.compress && params.comp != IH_COMP_NONE))
+    usage(params.cmdname);
+  if (params.compress)
+    params.comp = IH_COMP_GZIP;
+
+  data = pack_read(&params, &len);
+  if (!data)
+    exit(EXIT_FAILURE);
+
+  if (params.compress) {
+    ret = k230_gzip(&params, data, len, &gz, &len);
+    free(data);
+    if (ret)
+      exit(EXIT_FAILURE);
+    data = gz;
+  }
+
+  payload = pack_payload(&params, data, len, &payload_len);
+  free(data);
+  if (!payload)
+    exit(EXIT_FAILURE);
+
+  ret = pack_firmware(&params, payload, payload_len);
+  free(payload);
+
+  exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
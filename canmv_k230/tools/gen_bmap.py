@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+Write the block map of a disk image in the bmap 2.0 format of bmaptool.
+
+Only the blocks the image file has data for are listed, found with
+SEEK_DATA/SEEK_HOLE. Images from genimage keep the unused parts of their
+partitions as holes, so 'bmaptool copy' and the burn stations only write
+the populated blocks.
+
+usage: gen_bmap.py [-b BLOCK_SIZE] IMAGE BMAP
+"""
+import argparse
+import errno
+import hashlib
+import os
+import sys
+
+CHECKSUM_TYPE = 'sha256'
+CHECKSUM_LEN = hashlib.sha256().digest_size * 2
+
+
+def mapped_ranges(fd, size, block_size):
+    """Return the [first, last] block ranges that hold data, merged."""
+    ranges = []
+    offset = 0
+
+    try:
+        while offset < size:
+            try:
+                start = os.lseek(fd, offset, os.SEEK_DATA)
+            except OSError as e:
+                if e.errno == errno.ENXIO:
+                    break
+                raise
+            end = min(os.lseek(fd, start, os.SEEK_HOLE), size)
+            first = start // block_size
+            last = (end + block_size - 1) // block_size - 1
+            if ranges and first <= ranges[-1][1] + 1:
+                ranges[-1][1] = max(ranges[-1][1], last)
+            else:
+                ranges.append([first, last])
+            offset = end
+    except (AttributeError, OSError):
+        # no SEEK_DATA on this file system: everything is mapped
+        ranges = [[0, (size + block_size - 1) // block_size - 1]] if size else []
+
+    return ranges
+
+
+def range_checksum(fd, first, last, size, block_size):
+    h = hashlib.new(CHECKSUM_TYPE)
+    offset = first * block_size
+    end = min((last + 1) * block_size, size)
+
+    while offset < end:
+        data = os.pread(fd, min(end - offset, 4 << 20), offset)
+        if not data:
+            raise IOError('short read at offset %d' % offset)
+        h.update(data)
+        offset += len(data)
+
+    return h.hexdigest()
+
+
+def human_size(size):
+    for unit in ('bytes', 'KiB', 'MiB', 'GiB'):
+        if size < 1024 or unit == 'GiB':
+            break
+        size /= 1024.0
+    return '%.1f %s' % (size, unit)
+
+
+def gen_bmap(image, block_size):
+    fd = os.open(image, os.O_RDONLY)
+    try:
+        size = os.fstat(fd).st_size
+        blocks = (size + block_size - 1) // block_size
+        ranges = mapped_ranges(fd, size, block_size)
+        mapped = sum(last - first + 1 for first, last in ranges)
+
+        lines = [
+            '<?xml version="1.0" ?>',
+            '<!-- Block map of %s, generated by gen_bmap.py. Only the listed' % os.path.basename(image),
+            '     blocks contain data and have to be written to the target. -->',
+            '',
+            '<bmap version="2.0">',
+            '    <!-- Image size in bytes: %s -->' % human_size(size),
+            '    <ImageSize> %d </ImageSize>' % size,
+            '',
+            '    <!-- Size of a block in bytes -->',
+            '    <BlockSize> %d </BlockSize>' % block_size,
+            '',
+            '    <!-- Count of blocks in the image file -->',
+            '    <BlocksCount> %d </BlocksCount>' % blocks,
+            '',
+            '    <!-- Count of mapped blocks: %s or %.1f%% -->' % (
+                human_size(mapped * block_size), 100.0 * mapped / blocks if blocks else 0),
+            '    <MappedBlocksCount> %d </MappedBlocksCount>' % mapped,
+            '',
+            '    <!-- Type of checksum used in this file -->',
+            '    <ChecksumType> %s </ChecksumType>' % CHECKSUM_TYPE,
+            '',
+            '    <!-- The checksum of this bmap file. When it is calculated, the value of',
+            '         the checksum has to be zero (all ASCII "0" symbols). -->',
+            '    <BmapFileChecksum> %s </BmapFileChecksum>' % ('0' * CHECKSUM_LEN),
+            '',
+            '    <BlockMap>',
+        ]
+        for first, last in ranges:
+            blocks_str = '%d-%d' % (first, last) if last != first else '%d' % first
+            lines.append('        <Range chksum="%s"> %s </Range>' % (
+                range_checksum(fd, first, last, size, block_size), blocks_str))
+        lines += [
+            '    </BlockMap>',
+            '</bmap>',
+            '',
+        ]
+    finally:
+        os.close(fd)
+
+    bmap = '\n'.join(lines)
+    checksum = hashlib.new(CHECKSUM_TYPE, bmap.encode()).hexdigest()
+
+    return bmap.replace('0' * CHECKSUM_LEN, checksum, 1), mapped, blocks
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a bmaptool block map of an image')
+    parser.add_argument('-b', '--block-size', type=int, default=4096,
+                        help='block size in bytes (default 4096)')
+    parser.add_argument('image')
+    parser.add_argument('bmap')
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size & (args.block_size - 1):
+        parser.error('block size must be a power of two')
+
+    bmap, mapped, blocks = gen_bmap(args.image, args.block_size)
+    with open(args.bmap, 'w') as f:
+        f.write(bmap)
+
+    print('%s: %d of %d blocks mapped' % (args.bmap, mapped, blocks))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -29,22 +29,78 @@ gen_repo_info()
 	popd > /dev/null
 }
 
+compress_image()
+{
+	local file="$1";
+
+	# the image is mostly zeros, a parallel gzip saves most of the time
+	if command -v pigz > /dev/null; then
+		pigz -k -f "${file}"
+	else
+		echo "WARNING: pigz not found, ${file} is compressed with the much slower gzip" >&2
+		gzip -k -f "${file}"
+	fi
+}
+
+# the sparse and bmap outputs have to give back the raw image
+check_image()
+{
+	local image="$1";
+	local sparse="$2";
+	local bmap="$3";
+	local out="${image}.check";
+
+	if [ -f "${sparse}" ]; then
+		if ! command -v simg2img > /dev/null; then
+			echo "WARNING: simg2img not found, ${sparse} is not checked" >&2
+		elif ! simg2img "${sparse}" "${out}" || ! cmp -s "${image}" "${out}"; then
+			echo "ERROR: ${sparse} does not match ${image}" >&2
+			rm -f "${out}"
+			exit 1
+		fi
+		rm -f "${out}"
+	fi
+
+	# bmaptool also verifies the checksum of every range
+	if ! command -v bmaptool > /dev/null; then
+		echo "WARNING: bmaptool not found, ${bmap} is not checked" >&2
+	elif ! bmaptool -q copy --bmap "${bmap}" "${image}" "${out}" || ! cmp -s "${image}" "${out}"; then
+		echo "ERROR: ${bmap} does not match ${image}" >&2
+		rm -f "${out}"
+		exit 1
+	fi
+	rm -f "${out}"
+}
+
 gen_image()
 {
 	local config="$1";
 	local image="$2";
+	local sparse="${image%.img}.simg";
+	local bmap="${image%.img}.bmap";
 
 	GENIMAGE_TMP="genimage.tmp"; rm -rf "${GENIMAGE_TMP}";
-	${TOOL_GENIMAGE} --rootpath "${SDK_BUILD_IMAGES_DIR}" --tmppath "${GENIMAGE_TMP}" --inputpath "${SDK_BUILD_IMAGES_DIR}" --outputpath "${SDK_BUILD_DIR}" --config "${config}"
+	${TOOL_GENIMAGE} --jobs "$(nproc)" --rootpath "${SDK_BUILD_IMAGES_DIR}" --tmppath "${GENIMAGE_TMP}" --inputpath "${SDK_BUILD_IMAGES_DIR}" --outputpath "${SDK_BUILD_DIR}" --config "${config}"
 
 	rm -rf "${GENIMAGE_TMP}"
     mv ${SDK_BUILD_DIR}/sysimage-sdcard.img ${SDK_BUILD_DIR}/${image}
+    if [ -f ${SDK_BUILD_DIR}/sysimage-sdcard.simg ]; then
+        mv ${SDK_BUILD_DIR}/sysimage-sdcard.simg ${SDK_BUILD_DIR}/${sparse}
+    fi
+
+    # block map of the populated blocks, for bmaptool and the burn stations
+    python3 ${SDK_TOOLS_DIR}/gen_bmap.py ${SDK_BUILD_DIR}/${image} ${SDK_BUILD_DIR}/${bmap}
+    check_image ${SDK_BUILD_DIR}/${image} ${SDK_BUILD_DIR}/${sparse} ${SDK_BUILD_DIR}/${bmap}
 
     echo "Compress image ${image}.gz, it will took a while"
 
-    gzip -k -f ${SDK_BUILD_DIR}/${image}
-    chmod a+rw ${SDK_BUILD_DIR}/${image} ${SDK_BUILD_DIR}/${image}.gz;
+    compress_image ${SDK_BUILD_DIR}/${image}
+    chmod a+rw ${SDK_BUILD_DIR}/${image} ${SDK_BUILD_DIR}/${image}.gz ${SDK_BUILD_DIR}/${bmap};
     md5sum ${SDK_BUILD_DIR}/${image} ${SDK_BUILD_DIR}/${image}.gz > ${SDK_BUILD_DIR}/${image}.gz.md5
+    if [ -f ${SDK_BUILD_DIR}/${sparse} ]; then
+        chmod a+rw ${SDK_BUILD_DIR}/${sparse}
+        md5sum ${SDK_BUILD_DIR}/${sparse} > ${SDK_BUILD_DIR}/${sparse}.md5
+    fi
 }
 
 parse_repo_version()
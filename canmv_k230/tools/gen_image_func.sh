@@ -1,49 +1,67 @@
 #!/bin/bash
 
-add_firmHead()
+# k230_pack arguments for the firmware headers of $1: fn_$1 always, and with
+# CONFIG_GEN_SECURITY_IMG fs_$1 (SM4 + SM2) and fa_$1 (AES-GCM + RSA) too
+firm_head_args()
 {
 	local filename="$1"
-	local firmware_gen="${SDK_TOOLS_DIR}/firmware_gen.py"
-	if [ $# -ge 2 ]; then 
-		firmArgs="$2"
-		cp ${filename} ${filename}.t; 					python3  ${firmware_gen}   -i ${filename}.t -o f${firmArgs##-}${filename} ${firmArgs};
-	else 
-		firmArgs="-n"; cp ${filename} ${filename}.t;  	python3  ${firmware_gen}   -i ${filename}.t -o f${firmArgs##-}_${filename} ${firmArgs};
 
-		if [ "${CONFIG_GEN_SECURITY_IMG}" = "y" ];then
-			firmArgs="-s";cp ${filename} ${filename}.t;	python3  ${firmware_gen}   -i ${filename}.t -o f${firmArgs##-}_${filename} ${firmArgs};
-			firmArgs="-a";cp ${filename} ${filename}.t;	python3  ${firmware_gen}   -i ${filename}.t -o f${firmArgs##-}_${filename} ${firmArgs};
-		fi
+	echo "-N fn_${filename}"
+	if [ "${CONFIG_GEN_SECURITY_IMG}" = "y" ]; then
+		echo "-S fs_${filename} -G fa_${filename}"
 	fi
-	rm -rf  ${filename}.t
 }
 
-k230_gzip()
+# add the firmware headers to $1, written to the current directory
+add_firmHead()
 {
-	local filename="$1"
-	local k230_gzip_tool="${SDK_TOOLS_DIR}/k230_priv_gzip "
-	${k230_gzip_tool} -n8  -f -k ${filename}  ||   ${k230_gzip_tool} -n9 -f -k ${filename} ||  \
-	${k230_gzip_tool} -n7 -f -k ${filename}   ||   ${k230_gzip_tool} -n6 -f -k ${filename} || \
-	${k230_gzip_tool} -n5 -f -k ${filename}   ||   ${k230_gzip_tool} -n4 -f -k ${filename}
-	sed -i -e "1s/\x08/\x09/"  ${filename}.gz
+	local k230_pack="${SDK_UBOOT_BUILD_DIR}/tools/k230_pack"
+	local filename=$(basename $1)
+
+	${k230_pack} -r -d $1 $(firm_head_args ${filename})
+}
+
+# compress $1 into $2 with the codec picked by CONFIG_UBOOT_IMAGE_COMPRESS_*,
+# prints the mkimage -C name, tool output goes to stderr. The K230 gzip
+# default prints k230 and is left to k230_pack, which compresses as it packs
+image_compress()
+{
+	local src="$1"
+	local dst="$2"
+
+	if [ "${CONFIG_UBOOT_IMAGE_COMPRESS_LZ4}" = "y" ]; then
+		lz4 -9 -f ${src} ${dst} >&2 && echo lz4
+	elif [ "${CONFIG_UBOOT_IMAGE_COMPRESS_ZSTD}" = "y" ]; then
+		zstd -19 -q -f ${src} -o ${dst} && echo zstd
+	elif [ "${CONFIG_UBOOT_IMAGE_COMPRESS_GZIP}" = "y" ]; then
+		gzip -9 -n -c ${src} > ${dst} && echo gzip
+	elif [ "${CONFIG_UBOOT_IMAGE_COMPRESS_NONE}" = "y" ]; then
+		echo none
+	else
+		echo k230
+	fi
 }
 
+# compress $1, add a legacy image header with the mkimage arguments $2 and
+# the firmware headers, the results are fn_ug_$1 and friends
 bin_gzip_ubootHead_firmHead()
 {
-	local mkimage="${SDK_UBOOT_BUILD_DIR}/tools/mkimage"
+	local k230_pack="${SDK_UBOOT_BUILD_DIR}/tools/k230_pack"
 	local file_full_path="$1"
 	local filename=$(basename ${file_full_path})
 	local mkimgArgs="$2"
-	local firmArgs="$3"
+	local comp
 
-	[ "$(dirname ${file_full_path})" == "$(pwd)" ] || cp ${file_full_path} .
+	comp=$(image_compress ${file_full_path} ${filename}.z) || exit 1
 
-	k230_gzip ${filename}
-
-	${mkimage} -A riscv -C gzip ${mkimgArgs} -d ${filename}.gz ug_${filename}
-
-	add_firmHead ug_${filename}
-	rm -rf ${filename} ${filename}.gz ug_${filename}
+	if [ "${comp}" = "k230" ]; then
+		${k230_pack} -A riscv -z ${mkimgArgs} -d ${file_full_path} $(firm_head_args ug_${filename}) || exit 1
+	elif [ "${comp}" = "none" ]; then
+		${k230_pack} -A riscv ${mkimgArgs} -d ${file_full_path} $(firm_head_args ug_${filename}) || exit 1
+	else
+		${k230_pack} -A riscv -C ${comp} ${mkimgArgs} -d ${filename}.z $(firm_head_args ug_${filename}) || exit 1
+	fi
+	rm -f ${filename}.z
 }
 
 # gz_file_add_ver()
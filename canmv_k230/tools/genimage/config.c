@@ -45,7 +45,8 @@ static void show_help(const char *cmd)
 	       "configuration file.\n\n"
 	       "Valid options:           [ default value ]    (environment variable)\n"
 	       "  -h, --help\n"
-	       "  -v, --version\n", cmd);
+	       "  -v, --version\n"
+	       "  -j <arg>                 same as --jobs\n", cmd);
 	list_for_each_entry(c, &optlist, list) {
 		char opt[20], def[20];
 		if (c->hidden)
@@ -223,7 +224,7 @@ int set_config_opts(int argc, char *argv[], cfg_t *cfg)
 	while (1) {
 		int option_index = 0;
 
-		n = getopt_long(argc, argv, "hv",
+		n = getopt_long(argc, argv, "hvj:",
 			long_options, &option_index);
 		if (n == -1)
 			break;
@@ -233,6 +234,11 @@ int set_config_opts(int argc, char *argv[], cfg_t *cfg)
 			if (ret)
 				goto err_out;
 			break;
+		case 'j':
+			ret = set_opt("jobs", optarg);
+			if (ret)
+				goto err_out;
+			break;
 		case 'h':
 			show_help(argv[0]);
 			exit(0);
@@ -315,6 +321,11 @@ static struct config opts[] = {
 		.opt = CFG_STR("loglevel", NULL, CFGF_NONE),
 		.env = "GENIMAGE_LOGLEVEL",
 		.def = "1",
+	}, {
+		.name = "jobs",
+		.opt = CFG_STR("jobs", NULL, CFGF_NONE),
+		.env = "GENIMAGE_JOBS",
+		.def = "1",
 	}, {
 		.name = "rootpath",
 		.opt = CFG_STR("rootpath", NULL, CFGF_NONE),
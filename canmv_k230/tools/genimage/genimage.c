@@ -23,7 +23,9 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
@@ -268,6 +270,49 @@ static int setenv_image(const struct image *image)
 	return 0;
 }
 
+/*
+ * generate a single image. All images it depends on must already
+ * be generated.
+ */
+static int image_generate_one(struct image *image)
+{
+	int ret;
+
+	ret = setenv_image(image);
+	if (ret)
+		return ret;
+
+	if (image->exec_pre) {
+		ret = systemp(image, "%s", image->exec_pre);
+		if (ret)
+			return ret;
+	}
+
+	if (image->handler->generate) {
+		ret = image->handler->generate(image);
+	} else {
+		image_error(image, "no generate function for %s\n", image->file);
+		return -EINVAL;
+	}
+
+	if (ret) {
+		struct stat s;
+		if (lstat(imageoutfile(image), &s) != 0 ||
+				((s.st_mode & S_IFMT) == S_IFREG) ||
+				((s.st_mode & S_IFMT) == S_IFLNK))
+			systemp(image, "rm -f \"%s\"", imageoutfile(image));
+		return ret;
+	}
+
+	if (image->exec_post) {
+		ret = systemp(image, "%s", image->exec_post);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 /*
  * generate the images. Calls ->generate function for each
  * image, recursively calls itself for resolving dependencies
@@ -303,43 +348,217 @@ static int image_generate(struct image *image)
 		}
 	}
 
-	ret = setenv_image(image);
+	ret = image_generate_one(image);
 	if (ret)
 		return ret;
 
-	if (image->exec_pre) {
-		ret = systemp(image, "%s", image->exec_pre);
-		if (ret)
+	image->done = 1;
+
+	return 0;
+}
+
+/*
+ * check the dependencies of an image the way image_generate() does,
+ * without generating anything. seen is 1 while the children of an image
+ * are checked and 2 once they are all fine.
+ */
+static int image_check_dependencies(struct image *image)
+{
+	int ret;
+	struct partition *part;
+
+	if (image->seen == 2)
+		return 0;
+
+	if (image->seen == 1) {
+		image_error(image, "recursive dependency detected\n");
+		return -EINVAL;
+	}
+
+	image->seen = 1;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child;
+		if (!part->image)
+			continue;
+		child = image_get(part->image);
+		if (!child) {
+			image_error(image, "could not find %s\n", part->image);
+			return -EINVAL;
+		}
+		ret = image_check_dependencies(child);
+		if (ret) {
+			image_error(image, "could not generate %s\n", child->file);
 			return ret;
+		}
 	}
 
-	if (image->handler->generate) {
-		ret = image->handler->generate(image);
-	} else {
-		image_error(image, "no generate function for %s\n", image->file);
-		return -EINVAL;
+	image->seen = 2;
+
+	return 0;
+}
+
+static int image_ready(struct image *image)
+{
+	struct partition *part;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		if (part->image && image_get(part->image)->done <= 0)
+			return 0;
 	}
+	return 1;
+}
 
-	if (ret) {
-		struct stat s;
-		if (lstat(imageoutfile(image), &s) != 0 ||
-				((s.st_mode & S_IFMT) == S_IFREG) ||
-				((s.st_mode & S_IFMT) == S_IFLNK))
-			systemp(image, "rm -f \"%s\"", imageoutfile(image));
-		return ret;
+struct job {
+	struct image *image;
+	pid_t pid;
+	int fd;
+};
+
+/*
+ * What a job reports back to the main process. Some handlers only know
+ * the final size of their image after generating it, and the images
+ * containing it need that size.
+ */
+struct job_result {
+	int ret;
+	unsigned long long size;
+};
+
+static int job_start(struct job *job, struct image *image)
+{
+	struct job_result result;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		image_error(image, "pipe: %s\n", strerror(errno));
+		return -errno;
 	}
 
-	if (image->exec_post) {
-		ret = systemp(image, "%s", image->exec_post);
-		if (ret)
-			return ret;
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid < 0) {
+		image_error(image, "fork: %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
 	}
 
+	if (!pid) {
+		close(fds[0]);
+		result.ret = image_generate_one(image);
+		result.size = image->size;
+		if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+			result.ret = -EIO;
+		fflush(stdout);
+		fflush(stderr);
+		_exit(result.ret ? 1 : 0);
+	}
+
+	close(fds[1]);
+	job->image = image;
+	job->pid = pid;
+	job->fd = fds[0];
+	image_debug(image, "started job %d\n", pid);
+
+	return 0;
+}
+
+static int job_finish(struct job *job, int status)
+{
+	struct job_result result = { .ret = -EIO };
+	struct image *image = job->image;
+	ssize_t r;
+
+	r = read(job->fd, &result, sizeof(result));
+	close(job->fd);
+	job->image = NULL;
+
+	if (r != sizeof(result) || !WIFEXITED(status) ||
+			WEXITSTATUS(status) || result.ret) {
+		image_error(image, "failed to generate %s\n", image->file);
+		return result.ret ? result.ret : -EIO;
+	}
+
+	image->size = result.size;
 	image->done = 1;
 
 	return 0;
 }
 
+/*
+ * generate the images with up to 'jobs' images at a time. Every image is
+ * generated in its own process once all images it depends on are done.
+ * Images are started in the order of the config file, so the scheduling
+ * only depends on which jobs have finished.
+ */
+static int images_generate_parallel(unsigned int jobs)
+{
+	struct job *job = xzalloc(jobs * sizeof(*job));
+	struct image *image;
+	unsigned int i, running = 0;
+	int ret = 0;
+
+	list_for_each_entry(image, &images, list) {
+		ret = image_check_dependencies(image);
+		if (ret) {
+			image_error(image, "failed to generate %s\n", image->file);
+			goto out;
+		}
+	}
+
+	/* after an error no new jobs are started, the running ones finish */
+	for (;;) {
+		int status;
+		pid_t pid;
+
+		list_for_each_entry(image, &images, list) {
+			if (ret || running == jobs)
+				break;
+			if (image->done > 0 || image->seen == 3 || !image_ready(image))
+				continue;
+			for (i = 0; job[i].image; i++)
+				;
+			ret = job_start(&job[i], image);
+			if (ret)
+				break;
+			/* mark it as running */
+			image->seen = 3;
+			running++;
+		}
+
+		if (!running)
+			break;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			error("Failed to wait for image generation: %s\n", strerror(errno));
+			ret = -errno;
+			break;
+		}
+		for (i = 0; i < jobs; i++) {
+			if (job[i].image && job[i].pid == pid)
+				break;
+		}
+		if (i == jobs)
+			continue;
+
+		running--;
+		status = job_finish(&job[i], status);
+		if (status && !ret)
+			ret = status;
+	}
+
+out:
+	free(job);
+	return ret;
+}
+
 static LIST_HEAD(flashlist);
 
 static int parse_flashes(cfg_t *cfg)
@@ -499,11 +718,92 @@ static void add_root_mountpoint(void)
 	list_add_tail(&mp->list, &mountpoints);
 }
 
+/*
+ * a mountpoint is nested if other mountpoints live below it. Its content
+ * then differs from the directory in rootpath.
+ */
+/* @path without leading and trailing '/', @len bytes long */
+static const char *mountpoint_trim(const char *path, size_t *len)
+{
+	size_t n;
+
+	while (*path == '/')
+		path++;
+	n = strlen(path);
+	while (n && path[n - 1] == '/')
+		n--;
+	*len = n;
+
+	return path;
+}
+
+static int mountpoint_is_nested(struct mountpoint *mp)
+{
+	struct mountpoint *sub;
+	const char *path, *sub_path;
+	size_t len, sub_len;
+
+	path = mountpoint_trim(mp->path, &len);
+
+	list_for_each_entry(sub, &mountpoints, list) {
+		if (sub == mp)
+			continue;
+		sub_path = mountpoint_trim(sub->path, &sub_len);
+		if (!sub_len)
+			continue;
+		if (!len || (sub_len > len && !strncmp(sub_path, path, len) &&
+				sub_path[len] == '/'))
+			return 1;
+	}
+	return 0;
+}
+
+/* deepest mountpoints first, so nested ones are split off before their parents */
+static int mountpoint_cmp(const void *a, const void *b)
+{
+	const struct mountpoint *mpa = *(struct mountpoint * const *)a;
+	const struct mountpoint *mpb = *(struct mountpoint * const *)b;
+
+	return (int)strlen(mpb->path) - (int)strlen(mpa->path);
+}
+
+/*
+ * Copy rootpath to tmppath/root. Hard links are used where possible,
+ * so only the directories are duplicated and no file data is copied.
+ */
+static int stage_root(void)
+{
+	struct stat sroot, stmp;
+	int ret;
+
+	if (!stat(rootpath(), &sroot) && !stat(tmppath(), &stmp) &&
+			sroot.st_dev == stmp.st_dev) {
+		ret = systemp(NULL, "cp -al \"%s\" \"%s/root\"", rootpath(), tmppath());
+		if (!ret)
+			return 0;
+		info("hard linking '%s' failed, copying it instead\n", rootpath());
+		ret = systemp(NULL, "rm -rf \"%s/root\"", tmppath());
+		if (ret)
+			return ret;
+	}
+
+	return systemp(NULL, "cp -a --reflink=auto \"%s\" \"%s/root\"",
+			rootpath(), tmppath());
+}
+
+/*
+ * Provide the content of every mountpoint. A mountpoint without other
+ * mountpoints below it is used in place from rootpath. Only the root
+ * mountpoint and nested mountpoints need a view that excludes the
+ * mountpoints below them. For those, rootpath is staged in tmppath and
+ * the subtrees are split off from the staged copy.
+ */
 static int collect_mountpoints(void)
 {
 	struct image *image;
-	struct mountpoint *mp;
-	int ret, need_mtime_fixup = 0, need_root = 0;
+	struct mountpoint *mp, **mps;
+	int ret = 0, need_mtime_fixup = 0, need_root = 0, need_stage = 0;
+	int i, n = 0;
 
 	list_for_each_entry(image, &images, list) {
 		if (!(image->empty || image->handler->no_rootpath || image->srcpath)) {
@@ -518,36 +818,75 @@ static int collect_mountpoints(void)
 
 	add_root_mountpoint();
 
+	list_for_each_entry(image, &images, list) {
+		if (image->mountpoint)
+			image->mp = add_mountpoint(image->mountpoint);
+	}
+
+	list_for_each_entry(image, &images, list) {
+		if (image->empty || image->handler->no_rootpath || image->srcpath)
+			continue;
+		mp = image->mp ? image->mp : get_mountpoint("");
+		if (!strlen(mp->path) || mountpoint_is_nested(mp))
+			need_stage = 1;
+	}
+
+	list_for_each_entry(mp, &mountpoints, list) {
+		struct stat s;
+
+		n++;
+		if (!strlen(mp->path) || mountpoint_is_nested(mp))
+			continue;
+		free(mp->mountpath);
+		xasprintf(&mp->mountpath, "%s/%s", rootpath(), mp->path);
+		if (stat(mp->mountpath, &s) || !S_ISDIR(s.st_mode)) {
+			error("mountpoint '%s' is not a directory in '%s'\n",
+					mp->path, rootpath());
+			return -EINVAL;
+		}
+	}
+
+	if (!need_stage)
+		return 0;
+
 	ret = systemp(NULL, "mkdir -p \"%s\"", tmppath());
 	if (ret)
 		return ret;
 
-	ret = systemp(NULL, "cp -a \"%s\" \"%s/root\"", rootpath(), tmppath());
+	ret = stage_root();
 	if (ret)
 		return ret;
 
-	list_for_each_entry(image, &images, list) {
-		if (image->mountpoint)
-			image->mp = add_mountpoint(image->mountpoint);
-	}
+	mps = xzalloc(n * sizeof(*mps));
+	n = 0;
+	list_for_each_entry(mp, &mountpoints, list)
+		mps[n++] = mp;
+	qsort(mps, n, sizeof(*mps), mountpoint_cmp);
 
-	list_for_each_entry(mp, &mountpoints, list) {
+	for (i = 0; i < n; i++) {
+		mp = mps[i];
 		if (!strlen(mp->path))
 			continue;
-		ret = systemp(NULL, "mv \"%s/root/%s\" \"%s\"", tmppath(), mp->path, mp->mountpath);
+		if (mountpoint_is_nested(mp))
+			ret = systemp(NULL, "mv \"%s/root/%s\" \"%s\"", tmppath(), mp->path, mp->mountpath);
+		else
+			ret = systemp(NULL, "rm -rf \"%s/root/%s\"", tmppath(), mp->path);
 		if (ret)
-			return ret;
+			break;
 		ret = systemp(NULL, "mkdir \"%s/root/%s\"", tmppath(), mp->path);
 		if (ret)
-			return ret;
-		ret = systemp(NULL, "chmod --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
+			break;
+		ret = systemp(NULL, "chmod --reference=\"%s/%s\" \"%s/root/%s\"", rootpath(), mp->path, tmppath(), mp->path);
 		if (ret)
-			return ret;
-		ret = systemp(NULL, "chown --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
+			break;
+		ret = systemp(NULL, "chown --reference=\"%s/%s\" \"%s/root/%s\"", rootpath(), mp->path, tmppath(), mp->path);
 		if (ret)
-			return ret;
+			break;
 		need_mtime_fixup = 1;
 	}
+	free(mps);
+	if (ret)
+		return ret;
 
 	/*
 	 * After the mv/mkdir of the mountpoints the timestamps of the
@@ -677,6 +1016,7 @@ int main(int argc, char *argv[])
 {
 	unsigned int i;
 	unsigned int num_images;
+	unsigned int jobs;
 	int ret;
 	cfg_opt_t *imageopts = xzalloc((ARRAY_SIZE(image_common_opts) +
 				ARRAY_SIZE(handlers) + 1) * sizeof(cfg_opt_t));
@@ -873,6 +1213,12 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto cleanup;
 
+	jobs = strtoul(get_opt("jobs"), NULL, 0);
+	if (jobs > 1) {
+		ret = images_generate_parallel(jobs);
+		goto cleanup;
+	}
+
 	list_for_each_entry(image, &images, list) {
 		ret = image_generate(image);
 		if (ret) {
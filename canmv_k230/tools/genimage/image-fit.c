@@ -51,7 +51,7 @@ static int fit_generate(struct image *image)
 
 	struct image *itsimg = image_get(its->image);
 
-	xasprintf(&itspath, "%s/fit.its", tmppath());
+	xasprintf(&itspath, "%s/fit-%s.its", tmppath(), sanitize_path(image->file));
 
 	/* Copy input its file to temporary path. Use 'cat' to ignore permissions */
 	ret = systemp(image, "cat '%s' > '%s'", imageoutfile(itsimg), itspath);
@@ -34,7 +34,7 @@ static int ubi_generate(struct image *image)
 	struct partition *part;
 	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 
-	xasprintf(&tempfile, "%s/ubi.ini", tmppath());
+	xasprintf(&tempfile, "%s/ubi-%s.ini", tmppath(), sanitize_path(image->file));
 	if (!tempfile)
 		return -ENOMEM;
 
@@ -15,14 +15,1126 @@
  */
 
 #include <confuse.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "genimage.h"
 
-static int vfat_generate(struct image *image)
+#define VFAT_SECTOR_SIZE	512
+#define VFAT_DIRENT_SIZE	32
+#define VFAT_LFN_CHARS		13
+#define VFAT_LFN_MAX		255
+#define VFAT_ROOT_ENTRIES	512
+#define VFAT_COPY_SIZE		(1024 * 1024)
+
+#define VFAT_ATTR_VOLUME_ID	0x08
+#define VFAT_ATTR_DIRECTORY	0x10
+#define VFAT_ATTR_ARCHIVE	0x20
+#define VFAT_ATTR_LFN		0x0f
+
+#define VFAT_NTRES_LOWER_BASE	0x08
+#define VFAT_NTRES_LOWER_EXT	0x10
+
+struct vfat_entry {
+	char *name;
+	char *path;
+	int is_dir;
+	unsigned long long size;
+	time_t mtime;
+	unsigned char shortname[11];
+	unsigned char ntres;
+	int has_shortname;
+	uint16_t lfn[VFAT_LFN_MAX];
+	unsigned int lfn_len;
+	unsigned int lfn_slots;
+	/* directories only: number of 32 byte slots in the table */
+	unsigned int n_slots;
+	uint32_t cluster;
+	uint32_t clusters;
+	struct vfat_entry *parent;
+	struct list_head children;
+	struct list_head list;
+};
+
+struct vfat {
+	cfg_bool_t native;
+	unsigned int fat_size;
+	unsigned long long cluster_size;
+	/* geometry of the native writer */
+	unsigned int bits;
+	uint32_t total_sectors;
+	uint32_t spc;
+	uint32_t reserved;
+	uint32_t fat_sectors;
+	uint32_t root_entries;
+	uint32_t root_sectors;
+	uint32_t clusters;
+	uint32_t next_cluster;
+	uint32_t *fat;
+	unsigned char label[11];
+	uint32_t volume_id;
+	struct vfat_entry root;
+	unsigned int n_files;
+	unsigned int n_dirs;
+};
+
+static struct vfat_entry *vfat_new_entry(struct vfat_entry *parent,
+		const char *name, const char *path, int is_dir)
+{
+	struct vfat_entry *entry = xzalloc(sizeof(*entry));
+
+	entry->name = strdup(name);
+	entry->path = path ? strdup(path) : NULL;
+	entry->is_dir = is_dir;
+	entry->parent = parent;
+	INIT_LIST_HEAD(&entry->children);
+	list_add_tail(&entry->list, &parent->children);
+
+	return entry;
+}
+
+static struct vfat_entry *vfat_find_entry(struct vfat_entry *dir,
+		const char *name)
+{
+	struct vfat_entry *entry;
+
+	list_for_each_entry(entry, &dir->children, list) {
+		if (!strcasecmp(entry->name, name))
+			return entry;
+	}
+	return NULL;
+}
+
+static int vfat_add_path(struct image *image, struct vfat_entry *dir,
+		const char *name, const char *path);
+
+static int vfat_name_filter(const struct dirent *d)
+{
+	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+static int vfat_name_compare(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Add the contents of the directory 'path' below 'dir'. Entries are sorted
+ * by name so the layout of the image does not depend on the order readdir()
+ * returns them in.
+ */
+static int vfat_add_tree(struct image *image, struct vfat_entry *dir,
+		const char *path)
+{
+	struct dirent **names;
+	int i, n, ret = 0;
+
+	n = scandir(path, &names, vfat_name_filter, vfat_name_compare);
+	if (n < 0) {
+		ret = -errno;
+		image_error(image, "scandir %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+	for (i = 0; i < n; i++) {
+		char *child;
+
+		if (!ret) {
+			xasprintf(&child, "%s/%s", path, names[i]->d_name);
+			ret = vfat_add_path(image, dir, names[i]->d_name, child);
+			free(child);
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+}
+
+static int vfat_add_path(struct image *image, struct vfat_entry *dir,
+		const char *name, const char *path)
+{
+	struct vfat_entry *entry;
+	struct stat s;
+
+	if (vfat_find_entry(dir, name)) {
+		image_error(image, "'%s' added twice (names are case insensitive)\n",
+				path);
+		return -EEXIST;
+	}
+	if (stat(path, &s)) {
+		image_error(image, "stat %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	if (S_ISDIR(s.st_mode)) {
+		entry = vfat_new_entry(dir, name, NULL, 1);
+		entry->mtime = s.st_mtime;
+		return vfat_add_tree(image, entry, path);
+	}
+	if (!S_ISREG(s.st_mode)) {
+		image_info(image, "skipping special file '%s'\n", path);
+		return 0;
+	}
+	if (s.st_size > 0xffffffffLL) {
+		image_error(image, "'%s' is too large for FAT\n", path);
+		return -EFBIG;
+	}
+	entry = vfat_new_entry(dir, name, path, 0);
+	entry->size = s.st_size;
+	entry->mtime = s.st_mtime;
+
+	return 0;
+}
+
+/* add a 'file' or 'files' partition, creating parent directories as needed */
+static int vfat_add_partition(struct image *image, struct vfat_entry *root,
+		struct partition *part)
+{
+	struct image *child = image_get(part->image);
+	const char *file = imageoutfile(child);
+	char *target, *name, *next;
+	struct vfat_entry *dir = root;
+	int ret;
+
+	if (*part->name) {
+		target = strdup(part->name);
+	} else {
+		const char *base = strrchr(child->file, '/');
+
+		target = strdup(base ? base + 1 : child->file);
+	}
+
+	name = target;
+	while ((next = strchr(name, '/')) != NULL) {
+		struct vfat_entry *sub;
+
+		*next = '\0';
+		if (*name) {
+			sub = vfat_find_entry(dir, name);
+			if (sub && !sub->is_dir) {
+				image_error(image, "'%s' is not a directory\n", name);
+				free(target);
+				return -ENOTDIR;
+			}
+			if (!sub) {
+				sub = vfat_new_entry(dir, name, NULL, 1);
+				sub->mtime = time(NULL);
+			}
+			dir = sub;
+		}
+		name = next + 1;
+	}
+
+	image_debug(image, "adding file '%s' as '%s' ...\n", child->file,
+			*part->name ? part->name : child->file);
+	ret = vfat_add_path(image, dir, name, file);
+	free(target);
+
+	return ret;
+}
+
+static int vfat_utf16(struct image *image, struct vfat_entry *entry)
+{
+	const unsigned char *p = (const unsigned char *)entry->name;
+	unsigned int len = 0;
+
+	while (*p) {
+		uint32_t c = *p++;
+		int more = 0;
+
+		if (c >= 0xf0 && c < 0xf8) {
+			c &= 0x07;
+			more = 3;
+		} else if (c >= 0xe0) {
+			c &= 0x0f;
+			more = 2;
+		} else if (c >= 0xc0) {
+			c &= 0x1f;
+			more = 1;
+		} else if (c >= 0x80) {
+			c = 0xfffd;
+		}
+		while (more--) {
+			if ((*p & 0xc0) != 0x80) {
+				c = 0xfffd;
+				break;
+			}
+			c = (c << 6) | (*p++ & 0x3f);
+		}
+		if (c < 0x20 || (c < 0x80 && strchr("\"*/:<>?\\|", c))) {
+			image_error(image, "'%s' is not a valid FAT name\n",
+					entry->name);
+			return -EINVAL;
+		}
+		if (len + (c > 0xffff ? 2 : 1) > VFAT_LFN_MAX)
+			goto too_long;
+		if (c > 0xffff) {
+			c -= 0x10000;
+			entry->lfn[len++] = 0xd800 | (c >> 10);
+			entry->lfn[len++] = 0xdc00 | (c & 0x3ff);
+		} else {
+			entry->lfn[len++] = c;
+		}
+	}
+	entry->lfn_len = len;
+
+	return 0;
+too_long:
+	image_error(image, "'%s' is longer than %d characters\n", entry->name,
+			VFAT_LFN_MAX);
+	return -ENAMETOOLONG;
+}
+
+static int vfat_short_char(int c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		(c && strchr("$%'-_@~`!(){}^#&", c));
+}
+
+/*
+ * If the name is a valid 8.3 name with the base and the extension in one
+ * case each, store it as short name only and record the case in the NT
+ * reserved byte, like Linux and mtools do.
+ */
+static int vfat_exact_shortname(struct vfat_entry *entry)
+{
+	const char *name = entry->name;
+	const char *dot = strrchr(name, '.');
+	size_t base = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext = dot ? strlen(dot + 1) : 0;
+	int lower[2] = { 0, 0 }, upper[2] = { 0, 0 };
+	size_t i;
+
+	if (base < 1 || base > 8 || ext > 3 || (dot && !ext))
+		return 0;
+
+	memset(entry->shortname, ' ', sizeof(entry->shortname));
+	for (i = 0; name[i]; i++) {
+		int part = dot && name + i > dot;
+		int c = (unsigned char)name[i];
+
+		if (name + i == dot)
+			continue;
+		if (c >= 'a' && c <= 'z') {
+			lower[part] = 1;
+			c -= 'a' - 'A';
+		} else if (c >= 'A' && c <= 'Z') {
+			upper[part] = 1;
+		}
+		if (!vfat_short_char(c))
+			return 0;
+		entry->shortname[part ? 8 + (name + i - dot - 1) : i] = c;
+	}
+	if ((lower[0] && upper[0]) || (lower[1] && upper[1]))
+		return 0;
+
+	entry->ntres = (lower[0] ? VFAT_NTRES_LOWER_BASE : 0) |
+		(lower[1] ? VFAT_NTRES_LOWER_EXT : 0);
+	if (entry->shortname[0] == 0xe5)
+		entry->shortname[0] = 0x05;
+
+	return 1;
+}
+
+struct vfat_names {
+	unsigned char (*slot)[11];
+	size_t mask;
+};
+
+static size_t vfat_names_hash(const unsigned char *name)
+{
+	return crc32(name, 11);
+}
+
+static int vfat_names_insert(struct vfat_names *names,
+		const unsigned char *name)
+{
+	size_t i = vfat_names_hash(name) & names->mask;
+
+	while (names->slot[i][0]) {
+		if (!memcmp(names->slot[i], name, 11))
+			return -EEXIST;
+		i = (i + 1) & names->mask;
+	}
+	memcpy(names->slot[i], name, 11);
+
+	return 0;
+}
+
+/*
+ * Derive a unique short name for a name that needs a long name entry, the
+ * way Windows does: upper case, invalid characters replaced by '_' and a
+ * numeric tail ~N if the conversion was lossy or the name is taken.
+ */
+static int vfat_generate_shortname(struct image *image, struct vfat_names *names,
+		struct vfat_entry *entry)
+{
+	const char *name = entry->name;
+	const char *dot = strrchr(name, '.');
+	unsigned char base[8], ext[3];
+	size_t nbase = 0, next = 0;
+	int lossy = 0;
+	const char *p;
+	uint32_t hash;
+	unsigned int n;
+
+	while (*name == '.')
+		name++;
+	if (dot && dot < name)
+		dot = NULL;
+
+	for (p = name; *p && p != dot; p++) {
+		int c = (unsigned char)*p;
+
+		if (c == ' ' || c == '.') {
+			lossy = 1;
+			continue;
+		}
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (!vfat_short_char(c)) {
+			lossy = 1;
+			c = '_';
+		}
+		if (nbase == sizeof(base)) {
+			lossy = 1;
+			break;
+		}
+		base[nbase++] = c;
+	}
+	for (p = dot ? dot + 1 : ""; *p; p++) {
+		int c = (unsigned char)*p;
+
+		if (c == ' ')
+			continue;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (!vfat_short_char(c)) {
+			lossy = 1;
+			c = '_';
+		}
+		if (next == sizeof(ext)) {
+			lossy = 1;
+			break;
+		}
+		ext[next++] = c;
+	}
+	if (!nbase) {
+		base[nbase++] = '_';
+		lossy = 1;
+	}
+
+	memset(entry->shortname, ' ', sizeof(entry->shortname));
+	memcpy(entry->shortname, base, nbase);
+	memcpy(entry->shortname + 8, ext, next);
+	if (entry->shortname[0] == 0xe5)
+		entry->shortname[0] = 0x05;
+
+	if (!lossy && !vfat_names_insert(names, entry->shortname))
+		return 0;
+
+	/*
+	 * ~1 to ~4 first, then two characters of the basis, four hex digits
+	 * derived from the long name and ~1 like Windows, which keeps the
+	 * search short in directories with many similar names.
+	 */
+	hash = crc32(entry->name, strlen(entry->name));
+	for (n = 1; n < 0x10000 + 5; n++) {
+		char tail[8];
+		int ntail;
+		size_t keep;
+
+		if (n <= 4) {
+			ntail = snprintf(tail, sizeof(tail), "~%u", n);
+			keep = min(nbase, 8 - ntail);
+		} else {
+			ntail = snprintf(tail, sizeof(tail), "%04X~1",
+					(hash + n - 5) & 0xffff);
+			keep = min(nbase, 2);
+		}
+
+		memset(entry->shortname, ' ', 8);
+		memcpy(entry->shortname, base, keep);
+		memcpy(entry->shortname + keep, tail, ntail);
+		if (entry->shortname[0] == 0xe5)
+			entry->shortname[0] = 0x05;
+		if (!vfat_names_insert(names, entry->shortname))
+			return 0;
+	}
+
+	image_error(image, "no free short name for '%s'\n", entry->name);
+	return -EEXIST;
+}
+
+/* assign short names and count the directory slots, recursively */
+static int vfat_prepare_dir(struct image *image, struct vfat *vfat,
+		struct vfat_entry *dir)
+{
+	struct vfat_names names;
+	struct vfat_entry *entry;
+	size_t n = 0, size = 16;
+	int ret = 0;
+
+	list_for_each_entry(entry, &dir->children, list)
+		n++;
+	while (size < 2 * n)
+		size <<= 1;
+	names.slot = xzalloc(size * sizeof(*names.slot));
+	names.mask = size - 1;
+
+	/* exact 8.3 names first, so generated names cannot take them */
+	list_for_each_entry(entry, &dir->children, list) {
+		ret = vfat_utf16(image, entry);
+		if (ret)
+			goto out;
+		if (vfat_exact_shortname(entry) &&
+		    !vfat_names_insert(&names, entry->shortname))
+			entry->has_shortname = 1;
+	}
+
+	dir->n_slots = dir == &vfat->root ? 0 : 2;
+	list_for_each_entry(entry, &dir->children, list) {
+		if (!entry->has_shortname) {
+			ret = vfat_generate_shortname(image, &names, entry);
+			if (ret)
+				goto out;
+			entry->ntres = 0;
+			entry->lfn_slots = (entry->lfn_len + VFAT_LFN_CHARS - 1) /
+				VFAT_LFN_CHARS;
+		}
+		dir->n_slots += 1 + entry->lfn_slots;
+		if (entry->is_dir) {
+			vfat->n_dirs++;
+			ret = vfat_prepare_dir(image, vfat, entry);
+			if (ret)
+				goto out;
+		} else {
+			vfat->n_files++;
+		}
+	}
+out:
+	free(names.slot);
+	return ret;
+}
+
+static uint32_t vfat_default_spc(unsigned int bits, uint32_t sectors)
+{
+	uint32_t spc;
+
+	switch (bits) {
+	case 12:
+		for (spc = 1; spc < 128 && sectors / spc > 4084; spc <<= 1)
+			;
+		return spc;
+	case 16:
+		/* the defaults of fatgen103 */
+		if (sectors <= 32680)
+			return 2;
+		if (sectors <= 262144)
+			return 4;
+		if (sectors <= 524288)
+			return 8;
+		if (sectors <= 1048576)
+			return 16;
+		if (sectors <= 2097152)
+			return 32;
+		return 64;
+	default:
+		if (sectors <= 532480)
+			return 1;
+		if (sectors <= 16777216)
+			return 8;
+		if (sectors <= 33554432)
+			return 16;
+		if (sectors <= 67108864)
+			return 32;
+		return 64;
+	}
+}
+
+/* compute the FAT size for the given FAT type and cluster size */
+static int vfat_geometry(struct vfat *vfat, unsigned int bits, uint32_t spc)
+{
+	uint32_t fat_sectors = 1;
+	uint32_t clusters;
+
+	vfat->bits = bits;
+	vfat->spc = spc;
+	vfat->reserved = bits == 32 ? 32 : 1;
+	vfat->root_sectors = bits == 32 ? 0 :
+		vfat->root_entries * VFAT_DIRENT_SIZE / VFAT_SECTOR_SIZE;
+
+	for (;;) {
+		uint32_t meta = vfat->reserved + 2 * fat_sectors + vfat->root_sectors;
+		unsigned long long bytes;
+		uint32_t needed;
+
+		if (meta >= vfat->total_sectors)
+			return -ENOSPC;
+		clusters = (vfat->total_sectors - meta) / spc;
+		if (bits == 12)
+			bytes = ((clusters + 2ULL) * 3 + 1) / 2;
+		else
+			bytes = (clusters + 2ULL) * (bits / 8);
+		needed = (bytes + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE;
+		if (needed <= fat_sectors)
+			break;
+		fat_sectors = needed;
+	}
+	vfat->fat_sectors = fat_sectors;
+	vfat->clusters = clusters;
+
+	if (bits == 12 && clusters > 4084)
+		return -E2BIG;
+	if (bits == 16 && clusters > 65524)
+		return -E2BIG;
+	if (bits == 32 && clusters > 0x0ffffff4)
+		return -E2BIG;
+	if (bits == 16 && clusters < 4085)
+		return -ENOSPC;
+	if (bits == 32 && clusters < 65525)
+		return -ENOSPC;
+
+	return 0;
+}
+
+/*
+ * Pick FAT type and cluster size. Explicit settings are used as given,
+ * otherwise the type follows the volume size like mkfs.fat and is
+ * adjusted when the cluster count does not fit it.
+ */
+static int vfat_setup_geometry(struct image *image, struct vfat *vfat)
+{
+	unsigned int bits = vfat->fat_size;
+	uint32_t spc = vfat->cluster_size / VFAT_SECTOR_SIZE;
+	int tries, ret = -EINVAL;
+
+	if (vfat->root.n_slots > vfat->root_entries)
+		vfat->root_entries = (vfat->root.n_slots + 15) & ~15;
+
+	if (!bits) {
+		if (vfat->total_sectors <= 8400)
+			bits = 12;
+		else if (vfat->total_sectors < 1048576)
+			bits = 16;
+		else
+			bits = 32;
+	}
+
+	for (tries = 0; tries < 16; tries++) {
+		uint32_t s = spc ? spc : vfat_default_spc(bits, vfat->total_sectors);
+
+		ret = vfat_geometry(vfat, bits, s);
+		if (!ret || vfat->fat_size)
+			break;
+		if (ret == -E2BIG && bits == 12)
+			bits = 16;
+		else if (ret == -E2BIG && !spc && s < 128)
+			spc = s << 1;
+		else if (ret == -ENOSPC && bits == 32)
+			bits = 16;
+		else if (ret == -ENOSPC && bits == 16)
+			bits = 12;
+		else
+			break;
+	}
+	if (ret) {
+		image_error(image, "cannot fit FAT%u with %u byte clusters into %u sectors\n",
+				vfat->bits, vfat->spc * VFAT_SECTOR_SIZE,
+				vfat->total_sectors);
+		return -EINVAL;
+	}
+
+	image_info(image, "FAT%u, %u clusters of %u bytes\n", vfat->bits,
+			vfat->clusters, vfat->spc * VFAT_SECTOR_SIZE);
+	return 0;
+}
+
+static uint32_t vfat_alloc(struct vfat *vfat, uint32_t clusters)
+{
+	uint32_t first = vfat->next_cluster;
+	uint32_t i;
+
+	if (!clusters)
+		return 0;
+	for (i = 0; i + 1 < clusters; i++)
+		vfat->fat[first + i] = first + i + 1;
+	vfat->fat[first + i] = 0x0fffffff;
+	vfat->next_cluster += clusters;
+
+	return first;
+}
+
+/*
+ * Lay out the tree: every directory table is followed by the data of the
+ * files in it, then the subdirectories follow. All chains are contiguous.
+ */
+static void vfat_layout_dir(struct vfat *vfat, struct vfat_entry *dir)
+{
+	unsigned long long csize = vfat->spc * VFAT_SECTOR_SIZE;
+	struct vfat_entry *entry;
+
+	if (dir != &vfat->root || vfat->bits == 32) {
+		unsigned long long bytes = dir->n_slots * VFAT_DIRENT_SIZE;
+
+		dir->clusters = bytes ? (bytes + csize - 1) / csize : 1;
+		dir->cluster = vfat_alloc(vfat, dir->clusters);
+	}
+	list_for_each_entry(entry, &dir->children, list) {
+		if (entry->is_dir)
+			continue;
+		entry->clusters = (entry->size + csize - 1) / csize;
+		entry->cluster = vfat_alloc(vfat, entry->clusters);
+	}
+	list_for_each_entry(entry, &dir->children, list) {
+		if (entry->is_dir)
+			vfat_layout_dir(vfat, entry);
+	}
+}
+
+static unsigned long long vfat_count_clusters(struct vfat *vfat,
+		struct vfat_entry *dir)
+{
+	unsigned long long csize = vfat->spc * VFAT_SECTOR_SIZE;
+	unsigned long long n = 0;
+	struct vfat_entry *entry;
+
+	if (dir != &vfat->root || vfat->bits == 32)
+		n += dir->n_slots ? (dir->n_slots * VFAT_DIRENT_SIZE + csize - 1) / csize : 1;
+	list_for_each_entry(entry, &dir->children, list) {
+		if (entry->is_dir)
+			n += vfat_count_clusters(vfat, entry);
+		else
+			n += (entry->size + csize - 1) / csize;
+	}
+	return n;
+}
+
+static unsigned long long vfat_cluster_offset(struct vfat *vfat, uint32_t cluster)
+{
+	unsigned long long sector = vfat->reserved + 2ULL * vfat->fat_sectors +
+		vfat->root_sectors + (unsigned long long)(cluster - 2) * vfat->spc;
+
+	return sector * VFAT_SECTOR_SIZE;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static int vfat_pwrite(struct image *image, int fd, const void *buf,
+		size_t size, unsigned long long offset)
+{
+	const char *p = buf;
+
+	while (size) {
+		ssize_t r = pwrite(fd, p, size, offset);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			image_error(image, "write %s: %s\n", imageoutfile(image),
+					strerror(errno));
+			return -errno;
+		}
+		p += r;
+		size -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static void vfat_timestamp(time_t t, uint16_t *date, uint16_t *time)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	if (tm.tm_year < 80) {
+		*date = (1 << 5) | 1;
+		*time = 0;
+		return;
+	}
+	if (tm.tm_year > 207)
+		tm.tm_year = 207;
+	*date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+	*time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+static void vfat_dirent(unsigned char *d, const unsigned char *name,
+		unsigned char attr, unsigned char ntres, time_t mtime,
+		uint32_t cluster, uint32_t size)
+{
+	uint16_t date, time;
+
+	vfat_timestamp(mtime, &date, &time);
+	memcpy(d, name, 11);
+	d[11] = attr;
+	d[12] = ntres;
+	put16(d + 14, time);
+	put16(d + 16, date);
+	put16(d + 18, date);
+	put16(d + 20, cluster >> 16);
+	put16(d + 22, time);
+	put16(d + 24, date);
+	put16(d + 26, cluster & 0xffff);
+	put32(d + 28, size);
+}
+
+static unsigned char *vfat_lfn(unsigned char *d, const struct vfat_entry *entry)
+{
+	static const unsigned char pos[VFAT_LFN_CHARS] = {
+		1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+	};
+	unsigned char sum = 0;
+	unsigned int slot, i;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + entry->shortname[i];
+
+	for (slot = entry->lfn_slots; slot > 0; slot--) {
+		d[0] = slot | (slot == entry->lfn_slots ? 0x40 : 0);
+		d[11] = VFAT_ATTR_LFN;
+		d[13] = sum;
+		for (i = 0; i < VFAT_LFN_CHARS; i++) {
+			unsigned int c = (slot - 1) * VFAT_LFN_CHARS + i;
+			uint16_t v;
+
+			if (c < entry->lfn_len)
+				v = entry->lfn[c];
+			else if (c == entry->lfn_len)
+				v = 0;
+			else
+				v = 0xffff;
+			put16(d + pos[i], v);
+		}
+		d += VFAT_DIRENT_SIZE;
+	}
+	return d;
+}
+
+static int vfat_write_dir(struct image *image, struct vfat *vfat, int fd,
+		struct vfat_entry *dir)
+{
+	unsigned long long csize = vfat->spc * VFAT_SECTOR_SIZE;
+	unsigned long long size, offset;
+	struct vfat_entry *entry;
+	unsigned char *buf, *d;
+	int ret;
+
+	if (dir == &vfat->root && vfat->bits != 32) {
+		size = vfat->root_sectors * VFAT_SECTOR_SIZE;
+		offset = (vfat->reserved + 2ULL * vfat->fat_sectors) * VFAT_SECTOR_SIZE;
+	} else {
+		size = dir->clusters * csize;
+		offset = vfat_cluster_offset(vfat, dir->cluster);
+	}
+	buf = xzalloc(size);
+	d = buf;
+
+	if (dir == &vfat->root) {
+		if (memcmp(vfat->label, "NO NAME    ", 11)) {
+			vfat_dirent(d, vfat->label, VFAT_ATTR_VOLUME_ID, 0,
+					time(NULL), 0, 0);
+			d += VFAT_DIRENT_SIZE;
+		}
+	} else {
+		uint32_t parent = dir->parent == &vfat->root ? 0 :
+			dir->parent->cluster;
+
+		vfat_dirent(d, (const unsigned char *)".          ",
+				VFAT_ATTR_DIRECTORY, 0, dir->mtime, dir->cluster, 0);
+		d += VFAT_DIRENT_SIZE;
+		vfat_dirent(d, (const unsigned char *)"..         ",
+				VFAT_ATTR_DIRECTORY, 0, dir->mtime, parent, 0);
+		d += VFAT_DIRENT_SIZE;
+	}
+
+	list_for_each_entry(entry, &dir->children, list) {
+		d = vfat_lfn(d, entry);
+		vfat_dirent(d, entry->shortname,
+				entry->is_dir ? VFAT_ATTR_DIRECTORY : VFAT_ATTR_ARCHIVE,
+				entry->ntres, entry->mtime, entry->cluster,
+				entry->is_dir ? 0 : entry->size);
+		d += VFAT_DIRENT_SIZE;
+	}
+
+	ret = vfat_pwrite(image, fd, buf, size, offset);
+	free(buf);
+
+	return ret;
+}
+
+static int vfat_write_file(struct image *image, struct vfat *vfat, int fd,
+		struct vfat_entry *entry, char *buf)
+{
+	unsigned long long offset, left = entry->size;
+	int in, ret = 0;
+
+	if (!left)
+		return 0;
+
+	in = open(entry->path, O_RDONLY);
+	if (in < 0) {
+		image_error(image, "open %s: %s\n", entry->path, strerror(errno));
+		return -errno;
+	}
+	offset = vfat_cluster_offset(vfat, entry->cluster);
+	while (left) {
+		ssize_t r = read(in, buf, min(left, VFAT_COPY_SIZE));
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			ret = r ? -errno : -EIO;
+			image_error(image, "read %s: %s\n", entry->path,
+					r ? strerror(errno) : "file changed size");
+			break;
+		}
+		ret = vfat_pwrite(image, fd, buf, r, offset);
+		if (ret)
+			break;
+		offset += r;
+		left -= r;
+	}
+	close(in);
+
+	return ret;
+}
+
+static int vfat_write_tree(struct image *image, struct vfat *vfat, int fd,
+		struct vfat_entry *dir, char *buf)
+{
+	struct vfat_entry *entry;
+	int ret;
+
+	ret = vfat_write_dir(image, vfat, fd, dir);
+	if (ret)
+		return ret;
+	list_for_each_entry(entry, &dir->children, list) {
+		if (entry->is_dir)
+			continue;
+		ret = vfat_write_file(image, vfat, fd, entry, buf);
+		if (ret)
+			return ret;
+	}
+	list_for_each_entry(entry, &dir->children, list) {
+		if (!entry->is_dir)
+			continue;
+		ret = vfat_write_tree(image, vfat, fd, entry, buf);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int vfat_write_fat(struct image *image, struct vfat *vfat, int fd)
+{
+	size_t size = vfat->fat_sectors * VFAT_SECTOR_SIZE;
+	unsigned char *buf = xzalloc(size);
+	uint32_t mask = vfat->bits == 32 ? 0x0fffffff :
+		(1U << vfat->bits) - 1;
+	uint32_t i;
+	int ret = 0, n;
+
+	vfat->fat[0] = 0x0fffff00 | 0xf8;
+	vfat->fat[1] = 0x0fffffff;
+
+	for (i = 0; i < vfat->next_cluster; i++) {
+		uint32_t v = vfat->fat[i] & mask;
+
+		switch (vfat->bits) {
+		case 12: {
+			unsigned char *p = buf + i + i / 2;
+
+			if (i & 1) {
+				p[0] = (p[0] & 0x0f) | ((v & 0x0f) << 4);
+				p[1] = v >> 4;
+			} else {
+				p[0] = v & 0xff;
+				p[1] = (p[1] & 0xf0) | ((v >> 8) & 0x0f);
+			}
+			break;
+		}
+		case 16:
+			put16(buf + 2 * i, v);
+			break;
+		default:
+			put32(buf + 4 * i, v);
+			break;
+		}
+	}
+
+	for (n = 0; n < 2 && !ret; n++)
+		ret = vfat_pwrite(image, fd, buf, size,
+				(vfat->reserved + (unsigned long long)n * vfat->fat_sectors) *
+				VFAT_SECTOR_SIZE);
+	free(buf);
+
+	return ret;
+}
+
+static int vfat_write_boot(struct image *image, struct vfat *vfat, int fd)
+{
+	unsigned char boot[VFAT_SECTOR_SIZE] = { 0 };
+	unsigned char *ext;
+	int ret;
+
+	boot[0] = 0xeb;
+	boot[1] = vfat->bits == 32 ? 0x58 : 0x3c;
+	boot[2] = 0x90;
+	memcpy(boot + 3, "genimage", 8);
+	put16(boot + 11, VFAT_SECTOR_SIZE);
+	boot[13] = vfat->spc;
+	put16(boot + 14, vfat->reserved);
+	boot[16] = 2;
+	put16(boot + 17, vfat->bits == 32 ? 0 : vfat->root_entries);
+	if (vfat->bits != 32 && vfat->total_sectors < 65536)
+		put16(boot + 19, vfat->total_sectors);
+	else
+		put32(boot + 32, vfat->total_sectors);
+	boot[21] = 0xf8;
+	put16(boot + 24, 32);
+	put16(boot + 26, 64);
+
+	if (vfat->bits == 32) {
+		put32(boot + 36, vfat->fat_sectors);
+		put32(boot + 44, 2);
+		put16(boot + 48, 1);
+		put16(boot + 50, 6);
+		ext = boot + 64;
+	} else {
+		put16(boot + 22, vfat->fat_sectors);
+		ext = boot + 36;
+	}
+	ext[0] = 0x80;
+	ext[2] = 0x29;
+	put32(ext + 3, vfat->volume_id);
+	memcpy(ext + 7, vfat->label, 11);
+	memcpy(ext + 18, vfat->bits == 12 ? "FAT12   " :
+			vfat->bits == 16 ? "FAT16   " : "FAT32   ", 8);
+	boot[510] = 0x55;
+	boot[511] = 0xaa;
+
+	ret = vfat_pwrite(image, fd, boot, sizeof(boot), 0);
+	if (ret || vfat->bits != 32)
+		return ret;
+
+	ret = vfat_pwrite(image, fd, boot, sizeof(boot), 6 * VFAT_SECTOR_SIZE);
+	if (ret)
+		return ret;
+
+	/* FSInfo and its backup */
+	memset(boot, 0, sizeof(boot));
+	put32(boot, 0x41615252);
+	put32(boot + 484, 0x61417272);
+	put32(boot + 488, vfat->clusters + 2 - vfat->next_cluster);
+	put32(boot + 492, vfat->next_cluster < vfat->clusters + 2 ?
+			vfat->next_cluster : 0xffffffff);
+	put32(boot + 508, 0xaa550000);
+	ret = vfat_pwrite(image, fd, boot, sizeof(boot), 1 * VFAT_SECTOR_SIZE);
+	if (ret)
+		return ret;
+
+	return vfat_pwrite(image, fd, boot, sizeof(boot), 7 * VFAT_SECTOR_SIZE);
+}
+
+/*
+ * Build the filesystem without mkdosfs and mtools: collect the tree, lay
+ * out all clusters in one pass and write metadata and file data with
+ * large sequential writes. Free clusters are never written and stay holes
+ * in the output file.
+ */
+static int vfat_generate_native(struct image *image)
+{
+	struct vfat *vfat = image->handler_priv;
+	struct partition *part;
+	unsigned long long needed;
+	char *buf;
+	int fd, ret;
+
+	INIT_LIST_HEAD(&vfat->root.children);
+	vfat->root.is_dir = 1;
+	vfat->root_entries = VFAT_ROOT_ENTRIES;
+	vfat->total_sectors = image->size / VFAT_SECTOR_SIZE;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		ret = vfat_add_partition(image, &vfat->root, part);
+		if (ret)
+			return ret;
+	}
+	if (list_empty(&image->partitions) && !image->empty) {
+		ret = vfat_add_tree(image, &vfat->root, mountpath(image));
+		if (ret)
+			return ret;
+	}
+
+	ret = vfat_prepare_dir(image, vfat, &vfat->root);
+	if (ret)
+		return ret;
+	if (memcmp(vfat->label, "NO NAME    ", 11))
+		vfat->root.n_slots++;
+
+	ret = vfat_setup_geometry(image, vfat);
+	if (ret)
+		return ret;
+
+	needed = vfat_count_clusters(vfat, &vfat->root);
+	if (needed > vfat->clusters) {
+		image_error(image, "content needs %llu clusters, only %u available\n",
+				needed, vfat->clusters);
+		return -ENOSPC;
+	}
+
+	vfat->fat = xzalloc((vfat->clusters + 2ULL) * sizeof(*vfat->fat));
+	vfat->next_cluster = 2;
+	vfat_layout_dir(vfat, &vfat->root);
+
+	ret = prepare_image(image, image->size);
+	if (ret)
+		return ret;
+
+	fd = open_file(image, imageoutfile(image), 0);
+	if (fd < 0)
+		return fd;
+
+	image_info(image, "adding %u files in %u directories ...\n",
+			vfat->n_files, vfat->n_dirs);
+
+	buf = xzalloc(VFAT_COPY_SIZE);
+	ret = vfat_write_boot(image, vfat, fd);
+	if (!ret)
+		ret = vfat_write_fat(image, vfat, fd);
+	if (!ret)
+		ret = vfat_write_tree(image, vfat, fd, &vfat->root, buf);
+	free(buf);
+	free(vfat->fat);
+
+	if (close(fd) && !ret) {
+		ret = -errno;
+		image_error(image, "close %s: %s\n", imageoutfile(image),
+				strerror(errno));
+	}
+
+	return ret;
+}
+
+static int vfat_generate_mtools(struct image *image)
 {
 	int ret;
 	struct partition *part;
@@ -76,9 +1188,22 @@ static int vfat_generate(struct image *image)
 	return ret;
 }
 
+static int vfat_generate(struct image *image)
+{
+	struct vfat *vfat = image->handler_priv;
+
+	if (vfat->native)
+		return vfat_generate_native(image);
+
+	return vfat_generate_mtools(image);
+}
+
 static int vfat_setup(struct image *image, cfg_t *cfg)
 {
+	struct vfat *vfat = xzalloc(sizeof(*vfat));
 	char *label = cfg_getstr(image->imagesec, "label");
+	const char *extraargs = cfg_getstr(cfg, "extraargs");
+	size_t i;
 
 	if (!image->size) {
 		image_error(image, "no size given or must not be zero\n");
@@ -90,6 +1215,50 @@ static int vfat_setup(struct image *image, cfg_t *cfg)
 		return -EINVAL;
 	}
 
+	vfat->native = cfg_getbool(cfg, "native");
+	vfat->fat_size = cfg_getint(cfg, "fat-size");
+	vfat->cluster_size = cfg_getint_suffix(cfg, "cluster-size");
+
+	if (!vfat->native) {
+		if (vfat->fat_size || vfat->cluster_size) {
+			image_error(image, "'fat-size' and 'cluster-size' are only used with 'native'\n");
+			return -EINVAL;
+		}
+		image->handler_priv = vfat;
+		return 0;
+	}
+
+	if (extraargs && extraargs[0] != '\0') {
+		image_error(image, "'extraargs' cannot be used with 'native'\n");
+		return -EINVAL;
+	}
+	if (vfat->fat_size && vfat->fat_size != 12 && vfat->fat_size != 16 &&
+	    vfat->fat_size != 32) {
+		image_error(image, "'fat-size' must be 12, 16 or 32\n");
+		return -EINVAL;
+	}
+	if (vfat->cluster_size && (vfat->cluster_size < VFAT_SECTOR_SIZE ||
+	    vfat->cluster_size > 128 * VFAT_SECTOR_SIZE ||
+	    (vfat->cluster_size & (vfat->cluster_size - 1)))) {
+		image_error(image, "'cluster-size' must be a power of two between 512 and 64k\n");
+		return -EINVAL;
+	}
+	if (image->size / VFAT_SECTOR_SIZE > 0xffffffffULL) {
+		image_error(image, "image is too large for FAT\n");
+		return -EINVAL;
+	}
+
+	/* mtools stores labels in upper case as well */
+	memcpy(vfat->label, "NO NAME    ", 11);
+	if (label && label[0] != '\0') {
+		memset(vfat->label, ' ', 11);
+		for (i = 0; label[i]; i++)
+			vfat->label[i] = toupper((unsigned char)label[i]);
+	}
+	vfat->volume_id = crc32(image->file, strlen(image->file));
+
+	image->handler_priv = vfat;
+
 	return 0;
 }
 
@@ -126,6 +1295,9 @@ static cfg_opt_t file_opts[] = {
 static cfg_opt_t vfat_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("label", "", CFGF_NONE),
+	CFG_BOOL("native", cfg_false, CFGF_NONE),
+	CFG_INT("fat-size", 0, CFGF_NONE),
+	CFG_STR("cluster-size", "0", CFGF_NONE),
 	CFG_STR_LIST("files", NULL, CFGF_NONE),
 	CFG_SEC("file", file_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_END()